@@ -0,0 +1,748 @@
+// Microbenchmarks for RangeMap and AddrSpace.
+//
+// Each benchmark builds a structure with a given number of regions and then
+// times batches of one operation, undoing its effect untimed between batches
+// so the region count stays fixed. Results are printed one JSON object per
+// line:
+//
+//   {"bench":"addrspace/unmap","regions":1000,"ns_per_op":41.2,
+//    "allocs_per_op":0.000,"peak_bytes":81920}
+//
+// 'allocs_per_op' counts global operator new calls made by the timed
+// operations. 'peak_bytes' is the peak live heap size over the benchmark,
+// including building the structure.
+//
+// Usage: bench_mmap [--filter SUBSTR] [--max-regions N] [--min-time MS]
+
+#include "addr_space.h"
+#include "frozen.h"
+#include "key_search.h"
+#include "range_map.h"
+#include "shared.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+// Heap accounting. Every allocation carries a header with its size so that
+// live bytes can be tracked on free. The operators are kept out of line so
+// the compiler does not see through the header arithmetic.
+
+static size_t g_allocs = 0;
+static size_t g_live = 0;
+static size_t g_peak = 0;
+
+static const size_t kHeader = alignof(std::max_align_t);
+
+__attribute__((noinline)) void *operator new(size_t size) {
+  char *p = static_cast<char *>(malloc(size + kHeader));
+  if (!p)
+    throw std::bad_alloc();
+  memcpy(p, &size, sizeof(size));
+  g_allocs++;
+  g_live += size;
+  if (g_live > g_peak)
+    g_peak = g_live;
+  return p + kHeader;
+}
+
+__attribute__((noinline)) void operator delete(void *ptr) noexcept {
+  if (!ptr)
+    return;
+  char *p = static_cast<char *>(ptr) - kHeader;
+  size_t size;
+  memcpy(&size, p, sizeof(size));
+  g_live -= size;
+  free(p);
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete[](void *ptr) noexcept { operator delete(ptr); }
+void operator delete(void *ptr, size_t) noexcept { operator delete(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { operator delete(ptr); }
+
+// Over-aligned allocations put the header in a whole alignment unit.
+__attribute__((noinline)) void *operator new(size_t size, std::align_val_t al) {
+  size_t align = std::max(kHeader, (size_t)al);
+  size_t total = (size + 2 * align - 1) / align * align;
+  char *p = static_cast<char *>(aligned_alloc(align, total));
+  if (!p)
+    throw std::bad_alloc();
+  memcpy(p + align - kHeader, &size, sizeof(size));
+  g_allocs++;
+  g_live += size;
+  if (g_live > g_peak)
+    g_peak = g_live;
+  return p + align;
+}
+
+__attribute__((noinline)) void operator delete(void *ptr,
+                                               std::align_val_t al) noexcept {
+  if (!ptr)
+    return;
+  size_t align = std::max(kHeader, (size_t)al);
+  size_t size;
+  memcpy(&size, static_cast<char *>(ptr) - kHeader, sizeof(size));
+  g_live -= size;
+  free(static_cast<char *>(ptr) - align);
+}
+
+void operator delete(void *ptr, size_t, std::align_val_t al) noexcept {
+  operator delete(ptr, al);
+}
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+  const char *filter = nullptr;
+  size_t max_regions = 1000000;
+  double min_time_ms = 50;
+};
+
+Options g_opts;
+
+struct Measurement {
+  double ns_per_op;
+  double allocs_per_op;
+};
+
+bool selected(const std::string &name) {
+  return !g_opts.filter || name.find(g_opts.filter) != std::string::npos;
+}
+
+// Keeps a benchmark's computed values alive so the optimiser cannot drop
+// the work.
+volatile uint64_t g_sink;
+
+// Run 'timed' (which performs 'ops' operations) until the minimum time has
+// elapsed, calling 'restore' untimed after each batch.
+template <class Timed, class Restore>
+Measurement measure(size_t ops, Timed timed, Restore restore) {
+  double total_ns = 0;
+  size_t total_ops = 0;
+  size_t total_allocs = 0;
+  while (total_ns < g_opts.min_time_ms * 1e6 || total_ops == 0) {
+    size_t allocs = g_allocs;
+    auto t0 = Clock::now();
+    timed();
+    auto t1 = Clock::now();
+    total_allocs += g_allocs - allocs;
+    total_ns += std::chrono::duration<double, std::nano>(t1 - t0).count();
+    total_ops += ops;
+    restore();
+  }
+  return {total_ns / total_ops, (double)total_allocs / total_ops};
+}
+
+template <class Timed> Measurement measure(size_t ops, Timed timed) {
+  return measure(ops, timed, [] {});
+}
+
+void report(const std::string &name, size_t regions, Measurement m,
+            size_t peak_bytes) {
+  printf("{\"bench\":\"%s\",\"regions\":%zu,\"ns_per_op\":%.2f,"
+         "\"allocs_per_op\":%.3f,\"peak_bytes\":%zu}\n",
+         name.c_str(), regions, m.ns_per_op, m.allocs_per_op, peak_bytes);
+  fflush(stdout);
+}
+
+// Track the heap peak of one benchmark from the point it is constructed.
+struct PeakScope {
+  size_t base;
+  PeakScope() : base(g_live) { g_peak = g_live; }
+  size_t peak() const { return g_peak - base; }
+};
+
+// Distinct random indices in [0, n), at most 'max' of them.
+std::vector<size_t> pick(std::mt19937_64 &rng, size_t n, size_t max) {
+  std::vector<size_t> all(n);
+  for (size_t i = 0; i < n; i++)
+    all[i] = i;
+  std::shuffle(all.begin(), all.end(), rng);
+  all.resize(std::min(n, max));
+  return all;
+}
+
+// Operations per batch for operations that cost O(regions) each.
+size_t linear_batch(size_t regions) {
+  return std::max<size_t>(1, std::min<size_t>(1000, 100000 / regions));
+}
+
+// RangeMap benchmarks. Entries are [2i, 2i+1) so that every odd key is a gap.
+
+using BenchMap = mmap::RangeMap<uint64_t, int>;
+
+void fill(BenchMap &m, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    m.insert(2 * i, 2 * i + 1, (int)(i % 2));
+}
+
+void bench_rangemap(size_t n) {
+  std::mt19937_64 rng(n);
+  auto idx = pick(rng, n, 1000);
+
+  if (selected("rangemap/insert") || selected("rangemap/remove")) {
+    PeakScope peak;
+    BenchMap m;
+    fill(m, n);
+    // Insert into and remove from distinct gaps, so neither coalesces.
+    auto ins = measure(
+        idx.size(),
+        [&] {
+          for (size_t i : idx)
+            m.insert(2 * i + 1, 2 * i + 2, 7);
+        },
+        [&] {
+          for (size_t i : idx)
+            m.remove(2 * i + 1, 2 * i + 2);
+        });
+    auto rem = measure(
+        idx.size(),
+        [&] {
+          for (size_t i : idx)
+            m.remove(2 * i, 2 * i + 1);
+        },
+        [&] {
+          for (size_t i : idx)
+            m.insert(2 * i, 2 * i + 1, (int)(i % 2));
+        });
+    if (selected("rangemap/insert"))
+      report("rangemap/insert", n, ins, peak.peak());
+    if (selected("rangemap/remove"))
+      report("rangemap/remove", n, rem, peak.peak());
+  }
+
+  if (selected("rangemap/insert_seq") || selected("rangemap/remove_seq")) {
+    PeakScope peak;
+    BenchMap m;
+    fill(m, n);
+    // The same in key order, passing each call's hint to the next.
+    size_t first = (n - idx.size()) / 2;
+    size_t last = first + idx.size();
+    BenchMap::Hint hint;
+    auto ins = measure(
+        idx.size(),
+        [&] {
+          for (size_t i = first; i < last; i++)
+            m.insert(2 * i + 1, 2 * i + 2, 7, &hint);
+        },
+        [&] {
+          for (size_t i = first; i < last; i++)
+            m.remove(2 * i + 1, 2 * i + 2, &hint);
+        });
+    auto rem = measure(
+        idx.size(),
+        [&] {
+          for (size_t i = first; i < last; i++)
+            m.remove(2 * i, 2 * i + 1, &hint);
+        },
+        [&] {
+          for (size_t i = first; i < last; i++)
+            m.insert(2 * i, 2 * i + 1, (int)(i % 2), &hint);
+        });
+    if (selected("rangemap/insert_seq"))
+      report("rangemap/insert_seq", n, ins, peak.peak());
+    if (selected("rangemap/remove_seq"))
+      report("rangemap/remove_seq", n, rem, peak.peak());
+  }
+
+  // Point and range lookups, on the tree and then on the frozen arrays.
+  for (bool frozen : {false, true}) {
+    std::string p = frozen ? "rangemap/frozen_" : "rangemap/";
+    if (!selected(p + "find") && !selected(p + "overlaps"))
+      continue;
+    std::vector<uint64_t> keys(1000);
+    for (auto &k : keys)
+      k = rng() % (2 * n);
+    PeakScope peak;
+    BenchMap m;
+    fill(m, n);
+    if (frozen)
+      m.freeze();
+    if (selected(p + "find")) {
+      auto r = measure(keys.size(), [&] {
+        uint64_t sum = 0;
+        for (uint64_t k : keys)
+          sum += m.find(k).has_value();
+        g_sink = sum;
+      });
+      report(p + "find", n, r, peak.peak());
+    }
+    if (selected(p + "overlaps")) {
+      auto r = measure(keys.size(), [&] {
+        uint64_t sum = 0;
+        for (uint64_t k : keys)
+          sum += m.overlaps(k, k + 3);
+        g_sink = sum;
+      });
+      report(p + "overlaps", n, r, peak.peak());
+    }
+  }
+
+  if (selected("rangemap/get_gaps")) {
+    PeakScope peak;
+    BenchMap m;
+    fill(m, n);
+    auto r = measure(linear_batch(n), [&] {
+      for (size_t i = 0; i < linear_batch(n); i++)
+        g_sink = m.get_gaps(0, 2 * n).size();
+    });
+    report("rangemap/get_gaps", n, r, peak.peak());
+  }
+}
+
+// AddrSpace benchmarks. The space starts with n adjacent one-page regions
+// whose protections alternate, so none coalesce, followed by free space.
+
+const uintptr_t kBase = 0x10000000;
+const size_t kPage = 4096;
+
+template <class Space> void fill(Space &mm, size_t n) {
+  mm.init(kBase, (n + 2 * 1000 + 16) * kPage, kPage);
+  for (size_t i = 0; i < n; i++)
+    mm.map_at(kBase + i * kPage, kPage, (int)(i % 2), 0, -1, 0);
+}
+
+template <class Space> void bench_addrspace(const char *prefix, size_t n) {
+  std::mt19937_64 rng(n);
+  auto idx = pick(rng, n, 1000);
+  std::string p = prefix;
+
+  if (selected(p + "/query_page")) {
+    std::vector<uintptr_t> addrs(1000);
+    for (auto &a : addrs)
+      a = kBase + (rng() % n) * kPage;
+    PeakScope peak;
+    Space mm;
+    fill(mm, n);
+    auto r = measure(addrs.size(), [&] {
+      uint64_t sum = 0;
+      mmap::MapInfo info;
+      for (uintptr_t a : addrs)
+        sum += mm.query_page(a, &info);
+      g_sink = sum;
+    });
+    report(p + "/query_page", n, r, peak.peak());
+  }
+
+  if (selected(p + "/iterate")) {
+    PeakScope peak;
+    Space mm;
+    fill(mm, n);
+    // One walk over every region, reported per region.
+    auto r = measure(n, [&] {
+      uint64_t sum = 0;
+      for (mmap::Region reg : mm)
+        sum += reg.len;
+      g_sink = sum;
+    });
+    report(p + "/iterate", n, r, peak.peak());
+  }
+
+  if (selected(p + "/read_maps")) {
+    PeakScope peak;
+    Space mm;
+    fill(mm, n);
+    // Every other region is named, like a process full of file mappings,
+    // and the listing is read in 4 KiB pieces, like read() on /proc.
+    auto names = [](uintptr_t start, size_t, mmap::MapInfo) {
+      mmap::MapsName name;
+      if ((start / kPage) % 2) {
+        name.path = "/usr/lib/x86_64-linux-gnu/libc.so.6";
+        name.dev_major = 0xfe;
+        name.inode = 467394;
+      }
+      return name;
+    };
+    static char buf[4096];
+    auto r = measure(n, [&] {
+      mmap::MapsCursor cursor;
+      uint64_t total = 0;
+      while (size_t got = mm.read_maps(&cursor, buf, sizeof(buf), names))
+        total += got;
+      g_sink = total;
+    });
+    report(p + "/read_maps", n, r, peak.peak());
+  }
+
+  if (selected(p + "/import_maps")) {
+    PeakScope peak;
+    Space mm;
+    fill(mm, n);
+    // The listing is written out untimed; each pass rereads it from the
+    // start, reported per region.
+    FILE *f = tmpfile();
+    if (!f)
+      abort();
+    static char buf[4096];
+    mmap::MapsCursor cursor;
+    while (size_t got = mm.read_maps(&cursor, buf, sizeof(buf)))
+      fwrite(buf, 1, got, f);
+    auto r = measure(n, [&] {
+      rewind(f);
+      if (mm.import_maps(f) != mmap::Error::kOk)
+        abort();
+    });
+    fclose(f);
+    report(p + "/import_maps", n, r, peak.peak());
+  }
+
+  if (selected(p + "/load_regions")) {
+    PeakScope peak;
+    Space mm;
+    fill(mm, n);
+    std::vector<mmap::Region> regions(mm.begin(), mm.end());
+    auto r = measure(n, [&] {
+      if (mm.load_regions(regions.data(), regions.size()) != mmap::Error::kOk)
+        abort();
+    });
+    report(p + "/load_regions", n, r, peak.peak());
+  }
+
+  if (selected(p + "/diff")) {
+    PeakScope peak;
+    Space mm, target;
+    fill(mm, n);
+    fill(target, n);
+    // The target differs in every hundredth region; reported per region.
+    for (size_t i = 0; i < n; i += 100)
+      target.protect(kBase + i * kPage, kPage, 3);
+    auto r = measure(n, [&] {
+      size_t changes = 0;
+      mm.diff(target, [&](mmap::DiffOp, uintptr_t, size_t, mmap::MapInfo) {
+        changes++;
+      });
+      g_sink = changes;
+    });
+    report(p + "/diff", n, r, peak.peak());
+  }
+
+  if (selected(p + "/serialize") || selected(p + "/deserialize")) {
+    PeakScope peak;
+    Space mm;
+    fill(mm, n);
+    std::vector<uint8_t> buf(mm.serialize(nullptr, 0));
+    if (selected(p + "/serialize")) {
+      auto r =
+          measure(n, [&] { g_sink = mm.serialize(buf.data(), buf.size()); });
+      report(p + "/serialize", n, r, peak.peak());
+    }
+    if (selected(p + "/deserialize")) {
+      mm.serialize(buf.data(), buf.size());
+      auto r = measure(n, [&] {
+        if (mm.deserialize(buf.data(), buf.size()) != mmap::Error::kOk)
+          abort();
+      });
+      report(p + "/deserialize", n, r, peak.peak());
+    }
+  }
+
+  if (selected(p + "/frozen_query_page")) {
+    std::vector<uintptr_t> addrs(1000);
+    for (auto &a : addrs)
+      a = kBase + (rng() % n) * kPage;
+    PeakScope peak;
+    Space mm;
+    fill(mm, n);
+    // Same lookups as query_page, against a frozen image of the space.
+    size_t size = mm.freeze(nullptr, 0);
+    std::vector<uint64_t> image((size + 7) / 8);
+    mm.freeze(image.data(), size);
+    mmap::FrozenAddrSpace frozen;
+    if (!frozen.open(image.data(), size))
+      abort();
+    auto r = measure(addrs.size(), [&] {
+      uint64_t sum = 0;
+      mmap::MapInfo info;
+      for (uintptr_t a : addrs)
+        sum += frozen.query_page(a, &info);
+      g_sink = sum;
+    });
+    report(p + "/frozen_query_page", n, r, peak.peak());
+  }
+
+  if (selected(p + "/shared_query_page")) {
+    std::vector<uintptr_t> addrs(1000);
+    for (auto &a : addrs)
+      a = kBase + (rng() % n) * kPage;
+    PeakScope peak;
+    Space mm;
+    fill(mm, n);
+    // Same lookups as query_page, from a reader of a shared arena.
+    size_t size = mmap::shared_arena_size(n);
+    std::vector<uint64_t> arena((size + 7) / 8);
+    mmap::SharedAddrSpace shared;
+    if (!mm.share(arena.data(), size) || !shared.open(arena.data(), size))
+      abort();
+    auto r = measure(addrs.size(), [&] {
+      uint64_t sum = 0;
+      mmap::MapInfo info;
+      bool found;
+      for (uintptr_t a : addrs) {
+        shared.query_page(a, &info, &found);
+        sum += found;
+      }
+      g_sink = sum;
+    });
+    report(p + "/shared_query_page", n, r, peak.peak());
+  }
+
+  if (selected(p + "/map_any")) {
+    PeakScope peak;
+    Space mm;
+    fill(mm, n);
+    // The first fit is past every existing region.
+    size_t batch = linear_batch(n);
+    auto r = measure(
+        batch,
+        [&] {
+          for (size_t i = 0; i < batch; i++)
+            mm.map_any(0, kPage, 2, 0, -1, 0);
+        },
+        [&] { mm.unmap(kBase + n * kPage, batch * kPage); });
+    report(p + "/map_any", n, r, peak.peak());
+  }
+
+  if (selected(p + "/map_at")) {
+    PeakScope peak;
+    Space mm;
+    fill(mm, n);
+    // Overwrite regions with identical mappings, which leaves the space as
+    // it was.
+    auto r = measure(idx.size(), [&] {
+      for (size_t i : idx)
+        mm.map_at(kBase + i * kPage, kPage, (int)(i % 2), 0, -1, 0);
+    });
+    report(p + "/map_at", n, r, peak.peak());
+  }
+
+  if (selected(p + "/map_at_noreplace")) {
+    PeakScope peak;
+    Space mm;
+    fill(mm, n);
+    // Every call overlaps a region and is refused.
+    auto r = measure(idx.size(), [&] {
+      for (size_t i : idx)
+        mm.map_at_noreplace(kBase + i * kPage, kPage, 2, 0, -1, 0);
+    });
+    report(p + "/map_at_noreplace", n, r, peak.peak());
+  }
+
+  if (selected(p + "/map_at_seq") || selected(p + "/unmap_seq")) {
+    PeakScope peak;
+    Space mm;
+    fill(mm, n);
+    // map_at and unmap over consecutive regions, as a loader maps segment
+    // after segment or an allocator frees an arena chunk by chunk.
+    size_t first = (n - idx.size()) / 2;
+    size_t last = first + idx.size();
+    auto map = measure(idx.size(), [&] {
+      for (size_t i = first; i < last; i++)
+        mm.map_at(kBase + i * kPage, kPage, (int)(i % 2), 0, -1, 0);
+    });
+    auto unmap = measure(
+        idx.size(),
+        [&] {
+          for (size_t i = first; i < last; i++)
+            mm.unmap(kBase + i * kPage, kPage);
+        },
+        [&] {
+          for (size_t i = first; i < last; i++)
+            mm.map_at(kBase + i * kPage, kPage, (int)(i % 2), 0, -1, 0);
+        });
+    if (selected(p + "/map_at_seq"))
+      report(p + "/map_at_seq", n, map, peak.peak());
+    if (selected(p + "/unmap_seq"))
+      report(p + "/unmap_seq", n, unmap, peak.peak());
+  }
+
+  if (selected(p + "/txn_map_at") || selected(p + "/txn_rollback")) {
+    PeakScope peak;
+    Space mm;
+    fill(mm, n);
+    // Each map_at in its own transaction, either kept or undone.
+    for (bool undo : {false, true}) {
+      std::string name = p + (undo ? "/txn_rollback" : "/txn_map_at");
+      if (!selected(name))
+        continue;
+      auto r = measure(idx.size(), [&] {
+        for (size_t i : idx) {
+          mm.begin_txn();
+          mm.map_at(kBase + i * kPage, kPage, (int)(i % 2) + undo * 2, 0, -1,
+                    0);
+          if (undo)
+            mm.rollback();
+          else
+            mm.commit();
+        }
+      });
+      report(name, n, r, peak.peak());
+    }
+  }
+
+  if (selected(p + "/shared_map_at")) {
+    PeakScope peak;
+    Space mm;
+    fill(mm, n);
+    // map_at while publishing every change to a shared arena.
+    size_t size = mmap::shared_arena_size(n);
+    std::vector<uint64_t> arena((size + 7) / 8);
+    if (!mm.share(arena.data(), size))
+      abort();
+    auto r = measure(idx.size(), [&] {
+      for (size_t i : idx)
+        mm.map_at(kBase + i * kPage, kPage, (int)(i % 2), 0, -1, 0);
+    });
+    report(p + "/shared_map_at", n, r, peak.peak());
+  }
+
+  if (selected(p + "/unmap")) {
+    PeakScope peak;
+    Space mm;
+    fill(mm, n);
+    auto r = measure(
+        idx.size(),
+        [&] {
+          for (size_t i : idx)
+            mm.unmap(kBase + i * kPage, kPage);
+        },
+        [&] {
+          for (size_t i : idx)
+            mm.map_at(kBase + i * kPage, kPage, (int)(i % 2), 0, -1, 0);
+        });
+    report(p + "/unmap", n, r, peak.peak());
+  }
+
+  if (selected(p + "/protect")) {
+    PeakScope peak;
+    Space mm;
+    fill(mm, n);
+    auto r = measure(
+        idx.size(),
+        [&] {
+          for (size_t i : idx)
+            mm.protect(kBase + i * kPage, kPage, 2);
+        },
+        [&] {
+          for (size_t i : idx)
+            mm.protect(kBase + i * kPage, kPage, (int)(i % 2));
+        });
+    report(p + "/protect", n, r, peak.peak());
+  }
+
+  if (selected(p + "/set_attr")) {
+    PeakScope peak;
+    Space mm;
+    fill(mm, n);
+    size_t layer = mm.add_layer();
+    // Set and clear a value on single pages, which never splits a region.
+    auto r = measure(
+        idx.size(),
+        [&] {
+          for (size_t i : idx)
+            mm.set_attr(layer, kBase + i * kPage, kPage, 1 + i % 2);
+        },
+        [&] {
+          for (size_t i : idx)
+            mm.set_attr(layer, kBase + i * kPage, kPage, 0);
+        });
+    report(p + "/set_attr", n, r, peak.peak());
+  }
+
+  if (selected(p + "/unmap_non_original")) {
+    PeakScope peak;
+    Space mm;
+    fill(mm, n);
+    mm.mark_original();
+    // Each call walks every original region to find the one that is not.
+    mm.map_at(kBase + (n + 1) * kPage, kPage, 2, 0, -1, 0);
+    auto r = measure(
+        1, [&] { mm.unmap_non_original(); },
+        [&] { mm.map_at(kBase + (n + 1) * kPage, kPage, 2, 0, -1, 0); });
+    report(p + "/unmap_non_original", n, r, peak.peak());
+  }
+}
+
+const char *isa_name(mmap::SearchIsa isa) {
+  switch (isa) {
+  case mmap::SearchIsa::kScalar:
+    return "scalar";
+  case mmap::SearchIsa::kSse42:
+    return "sse42";
+  case mmap::SearchIsa::kAvx2:
+    return "avx2";
+  case mmap::SearchIsa::kAvx512:
+    return "avx512";
+  }
+  return "unknown";
+}
+
+// Latency of one inline key search with each kernel the CPU supports.
+template <class K> void bench_key_search(const char *type) {
+  const size_t n = 16;
+  std::mt19937_64 rng(n);
+  K keys[n];
+  for (size_t i = 0; i < n; i++)
+    keys[i] = (K)(i * 10);
+  std::vector<K> probes(1000);
+  for (auto &k : probes)
+    k = (K)(rng() % (n * 10));
+
+  for (mmap::SearchIsa isa :
+       {mmap::SearchIsa::kScalar, mmap::SearchIsa::kSse42,
+        mmap::SearchIsa::kAvx2, mmap::SearchIsa::kAvx512}) {
+    std::string name =
+        std::string("key_search/") + type + "/" + isa_name(isa);
+    if (!selected(name) || !mmap::search_isa_supported(isa))
+      continue;
+    PeakScope peak;
+    auto ks = mmap::key_search_for<K>(isa);
+    auto r = measure(probes.size(), [&] {
+      size_t sum = 0;
+      for (K k : probes)
+        sum += ks.count_less_equal(keys, n, k);
+      g_sink = sum;
+    });
+    report(name, n, r, peak.peak());
+  }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--filter") && i + 1 < argc) {
+      g_opts.filter = argv[++i];
+    } else if (!strcmp(argv[i], "--max-regions") && i + 1 < argc) {
+      g_opts.max_regions = strtoull(argv[++i], nullptr, 0);
+    } else if (!strcmp(argv[i], "--min-time") && i + 1 < argc) {
+      g_opts.min_time_ms = atof(argv[++i]);
+    } else {
+      fprintf(stderr,
+              "usage: %s [--filter SUBSTR] [--max-regions N] "
+              "[--min-time MS]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  bench_key_search<uint64_t>("u64");
+  bench_key_search<uint32_t>("u32");
+
+  for (size_t n = 10; n <= g_opts.max_regions; n *= 10) {
+    bench_rangemap(n);
+    bench_addrspace<mmap::AddrSpace>("addrspace", n);
+    bench_addrspace<mmap::AddrSpace4K>("addrspace4k", n);
+    bench_addrspace<mmap::CompactAddrSpace>("compact", n);
+  }
+  return 0;
+}
@@ -0,0 +1,411 @@
+// Head-to-head benchmark of mmap::AddrSpace against the linked-list
+// implementation in test/fuzz/ref_mmap.c.
+//
+// Each workload is generated once as a list of operations and then replayed
+// against both implementations. Operations that create a mapping with
+// map_any store the returned address in a slot, and later operations address
+// pages relative to that slot, so the two replays stay equivalent even
+// though the implementations place mappings differently.
+//
+// A workload has an untimed setup prefix that builds roughly 'regions'
+// regions, followed by the measured operations. The measured part is
+// replayed twice per implementation: once under a single clock for
+// throughput, and once with every operation timed for latency percentiles.
+// Per-operation timing includes the clock overhead (tens of nanoseconds),
+// so percentiles of fast operations are upper bounds.
+//
+// Output is one JSON object per workload, implementation and region count:
+//
+//   {"workload":"arena","impl":"libmmap","regions":1000,"ops":10000,
+//    "ops_per_sec":8512345,"p50_ns":98,"p90_ns":130,"p99_ns":410,
+//    "max_ns":5120}
+//
+// followed by a summary line with the throughput ratio, where a speedup
+// above 1 means the tree is faster:
+//
+//   {"workload":"arena","regions":1000,"speedup":12.40}
+//
+// Usage: bench_ref [--filter SUBSTR] [--max-regions N] [--ops N]
+
+#include "addr_space.h"
+
+extern "C" {
+#include "ref_mmap.h"
+}
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+  const char *filter = nullptr;
+  size_t max_regions = 10000;
+  size_t ops = 10000;
+};
+
+Options g_opts;
+
+const uintptr_t kBase = 0x10000000;
+const size_t kPage = 4096;
+const uintptr_t kFail = (uintptr_t)-1;
+
+const int kProtNone = 0;
+const int kProtR = 1;
+const int kProtRW = 3;
+const int kProtRX = 5;
+const int kFlagsFile = 0x02;
+const int kFlagsAnon = 0x22;
+
+enum class OpKind { kMapAny, kMapAt, kUnmap, kProtect, kQuery };
+
+const uint32_t kNoSlot = ~(uint32_t)0;
+
+// One operation of a workload. For kMapAny, 'slot' receives the address of
+// the new mapping. For the other kinds 'page' is relative to the mapping in
+// 'slot', or to the start of the space if 'slot' is kNoSlot.
+struct Op {
+  OpKind kind;
+  uint32_t slot;
+  uint64_t page;
+  uint64_t pages;
+  int prot;
+  int flags;
+  int64_t offset;
+};
+
+struct Workload {
+  Workload(const char *n, size_t nregions, size_t pages)
+      : name(n), regions(nregions), space_pages(pages) {}
+
+  std::string name;
+  size_t regions;
+  size_t space_pages;
+  size_t nslots = 0;
+  size_t setup = 0;
+  std::vector<Op> ops;
+
+  uint32_t new_slot() { return (uint32_t)nslots++; }
+  void map_any(uint32_t slot, uint64_t pages, int prot, int flags,
+               int64_t offset) {
+    ops.push_back({OpKind::kMapAny, slot, 0, pages, prot, flags, offset});
+  }
+  void map_at(uint32_t slot, uint64_t page, uint64_t pages, int prot,
+              int flags, int64_t offset) {
+    ops.push_back({OpKind::kMapAt, slot, page, pages, prot, flags, offset});
+  }
+  void unmap(uint32_t slot, uint64_t page, uint64_t pages) {
+    ops.push_back({OpKind::kUnmap, slot, page, pages, 0, 0, 0});
+  }
+  void protect(uint32_t slot, uint64_t page, uint64_t pages, int prot) {
+    ops.push_back({OpKind::kProtect, slot, page, pages, prot, 0, 0});
+  }
+  void query(uint32_t slot, uint64_t page) {
+    ops.push_back({OpKind::kQuery, slot, page, 1, 0, 0, 0});
+  }
+  // Everything added so far is setup.
+  void end_setup() { setup = ops.size(); }
+};
+
+// A dynamic loader mapping 'regions' / 5 libraries. Each library is reserved
+// with one map_any and then split into text, rodata, data, bss and guard
+// regions with protect and map_at, as ld.so does. Every operation is timed.
+Workload loader(size_t regions) {
+  Workload w{"loader", regions, 0};
+  size_t libs = std::max<size_t>(1, regions / 5);
+  w.space_pages = libs * 16 + 16;
+  std::mt19937_64 rng(regions);
+  for (size_t i = 0; i < libs; i++) {
+    uint32_t lib = w.new_slot();
+    w.map_any(lib, 16, kProtR, kFlagsFile, (int64_t)(i * 16 * kPage));
+    w.protect(lib, 0, 4, kProtRX);
+    w.protect(lib, 8, 4, kProtRW);
+    w.map_at(lib, 12, 2, kProtRW, kFlagsAnon, 0);
+    w.protect(lib, 14, 2, kProtNone);
+    for (int j = 0; j < 4; j++)
+      w.query(lib, rng() % 16);
+  }
+  return w;
+}
+
+// A malloc with 'regions' live arenas of 1 to 16 pages, then churn: free a
+// random arena, map a new one and touch a page of another.
+Workload arena(size_t regions) {
+  Workload w{"arena", regions, regions * 32 + 64};
+  std::mt19937_64 rng(regions);
+  std::vector<uint32_t> live;
+  std::vector<uint64_t> sizes;
+  auto add = [&] {
+    uint32_t slot = w.new_slot();
+    uint64_t pages = 1 + rng() % 16;
+    sizes.push_back(pages);
+    // Distinct offsets keep neighbouring arenas from coalescing.
+    w.map_any(slot, pages, kProtRW, kFlagsAnon, (int64_t)slot * kPage);
+    live.push_back(slot);
+  };
+  for (size_t i = 0; i < regions; i++)
+    add();
+  w.end_setup();
+  while (w.ops.size() - w.setup < g_opts.ops) {
+    size_t i = rng() % live.size();
+    w.unmap(live[i], 0, sizes[live[i]]);
+    live[i] = live.back();
+    live.pop_back();
+    add();
+    uint32_t other = live[rng() % live.size()];
+    w.query(other, rng() % sizes[other]);
+  }
+  return w;
+}
+
+// A JIT with 'regions' code chunks of 4 pages that repeatedly flips part of
+// a chunk to writable, patches it and flips it back to executable.
+Workload jit(size_t regions) {
+  Workload w{"jit", regions, regions * 4 + 16};
+  std::mt19937_64 rng(regions);
+  for (size_t i = 0; i < regions; i++)
+    w.map_any(w.new_slot(), 4, kProtRX, kFlagsAnon, (int64_t)(i * kPage));
+  w.end_setup();
+  while (w.ops.size() - w.setup < g_opts.ops) {
+    uint32_t chunk = (uint32_t)(rng() % regions);
+    uint64_t page = rng() % 4;
+    uint64_t pages = 1 + rng() % (4 - page);
+    w.protect(chunk, page, pages, kProtRW);
+    w.query(chunk, page);
+    w.protect(chunk, page, pages, kProtRX);
+  }
+  return w;
+}
+
+// Random map_at, unmap and protect calls of 1 to 8 pages anywhere in a space
+// four times the region count, which leaves it badly fragmented.
+Workload fragment(size_t regions) {
+  Workload w{"fragment", regions, regions * 4 + 16};
+  std::mt19937_64 rng(regions);
+  auto page = [&] { return rng() % (w.space_pages - 8); };
+  for (size_t i = 0; i < regions; i++)
+    w.map_at(kNoSlot, page(), 1 + rng() % 4, (int)(rng() % 4), kFlagsAnon,
+             (int64_t)(rng() % 64) * (int64_t)kPage);
+  w.end_setup();
+  while (w.ops.size() - w.setup < g_opts.ops) {
+    switch (rng() % 4) {
+    case 0:
+      w.map_at(kNoSlot, page(), 1 + rng() % 8, (int)(rng() % 4), kFlagsAnon,
+               (int64_t)(rng() % 64) * (int64_t)kPage);
+      break;
+    case 1:
+      w.unmap(kNoSlot, page(), 1 + rng() % 8);
+      break;
+    case 2:
+      w.protect(kNoSlot, page(), 1 + rng() % 8, (int)(rng() % 4));
+      break;
+    default:
+      w.query(kNoSlot, page());
+      break;
+    }
+  }
+  return w;
+}
+
+// Adapters giving both implementations the same interface.
+
+struct Tree {
+  static constexpr const char *kName = "libmmap";
+  mmap::AddrSpace mm;
+
+  bool init(uintptr_t start, size_t len) {
+    return mm.init(start, len, kPage);
+  }
+  uintptr_t map_any(size_t len, int prot, int flags, int64_t offset) {
+    return mm.map_any(0, len, prot, flags, -1, offset);
+  }
+  uintptr_t map_at(uintptr_t addr, size_t len, int prot, int flags,
+                   int64_t offset) {
+    return mm.map_at(addr, len, prot, flags, -1, offset);
+  }
+  void unmap(uintptr_t addr, size_t len) { mm.unmap(addr, len); }
+  void protect(uintptr_t addr, size_t len, int prot) {
+    mm.protect(addr, len, prot);
+  }
+  bool query(uintptr_t addr) {
+    mmap::MapInfo info;
+    return mm.query_page(addr, &info);
+  }
+};
+
+struct List {
+  static constexpr const char *kName = "ref_mmap";
+  MMAddrSpace mm{};
+  bool ok = false;
+
+  ~List() {
+    if (ok)
+      mm_free(&mm);
+  }
+  bool init(uintptr_t start, size_t len) {
+    return ok = mm_init(&mm, start, len, kPage);
+  }
+  uintptr_t map_any(size_t len, int prot, int flags, int64_t offset) {
+    return mm_mapany(&mm, len, prot, flags, -1, offset);
+  }
+  uintptr_t map_at(uintptr_t addr, size_t len, int prot, int flags,
+                   int64_t offset) {
+    return mm_mapat(&mm, addr, len, prot, flags, -1, offset);
+  }
+  void unmap(uintptr_t addr, size_t len) { mm_unmap(&mm, addr, len); }
+  void protect(uintptr_t addr, size_t len, int prot) {
+    mm_protect(&mm, addr, len, prot);
+  }
+  bool query(uintptr_t addr) {
+    MMInfo info;
+    return mm_querypage(&mm, addr, &info);
+  }
+};
+
+volatile uint64_t g_sink;
+
+// Apply one operation. Operations on a slot whose map_any failed are
+// skipped.
+template <class Impl>
+void apply(Impl &impl, std::vector<uintptr_t> &slots, const Op &op) {
+  uintptr_t addr;
+  if (op.kind == OpKind::kMapAny) {
+    slots[op.slot] = impl.map_any(op.pages * kPage, op.prot, op.flags,
+                                  op.offset);
+    return;
+  }
+  if (op.slot == kNoSlot) {
+    addr = kBase + op.page * kPage;
+  } else {
+    if (slots[op.slot] == kFail)
+      return;
+    addr = slots[op.slot] + op.page * kPage;
+  }
+  size_t len = op.pages * kPage;
+  switch (op.kind) {
+  case OpKind::kMapAt:
+    impl.map_at(addr, len, op.prot, op.flags, op.offset);
+    break;
+  case OpKind::kUnmap:
+    impl.unmap(addr, len);
+    break;
+  case OpKind::kProtect:
+    impl.protect(addr, len, op.prot);
+    break;
+  case OpKind::kQuery:
+    g_sink = g_sink + impl.query(addr);
+    break;
+  case OpKind::kMapAny:
+    break;
+  }
+}
+
+struct Result {
+  double ops_per_sec;
+  std::vector<uint64_t> latencies;
+};
+
+// Replay 'w' from scratch. With 'per_op' every measured operation is timed
+// on its own; otherwise the measured part is timed as a whole.
+template <class Impl>
+Result replay(const Workload &w, bool per_op) {
+  Impl impl;
+  if (!impl.init(kBase, w.space_pages * kPage)) {
+    fprintf(stderr, "%s: init failed\n", Impl::kName);
+    exit(1);
+  }
+  std::vector<uintptr_t> slots(w.nslots, kFail);
+  for (size_t i = 0; i < w.setup; i++)
+    apply(impl, slots, w.ops[i]);
+
+  Result r{};
+  size_t n = w.ops.size() - w.setup;
+  if (per_op) {
+    r.latencies.reserve(n);
+    for (size_t i = w.setup; i < w.ops.size(); i++) {
+      auto t0 = Clock::now();
+      apply(impl, slots, w.ops[i]);
+      auto t1 = Clock::now();
+      r.latencies.push_back(
+          (uint64_t)std::chrono::duration<double, std::nano>(t1 - t0).count());
+    }
+  } else {
+    auto t0 = Clock::now();
+    for (size_t i = w.setup; i < w.ops.size(); i++)
+      apply(impl, slots, w.ops[i]);
+    auto t1 = Clock::now();
+    double ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+    r.ops_per_sec = n / (ns * 1e-9);
+  }
+  return r;
+}
+
+uint64_t percentile(const std::vector<uint64_t> &sorted, double p) {
+  if (sorted.empty())
+    return 0;
+  size_t i = (size_t)(p * (sorted.size() - 1));
+  return sorted[i];
+}
+
+template <class Impl> double run(const Workload &w) {
+  double ops_per_sec = replay<Impl>(w, false).ops_per_sec;
+  auto lat = replay<Impl>(w, true).latencies;
+  std::sort(lat.begin(), lat.end());
+  printf("{\"workload\":\"%s\",\"impl\":\"%s\",\"regions\":%zu,\"ops\":%zu,"
+         "\"ops_per_sec\":%.0f,\"p50_ns\":%llu,\"p90_ns\":%llu,"
+         "\"p99_ns\":%llu,\"max_ns\":%llu}\n",
+         w.name.c_str(), Impl::kName, w.regions, w.ops.size() - w.setup,
+         ops_per_sec, (unsigned long long)percentile(lat, 0.5),
+         (unsigned long long)percentile(lat, 0.9),
+         (unsigned long long)percentile(lat, 0.99),
+         (unsigned long long)percentile(lat, 1.0));
+  fflush(stdout);
+  return ops_per_sec;
+}
+
+void compare(const Workload &w) {
+  if (g_opts.filter && w.name.find(g_opts.filter) == std::string::npos)
+    return;
+  double tree = run<Tree>(w);
+  double list = run<List>(w);
+  printf("{\"workload\":\"%s\",\"regions\":%zu,\"speedup\":%.2f}\n",
+         w.name.c_str(), w.regions, tree / list);
+  fflush(stdout);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--filter") && i + 1 < argc) {
+      g_opts.filter = argv[++i];
+    } else if (!strcmp(argv[i], "--max-regions") && i + 1 < argc) {
+      g_opts.max_regions = strtoull(argv[++i], nullptr, 0);
+    } else if (!strcmp(argv[i], "--ops") && i + 1 < argc) {
+      g_opts.ops = strtoull(argv[++i], nullptr, 0);
+    } else {
+      fprintf(stderr,
+              "usage: %s [--filter SUBSTR] [--max-regions N] [--ops N]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  // 10, 30, 100, 300, ... so the crossover point is visible.
+  for (size_t n = 10; n <= g_opts.max_regions;
+       n = n % 3 ? n * 3 : n / 3 * 10) {
+    compare(loader(n));
+    compare(arena(n));
+    compare(jit(n));
+    compare(fragment(n));
+  }
+}
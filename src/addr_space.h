@@ -1,32 +1,108 @@
 #ifndef LIBMMAP_ADDR_SPACE_H
 #define LIBMMAP_ADDR_SPACE_H
 
+#include "gap_histogram.h"
+#include "info_table.h"
+#include "maps.h"
+#include "node_pool.h"
 #include "range_map.h"
+#include "stats.h"
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
+#include <cstdio>
 #include <functional>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <utility>
+#include <vector>
 
 namespace mmap {
 
-struct MapInfo {
-  int prot;
-  int flags;
-  int fd;
-  int64_t offset;
-  bool original;
+enum class Error { kOk, kInval, kNoMem, kExists };
 
-  bool operator==(const MapInfo &other) const {
-    return prot == other.prot && flags == other.flags && fd == other.fd &&
-           offset == other.offset && original == other.original;
-  }
+using UpdateFn = std::function<void(uintptr_t, size_t, MapInfo)>;
+
+// A change reported by BasicAddrSpace::diff().
+enum class DiffOp { kUnmap, kMap, kProtect };
+
+// Called by diff() with each change. For kMap 'info' is the mapping to make,
+// for kProtect only info.prot, the new protection, is set, and for kUnmap it
+// is zero.
+using DiffFn = std::function<void(DiffOp, uintptr_t, size_t, MapInfo)>;
+
+// Called by for_each_attr() with each run of pages that share a nonzero value
+// in an attribute layer.
+using AttrFn = std::function<void(uintptr_t, size_t, uint64_t)>;
+
+class FrozenAddrSpace;
+struct SharedHeader;
+class TraceWriter;
+
+// Number of protection classes counted by Usage: the PROT_READ, PROT_WRITE
+// and PROT_EXEC bits of a region's prot.
+inline constexpr size_t kProtClasses = 8;
+
+// Totals kept up to date by every call that changes the mapping, so reading
+// them is O(1). All sizes are in pages.
+struct Usage {
+  uint64_t mapped_pages;
+  // Pages mapped with each value of prot & (kProtClasses - 1).
+  uint64_t prot_pages[kProtClasses];
+  uint64_t regions;
+  // Longest run of unmapped pages.
+  uint64_t largest_gap;
 };
 
-enum class Error { kOk, kInval, kNoMem };
+// Storage layouts for BasicAddrSpace. Region keys are page numbers relative
+// to the start of the address space, so 32-bit keys cover up to 2^32 pages.
+//
+// WideLayout stores 64-bit keys and the MapInfo of each region inline.
+struct WideLayout {
+  using Key = uint64_t;
+  using Infos = DirectInfos;
+};
 
-using UpdateFn = std::function<void(uintptr_t, size_t, MapInfo)>;
+// CompactLayout stores 32-bit keys and an interned MapInfo id, which cuts
+// the per-region footprint to a few words. init() fails if the address space
+// has more pages than a 32-bit key can count.
+struct CompactLayout {
+  using Key = uint32_t;
+  using Infos = InfoTable;
+};
+
+// One mapped region, as yielded by BasicAddrSpace's iterator.
+struct Region {
+  uintptr_t start;
+  size_t len;
+  MapInfo info;
+};
+
+// Page shift of a BasicAddrSpace whose page size is chosen by init().
+inline constexpr size_t kDynamicPageShift = ~(size_t)0;
+
+// BasicAddrSpace tracks regions in pages of 1 << PageShift bytes. With a
+// fixed PageShift the address/page conversions are compile-time shifts and
+// masks, and init() only accepts that page size; kDynamicPageShift takes the
+// page size from init() instead.
+//
+// BasicAddrSpace owns the pools its nodes are allocated from. A move hands
+// them over with the nodes, along with the trace and shared arena, and
+// leaves a space that must be init()ed again before use. A copy rebuilds the
+// regions into fresh pools and starts without a trace or shared arena.
+// Neither carries statistics: each space counts the calls made on it.
+template <size_t PageShift = kDynamicPageShift, class Layout = WideLayout>
+struct BasicAddrSpace {
+  BasicAddrSpace() { make_pool(); }
+  BasicAddrSpace(const BasicAddrSpace &other);
+  BasicAddrSpace(BasicAddrSpace &&other) noexcept { *this = std::move(other); }
+  BasicAddrSpace &operator=(const BasicAddrSpace &other) {
+    return *this = BasicAddrSpace(other);
+  }
+  BasicAddrSpace &operator=(BasicAddrSpace &&other) noexcept;
 
-struct AddrSpace {
   bool init(uintptr_t start, size_t len, size_t pagesize);
   void reset();
 
@@ -34,6 +110,10 @@ struct AddrSpace {
                     int64_t offset);
   uintptr_t map_at(uintptr_t addr, size_t len, int prot, int flags, int fd,
                    int64_t offset, UpdateFn ufn = nullptr);
+  // map_at for MAP_FIXED_NOREPLACE: fail with map_error() kExists, changing
+  // nothing, if any page of the range is already mapped.
+  uintptr_t map_at_noreplace(uintptr_t addr, size_t len, int prot, int flags,
+                             int fd, int64_t offset);
 
   Error unmap(uintptr_t addr, size_t len, UpdateFn ufn = nullptr);
   bool query_page(uintptr_t addr, MapInfo *info) const;
@@ -42,31 +122,418 @@ struct AddrSpace {
   void mark_original();
   void unmap_non_original(UpdateFn ufn = nullptr);
 
+  // Attribute layers hold per-page values kept out of MapInfo, such as
+  // madvise advice, mlock state or userfaultfd registration. Each layer is a
+  // coalescing range map of its own beside the regions, so setting a value
+  // on part of a region never splits it, and query_page and the other
+  // region lookups cost the same however many layers there are. A value of
+  // 0 means unset. Values exist only on mapped pages: unmap, and map_at over
+  // mapped pages, clear every layer there, while protect keeps them. init(),
+  // reset() and the calls that replace every mapping clear all layers, and
+  // diff with 'apply' copies the target's. Layers are not saved by
+  // serialize, freeze or share, nor traced.
+  //
+  // Add a layer, with every value 0, and return its index.
+  size_t add_layer();
+  size_t layers() const { return layers_.size(); }
+  // Set every page of [addr, addr + len) in 'layer' to 'value'. Returns
+  // kInval for a bad range or layer, and kNoMem, changing nothing, if any
+  // page is unmapped, as madvise and mlock fail with ENOMEM.
+  Error set_attr(size_t layer, uintptr_t addr, size_t len, uint64_t value);
+  // Value in 'layer' of the page containing 'addr', or 0.
+  uint64_t attr(size_t layer, uintptr_t addr) const;
+  // Call 'fn' in address order with the runs of nonzero values in 'layer'
+  // that overlap [addr, addr + len), clipped to it. Returns kInval for a bad
+  // range or layer.
+  Error for_each_attr(size_t layer, uintptr_t addr, size_t len,
+                      const AttrFn &fn) const;
+
+  class const_iterator;
+  // Iterate over the regions in address order, as in
+  // 'for (Region r : mm)'. Any call that changes the mapping invalidates
+  // the iterators.
+  const_iterator begin() const;
+  const_iterator end() const;
+  // Iterator to the region containing 'addr', or to the first one after
+  // it. The region is yielded whole even if 'addr' is inside it.
+  const_iterator begin_from(uintptr_t addr) const;
+
+  // Write the next part of a /proc/<pid>/maps listing (see maps.h) into
+  // 'buf', continuing from 'cursor'; lines may be split between calls.
+  // Returns the number of bytes written, which is 0 once the listing is
+  // complete. Nothing is allocated. Without 'names' no region has a path.
+  // Bytes of 'buf' past the returned length may be overwritten.
+  size_t read_maps(MapsCursor *cursor, char *buf, size_t len,
+                   const MapsNameFn &names = nullptr) const;
+
+  // Replace every mapping with the regions listed in 'in', a
+  // /proc/<pid>/maps listing such as the host's /proc/self/maps, marking
+  // them original if 'original'. Imported regions have fd -1 and the
+  // listing's prot, offset and MAP_SHARED or MAP_PRIVATE. Parts of regions
+  // outside the address space are dropped. The file is read in fixed-size
+  // chunks and, since the kernel lists regions in order, the regions are
+  // appended without searching, in O(n) total. Returns kInval if a line is
+  // malformed, the regions are unsorted or overlap, or reading fails, and
+  // kNoMem if the regions exceed the limit; either leaves the address space
+  // empty. Traced as a reset and one map_at per region.
+  Error import_maps(FILE *in, bool original = false);
+
+  // Replace every mapping with 'count' regions, which must be sorted by
+  // start without overlapping, page-aligned and inside the address space.
+  // Each keeps its MapInfo, including 'original'. Like import_maps this
+  // appends without searching, in O(n). Returns kInval for regions not in
+  // that form and kNoMem if they exceed the limit, leaving the mapping
+  // unchanged.
+  Error load_regions(const Region *regions, size_t count);
+
+  // Call 'fn' in address order with the changes that turn this mapping into
+  // 'target's, walking both in O(n + m). Pages that already match are left
+  // alone, pages whose MapInfo differs only in prot are protected rather
+  // than remapped, and neighboring changes that one host call could make are
+  // merged, so restoring a mostly unchanged layout takes a few calls. The
+  // host never sees 'original', so a difference in it alone is no change. If
+  // 'apply', also make the changes here, regardless of the limit, and set
+  // 'original' where it differs, leaving the mapping equal to 'target's;
+  // this is traced as a reset and load. Attribute layers are not compared
+  // for 'fn', but applying gives each layer the target's values, or 0 in
+  // layers the target lacks, including on remapped pages.
+  // Returns kInval, reporting nothing, if the two were init()ed differently.
+  Error diff(const BasicAddrSpace &target, const DiffFn &fn,
+             bool apply = false);
+
+  // Group the following changes so that rollback() can undo them all, for
+  // example when the host call behind a map_at fails after the old mapping
+  // is gone. Each change logs the pieces of the regions it replaces, so
+  // rollback() is O(changes log n) and nothing is copied up front. Callbacks
+  // already made are not undone. Returns false if a transaction is already
+  // open; they do not nest. init(), deserialize() and thaw() commit it.
+  bool begin_txn();
+  // Keep the changes and drop the undo log, in O(1).
+  void commit();
+  // Undo every change since begin_txn(), restoring the regions and usage
+  // totals. Traced as a reset and load.
+  void rollback();
+  bool in_txn() const { return txn_; }
+
+  // Write the init() parameters and every region to 'buf' in a compact,
+  // versioned binary format, writing at most 'len' bytes, and return the
+  // full size; serialize(nullptr, 0) sizes the buffer.
+  size_t serialize(uint8_t *buf, size_t len) const;
+  // Replace the whole state, init() parameters included, with the output of
+  // serialize. The regions are rebuilt in O(n) as by load_regions, and the
+  // call is traced as an init and load. Returns kInval for malformed data,
+  // another format version or a page size this BasicAddrSpace cannot use,
+  // and kNoMem if the regions exceed the limit; either leaves the state
+  // unchanged.
+  Error deserialize(const uint8_t *data, size_t len);
+
+  // Write a read-only image of the address space to 'buf', which must be
+  // 8-byte aligned, for FrozenAddrSpace to query in place (see frozen.h).
+  // Returns the image size; nothing is written unless it is at most 'len'.
+  size_t freeze(void *buf, size_t len) const;
+  // Replace the whole state, init() parameters included, with the regions
+  // of a frozen image, in O(n). Traced as an init and load. Returns kInval
+  // if the image's page size does not suit this BasicAddrSpace or its
+  // regions are not sorted and disjoint, and kNoMem if they exceed the
+  // limit; either leaves the state unchanged.
+  Error thaw(const FrozenAddrSpace &frozen);
+  // Switch the region index to read-optimized arrays, for a space that is
+  // only queried from now on (see RangeMap::freeze). The next change to the
+  // mapping switches it back. O(n).
+  void freeze_regions() { regions_.freeze(); }
+
+  // Publish the regions and usage totals to 'arena', such as MAP_SHARED
+  // memory, where other processes can read them without locking through
+  // SharedAddrSpace (see shared.h), and keep it up to date. Each later
+  // change rewrites only the part of the arena it touched, under a sequence
+  // lock. 'arena' must be 8-byte aligned; shared_arena_size(n) bytes always
+  // hold n regions, and while the regions do not fit, readers are told the
+  // arena is stale. Returns false if it is too small for any regions. A
+  // null arena stops publishing.
+  bool share(void *arena, size_t len);
+
+  Usage usage() const;
+  // Make map_any and map_at fail with kNoMem if they would take the mapped
+  // total above 'bytes', like RLIMIT_AS. Zero removes the limit.
+  void set_limit(size_t bytes);
+  // Why the last map_any or map_at call failed: kInval for bad arguments,
+  // kNoMem if there was no room or the limit was reached, and kExists if
+  // map_at_noreplace found the range in use. kOk if it succeeded.
+  Error map_error() const { return map_error_; }
+
+  // Record every following call to 'trace' (see trace.h), or stop recording
+  // if it is null.
+  void set_trace(TraceWriter *trace) { trace_ = trace; }
+
+  // Counters for the calls made so far, summed over all threads. Unless
+  // built with LIBMMAP_STATS only 'regions' is filled in (see stats.h).
+  Stats stats() const;
+  void reset_stats() { stats_.reset(); }
+
 private:
-  uint64_t to_page(uint64_t addr) const { return addr >> p2pagesize_; }
+  using Key = typename Layout::Key;
+  using Infos = typename Layout::Infos;
+  using Value = typename Infos::Value;
+  using Alloc = PoolAllocator<Entry<Key, Value>>;
+
+  size_t page_shift() const {
+    if constexpr (PageShift == kDynamicPageShift)
+      return p2pagesize_;
+    else
+      return PageShift;
+  }
+  uint64_t page_size() const { return 1ULL << page_shift(); }
+  uint64_t to_page(uint64_t addr) const { return addr >> page_shift(); }
   uint64_t to_page_ceil(uint64_t len) const {
-    uint64_t pages = len >> p2pagesize_;
-    uint64_t mask = (1ULL << p2pagesize_) - 1;
+    uint64_t pages = len >> page_shift();
+    uint64_t mask = page_size() - 1;
     if (len & mask)
       pages++;
     return pages;
   }
-  uintptr_t to_addr(uint64_t page) const { return page << p2pagesize_; }
+  uintptr_t to_addr(uint64_t page) const { return page << page_shift(); }
+  // Convert between absolute page numbers and region keys.
+  Key to_key(uint64_t page) const { return (Key)(page - base_); }
+  uintptr_t key_to_addr(Key key) const { return to_addr(base_ + key); }
   void check_in_region(uintptr_t addr, size_t len) const;
   bool is_valid(uint64_t start, uint64_t len) const {
-    if (start < base_)
+    if (start < base_ || start - base_ > len_)
       return false;
-    if (len > base_ + len_ - start)
+    if (len > len_ - (start - base_))
       return false;
     return true;
   }
+  // Give regions_ a pool of its own.
+  void make_pool();
+  void insert(Key start, Key end, const MapInfo &info);
+  // Map [start, end), which must be unmapped and lie within the unmapped
+  // run 'run', keeping the usage totals.
+  void map_free(Key start, Key end, const MapInfo &info,
+                std::pair<Key, Key> run);
+  // Unmap [start, end) and return the unmapped run that now contains it.
+  std::pair<Key, Key> unmap_range(Key start, Key end, const UpdateFn &ufn);
+  // Map [start, end) over whatever is there, calling 'ufn' for each part
+  // replaced, with one search of the region index. With 'noreplace' fail,
+  // changing nothing, if any of it is mapped.
+  bool map_over(Key start, Key end, const MapInfo &info, const UpdateFn &ufn,
+                bool noreplace);
+  uintptr_t map_failed(Error err) {
+    map_error_ = err;
+    return (uintptr_t)-1;
+  }
+  bool over_limit(Key start, Key end) const;
+
+  // The unmapped run containing 'key', which must be unmapped.
+  std::pair<Key, Key> free_run(Key key) const;
+  void add_gap(uint64_t pages) {
+    if (pages)
+      gaps_.add(pages);
+  }
+  void remove_gap(uint64_t pages) {
+    if (pages)
+      gaps_.remove(pages);
+  }
+  void reset_usage();
+  // Set [start, end), or every page, back to 0 in all attribute layers.
+  void clear_attrs(Key start, Key end) {
+    for (AttrLayer &l : layers_)
+      l.map.remove(start, end, &l.finger);
+  }
+  void reset_attrs() {
+    for (AttrLayer &l : layers_)
+      l.map.clear();
+  }
+  // Check the arguments of the attribute calls and convert the range to
+  // keys.
+  bool attr_range(size_t layer, uintptr_t addr, size_t len, Key *start,
+                  Key *end) const;
+  // Bulk loading: begin_load drops every mapping, append_region maps
+  // [start, end) at or after 'last', the end of the previous region, and
+  // advances it, and end_load adds the final gap.
+  void begin_load();
+  void append_region(Key start, Key end, const MapInfo &info, Key *last);
+  void end_load(Key last);
+  // Replace every mapping with the checked regions in [first, last).
+  template <class It> void load_sorted(It first, It last);
+  // Record the loaded regions to the trace as map_at calls.
+  void trace_loaded();
+  // Log the pieces of regions in [start, end) before they change, while a
+  // transaction is open. log_undo_range logs only the range, and the
+  // caller logs its pieces, if any, right after.
+  void log_undo(Key start, Key end);
+  void log_undo_range(Key start, Key end) {
+    if (!txn_)
+      return;
+    undo_ranges_.push_back(
+        {start, end, undo_pieces_.size(), undo_attrs_.size()});
+    if (!layers_.empty())
+      log_undo_attrs(start, end);
+  }
+  void log_undo_attrs(Key start, Key end);
+  // Call emit(op, start, end, info) with diff()'s changes in keys, and
+  // mark(start, end, original) for each piece not remapped whose 'original'
+  // differs from the target's.
+  template <class Fn, class MarkFn>
+  void diff_walk(const BasicAddrSpace &target, Fn emit, MarkFn mark) const;
+  // Append the region on the listing line [p, end) for import_maps.
+  // 'prev_end' is the end address of the previous line and is advanced.
+  bool import_line(const char *p, const char *end, bool original,
+                   uintptr_t *prev_end, Key *last);
+
+  // Note that the regions touching keys [start, end] changed, or that all
+  // of them did, for publish().
+  void touch(Key start, Key end) {
+    dirty_lo_ = std::min(dirty_lo_, start);
+    dirty_hi_ = std::max(dirty_hi_, end);
+  }
+  void touch_all() { dirty_all_ = true; }
+  // Bring the shared arena, if any, up to date with the changes noted.
+  void publish();
+
+  // Untraced implementations of the public calls.
+  bool do_init(uintptr_t start, size_t len, size_t pagesize);
+  uintptr_t do_map_any(uintptr_t hint, size_t len, int prot, int flags,
+                       int fd, int64_t offset);
+  uintptr_t do_map_at(uintptr_t addr, size_t len, int prot, int flags, int fd,
+                      int64_t offset, const UpdateFn &ufn, bool noreplace);
+  Error do_unmap(uintptr_t addr, size_t len, const UpdateFn &ufn);
+  bool do_query_page(uintptr_t addr, MapInfo *info) const;
+  Error do_protect(uintptr_t addr, size_t len, int prot, const UpdateFn &ufn);
+
+  uint64_t base_ = 0;
+  uint64_t len_ = 0;
+  // Only used with kDynamicPageShift.
+  size_t p2pagesize_ = 0;
+  TraceWriter *trace_ = nullptr;
+  mutable StatsCollectorType stats_;
+  uint64_t mapped_pages_ = 0;
+  uint64_t prot_pages_[kProtClasses] = {};
+  // Number of unmapped runs of each length, in pages.
+  GapHistogram<> gaps_;
+  uint64_t limit_ = 0;
+  Error map_error_ = Error::kOk;
+  // Held by pointer so that it stays put when the space moves, since the
+  // allocator of regions_ points at it.
+  std::unique_ptr<NodePool> pool_;
+  Infos infos_;
+  RangeMap<Key, Value, Alloc> regions_;
+  // Attribute layers, each with the finger of its last change.
+  struct AttrLayer {
+    RangeMap<Key, uint64_t> map;
+    typename RangeMap<Key, uint64_t>::Hint finger;
+  };
+  std::vector<AttrLayer> layers_;
+  // Where the last change to regions_ left off, so that calls working
+  // through the space in address order find their place in O(1). Const
+  // calls start from it without moving it, so they stay safe to make
+  // concurrently.
+  typename RangeMap<Key, Value, Alloc>::Hint finger_;
+  // The shared arena, the keys changed since it was last updated (none
+  // while dirty_lo_ > dirty_hi_), and buffers reused between updates.
+  SharedHeader *shared_ = nullptr;
+  Key dirty_lo_ = std::numeric_limits<Key>::max();
+  Key dirty_hi_ = 0;
+  bool dirty_all_ = false;
+  std::vector<Region> shared_regions_;
+  std::vector<Region> shared_scratch_;
+  // The undo log of the open transaction: each range changed, in order,
+  // with the index of its first piece and first attribute, and the pieces
+  // of the regions and the attribute values that were in it.
+  struct UndoRange {
+    Key start;
+    Key end;
+    size_t first;
+    size_t first_attr;
+  };
+  struct UndoPiece {
+    Key start;
+    Key end;
+    MapInfo info;
+  };
+  struct UndoAttr {
+    size_t layer;
+    Key start;
+    Key end;
+    uint64_t value;
+  };
+  bool txn_ = false;
+  std::vector<UndoRange> undo_ranges_;
+  std::vector<UndoPiece> undo_pieces_;
+  std::vector<UndoAttr> undo_attrs_;
+};
+
+// Walks the region tree in order, so each step is O(1) amortized and
+// nothing is allocated.
+template <size_t PageShift, class Layout>
+class BasicAddrSpace<PageShift, Layout>::const_iterator {
+public:
+  using iterator_category = std::forward_iterator_tag;
+  using value_type = Region;
+  using difference_type = std::ptrdiff_t;
+  using pointer = void;
+  using reference = Region;
+
+  const_iterator() = default;
+
+  Region operator*() const {
+    auto e = *it_;
+    uintptr_t start = mm_->key_to_addr(e.start);
+    return {start, mm_->key_to_addr(e.end) - start, mm_->infos_.get(e.val)};
+  }
+  const_iterator &operator++() {
+    ++it_;
+    return *this;
+  }
+  const_iterator operator++(int) {
+    const_iterator old = *this;
+    ++it_;
+    return old;
+  }
+  bool operator==(const const_iterator &o) const { return it_ == o.it_; }
+  bool operator!=(const const_iterator &o) const { return it_ != o.it_; }
 
-  uint64_t base_;
-  uint64_t len_;
-  size_t p2pagesize_;
-  RangeMap<uint64_t, MapInfo> regions_;
+private:
+  friend struct BasicAddrSpace;
+  using MapIter = typename RangeMap<Key, Value, Alloc>::const_iterator;
+  const_iterator(const BasicAddrSpace *mm, MapIter it) : mm_(mm), it_(it) {}
+
+  const BasicAddrSpace *mm_ = nullptr;
+  MapIter it_;
 };
 
+template <size_t PageShift, class Layout>
+auto BasicAddrSpace<PageShift, Layout>::begin() const -> const_iterator {
+  return {this, regions_.begin()};
+}
+
+template <size_t PageShift, class Layout>
+auto BasicAddrSpace<PageShift, Layout>::end() const -> const_iterator {
+  return {this, regions_.end()};
+}
+
+template <size_t PageShift, class Layout>
+auto BasicAddrSpace<PageShift, Layout>::begin_from(uintptr_t addr) const
+    -> const_iterator {
+  uint64_t page = to_page(addr);
+  if (page < base_)
+    return begin();
+  if (page - base_ >= len_)
+    return end();
+  return {this, regions_.begin_from(to_key(page))};
+}
+
+using AddrSpace = BasicAddrSpace<>;
+using AddrSpace4K = BasicAddrSpace<12>;
+using AddrSpace16K = BasicAddrSpace<14>;
+using CompactAddrSpace = BasicAddrSpace<kDynamicPageShift, CompactLayout>;
+
+extern template struct BasicAddrSpace<kDynamicPageShift, WideLayout>;
+extern template struct BasicAddrSpace<12, WideLayout>;
+extern template struct BasicAddrSpace<14, WideLayout>;
+extern template struct BasicAddrSpace<kDynamicPageShift, CompactLayout>;
+extern template struct BasicAddrSpace<12, CompactLayout>;
+extern template struct BasicAddrSpace<14, CompactLayout>;
+
 } // namespace mmap
 
 #endif // LIBMMAP_ADDR_SPACE_H
@@ -0,0 +1,82 @@
+#ifndef LIBMMAP_EYTZINGER_H
+#define LIBMMAP_EYTZINGER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+namespace mmap {
+namespace detail {
+
+// Eytzinger order stores a sorted array as an implicit binary search tree,
+// breadth first from index 1, so node k has children 2k and 2k + 1. The
+// first levels of every search share a few cache lines, and since the
+// nodes a few levels below k are contiguous, they can be prefetched before
+// the search knows which one it needs. Index 0 is unused.
+
+// In-order traversal of an Eytzinger tree of n nodes: the first node, and
+// the node after k, or 0 after the last. Each step is O(1) amortized.
+inline uint64_t eytzinger_first(uint64_t n) {
+  uint64_t k = n ? 1 : 0;
+  while (k && 2 * k <= n)
+    k = 2 * k;
+  return k;
+}
+
+inline uint64_t eytzinger_next(uint64_t k, uint64_t n) {
+  if (2 * k + 1 <= n) {
+    k = 2 * k + 1;
+    while (2 * k <= n)
+      k = 2 * k;
+    return k;
+  }
+  while (k & 1)
+    k >>= 1;
+  return k >> 1;
+}
+
+// Node holding the last key <= 'key' (or < 'key' unless OrEqual), or 0 if
+// there is none, in the Eytzinger tree keys[1..n]. The descent does not
+// branch on the keys.
+template <bool OrEqual, class K>
+inline uint64_t eytzinger_search(const K *keys, uint64_t n, K key) {
+  // The nodes 64k / sizeof(K) bytes in share a cache line and are the
+  // descendants of k a whole line's worth of levels down.
+  constexpr size_t kPerLine = 64 / sizeof(K) ? 64 / sizeof(K) : 1;
+  uint64_t k = 1;
+  while (k <= n) {
+    __builtin_prefetch(keys + kPerLine * k);
+    k = 2 * k + (OrEqual ? !(key < keys[k]) : keys[k] < key);
+  }
+  // The bits below the leading one record the path, 1 for each step
+  // right, and the node wanted is where the last step right was taken.
+  return k >> (__builtin_ctzll(k) + 1);
+}
+
+// Allocator for search arrays, aligned so that each group of nodes that
+// eytzinger_search() prefetches lies in one cache line.
+template <class T> struct CacheAlignedAllocator {
+  using value_type = T;
+
+  CacheAlignedAllocator() = default;
+  template <class U>
+  CacheAlignedAllocator(const CacheAlignedAllocator<U> &) {}
+
+  T *allocate(size_t n) {
+    return static_cast<T *>(
+        ::operator new(n * sizeof(T), std::align_val_t(64)));
+  }
+  void deallocate(T *p, size_t) { ::operator delete(p, std::align_val_t(64)); }
+
+  template <class U> bool operator==(const CacheAlignedAllocator<U> &) const {
+    return true;
+  }
+  template <class U> bool operator!=(const CacheAlignedAllocator<U> &) const {
+    return false;
+  }
+};
+
+} // namespace detail
+} // namespace mmap
+
+#endif // LIBMMAP_EYTZINGER_H
@@ -0,0 +1,65 @@
+#include "frozen.h"
+
+#include <cstring>
+
+namespace mmap {
+
+static_assert(sizeof(FrozenHeader) == 64, "header must fill a cache line");
+static_assert(sizeof(FrozenInfo) == 24, "FrozenInfo has padding");
+
+static size_t align64(size_t n) { return (n + 63) & ~(size_t)63; }
+
+FrozenLayout::FrozenLayout(uint64_t regions, uint64_t ninfos) {
+  starts = sizeof(FrozenHeader);
+  ends = align64(starts + sizeof(uint64_t) * (regions + 1));
+  ids = align64(ends + sizeof(uint64_t) * (regions + 1));
+  infos = align64(ids + sizeof(uint32_t) * (regions + 1));
+  size = infos + sizeof(FrozenInfo) * ninfos;
+}
+
+bool FrozenAddrSpace::open(const void *data, size_t len) {
+  if (len < sizeof(FrozenHeader) || (uintptr_t)data % alignof(uint64_t))
+    return false;
+  auto *hdr = static_cast<const FrozenHeader *>(data);
+  if (memcmp(hdr->magic, kFrozenMagic, sizeof(kFrozenMagic)) != 0 ||
+      hdr->size != len)
+    return false;
+  // Bound the counts so the layout cannot overflow.
+  if (hdr->regions > len / 20 || hdr->infos > len / sizeof(FrozenInfo))
+    return false;
+  FrozenLayout layout(hdr->regions, hdr->infos);
+  if (layout.size != len)
+    return false;
+  auto *base = static_cast<const char *>(data);
+  hdr_ = hdr;
+  starts_ = reinterpret_cast<const uint64_t *>(base + layout.starts);
+  ends_ = reinterpret_cast<const uint64_t *>(base + layout.ends);
+  ids_ = reinterpret_cast<const uint32_t *>(base + layout.ids);
+  infos_ = reinterpret_cast<const FrozenInfo *>(base + layout.infos);
+  n_ = hdr->regions;
+  return true;
+}
+
+uint64_t FrozenAddrSpace::search(uint64_t addr) const {
+  return detail::eytzinger_search<true>(starts_, n_, addr);
+}
+
+Region FrozenAddrSpace::region(uint64_t k) const {
+  MapInfo info{};
+  uint32_t id = ids_[k];
+  if (id < hdr_->infos) {
+    const FrozenInfo &fi = infos_[id];
+    info = {fi.prot, fi.flags, fi.fd, fi.offset, fi.original != 0};
+  }
+  return {starts_[k], ends_[k] - starts_[k], info};
+}
+
+bool FrozenAddrSpace::query_page(uintptr_t addr, MapInfo *info) const {
+  uint64_t k = search(addr);
+  if (k == 0 || addr >= ends_[k] || ids_[k] >= hdr_->infos)
+    return false;
+  *info = region(k).info;
+  return true;
+}
+
+} // namespace mmap
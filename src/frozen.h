@@ -0,0 +1,146 @@
+#ifndef LIBMMAP_FROZEN_H
+#define LIBMMAP_FROZEN_H
+
+#include "addr_space.h"
+#include "eytzinger.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+
+namespace mmap {
+
+// Frozen address space images.
+//
+// BasicAddrSpace::freeze() writes a read-only image of an address space that
+// is meant to be written to a file once and then mmap()ed by every process
+// that starts from it. FrozenAddrSpace queries the image where it lies:
+// opening it checks only the fixed-size header, so the cost does not depend
+// on the number of regions.
+//
+// The image is a 64-byte header followed by 64-byte aligned arrays, in
+// native byte order:
+//
+//   uint64_t starts[n + 1]   region start addresses in Eytzinger order
+//   uint64_t ends[n + 1]     the matching end addresses
+//   uint32_t ids[n + 1]      the matching MapInfo indexes
+//   FrozenInfo infos[m]      the distinct MapInfos
+//
+// Eytzinger order (see eytzinger.h) makes each lookup a branchless descent
+// that prefetches the levels below it.
+
+inline constexpr char kFrozenMagic[8] = {'M', 'M', 'F', 'R', 'O', 'Z', 'E', 1};
+
+struct FrozenHeader {
+  char magic[8];
+  // init() parameters.
+  uint64_t start;
+  uint64_t len;
+  uint64_t pagesize;
+  uint64_t regions;
+  uint64_t infos;
+  // Size of the whole image in bytes.
+  uint64_t size;
+  uint64_t reserved;
+};
+
+struct FrozenInfo {
+  int32_t prot;
+  int32_t flags;
+  int32_t fd;
+  uint32_t original;
+  int64_t offset;
+};
+
+// Offsets of the arrays in an image with 'regions' regions and 'infos'
+// MapInfos, and its total size.
+struct FrozenLayout {
+  size_t starts;
+  size_t ends;
+  size_t ids;
+  size_t infos;
+  size_t size;
+
+  FrozenLayout(uint64_t regions, uint64_t infos);
+};
+
+// Read-only view of an image written by BasicAddrSpace::freeze(). The image
+// is not copied, so it must outlive the view.
+class FrozenAddrSpace {
+public:
+  FrozenAddrSpace() = default;
+
+  // View the image at 'data', which must be 8-byte aligned (64-byte aligned,
+  // as from mmap, makes the searches touch the fewest cache lines). Returns
+  // false if the header is not that of an image of 'len' bytes. The arrays
+  // are not checked; a corrupt image gives wrong answers but never reads
+  // outside it.
+  bool open(const void *data, size_t len);
+
+  bool query_page(uintptr_t addr, MapInfo *info) const;
+
+  // The init() parameters and region count of the frozen address space.
+  uintptr_t start() const { return hdr_->start; }
+  size_t len() const { return hdr_->len; }
+  size_t pagesize() const { return hdr_->pagesize; }
+  size_t size() const { return n_; }
+
+  class const_iterator;
+  // Iterate over the regions in address order, O(1) amortized per step.
+  const_iterator begin() const;
+  const_iterator end() const;
+
+private:
+  // Index of the node holding the last start <= addr, or 0 if none.
+  uint64_t search(uint64_t addr) const;
+  Region region(uint64_t k) const;
+
+  const FrozenHeader *hdr_ = nullptr;
+  const uint64_t *starts_ = nullptr;
+  const uint64_t *ends_ = nullptr;
+  const uint32_t *ids_ = nullptr;
+  const FrozenInfo *infos_ = nullptr;
+  uint64_t n_ = 0;
+};
+
+// Walks the implicit tree in order.
+class FrozenAddrSpace::const_iterator {
+public:
+  using iterator_category = std::forward_iterator_tag;
+  using value_type = Region;
+  using difference_type = std::ptrdiff_t;
+  using pointer = void;
+  using reference = Region;
+
+  const_iterator() = default;
+
+  Region operator*() const { return f_->region(k_); }
+  const_iterator &operator++() {
+    k_ = detail::eytzinger_next(k_, f_->n_);
+    return *this;
+  }
+  const_iterator operator++(int) {
+    const_iterator old = *this;
+    ++*this;
+    return old;
+  }
+  bool operator==(const const_iterator &o) const { return k_ == o.k_; }
+  bool operator!=(const const_iterator &o) const { return k_ != o.k_; }
+
+private:
+  friend class FrozenAddrSpace;
+  const_iterator(const FrozenAddrSpace *f, uint64_t k) : f_(f), k_(k) {}
+
+  const FrozenAddrSpace *f_ = nullptr;
+  uint64_t k_ = 0;
+};
+
+inline auto FrozenAddrSpace::begin() const -> const_iterator {
+  return {this, detail::eytzinger_first(n_)};
+}
+
+inline auto FrozenAddrSpace::end() const -> const_iterator { return {this, 0}; }
+
+} // namespace mmap
+
+#endif // LIBMMAP_FROZEN_H
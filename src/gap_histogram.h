@@ -0,0 +1,143 @@
+#ifndef LIBMMAP_GAP_HISTOGRAM_H
+#define LIBMMAP_GAP_HISTOGRAM_H
+
+#include "node_pool.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <utility>
+
+namespace mmap {
+
+// GapHistogram counts how many runs there are of each length and knows the
+// longest. Up to 'InlineCap' distinct lengths are kept in sorted arrays
+// inside the object, so a lightly fragmented space never allocates. Like
+// RangeMap, the first add that would exceed the inline capacity moves every
+// length into a tree, where they stay until the next clear(). The tree draws
+// from a pool of its own; both are created on the first spill and kept, so
+// later spills reuse their storage.
+template <size_t InlineCap = 16> class GapHistogram {
+public:
+  GapHistogram() = default;
+  GapHistogram(const GapHistogram &other)
+      : lens_(other.lens_), counts_(other.counts_), n_(other.n_),
+        spilled_(other.spilled_) {
+    if (spilled_)
+      tree().map.insert(other.tree_->map.begin(), other.tree_->map.end());
+  }
+  GapHistogram(GapHistogram &&other) noexcept
+      : lens_(other.lens_), counts_(other.counts_),
+        n_(std::exchange(other.n_, 0)),
+        spilled_(std::exchange(other.spilled_, false)),
+        tree_(std::move(other.tree_)) {}
+  GapHistogram &operator=(const GapHistogram &other) {
+    return *this = GapHistogram(other);
+  }
+  GapHistogram &operator=(GapHistogram &&other) noexcept {
+    lens_ = other.lens_;
+    counts_ = other.counts_;
+    n_ = std::exchange(other.n_, 0);
+    spilled_ = std::exchange(other.spilled_, false);
+    tree_ = std::move(other.tree_);
+    return *this;
+  }
+
+  // Count one more run of 'len'.
+  void add(uint64_t len) {
+    if (!spilled_) {
+      size_t i = lower(len);
+      if (i < n_ && lens_[i] == len) {
+        counts_[i]++;
+        return;
+      }
+      if (n_ < InlineCap) {
+        std::move_backward(lens_.begin() + i, lens_.begin() + n_,
+                           lens_.begin() + n_ + 1);
+        std::move_backward(counts_.begin() + i, counts_.begin() + n_,
+                           counts_.begin() + n_ + 1);
+        lens_[i] = len;
+        counts_[i] = 1;
+        n_++;
+        return;
+      }
+      spill();
+    }
+    tree_->map[len]++;
+  }
+
+  // Count one fewer run of 'len', which must have been added.
+  void remove(uint64_t len) {
+    if (!spilled_) {
+      size_t i = lower(len);
+      if (--counts_[i] == 0) {
+        std::move(lens_.begin() + i + 1, lens_.begin() + n_,
+                  lens_.begin() + i);
+        std::move(counts_.begin() + i + 1, counts_.begin() + n_,
+                  counts_.begin() + i);
+        n_--;
+      }
+      return;
+    }
+    auto it = tree_->map.find(len);
+    if (--it->second == 0)
+      tree_->map.erase(it);
+  }
+
+  void clear() {
+    n_ = 0;
+    if (spilled_)
+      tree_->map.clear();
+    spilled_ = false;
+  }
+
+  // The longest length counted, or 0 if there is none.
+  uint64_t largest() const {
+    if (spilled_)
+      return tree_->map.empty() ? 0 : tree_->map.rbegin()->first;
+    return n_ ? lens_[n_ - 1] : 0;
+  }
+
+private:
+  struct Tree {
+    NodePool pool;
+    std::map<uint64_t, uint64_t, std::less<uint64_t>,
+             PoolAllocator<std::pair<const uint64_t, uint64_t>>>
+        map{PoolAllocator<std::pair<const uint64_t, uint64_t>>(&pool)};
+  };
+
+  size_t lower(uint64_t len) const {
+    return std::lower_bound(lens_.begin(), lens_.begin() + n_, len) -
+           lens_.begin();
+  }
+
+  Tree &tree() {
+    if (!tree_)
+      tree_ = std::make_unique<Tree>();
+    return *tree_;
+  }
+
+  void spill() {
+    Tree &t = tree();
+    for (size_t i = 0; i < n_; i++)
+      t.map.emplace_hint(t.map.end(), lens_[i], counts_[i]);
+    n_ = 0;
+    spilled_ = true;
+  }
+
+  // Inline lengths [0, n_) in increasing order with their counts, used
+  // until spilled_ is set.
+  std::array<uint64_t, InlineCap> lens_{};
+  std::array<uint64_t, InlineCap> counts_{};
+  size_t n_ = 0;
+  bool spilled_ = false;
+  std::unique_ptr<Tree> tree_;
+};
+
+} // namespace mmap
+
+#endif // LIBMMAP_GAP_HISTOGRAM_H
@@ -0,0 +1,96 @@
+#ifndef LIBMMAP_INFO_TABLE_H
+#define LIBMMAP_INFO_TABLE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+namespace mmap {
+
+struct MapInfo {
+  int prot;
+  int flags;
+  int fd;
+  int64_t offset;
+  bool original;
+
+  bool operator==(const MapInfo &other) const {
+    return prot == other.prot && flags == other.flags && fd == other.fd &&
+           offset == other.offset && original == other.original;
+  }
+};
+
+struct MapInfoHash {
+  size_t operator()(const MapInfo &info) const {
+    uint64_t h = (uint64_t)(uint32_t)info.prot;
+    h = h * 0x9e3779b97f4a7c15ULL ^ (uint32_t)info.flags;
+    h = h * 0x9e3779b97f4a7c15ULL ^ (uint32_t)info.fd;
+    h = h * 0x9e3779b97f4a7c15ULL ^ (uint64_t)info.offset;
+    h = h * 0x9e3779b97f4a7c15ULL ^ (uint64_t)info.original;
+    return (size_t)(h ^ (h >> 29));
+  }
+};
+
+// DirectInfos stores each region's MapInfo in the region itself.
+struct DirectInfos {
+  using Value = MapInfo;
+
+  Value add(const MapInfo &info) { return info; }
+  const MapInfo &get(const Value &val) const { return val; }
+  void clear() {}
+  template <class Map> void maybe_compact(Map &) {}
+};
+
+// InfoTable interns MapInfo values so that regions store a 32-bit id instead
+// of the full struct. Equal infos always get the same id, so ids can be
+// compared directly when coalescing.
+//
+// Ids are never reference counted: ranges are copied and dropped inside
+// RangeMap without the table seeing it. Instead maybe_compact() rebuilds the
+// table from the live regions once it has grown well past their count, which
+// keeps the cost amortised O(1) per mapping.
+class InfoTable {
+public:
+  using Value = uint32_t;
+
+  Value add(const MapInfo &info) {
+    auto it = ids_.find(info);
+    if (it != ids_.end())
+      return it->second;
+    Value id = (Value)infos_.size();
+    infos_.push_back(info);
+    ids_.emplace(info, id);
+    return id;
+  }
+
+  const MapInfo &get(Value id) const { return infos_[id]; }
+
+  size_t size() const { return infos_.size(); }
+
+  void clear() {
+    infos_.clear();
+    ids_.clear();
+  }
+
+  // Drop ids no longer referenced by any value in 'regions' when the table
+  // has grown to more than twice the number of regions.
+  template <class Map> void maybe_compact(Map &regions) {
+    if (infos_.size() <= 2 * regions.size() + kSlack)
+      return;
+    InfoTable live;
+    regions.update_all([&](Value &id) { id = live.add(infos_[id]); });
+    *this = std::move(live);
+  }
+
+private:
+  static constexpr size_t kSlack = 16;
+
+  std::vector<MapInfo> infos_;
+  std::unordered_map<MapInfo, Value, MapInfoHash> ids_;
+};
+
+} // namespace mmap
+
+#endif // LIBMMAP_INFO_TABLE_H
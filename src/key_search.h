@@ -0,0 +1,310 @@
+#ifndef LIBMMAP_KEY_SEARCH_H
+#define LIBMMAP_KEY_SEARCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <type_traits>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define LIBMMAP_X86_DISPATCH 1
+#include <immintrin.h>
+#endif
+
+namespace mmap {
+
+// Rank searches over short sorted arrays of keys, as stored in RangeMap's
+// inline entries. Because the keys are sorted, the number of keys below a
+// bound is also the index where the bound would be inserted, so each search
+// is a branch-free count that vector units can do several keys at a time.
+// There are vector kernels for uint64_t and uint32_t keys.
+//
+// Every kernel returns exactly what the scalar kernel returns; the widest
+// one the CPU supports is picked at runtime by key_search().
+enum class SearchIsa { kScalar, kSse42, kAvx2, kAvx512 };
+
+template <class K> struct KeySearch {
+  using CountFn = size_t (*)(const K *keys, size_t n, K key);
+
+  SearchIsa isa;
+  // Number of keys strictly less than 'key' (lower bound).
+  CountFn count_less;
+  // Number of keys less than or equal to 'key' (upper bound).
+  CountFn count_less_equal;
+};
+
+namespace detail {
+
+template <class K>
+inline size_t scalar_count_less(const K *keys, size_t n, K key) {
+  size_t c = 0;
+  for (size_t i = 0; i < n; i++)
+    c += keys[i] < key;
+  return c;
+}
+
+template <class K>
+inline size_t scalar_count_less_equal(const K *keys, size_t n, K key) {
+  size_t c = 0;
+  for (size_t i = 0; i < n; i++)
+    c += !(key < keys[i]);
+  return c;
+}
+
+#ifdef LIBMMAP_X86_DISPATCH
+
+// SSE4.2 and AVX2 only have signed 64-bit compares; flipping the sign bit of
+// both sides turns them into unsigned compares.
+
+template <bool Less>
+__attribute__((target("sse4.2"))) inline size_t
+sse42_count_greater(const uint64_t *keys, size_t n, uint64_t key) {
+  const __m128i bias = _mm_set1_epi64x((long long)(1ULL << 63));
+  const __m128i k = _mm_xor_si128(_mm_set1_epi64x((long long)key), bias);
+  size_t c = 0;
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i v = _mm_xor_si128(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys + i)), bias);
+    __m128i gt = Less ? _mm_cmpgt_epi64(k, v) : _mm_cmpgt_epi64(v, k);
+    c += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(gt)));
+  }
+  for (; i < n; i++)
+    c += Less ? keys[i] < key : keys[i] > key;
+  return c;
+}
+
+__attribute__((target("sse4.2"))) inline size_t
+sse42_count_less(const uint64_t *keys, size_t n, uint64_t key) {
+  return sse42_count_greater<true>(keys, n, key);
+}
+
+__attribute__((target("sse4.2"))) inline size_t
+sse42_count_less_equal(const uint64_t *keys, size_t n, uint64_t key) {
+  return n - sse42_count_greater<false>(keys, n, key);
+}
+
+template <bool Less>
+__attribute__((target("avx2"))) inline size_t
+avx2_count_greater(const uint64_t *keys, size_t n, uint64_t key) {
+  const __m256i bias = _mm256_set1_epi64x((long long)(1ULL << 63));
+  const __m256i k = _mm256_xor_si256(_mm256_set1_epi64x((long long)key), bias);
+  size_t c = 0;
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i v = _mm256_xor_si256(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + i)), bias);
+    __m256i gt = Less ? _mm256_cmpgt_epi64(k, v) : _mm256_cmpgt_epi64(v, k);
+    c += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(gt)));
+  }
+  for (; i < n; i++)
+    c += Less ? keys[i] < key : keys[i] > key;
+  return c;
+}
+
+__attribute__((target("avx2"))) inline size_t
+avx2_count_less(const uint64_t *keys, size_t n, uint64_t key) {
+  return avx2_count_greater<true>(keys, n, key);
+}
+
+__attribute__((target("avx2"))) inline size_t
+avx2_count_less_equal(const uint64_t *keys, size_t n, uint64_t key) {
+  return n - avx2_count_greater<false>(keys, n, key);
+}
+
+// AVX-512 has unsigned compares and masked loads, so the tail needs no
+// scalar loop.
+
+__attribute__((target("avx512f"))) inline size_t
+avx512_count_less(const uint64_t *keys, size_t n, uint64_t key) {
+  const __m512i k = _mm512_set1_epi64((long long)key);
+  size_t c = 0;
+  for (size_t i = 0; i < n; i += 8) {
+    size_t left = n - i;
+    __mmask8 m = left >= 8 ? (__mmask8)0xff : (__mmask8)((1u << left) - 1);
+    __m512i v = _mm512_maskz_loadu_epi64(m, keys + i);
+    c += __builtin_popcount(_mm512_mask_cmplt_epu64_mask(m, v, k));
+  }
+  return c;
+}
+
+__attribute__((target("avx512f"))) inline size_t
+avx512_count_less_equal(const uint64_t *keys, size_t n, uint64_t key) {
+  const __m512i k = _mm512_set1_epi64((long long)key);
+  size_t c = 0;
+  for (size_t i = 0; i < n; i += 8) {
+    size_t left = n - i;
+    __mmask8 m = left >= 8 ? (__mmask8)0xff : (__mmask8)((1u << left) - 1);
+    __m512i v = _mm512_maskz_loadu_epi64(m, keys + i);
+    c += __builtin_popcount(_mm512_mask_cmple_epu64_mask(m, v, k));
+  }
+  return c;
+}
+
+// 32-bit keys fit twice as many per vector. AVX-512 has unsigned 32-bit
+// compares; the narrower kernels use the same sign-bit trick as above.
+
+template <bool Less>
+__attribute__((target("sse4.2"))) inline size_t
+sse42_count_greater32(const uint32_t *keys, size_t n, uint32_t key) {
+  const __m128i bias = _mm_set1_epi32((int)(1u << 31));
+  const __m128i k = _mm_xor_si128(_mm_set1_epi32((int)key), bias);
+  size_t c = 0;
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_xor_si128(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys + i)), bias);
+    __m128i gt = Less ? _mm_cmpgt_epi32(k, v) : _mm_cmpgt_epi32(v, k);
+    c += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(gt)));
+  }
+  for (; i < n; i++)
+    c += Less ? keys[i] < key : keys[i] > key;
+  return c;
+}
+
+__attribute__((target("sse4.2"))) inline size_t
+sse42_count_less32(const uint32_t *keys, size_t n, uint32_t key) {
+  return sse42_count_greater32<true>(keys, n, key);
+}
+
+__attribute__((target("sse4.2"))) inline size_t
+sse42_count_less_equal32(const uint32_t *keys, size_t n, uint32_t key) {
+  return n - sse42_count_greater32<false>(keys, n, key);
+}
+
+template <bool Less>
+__attribute__((target("avx2"))) inline size_t
+avx2_count_greater32(const uint32_t *keys, size_t n, uint32_t key) {
+  const __m256i bias = _mm256_set1_epi32((int)(1u << 31));
+  const __m256i k = _mm256_xor_si256(_mm256_set1_epi32((int)key), bias);
+  size_t c = 0;
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_xor_si256(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + i)), bias);
+    __m256i gt = Less ? _mm256_cmpgt_epi32(k, v) : _mm256_cmpgt_epi32(v, k);
+    c += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(gt)));
+  }
+  for (; i < n; i++)
+    c += Less ? keys[i] < key : keys[i] > key;
+  return c;
+}
+
+__attribute__((target("avx2"))) inline size_t
+avx2_count_less32(const uint32_t *keys, size_t n, uint32_t key) {
+  return avx2_count_greater32<true>(keys, n, key);
+}
+
+__attribute__((target("avx2"))) inline size_t
+avx2_count_less_equal32(const uint32_t *keys, size_t n, uint32_t key) {
+  return n - avx2_count_greater32<false>(keys, n, key);
+}
+
+__attribute__((target("avx512f"))) inline size_t
+avx512_count_less32(const uint32_t *keys, size_t n, uint32_t key) {
+  const __m512i k = _mm512_set1_epi32((int)key);
+  size_t c = 0;
+  for (size_t i = 0; i < n; i += 16) {
+    size_t left = n - i;
+    __mmask16 m =
+        left >= 16 ? (__mmask16)0xffff : (__mmask16)((1u << left) - 1);
+    __m512i v = _mm512_maskz_loadu_epi32(m, keys + i);
+    c += __builtin_popcount(_mm512_mask_cmplt_epu32_mask(m, v, k));
+  }
+  return c;
+}
+
+__attribute__((target("avx512f"))) inline size_t
+avx512_count_less_equal32(const uint32_t *keys, size_t n, uint32_t key) {
+  const __m512i k = _mm512_set1_epi32((int)key);
+  size_t c = 0;
+  for (size_t i = 0; i < n; i += 16) {
+    size_t left = n - i;
+    __mmask16 m =
+        left >= 16 ? (__mmask16)0xffff : (__mmask16)((1u << left) - 1);
+    __m512i v = _mm512_maskz_loadu_epi32(m, keys + i);
+    c += __builtin_popcount(_mm512_mask_cmple_epu32_mask(m, v, k));
+  }
+  return c;
+}
+
+#endif // LIBMMAP_X86_DISPATCH
+
+} // namespace detail
+
+// Return whether this CPU can run the kernels for 'isa'.
+inline bool search_isa_supported(SearchIsa isa) {
+  switch (isa) {
+  case SearchIsa::kScalar:
+    return true;
+#ifdef LIBMMAP_X86_DISPATCH
+  case SearchIsa::kSse42:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+  case SearchIsa::kAvx2:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+  case SearchIsa::kAvx512:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f");
+#else
+  default:
+    return false;
+#endif
+  }
+  return false;
+}
+
+// Return the kernels for 'isa', which must be supported. Key types without
+// vector kernels always get the scalar ones.
+template <class K> inline KeySearch<K> key_search_for(SearchIsa isa) {
+#ifdef LIBMMAP_X86_DISPATCH
+  if constexpr (std::is_same_v<K, uint64_t>) {
+    switch (isa) {
+    case SearchIsa::kScalar:
+      break;
+    case SearchIsa::kSse42:
+      return {isa, &detail::sse42_count_less, &detail::sse42_count_less_equal};
+    case SearchIsa::kAvx2:
+      return {isa, &detail::avx2_count_less, &detail::avx2_count_less_equal};
+    case SearchIsa::kAvx512:
+      return {isa, &detail::avx512_count_less,
+              &detail::avx512_count_less_equal};
+    }
+  } else if constexpr (std::is_same_v<K, uint32_t>) {
+    switch (isa) {
+    case SearchIsa::kScalar:
+      break;
+    case SearchIsa::kSse42:
+      return {isa, &detail::sse42_count_less32,
+              &detail::sse42_count_less_equal32};
+    case SearchIsa::kAvx2:
+      return {isa, &detail::avx2_count_less32,
+              &detail::avx2_count_less_equal32};
+    case SearchIsa::kAvx512:
+      return {isa, &detail::avx512_count_less32,
+              &detail::avx512_count_less_equal32};
+    }
+  }
+#endif
+  (void)isa;
+  return {SearchIsa::kScalar, &detail::scalar_count_less<K>,
+          &detail::scalar_count_less_equal<K>};
+}
+
+// Return the widest kernels supported by this CPU. Selected once.
+template <class K> inline const KeySearch<K> &key_search() {
+  static const KeySearch<K> best = [] {
+    for (SearchIsa isa :
+         {SearchIsa::kAvx512, SearchIsa::kAvx2, SearchIsa::kSse42}) {
+      if (search_isa_supported(isa))
+        return key_search_for<K>(isa);
+    }
+    return key_search_for<K>(SearchIsa::kScalar);
+  }();
+  return best;
+}
+
+} // namespace mmap
+
+#endif // LIBMMAP_KEY_SEARCH_H
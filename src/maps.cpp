@@ -0,0 +1,230 @@
+#include "maps.h"
+
+#include <cstring>
+
+namespace mmap {
+
+static const int kProtRead = 0x1;
+static const int kProtWrite = 0x2;
+static const int kProtExec = 0x4;
+static const int kMapShared = 0x1;
+static const int kMapPrivate = 0x2;
+
+// The kernel pads the fields before the path to this width, then adds one
+// space.
+static const size_t kPathColumn = 72;
+
+// The writers below store whole words, so they may write up to 16 bytes
+// past the text they return. kMapsPrefixMax leaves room for that.
+
+// Spread the eight nibbles of 'v' into the bytes of the result as
+// lowercase hex digits, most significant first in memory.
+static uint64_t hex8(uint32_t v) {
+  uint64_t x = v;
+  x = ((x & 0xffff0000) << 16) | (x & 0xffff);
+  x = ((x & 0x0000ff000000ff00) << 8) | (x & 0x000000ff000000ff);
+  x = ((x & 0x00f000f000f000f0) << 4) | (x & 0x000f000f000f000f);
+  // Bytes above 9 need 'a' - '0' - 10 added.
+  uint64_t letters = ((x + 0x0606060606060606) >> 4) & 0x0101010101010101;
+  x += 0x3030303030303030 + letters * ('a' - '0' - 10);
+  return __builtin_bswap64(x);
+}
+
+// Write 'v' in lowercase hex, zero-padded to at least 'width' digits.
+static char *put_hex(char *p, uint64_t v, int width) {
+  int digits = v ? (64 - __builtin_clzll(v) + 3) / 4 : 1;
+  if (digits < width)
+    digits = width;
+  // Shift the digits to the top so they are stored first.
+  v <<= 4 * (16 - digits);
+  uint64_t hi = hex8((uint32_t)(v >> 32));
+  uint64_t lo = hex8((uint32_t)v);
+  memcpy(p, &hi, 8);
+  memcpy(p + 8, &lo, 8);
+  return p + digits;
+}
+
+// Two-digit strings for 0 to 99, so decimal formatting writes two digits
+// per step.
+struct DecimalPairs {
+  char pairs[100][2];
+
+  constexpr DecimalPairs() : pairs() {
+    for (int i = 0; i < 100; i++) {
+      pairs[i][0] = (char)('0' + i / 10);
+      pairs[i][1] = (char)('0' + i % 10);
+    }
+  }
+};
+
+static constexpr DecimalPairs kDecimal;
+
+static const uint64_t kPow10[20] = {
+    1ULL,
+    10ULL,
+    100ULL,
+    1000ULL,
+    10000ULL,
+    100000ULL,
+    1000000ULL,
+    10000000ULL,
+    100000000ULL,
+    1000000000ULL,
+    10000000000ULL,
+    100000000000ULL,
+    1000000000000ULL,
+    10000000000000ULL,
+    100000000000000ULL,
+    1000000000000000ULL,
+    10000000000000000ULL,
+    100000000000000000ULL,
+    1000000000000000000ULL,
+    10000000000000000000ULL,
+};
+
+static char *put_dec(char *p, uint64_t v) {
+  // Estimate log10 from log2; 1233 / 4096 is just above log10(2).
+  int bits = 64 - __builtin_clzll(v | 1);
+  int digits = (bits * 1233) >> 12;
+  digits += digits < 20 && v >= kPow10[digits];
+  if (digits == 0)
+    digits = 1;
+  char *q = p + digits;
+  while (v >= 100) {
+    q -= 2;
+    memcpy(q, kDecimal.pairs[v % 100], 2);
+    v /= 100;
+  }
+  if (v >= 10)
+    memcpy(q - 2, kDecimal.pairs[v], 2);
+  else
+    q[-1] = (char)('0' + v);
+  return p + digits;
+}
+
+size_t format_maps_prefix(char *out, uintptr_t start, uintptr_t end,
+                          const MapInfo &info, const MapsName &name,
+                          bool has_path) {
+  char *p = out;
+  p = put_hex(p, start, 8);
+  *p++ = '-';
+  p = put_hex(p, end, 8);
+  *p++ = ' ';
+  *p++ = info.prot & kProtRead ? 'r' : '-';
+  *p++ = info.prot & kProtWrite ? 'w' : '-';
+  *p++ = info.prot & kProtExec ? 'x' : '-';
+  *p++ = info.flags & kMapShared ? 's' : 'p';
+  *p++ = ' ';
+  p = put_hex(p, (uint64_t)info.offset, 8);
+  *p++ = ' ';
+  p = put_hex(p, name.dev_major, 2);
+  *p++ = ':';
+  p = put_hex(p, name.dev_minor, 2);
+  *p++ = ' ';
+  p = put_dec(p, name.inode);
+  *p++ = ' ';
+  if (has_path) {
+    for (char *q = p; q < out + kPathColumn; q += 8)
+      memcpy(q, "        ", 8);
+    if (p < out + kPathColumn)
+      p = out + kPathColumn;
+    *p++ = ' ';
+  }
+  return p - out;
+}
+
+// Parse a nonempty run of hex digits at 'p', returning the position after
+// it, or null if there is none or it overflows 64 bits.
+static const char *get_hex(const char *p, const char *end, uint64_t *v) {
+  const char *begin = p;
+  uint64_t x = 0;
+  for (; p < end; p++) {
+    unsigned d;
+    if (*p >= '0' && *p <= '9')
+      d = *p - '0';
+    else if (*p >= 'a' && *p <= 'f')
+      d = *p - 'a' + 10;
+    else if (*p >= 'A' && *p <= 'F')
+      d = *p - 'A' + 10;
+    else
+      break;
+    if (x >> 60)
+      return nullptr;
+    x = x << 4 | d;
+  }
+  *v = x;
+  return p == begin ? nullptr : p;
+}
+
+static const char *get_dec(const char *p, const char *end, uint64_t *v) {
+  const char *begin = p;
+  uint64_t x = 0;
+  for (; p < end && *p >= '0' && *p <= '9'; p++) {
+    if (__builtin_mul_overflow(x, 10, &x) ||
+        __builtin_add_overflow(x, (uint64_t)(*p - '0'), &x))
+      return nullptr;
+  }
+  *v = x;
+  return p == begin ? nullptr : p;
+}
+
+static const char *get_char(const char *p, const char *end, char c) {
+  return p && p < end && *p == c ? p + 1 : nullptr;
+}
+
+bool parse_maps_line(const char *p, const char *end, MapsLine *out) {
+  uint64_t start, stop, offset, major, minor, inode;
+  p = get_hex(p, end, &start);
+  p = p ? get_char(p, end, '-') : nullptr;
+  p = p ? get_hex(p, end, &stop) : nullptr;
+  p = get_char(p, end, ' ');
+  if (!p || end - p < 5 || p[4] != ' ')
+    return false;
+  int prot = 0;
+  if (p[0] == 'r')
+    prot |= kProtRead;
+  else if (p[0] != '-')
+    return false;
+  if (p[1] == 'w')
+    prot |= kProtWrite;
+  else if (p[1] != '-')
+    return false;
+  if (p[2] == 'x')
+    prot |= kProtExec;
+  else if (p[2] != '-')
+    return false;
+  int flags;
+  if (p[3] == 's')
+    flags = kMapShared;
+  else if (p[3] == 'p')
+    flags = kMapPrivate;
+  else
+    return false;
+  p = get_hex(p + 5, end, &offset);
+  p = get_char(p, end, ' ');
+  p = p ? get_hex(p, end, &major) : nullptr;
+  p = get_char(p, end, ':');
+  p = p ? get_hex(p, end, &minor) : nullptr;
+  p = get_char(p, end, ' ');
+  p = p ? get_dec(p, end, &inode) : nullptr;
+  if (!p || start >= stop || major > UINT32_MAX || minor > UINT32_MAX)
+    return false;
+  if (p < end && *p != ' ')
+    return false;
+  while (p < end && *p == ' ')
+    p++;
+
+  out->start = start;
+  out->end = stop;
+  out->prot = prot;
+  out->flags = flags;
+  out->offset = offset;
+  out->dev_major = (uint32_t)major;
+  out->dev_minor = (uint32_t)minor;
+  out->inode = inode;
+  out->path = p;
+  out->path_len = end - p;
+  return true;
+}
+
+} // namespace mmap
@@ -0,0 +1,82 @@
+#ifndef LIBMMAP_MAPS_H
+#define LIBMMAP_MAPS_H
+
+#include "info_table.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+namespace mmap {
+
+// /proc/<pid>/maps listings, rendered by BasicAddrSpace::read_maps and
+// imported by BasicAddrSpace::import_maps, in the kernel's format:
+//
+//   7f0000000000-7f0000002000 r-xp 00001000 fe:00 467394      /usr/lib/x.so
+//
+// Permissions read the PROT_READ, PROT_WRITE and PROT_EXEC bits of prot and
+// the MAP_SHARED bit of flags, with their Linux values.
+
+// The file a region is shown as mapping.
+struct MapsName {
+  // Printed at column 74, or omitted if null. Must stay valid until the
+  // next resolver call.
+  const char *path = nullptr;
+  uint32_t dev_major = 0;
+  uint32_t dev_minor = 0;
+  uint64_t inode = 0;
+};
+
+// Name a region, usually by looking up info.fd. Anonymous regions can be
+// given names such as "[heap]" too.
+using MapsNameFn =
+    std::function<MapsName(uintptr_t start, size_t len, MapInfo info)>;
+
+// Position in a listing, so that it can be read in pieces like a file. A
+// zeroed cursor starts at the beginning. Between reads the cursor remembers
+// an address rather than an iterator, so the mapping may change: a read
+// picks up at the first region that starts at or after where the last one
+// stopped.
+struct MapsCursor {
+  // Start of the region whose line is being written, or the end of the
+  // last region whose line is complete.
+  uintptr_t addr = 0;
+  // Bytes of that region's line already returned.
+  size_t offset = 0;
+};
+
+// Longest line prefix written by format_maps_prefix.
+inline constexpr size_t kMapsPrefixMax = 128;
+
+// Write the part of a listing line that precedes the path, including the
+// padding before it if 'has_path', into 'out', which must have room for
+// kMapsPrefixMax bytes. Returns the length written.
+size_t format_maps_prefix(char *out, uintptr_t start, uintptr_t end,
+                          const MapInfo &info, const MapsName &name,
+                          bool has_path);
+
+// One line of a listing, as parsed by parse_maps_line.
+struct MapsLine {
+  uintptr_t start = 0;
+  uintptr_t end = 0;
+  // PROT_* bits, and MAP_SHARED or MAP_PRIVATE, with their Linux values.
+  int prot = 0;
+  int flags = 0;
+  uint64_t offset = 0;
+  uint32_t dev_major = 0;
+  uint32_t dev_minor = 0;
+  uint64_t inode = 0;
+  // Points into the parsed text and is not NUL-terminated; empty if the
+  // line has no path.
+  const char *path = nullptr;
+  size_t path_len = 0;
+};
+
+// Parse the line [p, end), without its newline, into 'out'. Nothing is
+// copied. Returns false if the fields before the path are malformed or
+// start >= end.
+bool parse_maps_line(const char *p, const char *end, MapsLine *out);
+
+} // namespace mmap
+
+#endif // LIBMMAP_MAPS_H
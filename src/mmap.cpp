@@ -1,84 +1,339 @@
 #include "addr_space.h"
+#include "frozen.h"
+#include "shared.h"
+#include "trace.h"
 
 #include <algorithm>
+#include <cstring>
 #include <exception>
+#include <iterator>
+#include <limits>
+#include <optional>
+#include <unordered_map>
+#include <vector>
 
 namespace mmap {
 
-void AddrSpace::check_in_region(uintptr_t addr, size_t len) const {
+template <size_t PageShift, class Layout>
+BasicAddrSpace<PageShift, Layout>::BasicAddrSpace(const BasicAddrSpace &other)
+    : BasicAddrSpace() {
+  base_ = other.base_;
+  len_ = other.len_;
+  p2pagesize_ = other.p2pagesize_;
+  mapped_pages_ = other.mapped_pages_;
+  std::copy(std::begin(other.prot_pages_), std::end(other.prot_pages_),
+            prot_pages_);
+  gaps_ = other.gaps_;
+  limit_ = other.limit_;
+  map_error_ = other.map_error_;
+  infos_ = other.infos_;
+  for (auto e : other.regions_)
+    regions_.append(e.start, e.end, e.val);
+  layers_ = other.layers_;
+  txn_ = other.txn_;
+  undo_ranges_ = other.undo_ranges_;
+  undo_pieces_ = other.undo_pieces_;
+  undo_attrs_ = other.undo_attrs_;
+}
+
+template <size_t PageShift, class Layout>
+auto BasicAddrSpace<PageShift, Layout>::operator=(
+    BasicAddrSpace &&other) noexcept -> BasicAddrSpace & {
+  if (this == &other)
+    return *this;
+  base_ = other.base_;
+  len_ = other.len_;
+  p2pagesize_ = other.p2pagesize_;
+  trace_ = std::exchange(other.trace_, nullptr);
+  mapped_pages_ = other.mapped_pages_;
+  std::copy(std::begin(other.prot_pages_), std::end(other.prot_pages_),
+            prot_pages_);
+  gaps_ = std::move(other.gaps_);
+  // The regions free their nodes into their own pool before taking over the
+  // other's nodes and allocator, so the pool must follow, not lead.
+  regions_ = std::move(other.regions_);
+  pool_ = std::move(other.pool_);
+  // Leave the other space drawing from the global allocator instead of the
+  // pool it gave up, until init() gives it a new one.
+  other.regions_ = RangeMap<Key, Value, Alloc>();
+  limit_ = other.limit_;
+  map_error_ = other.map_error_;
+  infos_ = std::move(other.infos_);
+  layers_ = std::move(other.layers_);
+  finger_ = {};
+  shared_ = std::exchange(other.shared_, nullptr);
+  dirty_lo_ = other.dirty_lo_;
+  dirty_hi_ = other.dirty_hi_;
+  dirty_all_ = other.dirty_all_;
+  shared_regions_ = std::move(other.shared_regions_);
+  shared_scratch_ = std::move(other.shared_scratch_);
+  txn_ = std::exchange(other.txn_, false);
+  undo_ranges_ = std::move(other.undo_ranges_);
+  undo_pieces_ = std::move(other.undo_pieces_);
+  undo_attrs_ = std::move(other.undo_attrs_);
+  return *this;
+}
+
+template <size_t PageShift, class Layout>
+void BasicAddrSpace<PageShift, Layout>::make_pool() {
+  pool_ = std::make_unique<NodePool>();
+  regions_ = RangeMap<Key, Value, Alloc>(Alloc(pool_.get()));
+}
+
+template <size_t PageShift, class Layout>
+void BasicAddrSpace<PageShift, Layout>::check_in_region(uintptr_t addr,
+                                                        size_t len) const {
   if (!is_valid(to_page(addr), to_page_ceil(len)))
     std::terminate();
 }
 
-bool AddrSpace::init(uintptr_t start, size_t len, size_t pagesize) {
+template <size_t PageShift, class Layout>
+void BasicAddrSpace<PageShift, Layout>::insert(Key start, Key end,
+                                               const MapInfo &info) {
+  touch(start, end);
+  regions_.insert(start, end, infos_.add(info), &finger_);
+  infos_.maybe_compact(regions_);
+}
+
+template <size_t PageShift, class Layout>
+void BasicAddrSpace<PageShift, Layout>::map_free(Key start, Key end,
+                                                 const MapInfo &info,
+                                                 std::pair<Key, Key> run) {
+  auto [lo, hi] = run;
+  remove_gap(hi - lo);
+  add_gap(start - lo);
+  add_gap(hi - end);
+  mapped_pages_ += end - start;
+  prot_pages_[info.prot & (kProtClasses - 1)] += end - start;
+  // There are no pieces to log, as the range was unmapped.
+  log_undo_range(start, end);
+  insert(start, end, info);
+}
+
+template <size_t PageShift, class Layout>
+bool BasicAddrSpace<PageShift, Layout>::over_limit(Key start, Key end) const {
+  if (limit_ == 0 || to_addr(mapped_pages_ + (end - start)) <= limit_)
+    return false;
+  // Pages that are already mapped are replaced rather than added, so only
+  // walk the range when the cheap check fails.
+  uint64_t replaced = 0;
+  auto hint = finger_;
+  regions_.for_each_overlapping(
+      start, end,
+      [&](const auto &e) {
+        replaced += std::min(e.end, end) - std::max(e.start, start);
+      },
+      &hint);
+  return to_addr(mapped_pages_ - replaced + (end - start)) > limit_;
+}
+
+template <size_t PageShift, class Layout>
+auto BasicAddrSpace<PageShift, Layout>::free_run(Key key) const
+    -> std::pair<Key, Key> {
+  Key lo = 0;
+  Key hi = (Key)len_;
+  auto hint = finger_;
+  regions_.for_each_from(
+      key,
+      [&](const auto &e) {
+        if (e.start < key) {
+          lo = e.end;
+          return true;
+        }
+        hi = e.start;
+        return false;
+      },
+      &hint);
+  return {lo, hi};
+}
+
+template <size_t PageShift, class Layout>
+void BasicAddrSpace<PageShift, Layout>::reset_usage() {
+  mapped_pages_ = 0;
+  std::fill(std::begin(prot_pages_), std::end(prot_pages_), 0);
+  gaps_.clear();
+  add_gap(len_);
+}
+
+template <size_t PageShift, class Layout>
+bool BasicAddrSpace<PageShift, Layout>::do_init(uintptr_t start, size_t len,
+                                                size_t pagesize) {
+  commit();
   if (pagesize == 0 || (pagesize & (pagesize - 1)) != 0)
     return false;
   p2pagesize_ = 0;
   size_t p = pagesize;
   while (p >>= 1)
     p2pagesize_++;
+  if (PageShift != kDynamicPageShift && p2pagesize_ != PageShift)
+    return false;
   base_ = to_page(start);
   len_ = to_page_ceil(len);
+  if (len_ > std::numeric_limits<Key>::max())
+    return false;
+  if (!pool_)
+    make_pool();
   regions_.clear();
+  infos_.clear();
+  reset_usage();
+  reset_attrs();
+  touch_all();
   return true;
 }
 
-void AddrSpace::reset() { regions_.clear(); }
+template <size_t PageShift, class Layout>
+void BasicAddrSpace<PageShift, Layout>::reset() {
+  log_undo(0, (Key)len_);
+  regions_.clear();
+  infos_.clear();
+  reset_usage();
+  reset_attrs();
+  touch_all();
+  publish();
+  if (trace_)
+    trace_->record({TraceOp::kReset});
+}
 
-uintptr_t AddrSpace::map_any(uintptr_t hint, size_t len, int prot, int flags,
-                             int fd, int64_t offset) {
+template <size_t PageShift, class Layout>
+uintptr_t BasicAddrSpace<PageShift, Layout>::do_map_any(uintptr_t hint,
+                                                        size_t len, int prot,
+                                                        int flags, int fd,
+                                                        int64_t offset) {
+  map_error_ = Error::kOk;
   if (len == 0)
-    return (uintptr_t)-1;
+    return map_failed(Error::kInval);
   uint64_t pages = to_page_ceil(len);
-  if (pages == 0)
-    return (uintptr_t)-1;
-  uint64_t pagesize = 1ULL << p2pagesize_;
+  if (pages == 0 || pages > len_)
+    return map_failed(Error::kNoMem);
+  // map_any never replaces a mapping, so every page counts toward the limit.
+  if (limit_ != 0 && to_addr(mapped_pages_ + pages) > limit_)
+    return map_failed(Error::kNoMem);
+  uint64_t pagesize = page_size();
   if (hint != 0 && hint % pagesize == 0) {
     uint64_t start = to_page(hint);
-    if (is_valid(start, pages) &&
-        !regions_.overlaps(start, start + pages)) {
-      regions_.insert(start, start + pages,
-                      MapInfo{prot, flags, fd, offset, false});
-      check_in_region(to_addr(start), len);
-      return to_addr(start);
+    if (is_valid(start, pages)) {
+      Key key = to_key(start);
+      if (!regions_.overlaps(key, key + pages)) {
+        map_free(key, key + pages, MapInfo{prot, flags, fd, offset, false},
+                 free_run(key));
+        check_in_region(to_addr(start), len);
+        return to_addr(start);
+      }
     }
   }
-  auto gaps = regions_.get_gaps(base_, base_ + len_);
-  for (auto &gap : gaps) {
-    if (gap.second - gap.first >= pages) {
-      uint64_t start = gap.first;
-      regions_.insert(start, start + pages,
-                      MapInfo{prot, flags, fd, offset, false});
-      check_in_region(to_addr(start), len);
-      return to_addr(start);
-    }
-  }
-  return (uintptr_t)-1;
+  if (hint != 0)
+    detail::count_hint_miss();
+  // Fail without scanning when no gap is long enough.
+  if (gaps_.largest() < pages)
+    return map_failed(Error::kNoMem);
+  auto gap = regions_.find_gap(0, (Key)len_, (Key)pages);
+  if (!gap)
+    return map_failed(Error::kNoMem);
+  Key key = *gap;
+  map_free(key, key + pages, MapInfo{prot, flags, fd, offset, false},
+           free_run(key));
+  check_in_region(key_to_addr(key), len);
+  return key_to_addr(key);
 }
 
-uintptr_t AddrSpace::map_at(uintptr_t addr, size_t len, int prot, int flags,
-                            int fd, int64_t offset, UpdateFn ufn) {
-  uint64_t pagesize = 1ULL << p2pagesize_;
+template <size_t PageShift, class Layout>
+uintptr_t BasicAddrSpace<PageShift, Layout>::do_map_at(
+    uintptr_t addr, size_t len, int prot, int flags, int fd, int64_t offset,
+    const UpdateFn &ufn, bool noreplace) {
+  map_error_ = Error::kOk;
+  uint64_t pagesize = page_size();
   if (addr % pagesize != 0 || len == 0)
-    return (uintptr_t)-1;
+    return map_failed(Error::kInval);
 
   uint64_t start = to_page(addr);
   uint64_t pages = to_page_ceil(len);
   if (pages == 0)
-    return (uintptr_t)-1;
+    return map_failed(Error::kInval);
 
   if (!is_valid(start, pages))
-    return (uintptr_t)-1;
+    return map_failed(Error::kInval);
 
-  unmap(addr, len, ufn);
-  regions_.insert(start, start + pages,
-                  MapInfo{prot, flags, fd, offset, false});
+  Key key = to_key(start);
+  if (over_limit(key, key + pages))
+    return map_failed(Error::kNoMem);
+
+  if (!map_over(key, key + pages, MapInfo{prot, flags, fd, offset, false}, ufn,
+                noreplace))
+    return map_failed(Error::kExists);
   check_in_region(addr, len);
   return addr;
 }
 
-Error AddrSpace::unmap(uintptr_t addr, size_t len, UpdateFn ufn) {
-  uint64_t pagesize = 1ULL << p2pagesize_;
+template <size_t PageShift, class Layout>
+bool BasicAddrSpace<PageShift, Layout>::map_over(Key start, Key end,
+                                                 const MapInfo &info,
+                                                 const UpdateFn &ufn,
+                                                 bool noreplace) {
+  // This is unmap_range and map_free in one: the replaced regions are
+  // accounted for as RangeMap::replace reports them, and the unmapped runs
+  // at either end are bounded by the neighbors it finds on the way.
+  Key lo = 0;
+  Key hi = (Key)len_;
+  std::optional<Key> first_start;
+  Key last_end = start;
+  if (!noreplace)
+    log_undo_range(start, end);
+  bool ok = regions_.replace(
+      start, end, infos_.add(info),
+      [&](const auto &e) {
+        if (noreplace)
+          return false;
+        Key cs = std::max(e.start, start);
+        Key ce = std::min(e.end, end);
+        MapInfo old = infos_.get(e.val);
+        mapped_pages_ -= ce - cs;
+        prot_pages_[old.prot & (kProtClasses - 1)] -= ce - cs;
+        if (!first_start)
+          first_start = e.start;
+        else
+          remove_gap(e.start - last_end);
+        if (txn_)
+          undo_pieces_.push_back({cs, ce, old});
+        last_end = e.end;
+        if (ufn) {
+          detail::count_callback();
+          ufn(key_to_addr(cs), key_to_addr(ce) - key_to_addr(cs), old);
+        }
+        return true;
+      },
+      &lo, &hi, &finger_);
+  if (!ok) {
+    // The info was interned before the search found the overlap.
+    infos_.maybe_compact(regions_);
+    return false;
+  }
+  if (noreplace)
+    log_undo_range(start, end);
+
+  if (first_start) {
+    if (*first_start < start)
+      lo = start;
+    if (last_end > end)
+      hi = end;
+    remove_gap(*first_start > lo ? *first_start - lo : 0);
+    remove_gap(hi > last_end ? hi - last_end : 0);
+    clear_attrs(start, end);
+  } else {
+    remove_gap(hi - lo);
+  }
+  add_gap(start - lo);
+  add_gap(hi - end);
+  mapped_pages_ += end - start;
+  prot_pages_[info.prot & (kProtClasses - 1)] += end - start;
+  touch(start, end);
+  infos_.maybe_compact(regions_);
+  return true;
+}
+
+template <size_t PageShift, class Layout>
+Error BasicAddrSpace<PageShift, Layout>::do_unmap(uintptr_t addr, size_t len,
+                                                  const UpdateFn &ufn) {
+  uint64_t pagesize = page_size();
   if (addr % pagesize != 0 || len == 0)
     return Error::kInval;
 
@@ -90,30 +345,89 @@ Error AddrSpace::unmap(uintptr_t addr, size_t len, UpdateFn ufn) {
   if (!is_valid(start, pages))
     return Error::kInval;
 
-  if (ufn) {
-    uint64_t end = start + pages;
-    auto overlapping = regions_.get_overlapping(start, end);
-    for (auto &e : overlapping) {
-      uint64_t cs = std::max(e.start, start);
-      uint64_t ce = std::min(e.end, end);
-      ufn(to_addr(cs), to_addr(ce) - to_addr(cs), e.val);
-    }
-  }
-
-  regions_.remove(start, start + pages);
+  Key kstart = to_key(start);
+  unmap_range(kstart, kstart + pages, ufn);
   return Error::kOk;
 }
 
-bool AddrSpace::query_page(uintptr_t addr, MapInfo *info) const {
-  auto entry = regions_.find(to_page(addr));
+template <size_t PageShift, class Layout>
+auto BasicAddrSpace<PageShift, Layout>::unmap_range(Key start, Key end,
+                                                    const UpdateFn &ufn)
+    -> std::pair<Key, Key> {
+  // Walk from the region before 'start' to the first region after 'end',
+  // which bound the unmapped run. The gaps between the regions removed all
+  // merge into that run.
+  Key lo = 0;
+  Key hi = (Key)len_;
+  std::optional<Key> first_start;
+  Key last_end = start;
+  regions_.for_each_from(
+      start,
+      [&](const auto &e) {
+        if (e.end <= start) {
+          lo = e.end;
+          return true;
+        }
+        if (e.start >= end) {
+          hi = e.start;
+          return false;
+        }
+        Key cs = std::max(e.start, start);
+        Key ce = std::min(e.end, end);
+        MapInfo info = infos_.get(e.val);
+        mapped_pages_ -= ce - cs;
+        prot_pages_[info.prot & (kProtClasses - 1)] -= ce - cs;
+        if (!first_start) {
+          first_start = e.start;
+          log_undo_range(start, end);
+        } else {
+          remove_gap(e.start - last_end);
+        }
+        if (txn_)
+          undo_pieces_.push_back({cs, ce, info});
+        last_end = e.end;
+        if (ufn) {
+          detail::count_callback();
+          ufn(key_to_addr(cs), key_to_addr(ce) - key_to_addr(cs), info);
+        }
+        return true;
+      },
+      &finger_);
+  if (!first_start)
+    return {lo, hi};
+  if (*first_start < start)
+    lo = start;
+  if (last_end > end)
+    hi = end;
+
+  remove_gap(*first_start > lo ? *first_start - lo : 0);
+  remove_gap(hi > last_end ? hi - last_end : 0);
+  add_gap(hi - lo);
+  touch(start, end);
+  regions_.remove(start, end, &finger_);
+  clear_attrs(start, end);
+  return {lo, hi};
+}
+
+template <size_t PageShift, class Layout>
+bool BasicAddrSpace<PageShift, Layout>::do_query_page(uintptr_t addr,
+                                                      MapInfo *info) const {
+  uint64_t page = to_page(addr);
+  if (page < base_ || page - base_ >= len_)
+    return false;
+  auto hint = finger_;
+  auto entry = regions_.find(to_key(page), &hint);
   if (!entry)
     return false;
-  *info = entry->val;
+  *info = infos_.get(entry->val);
   return true;
 }
 
-Error AddrSpace::protect(uintptr_t addr, size_t len, int prot, UpdateFn ufn) {
-  uint64_t pagesize = 1ULL << p2pagesize_;
+template <size_t PageShift, class Layout>
+Error BasicAddrSpace<PageShift, Layout>::do_protect(uintptr_t addr,
+                                                    size_t len, int prot,
+                                                    const UpdateFn &ufn) {
+  uint64_t pagesize = page_size();
   if (addr % pagesize != 0 || len == 0)
     return Error::kInval;
 
@@ -121,35 +435,1133 @@ Error AddrSpace::protect(uintptr_t addr, size_t len, int prot, UpdateFn ufn) {
   uint64_t pages = to_page_ceil(len);
   if (pages == 0)
     return Error::kInval;
-  uint64_t end = start + pages;
 
   if (!is_valid(start, pages))
     return Error::kInval;
 
-  auto overlapping = regions_.get_overlapping(start, end);
-  for (auto &e : overlapping) {
-    uint64_t cs = std::max(e.start, start);
-    uint64_t ce = std::min(e.end, end);
-    if (ufn)
-      ufn(to_addr(cs), to_addr(ce) - to_addr(cs), e.val);
-    MapInfo new_info = e.val;
+  Key cursor = to_key(start);
+  Key end = cursor + pages;
+  while (auto e = regions_.first_overlapping(cursor, end, &finger_)) {
+    Key cs = std::max(e->start, cursor);
+    Key ce = std::min(e->end, end);
+    MapInfo new_info = infos_.get(e->val);
+    if (ufn) {
+      detail::count_callback();
+      ufn(key_to_addr(cs), key_to_addr(ce) - key_to_addr(cs), new_info);
+    }
+    prot_pages_[new_info.prot & (kProtClasses - 1)] -= ce - cs;
+    prot_pages_[prot & (kProtClasses - 1)] += ce - cs;
+    log_undo(cs, ce);
     new_info.prot = prot;
-    regions_.remove(cs, ce);
-    regions_.insert(cs, ce, new_info);
+    insert(cs, ce, new_info);
+    cursor = ce;
   }
   return Error::kOk;
 }
 
-void AddrSpace::mark_original() {
-  regions_.update_all([](MapInfo &info) { info.original = true; });
+template <size_t PageShift, class Layout>
+void BasicAddrSpace<PageShift, Layout>::mark_original() {
+  [[maybe_unused]] auto scope = stats_.scope(StatOp::kMarkOriginal);
+  log_undo(0, (Key)len_);
+  regions_.update_all([&](Value &val) {
+    MapInfo info = infos_.get(val);
+    info.original = true;
+    val = infos_.add(info);
+  });
+  infos_.maybe_compact(regions_);
+  touch_all();
+  publish();
+  if (trace_)
+    trace_->record({TraceOp::kMarkOriginal});
+}
+
+template <size_t PageShift, class Layout>
+void BasicAddrSpace<PageShift, Layout>::unmap_non_original(UpdateFn ufn) {
+  [[maybe_unused]] auto scope = stats_.scope(StatOp::kUnmapNonOriginal);
+  // Collect the victims in one walk rather than looking up each region, so
+  // the cost is linear in the number of regions plus a log factor per
+  // region actually unmapped.
+  std::vector<std::pair<Key, Key>> victims;
+  regions_.for_each_overlapping(0, (Key)len_, [&](const auto &e) {
+    if (!infos_.get(e.val).original)
+      victims.emplace_back(e.start, e.end);
+  });
+  for (auto [start, end] : victims)
+    do_unmap(key_to_addr(start), key_to_addr(end) - key_to_addr(start), ufn);
+  publish();
+  if (trace_)
+    trace_->record({TraceOp::kUnmapNonOriginal, ufn != nullptr});
+}
+
+template <size_t PageShift, class Layout>
+size_t BasicAddrSpace<PageShift, Layout>::add_layer() {
+  layers_.emplace_back();
+  return layers_.size() - 1;
 }
 
-void AddrSpace::unmap_non_original(UpdateFn ufn) {
-  auto all = regions_.get_overlapping(base_, base_ + len_);
-  for (auto &e : all) {
-    if (!e.val.original)
-      unmap(to_addr(e.start), to_addr(e.end) - to_addr(e.start), ufn);
+template <size_t PageShift, class Layout>
+bool BasicAddrSpace<PageShift, Layout>::attr_range(size_t layer,
+                                                   uintptr_t addr, size_t len,
+                                                   Key *start,
+                                                   Key *end) const {
+  if (layer >= layers_.size() || addr % page_size() != 0 || len == 0)
+    return false;
+  uint64_t page = to_page(addr);
+  uint64_t pages = to_page_ceil(len);
+  if (pages == 0 || !is_valid(page, pages))
+    return false;
+  *start = to_key(page);
+  *end = *start + pages;
+  return true;
+}
+
+template <size_t PageShift, class Layout>
+Error BasicAddrSpace<PageShift, Layout>::set_attr(size_t layer,
+                                                  uintptr_t addr, size_t len,
+                                                  uint64_t value) {
+  [[maybe_unused]] auto scope = stats_.scope(StatOp::kSetAttr);
+  Key start, end;
+  if (!attr_range(layer, addr, len, &start, &end))
+    return Error::kInval;
+  // The regions must cover the range without a gap.
+  Key cursor = start;
+  regions_.for_each_overlapping(
+      start, end,
+      [&](const auto &e) {
+        if (e.start > cursor)
+          return false;
+        cursor = e.end;
+        return true;
+      },
+      &finger_);
+  if (cursor < end)
+    return Error::kNoMem;
+  log_undo(start, end);
+  AttrLayer &l = layers_[layer];
+  if (value == 0)
+    l.map.remove(start, end, &l.finger);
+  else
+    l.map.insert(start, end, value, &l.finger);
+  return Error::kOk;
+}
+
+template <size_t PageShift, class Layout>
+uint64_t BasicAddrSpace<PageShift, Layout>::attr(size_t layer,
+                                                 uintptr_t addr) const {
+  uint64_t page = to_page(addr);
+  if (layer >= layers_.size() || page < base_ || page - base_ >= len_)
+    return 0;
+  const AttrLayer &l = layers_[layer];
+  auto hint = l.finger;
+  auto e = l.map.find(to_key(page), &hint);
+  return e ? e->val : 0;
+}
+
+template <size_t PageShift, class Layout>
+Error BasicAddrSpace<PageShift, Layout>::for_each_attr(
+    size_t layer, uintptr_t addr, size_t len, const AttrFn &fn) const {
+  Key start, end;
+  if (!attr_range(layer, addr, len, &start, &end))
+    return Error::kInval;
+  const AttrLayer &l = layers_[layer];
+  auto hint = l.finger;
+  l.map.for_each_overlapping(
+      start, end,
+      [&](const auto &e) {
+        Key cs = std::max(e.start, start);
+        Key ce = std::min(e.end, end);
+        fn(key_to_addr(cs), key_to_addr(ce) - key_to_addr(cs), e.val);
+      },
+      &hint);
+  return Error::kOk;
+}
+
+// Public entry points, which record the call to the trace if one is attached.
+
+template <size_t PageShift, class Layout>
+bool BasicAddrSpace<PageShift, Layout>::init(uintptr_t start, size_t len,
+                                             size_t pagesize) {
+  bool ok = do_init(start, len, pagesize);
+  publish();
+  if (trace_) {
+    TraceRecord rec{TraceOp::kInit, false, start, len, pagesize};
+    rec.result = ok;
+    trace_->record(rec);
+  }
+  return ok;
+}
+
+template <size_t PageShift, class Layout>
+uintptr_t BasicAddrSpace<PageShift, Layout>::map_any(uintptr_t hint,
+                                                     size_t len, int prot,
+                                                     int flags, int fd,
+                                                     int64_t offset) {
+  [[maybe_unused]] auto scope = stats_.scope(StatOp::kMapAny);
+  uintptr_t ret = do_map_any(hint, len, prot, flags, fd, offset);
+  publish();
+  if (trace_)
+    trace_->record({TraceOp::kMapAny, false, hint, len, 0, prot, flags, fd,
+                    offset, ret});
+  return ret;
+}
+
+template <size_t PageShift, class Layout>
+uintptr_t BasicAddrSpace<PageShift, Layout>::map_at(uintptr_t addr,
+                                                    size_t len, int prot,
+                                                    int flags, int fd,
+                                                    int64_t offset,
+                                                    UpdateFn ufn) {
+  [[maybe_unused]] auto scope = stats_.scope(StatOp::kMapAt);
+  uintptr_t ret = do_map_at(addr, len, prot, flags, fd, offset, ufn, false);
+  publish();
+  if (trace_)
+    trace_->record({TraceOp::kMapAt, ufn != nullptr, addr, len, 0, prot, flags,
+                    fd, offset, ret});
+  return ret;
+}
+
+template <size_t PageShift, class Layout>
+uintptr_t BasicAddrSpace<PageShift, Layout>::map_at_noreplace(
+    uintptr_t addr, size_t len, int prot, int flags, int fd, int64_t offset) {
+  [[maybe_unused]] auto scope = stats_.scope(StatOp::kMapAt);
+  uintptr_t ret = do_map_at(addr, len, prot, flags, fd, offset, nullptr, true);
+  publish();
+  if (trace_)
+    trace_->record({TraceOp::kMapAtNoReplace, false, addr, len, 0, prot, flags,
+                    fd, offset, ret});
+  return ret;
+}
+
+template <size_t PageShift, class Layout>
+Error BasicAddrSpace<PageShift, Layout>::unmap(uintptr_t addr, size_t len,
+                                               UpdateFn ufn) {
+  [[maybe_unused]] auto scope = stats_.scope(StatOp::kUnmap);
+  Error err = do_unmap(addr, len, ufn);
+  publish();
+  if (trace_) {
+    TraceRecord rec{TraceOp::kUnmap, ufn != nullptr, addr, len};
+    rec.result = (uint64_t)err;
+    trace_->record(rec);
+  }
+  return err;
+}
+
+template <size_t PageShift, class Layout>
+bool BasicAddrSpace<PageShift, Layout>::query_page(uintptr_t addr,
+                                                   MapInfo *info) const {
+  [[maybe_unused]] auto scope = stats_.scope(StatOp::kQueryPage);
+  bool found = do_query_page(addr, info);
+  if (trace_) {
+    TraceRecord rec{TraceOp::kQueryPage, false, addr};
+    rec.result = found;
+    if (found)
+      rec.info = *info;
+    trace_->record(rec);
   }
+  return found;
 }
 
+template <size_t PageShift, class Layout>
+Error BasicAddrSpace<PageShift, Layout>::protect(uintptr_t addr, size_t len,
+                                                 int prot, UpdateFn ufn) {
+  [[maybe_unused]] auto scope = stats_.scope(StatOp::kProtect);
+  Error err = do_protect(addr, len, prot, ufn);
+  publish();
+  if (trace_) {
+    TraceRecord rec{TraceOp::kProtect, ufn != nullptr, addr, len};
+    rec.prot = prot;
+    rec.result = (uint64_t)err;
+    trace_->record(rec);
+  }
+  return err;
+}
+
+template <size_t PageShift, class Layout>
+size_t BasicAddrSpace<PageShift, Layout>::read_maps(
+    MapsCursor *cursor, char *buf, size_t len,
+    const MapsNameFn &names) const {
+  size_t n = 0;
+  for (auto it = begin_from(cursor->addr); it != end() && n < len; ++it) {
+    Region r = *it;
+    // A region that grew over the cursor since the last read has already
+    // been listed.
+    if (r.start < cursor->addr)
+      continue;
+    if (r.start != cursor->addr)
+      cursor->offset = 0;
+    MapsName name;
+    if (names)
+      name = names(r.start, r.len, r.info);
+    size_t path_len = name.path ? strlen(name.path) : 0;
+    bool has_path = name.path != nullptr;
+
+    if (cursor->offset == 0 && len - n >= kMapsPrefixMax + path_len + 1) {
+      // The whole line fits, so format it in place.
+      char *p = buf + n;
+      p += format_maps_prefix(p, r.start, r.start + r.len, r.info, name,
+                              has_path);
+      if (has_path)
+        memcpy(p, name.path, path_len);
+      p[path_len] = '\n';
+      n = p + path_len + 1 - buf;
+    } else {
+      char prefix[kMapsPrefixMax];
+      size_t prefix_len = format_maps_prefix(prefix, r.start, r.start + r.len,
+                                             r.info, name, has_path);
+      // Copy the part of the line from cursor->offset that fits.
+      size_t off = cursor->offset;
+      size_t pos = 0;
+      auto emit = [&](const char *src, size_t src_len) {
+        if (off >= pos && off < pos + src_len) {
+          size_t k = std::min(pos + src_len - off, len - n);
+          memcpy(buf + n, src + (off - pos), k);
+          n += k;
+          off += k;
+        }
+        pos += src_len;
+      };
+      emit(prefix, prefix_len);
+      emit(name.path, path_len);
+      emit("\n", 1);
+      if (off < pos) {
+        cursor->addr = r.start;
+        cursor->offset = off;
+        return n;
+      }
+    }
+    cursor->addr = r.start + r.len;
+    cursor->offset = 0;
+  }
+  return n;
+}
+
+template <size_t PageShift, class Layout>
+void BasicAddrSpace<PageShift, Layout>::begin_load() {
+  touch_all();
+  log_undo(0, (Key)len_);
+  regions_.clear();
+  infos_.clear();
+  reset_attrs();
+  mapped_pages_ = 0;
+  std::fill(std::begin(prot_pages_), std::end(prot_pages_), 0);
+  gaps_.clear();
+}
+
+template <size_t PageShift, class Layout>
+void BasicAddrSpace<PageShift, Layout>::append_region(Key start, Key end,
+                                                      const MapInfo &info,
+                                                      Key *last) {
+  add_gap(start - *last);
+  mapped_pages_ += end - start;
+  prot_pages_[info.prot & (kProtClasses - 1)] += end - start;
+  regions_.append(start, end, infos_.add(info));
+  *last = end;
+}
+
+template <size_t PageShift, class Layout>
+void BasicAddrSpace<PageShift, Layout>::end_load(Key last) {
+  add_gap(len_ - last);
+  infos_.maybe_compact(regions_);
+}
+
+template <size_t PageShift, class Layout>
+bool BasicAddrSpace<PageShift, Layout>::import_line(const char *p,
+                                                    const char *end,
+                                                    bool original,
+                                                    uintptr_t *prev_end,
+                                                    Key *last) {
+  MapsLine line;
+  if (!parse_maps_line(p, end, &line) || line.start < *prev_end)
+    return false;
+  *prev_end = line.end;
+  uint64_t lo = std::max(to_page(line.start), base_);
+  uint64_t hi = std::min(to_page_ceil(line.end), base_ + len_);
+  if (lo >= hi)
+    return true;
+  // With pages larger than the host's, neighbors can round into the same
+  // page; the earlier region keeps it.
+  Key start = std::max(to_key(lo), *last);
+  Key stop = to_key(hi);
+  if (start >= stop)
+    return true;
+
+  MapInfo info{line.prot, line.flags, -1, (int64_t)line.offset, original};
+  append_region(start, stop, info, last);
+  if (trace_) {
+    uintptr_t addr = key_to_addr(start);
+    trace_->record({TraceOp::kMapAt, false, addr, key_to_addr(stop) - addr,
+                    0, info.prot, info.flags, info.fd, info.offset, addr});
+  }
+  return true;
+}
+
+template <size_t PageShift, class Layout>
+Error BasicAddrSpace<PageShift, Layout>::import_maps(FILE *in,
+                                                    bool original) {
+  begin_load();
+  if (trace_)
+    trace_->record({TraceOp::kReset});
+
+  // Lines are parsed in place in the buffer; only a line split between two
+  // reads is moved to the front. A line longer than the buffer has all its
+  // fields near the start, so it is parsed from what fits and the rest of
+  // its path skipped.
+  char buf[4096];
+  size_t have = 0;
+  bool skipping = false;
+  uintptr_t prev_end = 0;
+  Key last = 0;
+  Error err = Error::kOk;
+  while (err == Error::kOk) {
+    size_t got = fread(buf + have, 1, sizeof(buf) - have, in);
+    if (got == 0 && ferror(in)) {
+      err = Error::kInval;
+      break;
+    }
+    bool eof = got == 0;
+    have += got;
+    const char *p = buf;
+    const char *end = buf + have;
+    while (p < end) {
+      const char *nl = (const char *)memchr(p, '\n', end - p);
+      bool complete = nl != nullptr;
+      if (!complete) {
+        if (!eof && !(p == buf && have == sizeof(buf)))
+          break;
+        nl = end;
+      }
+      if (!skipping && !import_line(p, nl, original, &prev_end, &last)) {
+        err = Error::kInval;
+        break;
+      }
+      // The mapped size only grows, so stop reading once it is too large.
+      if (limit_ != 0 && to_addr(mapped_pages_) > limit_) {
+        err = Error::kNoMem;
+        break;
+      }
+      skipping = !complete && !eof;
+      p = complete ? nl + 1 : end;
+    }
+    have = end - p;
+    memmove(buf, p, have);
+    if (eof)
+      break;
+  }
+
+  if (err != Error::kOk) {
+    regions_.clear();
+    infos_.clear();
+    reset_usage();
+    publish();
+    if (trace_)
+      trace_->record({TraceOp::kReset});
+    return err;
+  }
+  end_load(last);
+  publish();
+  if (original && trace_)
+    trace_->record({TraceOp::kMarkOriginal});
+  return Error::kOk;
+}
+
+template <size_t PageShift, class Layout>
+void BasicAddrSpace<PageShift, Layout>::trace_loaded() {
+  // map_at cannot set 'original', so replay maps the original regions,
+  // marks them, then maps the rest. The regions are disjoint, so the order
+  // does not change the result.
+  bool any_original = false;
+  for (int pass = 0; pass < 2; pass++) {
+    for (Region r : *this) {
+      if (r.info.original != (pass == 0))
+        continue;
+      any_original = true;
+      trace_->record({TraceOp::kMapAt, false, r.start, r.len, 0, r.info.prot,
+                      r.info.flags, r.info.fd, r.info.offset, r.start});
+    }
+    if (pass == 0 && any_original)
+      trace_->record({TraceOp::kMarkOriginal});
+  }
+}
+
+// Check that the regions in [first, last) are nonempty, page-aligned,
+// sorted and disjoint, and lie in [base, base + pages), for pages of
+// 1 << shift bytes. Returns the number of pages they cover, or nullopt.
+template <class It>
+static std::optional<uint64_t> check_regions(It first, It last, size_t shift,
+                                             uint64_t base, uint64_t pages) {
+  uint64_t mask = (1ULL << shift) - 1;
+  uint64_t next = base;
+  uint64_t total = 0;
+  for (; first != last; ++first) {
+    Region r = *first;
+    uint64_t start = r.start >> shift;
+    uint64_t n = (r.len >> shift) + ((r.len & mask) != 0);
+    if ((r.start & mask) != 0 || n == 0 || start < next ||
+        start - base > pages || n > pages - (start - base))
+      return std::nullopt;
+    next = start + n;
+    total += n;
+  }
+  return total;
+}
+
+template <size_t PageShift, class Layout>
+template <class It>
+void BasicAddrSpace<PageShift, Layout>::load_sorted(It first, It last) {
+  begin_load();
+  Key end = 0;
+  for (; first != last; ++first) {
+    Region r = *first;
+    Key start = to_key(to_page(r.start));
+    append_region(start, start + (Key)to_page_ceil(r.len), r.info, &end);
+  }
+  end_load(end);
+}
+
+template <size_t PageShift, class Layout>
+Error BasicAddrSpace<PageShift, Layout>::load_regions(const Region *regions,
+                                                     size_t count) {
+  // Check everything first so that bad input leaves the mapping alone.
+  auto pages =
+      check_regions(regions, regions + count, page_shift(), base_, len_);
+  if (!pages)
+    return Error::kInval;
+  if (limit_ != 0 && to_addr(*pages) > limit_)
+    return Error::kNoMem;
+
+  load_sorted(regions, regions + count);
+  publish();
+  if (trace_) {
+    trace_->record({TraceOp::kReset});
+    trace_loaded();
+  }
+  return Error::kOk;
+}
+
+template <size_t PageShift, class Layout>
+template <class Fn, class MarkFn>
+void BasicAddrSpace<PageShift, Layout>::diff_walk(const BasicAddrSpace &target,
+                                                  Fn emit, MarkFn mark) const {
+  // Cut both region lists at every boundary of either, so each piece lies
+  // wholly inside or outside a region of each, and hold back the change for
+  // a piece until the next one shows whether the two can merge.
+  auto a = regions_.begin(), a_end = regions_.end();
+  auto b = target.regions_.begin(), b_end = target.regions_.end();
+  std::optional<DiffOp> op;
+  Key op_start = 0, op_end = 0;
+  MapInfo op_info{};
+  auto add = [&](DiffOp next, Key start, Key end, const MapInfo &info) {
+    bool same = next == DiffOp::kUnmap ||
+                (next == DiffOp::kMap ? info == op_info
+                                      : info.prot == op_info.prot);
+    if (op && *op == next && op_end == start && same) {
+      op_end = end;
+      return;
+    }
+    if (op)
+      emit(*op, op_start, op_end, op_info);
+    op = next;
+    op_start = start;
+    op_end = end;
+    op_info = info;
+  };
+  Key pos = 0;
+  while (a != a_end || b != b_end) {
+    bool has_a = a != a_end, has_b = b != b_end;
+    auto ea = has_a ? *a : Entry<Key, Value>{};
+    auto eb = has_b ? *b : Entry<Key, Value>{};
+    Key sa = std::max(ea.start, pos), sb = std::max(eb.start, pos);
+    Key start = !has_a ? sb : !has_b ? sa : std::min(sa, sb);
+    bool in_a = has_a && sa == start, in_b = has_b && sb == start;
+    Key end = std::numeric_limits<Key>::max();
+    if (has_a)
+      end = in_a ? ea.end : sa;
+    if (has_b)
+      end = std::min(end, in_b ? eb.end : sb);
+
+    if (in_a && in_b) {
+      MapInfo cur = infos_.get(ea.val);
+      MapInfo want = target.infos_.get(eb.val);
+      bool original = cur.original;
+      cur.original = want.original;
+      bool remap = false;
+      if (!(cur == want)) {
+        cur.prot = want.prot;
+        if (cur == want) {
+          add(DiffOp::kProtect, start, end, MapInfo{want.prot, 0, 0, 0, false});
+        } else {
+          add(DiffOp::kMap, start, end, want);
+          remap = true;
+        }
+      }
+      if (!remap && original != want.original)
+        mark(start, end, want.original);
+    } else if (in_a) {
+      add(DiffOp::kUnmap, start, end, MapInfo{});
+    } else {
+      add(DiffOp::kMap, start, end, target.infos_.get(eb.val));
+    }
+    pos = end;
+    if (in_a && ea.end == end)
+      ++a;
+    if (in_b && eb.end == end)
+      ++b;
+  }
+  if (op)
+    emit(*op, op_start, op_end, op_info);
+}
+
+// Call fn(start, end, value) for each run where the values in 'from' and
+// 'to' differ, with the value in 'to', 0 where unset. Both are walked once.
+template <class Key, class Fn>
+static void diff_values(const RangeMap<Key, uint64_t> &from,
+                        const RangeMap<Key, uint64_t> &to, Fn fn) {
+  auto a = from.begin(), a_end = from.end();
+  auto b = to.begin(), b_end = to.end();
+  Key pos = 0;
+  while (a != a_end || b != b_end) {
+    bool has_a = a != a_end, has_b = b != b_end;
+    auto ea = has_a ? *a : Entry<Key, uint64_t>{};
+    auto eb = has_b ? *b : Entry<Key, uint64_t>{};
+    Key sa = std::max(ea.start, pos), sb = std::max(eb.start, pos);
+    Key start = !has_a ? sb : !has_b ? sa : std::min(sa, sb);
+    bool in_a = has_a && sa == start, in_b = has_b && sb == start;
+    Key end = std::numeric_limits<Key>::max();
+    if (has_a)
+      end = in_a ? ea.end : sa;
+    if (has_b)
+      end = std::min(end, in_b ? eb.end : sb);
+    uint64_t va = in_a ? ea.val : 0, vb = in_b ? eb.val : 0;
+    if (va != vb)
+      fn(start, end, vb);
+    pos = end;
+    if (in_a && ea.end == end)
+      ++a;
+    if (in_b && eb.end == end)
+      ++b;
+  }
+}
+
+template <size_t PageShift, class Layout>
+Error BasicAddrSpace<PageShift, Layout>::diff(const BasicAddrSpace &target,
+                                              const DiffFn &fn, bool apply) {
+  if (target.base_ != base_ || target.len_ != len_ ||
+      target.page_shift() != page_shift())
+    return Error::kInval;
+  auto report = [&](DiffOp op, Key start, Key end, const MapInfo &info) {
+    if (fn)
+      fn(op, key_to_addr(start), key_to_addr(end) - key_to_addr(start), info);
+  };
+  if (!apply) {
+    diff_walk(target, report, [](Key, Key, bool) {});
+    return Error::kOk;
+  }
+
+  // Changing the regions would invalidate the walk, so list the changes
+  // first.
+  struct Change {
+    DiffOp op;
+    Key start;
+    Key end;
+    MapInfo info;
+  };
+  struct Mark {
+    Key start;
+    Key end;
+    bool original;
+  };
+  std::vector<Change> changes;
+  std::vector<Mark> marks;
+  diff_walk(
+      target,
+      [&](DiffOp op, Key start, Key end, const MapInfo &info) {
+        changes.push_back({op, start, end, info});
+      },
+      [&](Key start, Key end, bool original) {
+        marks.push_back({start, end, original});
+      });
+  for (const Change &c : changes) {
+    report(c.op, c.start, c.end, c.info);
+    if (c.op == DiffOp::kProtect) {
+      do_protect(key_to_addr(c.start),
+                 key_to_addr(c.end) - key_to_addr(c.start), c.info.prot,
+                 nullptr);
+      continue;
+    }
+    auto run = unmap_range(c.start, c.end, nullptr);
+    if (c.op == DiffOp::kMap)
+      map_free(c.start, c.end, c.info, run);
+  }
+  // Each marked piece now lies within one region, whatever was protected.
+  for (const Mark &m : marks) {
+    log_undo(m.start, m.end);
+    MapInfo info = infos_.get(regions_.find(m.start, &finger_)->val);
+    info.original = m.original;
+    insert(m.start, m.end, info);
+  }
+  // Remapping cleared the attributes of the remapped pages, so bring every
+  // layer to the target's values, or to 0 in layers the target lacks.
+  struct AttrChange {
+    size_t layer;
+    Key start;
+    Key end;
+    uint64_t value;
+  };
+  std::vector<AttrChange> attrs;
+  RangeMap<Key, uint64_t> none;
+  for (size_t i = 0; i < layers_.size(); i++) {
+    const auto &want = i < target.layers_.size() ? target.layers_[i].map : none;
+    diff_values(layers_[i].map, want, [&](Key start, Key end, uint64_t val) {
+      attrs.push_back({i, start, end, val});
+    });
+  }
+  for (const AttrChange &c : attrs) {
+    log_undo(c.start, c.end);
+    AttrLayer &l = layers_[c.layer];
+    if (c.value == 0)
+      l.map.remove(c.start, c.end, &l.finger);
+    else
+      l.map.insert(c.start, c.end, c.value, &l.finger);
+  }
+  publish();
+  if (trace_ && (!changes.empty() || !marks.empty())) {
+    trace_->record({TraceOp::kReset});
+    trace_loaded();
+  }
+  return Error::kOk;
+}
+
+template <size_t PageShift, class Layout>
+size_t BasicAddrSpace<PageShift, Layout>::freeze(void *buf, size_t len) const {
+  std::vector<MapInfo> dict;
+  std::unordered_map<MapInfo, uint32_t, MapInfoHash> ids;
+  for (auto e : regions_) {
+    const MapInfo &info = infos_.get(e.val);
+    if (ids.try_emplace(info, (uint32_t)dict.size()).second)
+      dict.push_back(info);
+  }
+  uint64_t n = regions_.size();
+  FrozenLayout layout(n, dict.size());
+  if (len < layout.size)
+    return layout.size;
+
+  char *out = static_cast<char *>(buf);
+  memset(out, 0, layout.size);
+  FrozenHeader hdr{};
+  memcpy(hdr.magic, kFrozenMagic, sizeof(hdr.magic));
+  hdr.start = to_addr(base_);
+  hdr.len = to_addr(len_);
+  hdr.pagesize = page_size();
+  hdr.regions = n;
+  hdr.infos = dict.size();
+  hdr.size = layout.size;
+  memcpy(out, &hdr, sizeof(hdr));
+
+  // Visiting the tree positions in order pairs each with the next region.
+  auto *starts = reinterpret_cast<uint64_t *>(out + layout.starts);
+  auto *ends = reinterpret_cast<uint64_t *>(out + layout.ends);
+  auto *idx = reinterpret_cast<uint32_t *>(out + layout.ids);
+  uint64_t k = detail::eytzinger_first(n);
+  for (auto e : regions_) {
+    starts[k] = key_to_addr(e.start);
+    ends[k] = key_to_addr(e.end);
+    idx[k] = ids[infos_.get(e.val)];
+    k = detail::eytzinger_next(k, n);
+  }
+  auto *infos = reinterpret_cast<FrozenInfo *>(out + layout.infos);
+  for (size_t i = 0; i < dict.size(); i++) {
+    const MapInfo &info = dict[i];
+    infos[i] = {info.prot, info.flags, info.fd, info.original, info.offset};
+  }
+  return layout.size;
+}
+
+template <size_t PageShift, class Layout>
+Error BasicAddrSpace<PageShift, Layout>::thaw(const FrozenAddrSpace &frozen) {
+  size_t pagesize = frozen.pagesize();
+  if (pagesize == 0 || (pagesize & (pagesize - 1)) != 0)
+    return Error::kInval;
+  size_t shift = __builtin_ctzll(pagesize);
+  if (PageShift != kDynamicPageShift && shift != PageShift)
+    return Error::kInval;
+  uint64_t base = frozen.start() >> shift;
+  uint64_t pages =
+      (frozen.len() >> shift) + ((frozen.len() & (pagesize - 1)) != 0);
+  if (pages > std::numeric_limits<Key>::max())
+    return Error::kInval;
+  auto mapped =
+      check_regions(frozen.begin(), frozen.end(), shift, base, pages);
+  if (!mapped)
+    return Error::kInval;
+  if (limit_ != 0 && (*mapped << shift) > limit_)
+    return Error::kNoMem;
+
+  do_init(frozen.start(), frozen.len(), pagesize);
+  load_sorted(frozen.begin(), frozen.end());
+  publish();
+  if (trace_) {
+    TraceRecord rec{TraceOp::kInit, false, frozen.start(), frozen.len(),
+                    pagesize};
+    rec.result = 1;
+    trace_->record(rec);
+    trace_loaded();
+  }
+  return Error::kOk;
+}
+
+// Serialized state: an 8-byte magic ending in the format version, then
+// LEB128 varints (zigzag-encoded where signed):
+//
+//   base page, length in pages, page shift
+//   count of distinct MapInfos, then for each:
+//     prot, flags, fd, offset (signed), original (one byte)
+//   count of regions, then for each, in address order:
+//     pages since the end of the previous region, length in pages,
+//     index of its MapInfo
+//
+// so a region usually takes three or four bytes.
+
+static const uint8_t kStateMagic[8] = {'M', 'M', 'S', 'T', 'A', 'T', 'E', 1};
+
+namespace {
+
+// Appends to a buffer that may be too small, counting every byte.
+struct StateWriter {
+  uint8_t *buf;
+  size_t cap;
+  size_t n = 0;
+
+  void byte(uint8_t b) {
+    if (n < cap)
+      buf[n] = b;
+    n++;
+  }
+  void varint(uint64_t v) {
+    while (v >= 0x80) {
+      byte((uint8_t)(v | 0x80));
+      v >>= 7;
+    }
+    byte((uint8_t)v);
+  }
+  void svarint(int64_t v) {
+    varint(((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+  }
+};
+
+// Reads from [p, end); 'ok' is cleared at the first malformed value.
+struct StateReader {
+  const uint8_t *p;
+  const uint8_t *end;
+  bool ok = true;
+
+  uint8_t byte() {
+    if (p == end) {
+      ok = false;
+      return 0;
+    }
+    return *p++;
+  }
+  uint64_t varint() {
+    uint64_t v = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+      uint8_t b = byte();
+      v |= (uint64_t)(b & 0x7f) << shift;
+      if (!(b & 0x80))
+        return v;
+    }
+    ok = false;
+    return 0;
+  }
+  int64_t svarint() {
+    uint64_t v = varint();
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+  }
+  int int32() {
+    int64_t v = svarint();
+    if (v < std::numeric_limits<int>::min() ||
+        v > std::numeric_limits<int>::max())
+      ok = false;
+    return (int)v;
+  }
+  size_t left() const { return end - p; }
+};
+
+} // namespace
+
+template <size_t PageShift, class Layout>
+size_t BasicAddrSpace<PageShift, Layout>::serialize(uint8_t *buf,
+                                                   size_t len) const {
+  StateWriter w{buf, len};
+  for (uint8_t b : kStateMagic)
+    w.byte(b);
+  w.varint(base_);
+  w.varint(len_);
+  w.varint(page_shift());
+
+  // Number the distinct infos in order of first use.
+  std::vector<MapInfo> dict;
+  std::unordered_map<MapInfo, uint64_t, MapInfoHash> ids;
+  std::vector<uint64_t> idx;
+  idx.reserve(regions_.size());
+  for (auto e : regions_) {
+    const MapInfo &info = infos_.get(e.val);
+    auto [it, added] = ids.try_emplace(info, dict.size());
+    if (added)
+      dict.push_back(info);
+    idx.push_back(it->second);
+  }
+  w.varint(dict.size());
+  for (const MapInfo &info : dict) {
+    w.svarint(info.prot);
+    w.svarint(info.flags);
+    w.svarint(info.fd);
+    w.svarint(info.offset);
+    w.byte(info.original);
+  }
+
+  w.varint(regions_.size());
+  Key last = 0;
+  size_t i = 0;
+  for (auto e : regions_) {
+    w.varint(e.start - last);
+    w.varint(e.end - e.start);
+    w.varint(idx[i++]);
+    last = e.end;
+  }
+  return w.n;
+}
+
+template <size_t PageShift, class Layout>
+Error BasicAddrSpace<PageShift, Layout>::deserialize(const uint8_t *data,
+                                                    size_t len) {
+  StateReader r{data, data + len};
+  for (uint8_t b : kStateMagic) {
+    if (r.byte() != b)
+      return Error::kInval;
+  }
+  uint64_t base = r.varint();
+  uint64_t pages = r.varint();
+  uint64_t shift = r.varint();
+  if (!r.ok || shift >= 64 ||
+      (PageShift != kDynamicPageShift && shift != PageShift) ||
+      pages > std::numeric_limits<Key>::max() ||
+      pages > (~0ULL >> shift) || base > (~0ULL >> shift) - pages)
+    return Error::kInval;
+
+  // Every info takes at least five bytes and every region three, which
+  // bounds the counts before anything is allocated.
+  uint64_t ninfos = r.varint();
+  if (!r.ok || ninfos > r.left() / 5)
+    return Error::kInval;
+  std::vector<MapInfo> dict(ninfos);
+  for (MapInfo &info : dict) {
+    info.prot = r.int32();
+    info.flags = r.int32();
+    info.fd = r.int32();
+    info.offset = r.svarint();
+    uint8_t original = r.byte();
+    if (original > 1)
+      r.ok = false;
+    info.original = original;
+  }
+  uint64_t nregions = r.varint();
+  if (!r.ok || nregions > r.left() / 3)
+    return Error::kInval;
+
+  // Check the regions before changing anything, then decode them again to
+  // build the tree.
+  StateReader start = r;
+  uint64_t next = 0;
+  uint64_t mapped = 0;
+  for (uint64_t i = 0; i < nregions && r.ok; i++) {
+    uint64_t gap = r.varint();
+    uint64_t n = r.varint();
+    uint64_t id = r.varint();
+    if (gap > pages - next || n == 0 || n > pages - next - gap ||
+        id >= ninfos)
+      return Error::kInval;
+    next += gap + n;
+    mapped += n;
+  }
+  if (!r.ok || r.left() != 0)
+    return Error::kInval;
+  if (limit_ != 0 && (mapped > (~0ULL >> shift) || (mapped << shift) > limit_))
+    return Error::kNoMem;
+
+  do_init(base << shift, pages << shift, (size_t)1 << shift);
+  begin_load();
+  r = start;
+  Key last = 0;
+  for (uint64_t i = 0; i < nregions; i++) {
+    Key s = last + (Key)r.varint();
+    Key e = s + (Key)r.varint();
+    append_region(s, e, dict[r.varint()], &last);
+  }
+  end_load(last);
+  publish();
+
+  if (trace_) {
+    TraceRecord rec{TraceOp::kInit, false, to_addr(base_), to_addr(len_),
+                    page_size()};
+    rec.result = 1;
+    trace_->record(rec);
+    trace_loaded();
+  }
+  return Error::kOk;
+}
+
+template <size_t PageShift, class Layout>
+bool BasicAddrSpace<PageShift, Layout>::share(void *arena, size_t len) {
+  shared_ = nullptr;
+  if (!arena)
+    return true;
+  shared_ = detail::SharedWriter::create(arena, len);
+  if (!shared_)
+    return false;
+  touch_all();
+  publish();
+  return true;
+}
+
+template <size_t PageShift, class Layout>
+void BasicAddrSpace<PageShift, Layout>::publish() {
+  if (!shared_ || (!dirty_all_ && dirty_lo_ > dirty_hi_))
+    return;
+  detail::SharedWriter w(shared_, &shared_scratch_);
+  w.lock();
+  shared_regions_.clear();
+  if (dirty_all_ || w.stale()) {
+    shared_regions_.assign(begin(), end());
+    w.assign(shared_regions_);
+  } else {
+    // Rewrite the regions touching the changed keys: a region that now
+    // ends or starts at their edge may have been merged or split there.
+    regions_.for_each_from(dirty_lo_, [&](const auto &e) {
+      if (e.start > dirty_hi_)
+        return false;
+      if (e.end >= dirty_lo_)
+        shared_regions_.push_back({key_to_addr(e.start),
+                                   key_to_addr(e.end) - key_to_addr(e.start),
+                                   infos_.get(e.val)});
+      return true;
+    });
+    w.replace(key_to_addr(dirty_lo_), key_to_addr(dirty_hi_), shared_regions_);
+  }
+  w.set_usage(usage());
+  w.unlock();
+  dirty_all_ = false;
+  dirty_lo_ = std::numeric_limits<Key>::max();
+  dirty_hi_ = 0;
+}
+
+template <size_t PageShift, class Layout>
+void BasicAddrSpace<PageShift, Layout>::log_undo_attrs(Key start, Key end) {
+  for (size_t i = 0; i < layers_.size(); i++) {
+    AttrLayer &l = layers_[i];
+    l.map.for_each_overlapping(
+        start, end,
+        [&](const auto &e) {
+          undo_attrs_.push_back(
+              {i, std::max(e.start, start), std::min(e.end, end), e.val});
+        },
+        &l.finger);
+  }
+}
+
+template <size_t PageShift, class Layout>
+void BasicAddrSpace<PageShift, Layout>::log_undo(Key start, Key end) {
+  if (!txn_)
+    return;
+  log_undo_range(start, end);
+  regions_.for_each_overlapping(
+      start, end,
+      [&](const auto &e) {
+        undo_pieces_.push_back({std::max(e.start, start),
+                                std::min(e.end, end), infos_.get(e.val)});
+      },
+      &finger_);
+}
+
+template <size_t PageShift, class Layout>
+bool BasicAddrSpace<PageShift, Layout>::begin_txn() {
+  if (txn_)
+    return false;
+  txn_ = true;
+  return true;
+}
+
+template <size_t PageShift, class Layout>
+void BasicAddrSpace<PageShift, Layout>::commit() {
+  txn_ = false;
+  undo_ranges_.clear();
+  undo_pieces_.clear();
+  undo_attrs_.clear();
+}
+
+template <size_t PageShift, class Layout>
+void BasicAddrSpace<PageShift, Layout>::rollback() {
+  if (!txn_)
+    return;
+  // Close the transaction first so that undoing logs nothing. Going back
+  // through the log, unmap each range and map its old pieces again; these
+  // keep the usage totals as any other change does. Unmapping clears the
+  // attributes, so the old ones go back last.
+  txn_ = false;
+  for (size_t i = undo_ranges_.size(); i-- > 0;) {
+    const UndoRange &r = undo_ranges_[i];
+    bool next = i + 1 < undo_ranges_.size();
+    size_t last = next ? undo_ranges_[i + 1].first : undo_pieces_.size();
+    size_t last_attr =
+        next ? undo_ranges_[i + 1].first_attr : undo_attrs_.size();
+    unmap_range(r.start, r.end, nullptr);
+    for (size_t j = r.first; j < last; j++) {
+      const UndoPiece &p = undo_pieces_[j];
+      map_free(p.start, p.end, p.info, free_run(p.start));
+    }
+    for (size_t j = r.first_attr; j < last_attr; j++) {
+      const UndoAttr &a = undo_attrs_[j];
+      AttrLayer &l = layers_[a.layer];
+      l.map.insert(a.start, a.end, a.value, &l.finger);
+    }
+  }
+  bool changed = !undo_ranges_.empty();
+  commit();
+  publish();
+  if (trace_ && changed) {
+    trace_->record({TraceOp::kReset});
+    trace_loaded();
+  }
+}
+
+template <size_t PageShift, class Layout>
+void BasicAddrSpace<PageShift, Layout>::set_limit(size_t bytes) {
+  limit_ = bytes;
+  if (trace_)
+    trace_->record({TraceOp::kSetLimit, false, 0, bytes});
+}
+
+template <size_t PageShift, class Layout>
+Usage BasicAddrSpace<PageShift, Layout>::usage() const {
+  Usage u{};
+  u.mapped_pages = mapped_pages_;
+  std::copy(std::begin(prot_pages_), std::end(prot_pages_), u.prot_pages);
+  u.regions = regions_.size();
+  u.largest_gap = gaps_.largest();
+  return u;
+}
+
+template <size_t PageShift, class Layout>
+Stats BasicAddrSpace<PageShift, Layout>::stats() const {
+  Stats st = stats_.snapshot();
+  st.regions = regions_.size();
+  return st;
+}
+
+template struct BasicAddrSpace<kDynamicPageShift, WideLayout>;
+template struct BasicAddrSpace<12, WideLayout>;
+template struct BasicAddrSpace<14, WideLayout>;
+template struct BasicAddrSpace<kDynamicPageShift, CompactLayout>;
+template struct BasicAddrSpace<12, CompactLayout>;
+template struct BasicAddrSpace<14, CompactLayout>;
+
 } // namespace mmap
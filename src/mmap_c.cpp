@@ -1,10 +1,25 @@
 #include "mmap_c.h"
 #include "addr_space.h"
+#include "frozen.h"
+#include "shared.h"
+
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <vector>
 
 struct MMapAddrSpace {
   mmap::AddrSpace impl;
 };
 
+struct MMapFrozen {
+  mmap::FrozenAddrSpace impl;
+};
+
+struct MMapShared {
+  mmap::SharedAddrSpace impl;
+};
+
 static struct MMapInfo to_c(mmap::MapInfo info) {
   return {info.prot, info.flags, info.fd, info.offset, info.original};
 }
@@ -25,6 +40,8 @@ static enum MMapError to_c_error(mmap::Error err) {
     return MMAP_INVAL;
   case mmap::Error::kNoMem:
     return MMAP_NOMEM;
+  case mmap::Error::kExists:
+    return MMAP_EXISTS;
   }
   return MMAP_INVAL;
 }
@@ -57,6 +74,12 @@ uintptr_t mmap_map_at(struct MMapAddrSpace *mm, uintptr_t addr, size_t len,
                          wrap_cb(ufn, udata));
 }
 
+uintptr_t mmap_map_at_noreplace(struct MMapAddrSpace *mm, uintptr_t addr,
+                                size_t len, int prot, int flags, int fd,
+                                int64_t offset) {
+  return mm->impl.map_at_noreplace(addr, len, prot, flags, fd, offset);
+}
+
 enum MMapError mmap_unmap(struct MMapAddrSpace *mm, uintptr_t addr, size_t len,
                           MMapUpdateFn ufn, void *udata) {
   return to_c_error(mm->impl.unmap(addr, len, wrap_cb(ufn, udata)));
@@ -83,3 +106,308 @@ void mmap_unmap_non_original(struct MMapAddrSpace *mm, MMapUpdateFn ufn,
                              void *udata) {
   mm->impl.unmap_non_original(wrap_cb(ufn, udata));
 }
+
+size_t mmap_add_layer(struct MMapAddrSpace *mm) { return mm->impl.add_layer(); }
+
+enum MMapError mmap_set_attr(struct MMapAddrSpace *mm, size_t layer,
+                             uintptr_t addr, size_t len, uint64_t value) {
+  return to_c_error(mm->impl.set_attr(layer, addr, len, value));
+}
+
+uint64_t mmap_attr(const struct MMapAddrSpace *mm, size_t layer,
+                   uintptr_t addr) {
+  return mm->impl.attr(layer, addr);
+}
+
+enum MMapError mmap_for_each_attr(const struct MMapAddrSpace *mm, size_t layer,
+                                  uintptr_t addr, size_t len, MMapAttrFn fn,
+                                  void *udata) {
+  return to_c_error(mm->impl.for_each_attr(
+      layer, addr, len, [fn, udata](uintptr_t start, size_t n, uint64_t val) {
+        fn(start, n, val, udata);
+      }));
+}
+
+namespace {
+
+struct IterState {
+  const MMapAddrSpace *mm;
+  mmap::AddrSpace::const_iterator it;
+};
+
+static_assert(sizeof(IterState) <= sizeof(MMapIter),
+              "MMapIter too small for the iterator");
+static_assert(alignof(IterState) <= alignof(MMapIter),
+              "MMapIter not aligned for the iterator");
+static_assert(std::is_trivially_destructible_v<IterState>,
+              "MMapIter is never destroyed");
+
+struct FrozenIterState {
+  const MMapFrozen *frozen;
+  mmap::FrozenAddrSpace::const_iterator it;
+};
+
+static_assert(sizeof(FrozenIterState) <= sizeof(MMapIter),
+              "MMapIter too small for the frozen iterator");
+static_assert(alignof(FrozenIterState) <= alignof(MMapIter),
+              "MMapIter not aligned for the frozen iterator");
+static_assert(std::is_trivially_destructible_v<FrozenIterState>,
+              "MMapIter is never destroyed");
+
+} // namespace
+
+void mmap_iter_begin(const struct MMapAddrSpace *mm, uintptr_t addr,
+                     struct MMapIter *it) {
+  new (it->opaque) IterState{mm, mm->impl.begin_from(addr)};
+}
+
+bool mmap_iter_next(struct MMapIter *it, struct MMapRegion *region) {
+  auto *st = std::launder(reinterpret_cast<IterState *>(it->opaque));
+  if (st->it == st->mm->impl.end())
+    return false;
+  mmap::Region r = *st->it;
+  ++st->it;
+  *region = {r.start, r.len, to_c(r.info)};
+  return true;
+}
+
+size_t mmap_read_maps(const struct MMapAddrSpace *mm,
+                      struct MMapMapsCursor *cursor, char *buf, size_t len,
+                      MMapMapsNameFn names, void *udata) {
+  mmap::MapsNameFn fn;
+  if (names) {
+    fn = [names, udata](uintptr_t start, size_t len, mmap::MapInfo info) {
+      struct MMapMapsName n = names(start, len, to_c(info), udata);
+      mmap::MapsName name;
+      name.path = n.path;
+      name.dev_major = n.dev_major;
+      name.dev_minor = n.dev_minor;
+      name.inode = n.inode;
+      return name;
+    };
+  }
+  mmap::MapsCursor c{cursor->addr, cursor->offset};
+  size_t n = mm->impl.read_maps(&c, buf, len, fn);
+  cursor->addr = c.addr;
+  cursor->offset = c.offset;
+  return n;
+}
+
+enum MMapError mmap_import_maps(struct MMapAddrSpace *mm, FILE *in,
+                                bool original) {
+  return to_c_error(mm->impl.import_maps(in, original));
+}
+
+enum MMapError mmap_load_regions(struct MMapAddrSpace *mm,
+                                 const struct MMapRegion *regions,
+                                 size_t count) {
+  std::vector<mmap::Region> rs;
+  try {
+    rs.resize(count);
+  } catch (const std::bad_alloc &) {
+    return MMAP_NOMEM;
+  }
+  for (size_t i = 0; i < count; i++) {
+    const struct MMapInfo &info = regions[i].info;
+    rs[i] = {regions[i].start,
+             regions[i].len,
+             {info.prot, info.flags, info.fd, info.offset, info.original}};
+  }
+  return to_c_error(mm->impl.load_regions(rs.data(), count));
+}
+
+static enum MMapDiffOp to_c_op(mmap::DiffOp op) {
+  switch (op) {
+  case mmap::DiffOp::kUnmap:
+    return MMAP_DIFF_UNMAP;
+  case mmap::DiffOp::kMap:
+    return MMAP_DIFF_MAP;
+  case mmap::DiffOp::kProtect:
+    return MMAP_DIFF_PROTECT;
+  }
+  return MMAP_DIFF_MAP;
+}
+
+enum MMapError mmap_diff(struct MMapAddrSpace *mm,
+                         const struct MMapAddrSpace *target, MMapDiffFn fn,
+                         void *udata, bool apply) {
+  mmap::DiffFn cb;
+  if (fn) {
+    cb = [fn, udata](mmap::DiffOp op, uintptr_t start, size_t len,
+                     mmap::MapInfo info) {
+      fn(to_c_op(op), start, len, to_c(info), udata);
+    };
+  }
+  return to_c_error(mm->impl.diff(target->impl, cb, apply));
+}
+
+bool mmap_begin_txn(struct MMapAddrSpace *mm) { return mm->impl.begin_txn(); }
+
+void mmap_commit(struct MMapAddrSpace *mm) { mm->impl.commit(); }
+
+void mmap_rollback(struct MMapAddrSpace *mm) { mm->impl.rollback(); }
+
+size_t mmap_serialize(const struct MMapAddrSpace *mm, uint8_t *buf,
+                      size_t len) {
+  return mm->impl.serialize(buf, len);
+}
+
+enum MMapError mmap_deserialize(struct MMapAddrSpace *mm, const uint8_t *data,
+                                size_t len) {
+  return to_c_error(mm->impl.deserialize(data, len));
+}
+
+size_t mmap_freeze(const struct MMapAddrSpace *mm, void *buf, size_t len) {
+  return mm->impl.freeze(buf, len);
+}
+
+struct MMapFrozen *mmap_frozen_open(const void *data, size_t len) {
+  auto *frozen = new (std::nothrow) MMapFrozen;
+  if (!frozen)
+    return nullptr;
+  if (!frozen->impl.open(data, len)) {
+    delete frozen;
+    return nullptr;
+  }
+  return frozen;
+}
+
+void mmap_frozen_close(struct MMapFrozen *frozen) { delete frozen; }
+
+bool mmap_frozen_query_page(const struct MMapFrozen *frozen, uintptr_t addr,
+                            struct MMapInfo *info) {
+  mmap::MapInfo cpp_info;
+  if (!frozen->impl.query_page(addr, &cpp_info))
+    return false;
+  *info = to_c(cpp_info);
+  return true;
+}
+
+void mmap_frozen_iter_begin(const struct MMapFrozen *frozen,
+                            struct MMapIter *it) {
+  new (it->opaque) FrozenIterState{frozen, frozen->impl.begin()};
+}
+
+bool mmap_frozen_iter_next(struct MMapIter *it, struct MMapRegion *region) {
+  auto *st = std::launder(reinterpret_cast<FrozenIterState *>(it->opaque));
+  if (st->it == st->frozen->impl.end())
+    return false;
+  mmap::Region r = *st->it;
+  ++st->it;
+  *region = {r.start, r.len, to_c(r.info)};
+  return true;
+}
+
+enum MMapError mmap_thaw(struct MMapAddrSpace *mm,
+                         const struct MMapFrozen *frozen) {
+  return to_c_error(mm->impl.thaw(frozen->impl));
+}
+
+void mmap_freeze_regions(struct MMapAddrSpace *mm) {
+  mm->impl.freeze_regions();
+}
+
+static enum MMapSharedRead to_c_read(mmap::SharedRead res) {
+  switch (res) {
+  case mmap::SharedRead::kOk:
+    return MMAP_SHARED_OK;
+  case mmap::SharedRead::kBusy:
+    return MMAP_SHARED_BUSY;
+  case mmap::SharedRead::kStale:
+    return MMAP_SHARED_STALE;
+  }
+  return MMAP_SHARED_BUSY;
+}
+
+size_t mmap_shared_size(size_t regions) {
+  return mmap::shared_arena_size(regions);
+}
+
+bool mmap_share(struct MMapAddrSpace *mm, void *arena, size_t len) {
+  return mm->impl.share(arena, len);
+}
+
+struct MMapShared *mmap_shared_open(const void *arena, size_t len) {
+  auto *shared = new (std::nothrow) MMapShared;
+  if (!shared)
+    return nullptr;
+  if (!shared->impl.open(arena, len)) {
+    delete shared;
+    return nullptr;
+  }
+  return shared;
+}
+
+void mmap_shared_close(struct MMapShared *shared) { delete shared; }
+
+enum MMapSharedRead mmap_shared_query_page(const struct MMapShared *shared,
+                                           uintptr_t addr,
+                                           struct MMapInfo *info,
+                                           bool *found) {
+  mmap::MapInfo cpp_info;
+  auto res = shared->impl.query_page(addr, &cpp_info, found);
+  if (res == mmap::SharedRead::kOk && *found)
+    *info = to_c(cpp_info);
+  return to_c_read(res);
+}
+
+static void to_c(const mmap::Usage &u, struct MMapUsage *usage) {
+  usage->mapped_pages = u.mapped_pages;
+  memcpy(usage->prot_pages, u.prot_pages, sizeof(usage->prot_pages));
+  usage->regions = u.regions;
+  usage->largest_gap = u.largest_gap;
+}
+
+enum MMapSharedRead mmap_shared_usage(const struct MMapShared *shared,
+                                      struct MMapUsage *usage) {
+  mmap::Usage u;
+  auto res = shared->impl.usage(&u);
+  if (res == mmap::SharedRead::kOk)
+    to_c(u, usage);
+  return to_c_read(res);
+}
+
+enum MMapSharedRead mmap_shared_regions(const struct MMapShared *shared,
+                                        struct MMapRegion *out, size_t max,
+                                        size_t *count) {
+  return to_c_read(
+      shared->impl.regions(max, count, [out](size_t i, mmap::Region r) {
+        out[i] = {r.start, r.len, to_c(r.info)};
+      }));
+}
+
+static_assert(MMAP_PROT_CLASSES == mmap::kProtClasses,
+              "prot classes out of sync");
+
+void mmap_usage(const struct MMapAddrSpace *mm, struct MMapUsage *usage) {
+  to_c(mm->impl.usage(), usage);
+}
+
+void mmap_set_limit(struct MMapAddrSpace *mm, size_t bytes) {
+  mm->impl.set_limit(bytes);
+}
+
+enum MMapError mmap_map_error(const struct MMapAddrSpace *mm) {
+  return to_c_error(mm->impl.map_error());
+}
+
+static_assert(MMAP_STAT_OPS == mmap::kNumStatOps, "stat ops out of sync");
+static_assert(MMAP_STAT_BUCKETS == mmap::kLatencyBuckets,
+              "latency buckets out of sync");
+
+void mmap_stats(const struct MMapAddrSpace *mm, struct MMapStats *stats) {
+  mmap::Stats st = mm->impl.stats();
+  for (size_t i = 0; i < mmap::kNumStatOps; i++) {
+    stats->ops[i].count = st.ops[i].count;
+    stats->ops[i].nodes_visited = st.ops[i].nodes_visited;
+    memcpy(stats->ops[i].latency_ns, st.ops[i].latency_ns,
+           sizeof(stats->ops[i].latency_ns));
+  }
+  stats->splits = st.splits;
+  stats->merges = st.merges;
+  stats->callbacks = st.callbacks;
+  stats->hint_misses = st.hint_misses;
+  stats->regions = st.regions;
+}
+
+void mmap_stats_reset(struct MMapAddrSpace *mm) { mm->impl.reset_stats(); }
@@ -4,12 +4,15 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 struct MMapAddrSpace;
+struct MMapFrozen;
+struct MMapShared;
 
 struct MMapInfo {
   int prot;
@@ -23,11 +26,96 @@ enum MMapError {
   MMAP_OK = 0,
   MMAP_INVAL = 1,
   MMAP_NOMEM = 2,
+  // mmap_map_at_noreplace found part of the range mapped.
+  MMAP_EXISTS = 3,
+};
+
+// Operations counted by mmap_stats.
+enum MMapStatOp {
+  MMAP_STAT_MAP_ANY,
+  MMAP_STAT_MAP_AT,
+  MMAP_STAT_UNMAP,
+  MMAP_STAT_PROTECT,
+  MMAP_STAT_QUERY_PAGE,
+  MMAP_STAT_MARK_ORIGINAL,
+  MMAP_STAT_UNMAP_NON_ORIGINAL,
+  MMAP_STAT_SET_ATTR,
+  MMAP_STAT_OPS,
+};
+
+#define MMAP_STAT_BUCKETS 32
+
+struct MMapOpStats {
+  uint64_t count;
+  uint64_t nodes_visited;
+  // Bucket i counts calls that took [2^i, 2^(i+1)) nanoseconds.
+  uint64_t latency_ns[MMAP_STAT_BUCKETS];
+};
+
+struct MMapStats {
+  struct MMapOpStats ops[MMAP_STAT_OPS];
+  uint64_t splits;
+  uint64_t merges;
+  uint64_t callbacks;
+  uint64_t hint_misses;
+  uint64_t regions;
+};
+
+#define MMAP_PROT_CLASSES 8
+
+// Totals in pages. prot_pages is indexed by prot & (MMAP_PROT_CLASSES - 1).
+struct MMapUsage {
+  uint64_t mapped_pages;
+  uint64_t prot_pages[MMAP_PROT_CLASSES];
+  uint64_t regions;
+  uint64_t largest_gap;
+};
+
+struct MMapRegion {
+  uintptr_t start;
+  size_t len;
+  struct MMapInfo info;
+};
+
+// Region iterator state, filled in by mmap_iter_begin. Treat it as opaque;
+// it lives wherever the caller puts it, so iterating never allocates.
+struct MMapIter {
+  uint64_t opaque[6];
+};
+
+// The file a region is shown as mapping in mmap_read_maps.
+struct MMapMapsName {
+  const char *path;
+  uint32_t dev_major;
+  uint32_t dev_minor;
+  uint64_t inode;
+};
+
+typedef struct MMapMapsName (*MMapMapsNameFn)(uintptr_t start, size_t len,
+                                              struct MMapInfo info,
+                                              void *udata);
+
+// Position in a maps listing. Zero it to start from the beginning.
+struct MMapMapsCursor {
+  uintptr_t addr;
+  size_t offset;
 };
 
 typedef void (*MMapUpdateFn)(uintptr_t start, size_t len, struct MMapInfo info,
                              void *udata);
 
+enum MMapDiffOp {
+  MMAP_DIFF_UNMAP = 0,
+  MMAP_DIFF_MAP = 1,
+  MMAP_DIFF_PROTECT = 2,
+};
+
+typedef void (*MMapDiffFn)(enum MMapDiffOp op, uintptr_t start, size_t len,
+                           struct MMapInfo info, void *udata);
+
+typedef void (*MMapAttrFn)(uintptr_t start, size_t len, uint64_t value,
+                           void *udata);
+
 struct MMapAddrSpace *mmap_create(uintptr_t start, size_t len, size_t pagesize);
 void mmap_destroy(struct MMapAddrSpace *mm);
 void mmap_reset(struct MMapAddrSpace *mm);
@@ -37,6 +125,11 @@ uintptr_t mmap_map_any(struct MMapAddrSpace *mm, uintptr_t hint, size_t len,
 uintptr_t mmap_map_at(struct MMapAddrSpace *mm, uintptr_t addr, size_t len,
                       int prot, int flags, int fd, int64_t offset,
                       MMapUpdateFn ufn, void *udata);
+// mmap_map_at for MAP_FIXED_NOREPLACE: fails, with mmap_map_error()
+// MMAP_EXISTS, if any page of the range is mapped.
+uintptr_t mmap_map_at_noreplace(struct MMapAddrSpace *mm, uintptr_t addr,
+                                size_t len, int prot, int flags, int fd,
+                                int64_t offset);
 
 enum MMapError mmap_unmap(struct MMapAddrSpace *mm, uintptr_t addr, size_t len,
                           MMapUpdateFn ufn, void *udata);
@@ -50,6 +143,126 @@ void mmap_mark_original(struct MMapAddrSpace *mm);
 void mmap_unmap_non_original(struct MMapAddrSpace *mm, MMapUpdateFn ufn,
                              void *udata);
 
+// Attribute layers: per-page values beside the regions (see
+// BasicAddrSpace::add_layer). mmap_add_layer returns the new layer's index.
+size_t mmap_add_layer(struct MMapAddrSpace *mm);
+enum MMapError mmap_set_attr(struct MMapAddrSpace *mm, size_t layer,
+                             uintptr_t addr, size_t len, uint64_t value);
+uint64_t mmap_attr(const struct MMapAddrSpace *mm, size_t layer,
+                   uintptr_t addr);
+enum MMapError mmap_for_each_attr(const struct MMapAddrSpace *mm, size_t layer,
+                                  uintptr_t addr, size_t len, MMapAttrFn fn,
+                                  void *udata);
+
+// Start iterating at the region containing 'addr', or the first one after
+// it. Any call that changes the mapping invalidates the iterator.
+void mmap_iter_begin(const struct MMapAddrSpace *mm, uintptr_t addr,
+                     struct MMapIter *it);
+// Store the next region in 'region' and return true, or return false once
+// every region has been seen.
+bool mmap_iter_next(struct MMapIter *it, struct MMapRegion *region);
+
+// Write the next part of a /proc/<pid>/maps listing into 'buf' and return
+// its length, or 0 once the listing is complete. 'names' may be NULL.
+size_t mmap_read_maps(const struct MMapAddrSpace *mm,
+                      struct MMapMapsCursor *cursor, char *buf, size_t len,
+                      MMapMapsNameFn names, void *udata);
+// Replace every mapping with the regions of the /proc/<pid>/maps listing
+// 'in', marking them original if 'original'. Returns MMAP_INVAL if the
+// listing cannot be read or parsed and MMAP_NOMEM if its regions exceed the
+// limit, leaving no mappings either way.
+enum MMapError mmap_import_maps(struct MMapAddrSpace *mm, FILE *in,
+                                bool original);
+// Replace every mapping with 'count' regions sorted by start, in O(n).
+// Returns MMAP_INVAL, changing nothing, if they overlap, are unsorted or
+// lie outside the address space, and MMAP_NOMEM if they exceed the limit.
+enum MMapError mmap_load_regions(struct MMapAddrSpace *mm,
+                                 const struct MMapRegion *regions,
+                                 size_t count);
+// Call 'fn' with the unmap, map and protect changes that turn 'mm' into
+// 'target', and make them too if 'apply'. Returns MMAP_INVAL if the two
+// were created with different parameters.
+enum MMapError mmap_diff(struct MMapAddrSpace *mm,
+                         const struct MMapAddrSpace *target, MMapDiffFn fn,
+                         void *udata, bool apply);
+
+// Group the following changes so that mmap_rollback can undo them. Returns
+// false if a transaction is already open.
+bool mmap_begin_txn(struct MMapAddrSpace *mm);
+void mmap_commit(struct MMapAddrSpace *mm);
+void mmap_rollback(struct MMapAddrSpace *mm);
+
+// Write the address space in a compact binary format to 'buf', writing at
+// most 'len' bytes, and return the full size; pass len 0 to size the buffer.
+size_t mmap_serialize(const struct MMapAddrSpace *mm, uint8_t *buf,
+                      size_t len);
+// Replace the whole state with the output of mmap_serialize. Returns
+// MMAP_INVAL, changing nothing, if the data is malformed.
+enum MMapError mmap_deserialize(struct MMapAddrSpace *mm, const uint8_t *data,
+                                size_t len);
+
+// Write a read-only image of the address space to the 8-byte aligned 'buf'
+// if it fits in 'len' bytes, and return the image size.
+size_t mmap_freeze(const struct MMapAddrSpace *mm, void *buf, size_t len);
+// View an image from mmap_freeze, such as one mmap()ed from a file, without
+// copying or parsing it. Returns NULL if it is not a valid image.
+struct MMapFrozen *mmap_frozen_open(const void *data, size_t len);
+void mmap_frozen_close(struct MMapFrozen *frozen);
+bool mmap_frozen_query_page(const struct MMapFrozen *frozen, uintptr_t addr,
+                            struct MMapInfo *info);
+// Iterate over the regions of a frozen image like mmap_iter_begin and
+// mmap_iter_next, from the first region, without allocating.
+void mmap_frozen_iter_begin(const struct MMapFrozen *frozen,
+                            struct MMapIter *it);
+bool mmap_frozen_iter_next(struct MMapIter *it, struct MMapRegion *region);
+// Replace the whole state with the regions of a frozen image, in O(n).
+enum MMapError mmap_thaw(struct MMapAddrSpace *mm,
+                         const struct MMapFrozen *frozen);
+// Make lookups faster until the next change to the mapping.
+void mmap_freeze_regions(struct MMapAddrSpace *mm);
+
+// Result of a read through struct MMapShared.
+enum MMapSharedRead {
+  MMAP_SHARED_OK = 0,
+  // The owner was mid-update on every retry, for example because it died.
+  MMAP_SHARED_BUSY = 1,
+  // The owner's regions do not fit in the arena.
+  MMAP_SHARED_STALE = 2,
+};
+
+// Bytes of arena that always hold 'regions' regions.
+size_t mmap_shared_size(size_t regions);
+// Publish the regions and usage to the 8-byte aligned 'arena', such as
+// MAP_SHARED memory, and keep it up to date for readers in other processes.
+// Returns false if it is too small. A NULL arena stops publishing.
+bool mmap_share(struct MMapAddrSpace *mm, void *arena, size_t len);
+// View an arena published by mmap_share, usually from another process.
+// Returns NULL if it is not one. Reads never block the owner.
+struct MMapShared *mmap_shared_open(const void *arena, size_t len);
+void mmap_shared_close(struct MMapShared *shared);
+enum MMapSharedRead mmap_shared_query_page(const struct MMapShared *shared,
+                                           uintptr_t addr,
+                                           struct MMapInfo *info,
+                                           bool *found);
+enum MMapSharedRead mmap_shared_usage(const struct MMapShared *shared,
+                                      struct MMapUsage *usage);
+// Copy up to 'max' regions in address order and set '*count' to the total.
+enum MMapSharedRead mmap_shared_regions(const struct MMapShared *shared,
+                                        struct MMapRegion *out, size_t max,
+                                        size_t *count);
+
+void mmap_usage(const struct MMapAddrSpace *mm, struct MMapUsage *usage);
+// Fail mmap_map_any and mmap_map_at with MMAP_NOMEM once more than 'bytes'
+// would be mapped. Zero removes the limit.
+void mmap_set_limit(struct MMapAddrSpace *mm, size_t bytes);
+// Why the last mmap_map_any or mmap_map_at call failed, or MMAP_OK.
+enum MMapError mmap_map_error(const struct MMapAddrSpace *mm);
+
+// Counters summed over all threads. Unless libmmap was built with
+// LIBMMAP_STATS, only 'regions' is nonzero.
+void mmap_stats(const struct MMapAddrSpace *mm, struct MMapStats *stats);
+void mmap_stats_reset(struct MMapAddrSpace *mm);
+
 #ifdef __cplusplus
 }
 #endif
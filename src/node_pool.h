@@ -0,0 +1,175 @@
+#ifndef LIBMMAP_NODE_POOL_H
+#define LIBMMAP_NODE_POOL_H
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+namespace mmap {
+
+// NodePool is a slab allocator for fixed-size nodes. Freed nodes are kept on
+// an intrusive free list and handed out again before any new slab memory is
+// touched. The node size is fixed by the first allocation; requests of any
+// other size fall through to the global allocator.
+//
+// release() forgets every outstanding node in O(1): slabs are retained and
+// reused from the start, so a pool that is repeatedly filled and released
+// stops allocating once it has reached its high-water mark.
+class NodePool {
+public:
+  NodePool() = default;
+  NodePool(const NodePool &) = delete;
+  NodePool &operator=(const NodePool &) = delete;
+  ~NodePool() {
+    Slab *s = head_;
+    while (s) {
+      Slab *next = s->next;
+      ::operator delete(s);
+      s = next;
+    }
+  }
+
+  void *allocate(size_t size) {
+    if (node_size_ == 0)
+      node_size_ = round_size(size);
+    if (round_size(size) != node_size_)
+      return ::operator new(size);
+
+    if (free_) {
+      FreeNode *n = free_;
+      free_ = n->next;
+      return n;
+    }
+    if (!cur_ || used_ == cur_->cap) {
+      if (cur_ && cur_->next) {
+        cur_ = cur_->next;
+      } else {
+        Slab *s = new_slab();
+        if (cur_)
+          cur_->next = s;
+        else
+          head_ = s;
+        cur_ = s;
+      }
+      used_ = 0;
+    }
+    return cur_->data() + node_size_ * used_++;
+  }
+
+  void deallocate(void *p, size_t size) {
+    if (round_size(size) != node_size_) {
+      ::operator delete(p);
+      return;
+    }
+    auto *n = static_cast<FreeNode *>(p);
+    n->next = free_;
+    free_ = n;
+  }
+
+  // Forget all outstanding nodes. The caller must not touch any node handed
+  // out before the release.
+  void release() {
+    cur_ = head_;
+    used_ = 0;
+    free_ = nullptr;
+  }
+
+private:
+  static constexpr size_t kMinSlabNodes = 16;
+  static constexpr size_t kMaxSlabNodes = 4096;
+
+  struct FreeNode {
+    FreeNode *next;
+  };
+
+  struct alignas(std::max_align_t) Slab {
+    Slab *next;
+    size_t cap;
+
+    char *data() { return reinterpret_cast<char *>(this + 1); }
+  };
+
+  static size_t round_size(size_t size) {
+    const size_t align = alignof(std::max_align_t);
+    if (size < sizeof(FreeNode))
+      size = sizeof(FreeNode);
+    return (size + align - 1) & ~(align - 1);
+  }
+
+  Slab *new_slab() {
+    size_t cap = last_cap_ ? last_cap_ * 2 : kMinSlabNodes;
+    if (cap > kMaxSlabNodes)
+      cap = kMaxSlabNodes;
+    last_cap_ = cap;
+    void *mem = ::operator new(sizeof(Slab) + node_size_ * cap);
+    return new (mem) Slab{nullptr, cap};
+  }
+
+  Slab *head_ = nullptr;
+  Slab *cur_ = nullptr;
+  size_t used_ = 0;
+  size_t last_cap_ = 0;
+  size_t node_size_ = 0;
+  FreeNode *free_ = nullptr;
+};
+
+// PoolAllocator adapts a NodePool to the standard allocator interface so that
+// node-based containers can draw from it. A default-constructed PoolAllocator
+// has no pool and uses the global allocator.
+template <class T> class PoolAllocator {
+public:
+  using value_type = T;
+  // Containers must never carry nodes between pools, so a copy keeps its own
+  // allocator, while a move takes the nodes' allocator along with them.
+  using propagate_on_container_copy_assignment = std::false_type;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::false_type;
+
+  PoolAllocator() = default;
+  explicit PoolAllocator(NodePool *pool) : pool_(pool) {}
+  template <class U>
+  PoolAllocator(const PoolAllocator<U> &other) : pool_(other.pool()) {}
+
+  T *allocate(size_t n) {
+    if (pool_ && n == 1)
+      return static_cast<T *>(pool_->allocate(sizeof(T)));
+    return static_cast<T *>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(T *p, size_t n) {
+    if (pool_ && n == 1)
+      pool_->deallocate(p, sizeof(T));
+    else
+      ::operator delete(p);
+  }
+
+  // A copied container draws from the global allocator, since a pool serves
+  // only one container.
+  PoolAllocator select_on_container_copy_construction() const {
+    return PoolAllocator();
+  }
+
+  // Whether release() can drop this allocator's nodes in bulk.
+  bool can_release() const { return pool_ != nullptr; }
+
+  // Drop every node allocated from the pool in O(1). Only valid when a single
+  // container draws from the pool and it has already forgotten its nodes.
+  void release() { pool_->release(); }
+
+  NodePool *pool() const { return pool_; }
+
+  template <class U> bool operator==(const PoolAllocator<U> &other) const {
+    return pool_ == other.pool();
+  }
+  template <class U> bool operator!=(const PoolAllocator<U> &other) const {
+    return pool_ != other.pool();
+  }
+
+private:
+  NodePool *pool_ = nullptr;
+};
+
+} // namespace mmap
+
+#endif // LIBMMAP_NODE_POOL_H
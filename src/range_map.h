@@ -1,10 +1,23 @@
 #ifndef LIBMMAP_RANGE_MAP_H
 #define LIBMMAP_RANGE_MAP_H
 
+#include "eytzinger.h"
+#include "key_search.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cstddef>
+#include <cstdint>
 #include <functional>
+#include <iterator>
 #include <map>
+#include <memory>
+#include <new>
 #include <optional>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 namespace mmap {
@@ -17,103 +30,404 @@ template <class K, class V> struct Entry {
   bool empty() const { return start >= end; }
 };
 
-template <class K, class V> class RangeMap {
+namespace detail {
+
+template <class A, class = void> struct can_bulk_release : std::false_type {};
+template <class A>
+struct can_bulk_release<A, std::void_t<decltype(std::declval<A &>().release()),
+                                       decltype(std::declval<const A &>()
+                                                    .can_release())>>
+    : std::true_type {};
+
+} // namespace detail
+
+// RangeMap stores its tree nodes through 'Alloc', which is rebound to the node
+// type. An allocator that provides can_release() and release() (such as
+// PoolAllocator) lets clear() drop every node in O(1) instead of walking the
+// tree.
+//
+// Up to 'InlineCap' entries are kept in sorted arrays inside the object, so a
+// small map never allocates. The first insert or remove that would exceed the
+// inline capacity moves every entry into the tree, where they stay until the
+// next clear(). V must be default-constructible when InlineCap is nonzero
+// or the map is frozen.
+//
+// freeze() copies a spilled map's entries into read-only arrays in
+// Eytzinger order, which lookups then search instead of the tree. The tree
+// is kept, so the next write only has to drop the arrays.
+//
+// The searching calls take an optional Hint, a finger into the tree that
+// they set to where they finished. Passed to the next call, it lets that
+// call walk over at most kFingerSteps entries from there instead of
+// searching from the root, so work that moves through the map in address
+// order costs O(1) amortized per call.
+template <class K, class V, class Alloc = std::allocator<Entry<K, V>>,
+          size_t InlineCap = 16>
+class RangeMap {
+  using MapValue = std::pair<const K, std::pair<K, V>>;
+  using MapAlloc =
+      typename std::allocator_traits<Alloc>::template rebind_alloc<MapValue>;
+  using MapType =
+      std::map<K, std::pair<K, V>, detail::CountingLess<K>, MapAlloc>;
+
 public:
-  bool empty() const { return Map_.empty(); }
-  size_t size() const { return Map_.size(); }
-  void clear() { Map_.clear(); }
+  RangeMap() = default;
+  explicit RangeMap(const Alloc &alloc) : Map_(MapAlloc(alloc)) {}
+
+  // Entries a hinted call walks from its hint before it gives up and
+  // searches from the root.
+  static constexpr int kFingerSteps = 2;
+
+  // Position in a spilled map, set by a hinted call. Any change made to the
+  // map without the hint, or a hint from another map, makes it stale, and a
+  // stale or default-constructed hint only costs the usual search.
+  class Hint {
+  public:
+    Hint() = default;
+
+  private:
+    friend class RangeMap;
+    uint64_t id_ = 0;
+    uint64_t epoch_ = 0;
+    typename MapType::const_iterator it_{};
+  };
+
+  bool empty() const { return size() == 0; }
+  size_t size() const { return spilled_ ? Map_.size() : nflat_; }
+
+  void clear() {
+    thaw();
+    epoch_.n++;
+    nflat_ = 0;
+    spilled_ = false;
+    if constexpr (detail::can_bulk_release<MapAlloc>::value &&
+                  std::is_trivially_destructible_v<K> &&
+                  std::is_trivially_destructible_v<V>) {
+      MapAlloc alloc = Map_.get_allocator();
+      if (alloc.can_release()) {
+        // The nodes hold nothing that needs destroying, so abandon them and
+        // reuse the storage for an empty map; the pool reclaims the nodes.
+        new (&Map_) MapType(alloc);
+        alloc.release();
+        return;
+      }
+    }
+    Map_.clear();
+  }
 
   // Find the entry containing the point 'key', or std::nullopt.
-  std::optional<Entry<K, V>> find(K key) const {
-    auto it = Map_.upper_bound(key);
-    if (it == Map_.begin())
-      return std::nullopt;
-    --it;
-    if (key < it->second.first)
+  std::optional<Entry<K, V>> find(K key, Hint *hint = nullptr) const {
+    typename MapType::const_iterator it;
+    bool near = near_overlap_begin(key, hint, &it);
+    if (!near && frozen()) {
+      uint64_t k = frozen_upper(key);
+      if (k == 0 || !(key < fends_[k]))
+        return std::nullopt;
+      return Entry<K, V>{fstarts_[k], fends_[k], fvals_[k]};
+    }
+    if (!spilled_) {
+      size_t i = flat_upper(key);
+      if (i == 0 || !(key < ends_[i - 1]))
+        return std::nullopt;
+      return Entry<K, V>{starts_[i - 1], ends_[i - 1], vals_[i - 1]};
+    }
+    if (!near) {
+      it = Map_.upper_bound(key);
+      if (it != Map_.begin())
+        --it;
+    }
+    set_hint(hint, it);
+    if (it != Map_.end() && !(key < it->first) && key < it->second.first)
       return Entry<K, V>{it->first, it->second.first, it->second.second};
     return std::nullopt;
   }
 
   // Insert range [start, end) with the given value. Overlapping ranges are
   // split or removed. Adjacent ranges with equal values are coalesced.
-  void insert(K start, K end, V val) {
-    if (start >= end)
-      return;
-
-    auto it = overlap_begin(start);
+  void insert(K start, K end, V val, Hint *hint = nullptr) {
+    K lo, hi;
+    replace(start, end, val, [](const Entry<K, V> &) {}, &lo, &hi, hint);
+  }
 
-    std::optional<std::pair<K, std::pair<K, V>>> left_stub;
-    std::optional<std::pair<K, std::pair<K, V>>> right_stub;
+  // Insert as insert() does, first calling fn(entry) for each entry that
+  // [start, end) overlaps, in order and unclipped. If fn returns false the
+  // map is left unchanged and replace() returns false. '*lo' is set to the
+  // end of the entry before the overlapped ones and '*hi' to the start of
+  // the entry after them, where there is one. The entries are found with a
+  // single search, and the overlapped ones are split, erased and replaced
+  // through the iterators it returns. The map must not be modified from
+  // within fn.
+  template <class Fn>
+  bool replace(K start, K end, V val, Fn fn, K *lo, K *hi,
+               Hint *hint = nullptr) {
+    if (start >= end)
+      return true;
 
-    while (it != Map_.end() && it->first < end) {
-      K e_start = it->first;
-      K e_end = it->second.first;
-      V e_val = it->second.second;
+    bool reported = false;
+    if (!spilled_) {
+      size_t i = flat_overlap_begin(start);
+      size_t j = i;
+      for (; j < nflat_ && starts_[j] < end; j++) {
+        if (!visit(fn, Entry<K, V>{starts_[j], ends_[j], vals_[j]}))
+          return false;
+      }
+      if (i > 0)
+        *lo = ends_[i - 1];
+      if (j < nflat_)
+        *hi = starts_[j];
 
-      if (e_start < start)
-        left_stub = {e_start, {start, e_val}};
-      if (e_end > end)
-        right_stub = {end, {e_end, e_val}};
+      Stubs stubs;
+      if (i < j && starts_[i] < start)
+        stubs.push(starts_[i], start, vals_[i]);
+      size_t pos = stubs.n;
+      stubs.push(start, end, val);
+      if (i < j && ends_[j - 1] > end)
+        stubs.push(end, ends_[j - 1], vals_[j - 1]);
 
-      it = Map_.erase(it);
+      if (nflat_ - (j - i) + stubs.n <= InlineCap) {
+        detail::count_splits(stubs.n - 1);
+        flat_splice(i, j, stubs);
+        flat_coalesce(i + pos);
+        return true;
+      }
+      spill();
+      reported = true;
     }
 
-    if (left_stub)
-      Map_.insert(*left_stub);
-    if (right_stub)
-      Map_.insert(*right_stub);
+    // A frozen map still has its tree, so only a change needs to thaw it.
+    auto first = to_mutable(overlap_begin(start, hint));
+    auto last = first;
+    for (; last != Map_.end() && last->first < end; ++last) {
+      detail::count_visits();
+      if (!reported && !visit(fn, Entry<K, V>{last->first, last->second.first,
+                                              last->second.second}))
+        return false;
+    }
+    if (first != Map_.begin())
+      *lo = std::prev(first)->second.first;
+    if (last != Map_.end())
+      *hi = last->first;
+    thaw();
+    epoch_.n++;
 
-    auto res = Map_.insert({start, {end, val}});
-    coalesce(res.first);
+    std::optional<std::pair<K, std::pair<K, V>>> right_stub;
+    int splits = 0;
+    if (first != last) {
+      auto back = std::prev(last);
+      if (end < back->second.first)
+        right_stub = {end, back->second};
+      if (first->first < start) {
+        // Trim the first entry in place rather than erase and reinsert it.
+        first->second.first = start;
+        ++first;
+        splits++;
+      }
+    }
+    auto pos = Map_.erase(first, last);
+    if (right_stub) {
+      pos = Map_.emplace_hint(pos, right_stub->first, right_stub->second);
+      splits++;
+    }
+    detail::count_splits(splits);
+    set_hint(hint,
+             coalesce(Map_.emplace_hint(pos, start, std::make_pair(end, val))));
+    return true;
   }
 
   // Remove all mappings within [start, end). Partially overlapping ranges
   // are trimmed/split.
-  void remove(K start, K end) {
+  void remove(K start, K end, Hint *hint = nullptr) {
     if (start >= end)
       return;
+    thaw();
 
-    auto it = overlap_begin(start);
+    if (!spilled_) {
+      size_t i = flat_overlap_begin(start);
+      size_t j = i;
+      while (j < nflat_ && starts_[j] < end)
+        j++;
+      if (i == j)
+        return;
 
-    std::optional<std::pair<K, std::pair<K, V>>> left_stub;
-    std::optional<std::pair<K, std::pair<K, V>>> right_stub;
+      Stubs stubs;
+      if (starts_[i] < start)
+        stubs.push(starts_[i], start, vals_[i]);
+      if (ends_[j - 1] > end)
+        stubs.push(end, ends_[j - 1], vals_[j - 1]);
 
-    while (it != Map_.end() && it->first < end) {
-      K e_start = it->first;
-      K e_end = it->second.first;
-      V e_val = it->second.second;
+      if (nflat_ - (j - i) + stubs.n <= InlineCap) {
+        detail::count_splits(stubs.n);
+        flat_splice(i, j, stubs);
+        return;
+      }
+      spill();
+    }
 
-      if (e_start < start)
-        left_stub = {e_start, {start, e_val}};
-      if (e_end > end)
-        right_stub = {end, {e_end, e_val}};
+    auto first = to_mutable(overlap_begin(start, hint));
+    auto last = first;
+    for (; last != Map_.end() && last->first < end; ++last)
+      detail::count_visits();
+    if (first == last)
+      return;
+    epoch_.n++;
 
-      it = Map_.erase(it);
+    // As in replace(), the first entry is trimmed in place and the rest of
+    // the last one goes back next to where it was.
+    std::optional<std::pair<K, std::pair<K, V>>> right_stub;
+    auto back = std::prev(last);
+    if (end < back->second.first)
+      right_stub = {end, back->second};
+    int splits = 0;
+    if (first->first < start) {
+      first->second.first = start;
+      ++first;
+      splits++;
     }
-
-    if (left_stub)
-      Map_.insert(*left_stub);
-    if (right_stub)
-      Map_.insert(*right_stub);
+    auto pos = Map_.erase(first, last);
+    if (right_stub) {
+      pos = Map_.emplace_hint(pos, right_stub->first, right_stub->second);
+      splits++;
+    }
+    detail::count_splits(splits);
+    set_hint(hint, pos);
   }
 
   // Return true if any stored range overlaps [start, end).
   bool overlaps(K start, K end) const {
     if (start >= end)
       return false;
+    if (frozen()) {
+      uint64_t k = frozen_overlap_begin(start);
+      return k != 0 && fstarts_[k] < end;
+    }
+    if (!spilled_) {
+      size_t i = flat_overlap_begin(start);
+      return i < nflat_ && starts_[i] < end;
+    }
     auto it = overlap_begin(start);
     return it != Map_.end() && it->first < end;
   }
 
+  // Return the first entry overlapping [start, end), or std::nullopt.
+  std::optional<Entry<K, V>> first_overlapping(K start, K end,
+                                               Hint *hint = nullptr) const {
+    std::optional<Entry<K, V>> result;
+    for_each_overlapping(
+        start, end,
+        [&](const Entry<K, V> &e) {
+          result = e;
+          return false;
+        },
+        hint);
+    return result;
+  }
+
+  // Call fn(entry) for each entry overlapping [start, end), in order. The
+  // walk stops early if fn returns false. The map must not be modified from
+  // within fn.
+  template <class Fn>
+  void for_each_overlapping(K start, K end, Fn fn, Hint *hint = nullptr) const {
+    if (start >= end)
+      return;
+    typename MapType::const_iterator it;
+    bool near = near_overlap_begin(start, hint, &it);
+    if (!near && frozen()) {
+      uint64_t n = fstarts_.size() - 1;
+      for (uint64_t k = frozen_overlap_begin(start);
+           k != 0 && fstarts_[k] < end; k = detail::eytzinger_next(k, n)) {
+        if (!visit(fn, Entry<K, V>{fstarts_[k], fends_[k], fvals_[k]}))
+          return;
+      }
+      return;
+    }
+    if (!spilled_) {
+      for (size_t i = flat_overlap_begin(start); i < nflat_ && starts_[i] < end;
+           i++) {
+        if (!visit(fn, Entry<K, V>{starts_[i], ends_[i], vals_[i]}))
+          return;
+      }
+      return;
+    }
+    if (!near)
+      it = overlap_begin(start);
+    set_hint(hint, it);
+    for (; it != Map_.end() && it->first < end; ++it) {
+      detail::count_visits();
+      if (!visit(fn, Entry<K, V>{it->first, it->second.first,
+                                 it->second.second}))
+        return;
+    }
+  }
+
+  // Call fn(entry) for each entry in order, starting from the last one that
+  // starts below 'key', or from the first if there is none. This finds an
+  // entry's neighbors without a second search. The walk stops early if fn
+  // returns false. The map must not be modified from within fn.
+  template <class Fn>
+  void for_each_from(K key, Fn fn, Hint *hint = nullptr) const {
+    typename MapType::const_iterator it;
+    bool near = near_overlap_begin(key, hint, &it);
+    if (!near && frozen()) {
+      uint64_t n = fstarts_.size() - 1;
+      detail::count_visits();
+      uint64_t k = detail::eytzinger_search<false>(fstarts_.data(), n, key);
+      for (k = k ? k : detail::eytzinger_first(n); k != 0;
+           k = detail::eytzinger_next(k, n)) {
+        if (!visit(fn, Entry<K, V>{fstarts_[k], fends_[k], fvals_[k]}))
+          return;
+      }
+      return;
+    }
+    if (!spilled_) {
+      size_t i = flat_lower(key);
+      for (i = i > 0 ? i - 1 : 0; i < nflat_; i++) {
+        if (!visit(fn, Entry<K, V>{starts_[i], ends_[i], vals_[i]}))
+          return;
+      }
+      return;
+    }
+    if (!near)
+      it = Map_.lower_bound(key);
+    else if (it != Map_.end() && it->first < key)
+      ++it;
+    // 'it' is now the first entry starting at or after 'key'.
+    if (it != Map_.begin())
+      --it;
+    set_hint(hint, it);
+    for (; it != Map_.end(); ++it) {
+      detail::count_visits();
+      if (!visit(fn, Entry<K, V>{it->first, it->second.first,
+                                 it->second.second}))
+        return;
+    }
+  }
+
   // Return all entries overlapping [start, end).
   std::vector<Entry<K, V>> get_overlapping(K start, K end) const {
     std::vector<Entry<K, V>> result;
+    for_each_overlapping(start, end,
+                         [&](const Entry<K, V> &e) { result.push_back(e); });
+    return result;
+  }
+
+  // Return the start of the first gap within [start, end) that is at least
+  // 'len' long, or std::nullopt if there is none.
+  std::optional<K> find_gap(K start, K end, K len) const {
+    std::optional<K> result;
     if (start >= end)
       return result;
-    for (auto it = overlap_begin(start); it != Map_.end() && it->first < end;
-         ++it) {
-      result.push_back({it->first, it->second.first, it->second.second});
-    }
+    K cursor = start;
+    for_each_overlapping(start, end, [&](const Entry<K, V> &e) {
+      if (e.start > cursor && e.start - cursor >= len) {
+        result = cursor;
+        return false;
+      }
+      if (e.end > cursor)
+        cursor = e.end;
+      return true;
+    });
+    if (!result && cursor < end && end - cursor >= len)
+      result = cursor;
     return result;
   }
 
@@ -123,13 +437,12 @@ public:
     if (start >= end)
       return result;
     K cursor = start;
-    for (auto it = overlap_begin(start); it != Map_.end() && it->first < end;
-         ++it) {
-      if (it->first > cursor)
-        result.push_back({cursor, it->first});
-      if (it->second.first > cursor)
-        cursor = it->second.first;
-    }
+    for_each_overlapping(start, end, [&](const Entry<K, V> &e) {
+      if (e.start > cursor)
+        result.push_back({cursor, e.start});
+      if (e.end > cursor)
+        cursor = e.end;
+    });
     if (cursor < end)
       result.push_back({cursor, end});
     return result;
@@ -137,13 +450,349 @@ public:
 
   // Apply a function to every value in the map.
   void update_all(std::function<void(V &)> fn) {
-    for (auto &entry : Map_)
+    thaw();
+    if (!spilled_) {
+      for (size_t i = 0; i < nflat_; i++)
+        fn(vals_[i]);
+      return;
+    }
+    for (auto &entry : Map_) {
+      detail::count_visits();
       fn(entry.second.second);
+    }
+  }
+
+  // Add [start, end) after every stored range, so 'start' must be at or
+  // after the end of the last one. Like insert() it coalesces with an equal
+  // neighbor, but it never searches: each call is O(1) amortized, so a map
+  // can be built from sorted ranges in O(n).
+  void append(K start, K end, V val) {
+    if (start >= end)
+      return;
+    thaw();
+    if (!spilled_) {
+      if (nflat_ > 0 && ends_[nflat_ - 1] == start &&
+          vals_[nflat_ - 1] == val) {
+        ends_[nflat_ - 1] = end;
+        detail::count_merge();
+        return;
+      }
+      if (nflat_ < InlineCap) {
+        starts_[nflat_] = start;
+        ends_[nflat_] = end;
+        vals_[nflat_] = val;
+        nflat_++;
+        return;
+      }
+      spill();
+    }
+    if (!Map_.empty()) {
+      auto last = std::prev(Map_.end());
+      if (last->second.first == start && last->second.second == val) {
+        last->second.first = end;
+        detail::count_merge();
+        return;
+      }
+    }
+    Map_.emplace_hint(Map_.end(), start, std::make_pair(end, val));
+  }
+
+  // Replace the contents with the entries in [first, last), which must be
+  // nonempty and sorted by start without overlapping. Adjacent entries with
+  // equal values are coalesced. The map is built in one pass, in O(n) rather
+  // than the O(n log n) of inserting them one at a time. Returns false,
+  // leaving the map unchanged, if the input is not in that form.
+  template <class It> bool assign_sorted(It first, It last) {
+    std::optional<K> prev_end;
+    for (It it = first; it != last; ++it) {
+      Entry<K, V> e = *it;
+      if (e.empty() || (prev_end && e.start < *prev_end))
+        return false;
+      prev_end = e.end;
+    }
+    clear();
+    for (; first != last; ++first) {
+      Entry<K, V> e = *first;
+      append(e.start, e.end, e.val);
+    }
+    return true;
+  }
+
+  // Copy the entries into read-only arrays in Eytzinger order, aligned to
+  // cache lines, for find(), overlaps() and the overlap walks to search in
+  // place of the tree: each search is a branchless descent that prefetches
+  // the nodes three or four levels down, rather than a chain of dependent
+  // loads from scattered nodes. The first insert, remove, append,
+  // update_all or clear thaws the map, dropping the arrays in O(1); the
+  // tree is kept meanwhile, and iteration still walks it. O(n). Inline
+  // entries are already contiguous, so a map that has not spilled is left
+  // as it is.
+  void freeze() {
+    if (!spilled_ || Map_.empty())
+      return;
+    uint64_t n = Map_.size();
+    fstarts_.assign(n + 1, K());
+    fends_.assign(n + 1, K());
+    fvals_.assign(n + 1, V());
+    uint64_t k = detail::eytzinger_first(n);
+    for (auto &entry : Map_) {
+      fstarts_[k] = entry.first;
+      fends_[k] = entry.second.first;
+      fvals_[k] = entry.second.second;
+      k = detail::eytzinger_next(k, n);
+    }
+  }
+
+  // Drop the arrays built by freeze(), if any.
+  void thaw() {
+    if (!frozen())
+      return;
+    FrozenKeys().swap(fstarts_);
+    FrozenKeys().swap(fends_);
+    FrozenVals().swap(fvals_);
+  }
+
+  bool frozen() const { return !fstarts_.empty(); }
+
+  // Iterator over entries in order of start, yielding them by value. Each
+  // step is O(1) amortized and allocates nothing. Any change to the map
+  // invalidates it.
+  class const_iterator {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = Entry<K, V>;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = Entry<K, V>;
+
+    const_iterator() = default;
+
+    Entry<K, V> operator*() const {
+      if (!m_->spilled_)
+        return {m_->starts_[i_], m_->ends_[i_], m_->vals_[i_]};
+      return {it_->first, it_->second.first, it_->second.second};
+    }
+    const_iterator &operator++() {
+      if (!m_->spilled_) {
+        i_++;
+      } else {
+        detail::count_visits();
+        ++it_;
+      }
+      return *this;
+    }
+    const_iterator operator++(int) {
+      const_iterator old = *this;
+      ++*this;
+      return old;
+    }
+    bool operator==(const const_iterator &o) const {
+      if (!m_ || !o.m_)
+        return m_ == o.m_;
+      return m_->spilled_ ? it_ == o.it_ : i_ == o.i_;
+    }
+    bool operator!=(const const_iterator &o) const { return !(*this == o); }
+
+  private:
+    friend class RangeMap;
+    const_iterator(const RangeMap *m, size_t i,
+                   typename MapType::const_iterator it)
+        : m_(m), i_(i), it_(it) {}
+
+    const RangeMap *m_ = nullptr;
+    // Inline index, or tree position once the map has spilled.
+    size_t i_ = 0;
+    typename MapType::const_iterator it_{};
+  };
+
+  const_iterator begin() const { return {this, 0, Map_.begin()}; }
+  const_iterator end() const { return {this, nflat_, Map_.end()}; }
+
+  // Iterator to the entry containing 'key', or to the first entry after it.
+  const_iterator begin_from(K key) const {
+    if (!spilled_) {
+      size_t i = flat_upper(key);
+      if (i > 0 && key < ends_[i - 1])
+        i--;
+      return {this, i, Map_.end()};
+    }
+    auto it = Map_.upper_bound(key);
+    if (it != Map_.begin() && key < std::prev(it)->second.first)
+      --it;
+    return {this, 0, it};
   }
 
 private:
+  // Up to three entries that replace a run of inline entries.
+  struct Stubs {
+    K starts[3];
+    K ends[3];
+    V vals[3];
+    size_t n = 0;
+
+    void push(K start, K end, const V &val) {
+      starts[n] = start;
+      ends[n] = end;
+      vals[n] = val;
+      n++;
+    }
+  };
+
+  // Inline entries [0, nflat_) sorted by start, used until spilled_ is set.
+  // Starts are kept in their own array so searches scan contiguous keys.
+  std::array<K, InlineCap> starts_{};
+  std::array<K, InlineCap> ends_{};
+  std::array<V, InlineCap> vals_{};
+  size_t nflat_ = 0;
+  bool spilled_ = InlineCap == 0;
+
   // Each entry (Start, (End, Value)) represents range [Start, End).
-  std::map<K, std::pair<K, V>> Map_;
+  MapType Map_;
+
+  // The tree's entries in Eytzinger order from index 1 while frozen, and
+  // empty otherwise.
+  using FrozenKeys = std::vector<K, detail::CacheAlignedAllocator<K>>;
+  using FrozenVals = std::vector<V, detail::CacheAlignedAllocator<V>>;
+  FrozenKeys fstarts_;
+  FrozenKeys fends_;
+  FrozenVals fvals_;
+
+  // Names the tree as it is now, for checking hints: 'id' is unique to each
+  // map and 'n' is bumped by every change that may erase tree nodes. A copy
+  // or assignment takes a new id, and a move also counts as a change to the
+  // map moved from, since the nodes hints point at are not its own.
+  struct Epoch {
+    uint64_t id = next_id();
+    uint64_t n = 0;
+
+    Epoch() = default;
+    Epoch(const Epoch &) {}
+    Epoch(Epoch &&o) noexcept { o.n++; }
+    Epoch &operator=(const Epoch &) {
+      id = next_id();
+      return *this;
+    }
+    Epoch &operator=(Epoch &&o) noexcept {
+      id = next_id();
+      o.n++;
+      return *this;
+    }
+
+    static uint64_t next_id() {
+      static std::atomic<uint64_t> ids{1};
+      return ids.fetch_add(1, std::memory_order_relaxed);
+    }
+  };
+  Epoch epoch_;
+
+  // Invoke a visitor that may or may not return a continue flag.
+  template <class Fn> static bool visit(Fn &fn, const Entry<K, V> &e) {
+    if constexpr (std::is_void_v<decltype(fn(e))>) {
+      fn(e);
+      return true;
+    } else {
+      return fn(e);
+    }
+  }
+
+  static constexpr bool kVectorKeys =
+      std::is_same_v<K, uint64_t> || std::is_same_v<K, uint32_t>;
+
+  // Number of inline entries whose start is <= key. Keys with vector kernels
+  // use the ones chosen for this CPU.
+  size_t flat_upper(K key) const {
+    detail::count_visits();
+    if constexpr (kVectorKeys)
+      return key_search<K>().count_less_equal(starts_.data(), nflat_, key);
+    else
+      return detail::scalar_count_less_equal(starts_.data(), nflat_, key);
+  }
+
+  // Number of inline entries whose start is < key.
+  size_t flat_lower(K key) const {
+    detail::count_visits();
+    if constexpr (kVectorKeys)
+      return key_search<K>().count_less(starts_.data(), nflat_, key);
+    else
+      return detail::scalar_count_less(starts_.data(), nflat_, key);
+  }
+
+  // Index of the first inline entry that could overlap a range starting at
+  // 'start'.
+  size_t flat_overlap_begin(K start) const {
+    size_t i = flat_lower(start);
+    if (i > 0 && start < ends_[i - 1])
+      --i;
+    return i;
+  }
+
+  // Node of the last frozen entry whose start is <= key, or 0 if none.
+  uint64_t frozen_upper(K key) const {
+    detail::count_visits();
+    return detail::eytzinger_search<true>(fstarts_.data(), fstarts_.size() - 1,
+                                          key);
+  }
+
+  // Node of the first frozen entry that could overlap a range starting at
+  // 'start', or 0 if none.
+  uint64_t frozen_overlap_begin(K start) const {
+    uint64_t n = fstarts_.size() - 1;
+    uint64_t k = frozen_upper(start);
+    if (k == 0)
+      return detail::eytzinger_first(n);
+    return start < fends_[k] ? k : detail::eytzinger_next(k, n);
+  }
+
+  // Replace inline entries [i, j) with the given stubs.
+  void flat_splice(size_t i, size_t j, const Stubs &stubs) {
+    size_t n = nflat_ - (j - i) + stubs.n;
+    if (stubs.n > j - i) {
+      size_t shift = stubs.n - (j - i);
+      std::move_backward(starts_.begin() + j, starts_.begin() + nflat_,
+                         starts_.begin() + nflat_ + shift);
+      std::move_backward(ends_.begin() + j, ends_.begin() + nflat_,
+                         ends_.begin() + nflat_ + shift);
+      std::move_backward(vals_.begin() + j, vals_.begin() + nflat_,
+                         vals_.begin() + nflat_ + shift);
+    } else if (stubs.n < j - i) {
+      size_t to = i + stubs.n;
+      std::move(starts_.begin() + j, starts_.begin() + nflat_,
+                starts_.begin() + to);
+      std::move(ends_.begin() + j, ends_.begin() + nflat_, ends_.begin() + to);
+      std::move(vals_.begin() + j, vals_.begin() + nflat_, vals_.begin() + to);
+    }
+    for (size_t k = 0; k < stubs.n; k++) {
+      starts_[i + k] = stubs.starts[k];
+      ends_[i + k] = stubs.ends[k];
+      vals_[i + k] = stubs.vals[k];
+    }
+    nflat_ = n;
+  }
+
+  // Try to merge the inline entry at 'i' with its left and right neighbors.
+  void flat_coalesce(size_t i) {
+    Stubs none;
+    if (i + 1 < nflat_ && ends_[i] == starts_[i + 1] &&
+        vals_[i] == vals_[i + 1]) {
+      ends_[i] = ends_[i + 1];
+      flat_splice(i + 1, i + 2, none);
+      detail::count_merge();
+    }
+    if (i > 0 && ends_[i - 1] == starts_[i] && vals_[i - 1] == vals_[i]) {
+      ends_[i - 1] = ends_[i];
+      flat_splice(i, i + 1, none);
+      detail::count_merge();
+    }
+  }
+
+  // Move every inline entry into the tree.
+  void spill() {
+    for (size_t i = 0; i < nflat_; i++)
+      Map_.emplace_hint(Map_.end(), starts_[i],
+                        std::make_pair(ends_[i], vals_[i]));
+    nflat_ = 0;
+    spilled_ = true;
+  }
 
   // Return an iterator to the first entry that could overlap a range
   // starting at 'start'.
@@ -167,14 +816,65 @@ private:
     return it;
   }
 
-  // Try to merge the entry at 'it' with its left and right neighbors.
-  void coalesce(typename std::map<K, std::pair<K, V>>::iterator it) {
+  // Set '*out' to overlap_begin(start) by walking from 'hint', if it is
+  // current and the entry is at most kFingerSteps away. The entry sought is
+  // the first that ends after 'start'.
+  bool near_overlap_begin(K start, const Hint *hint,
+                          typename MapType::const_iterator *out) const {
+    if (!hint || hint->id_ != epoch_.id || hint->epoch_ != epoch_.n)
+      return false;
+    auto it = hint->it_;
+    bool forward = it != Map_.end() && !(start < it->second.first);
+    for (int i = 0; i < kFingerSteps; i++) {
+      detail::count_visits();
+      if (forward) {
+        if (++it == Map_.end() || start < it->second.first) {
+          *out = it;
+          return true;
+        }
+      } else {
+        if (it == Map_.begin() || !(start < std::prev(it)->second.first)) {
+          *out = it;
+          return true;
+        }
+        --it;
+      }
+    }
+    return false;
+  }
+
+  // overlap_begin(start), from 'hint' where it helps, and set 'hint' to it.
+  typename MapType::const_iterator overlap_begin(K start, Hint *hint) const {
+    typename MapType::const_iterator it;
+    if (!near_overlap_begin(start, hint, &it))
+      it = overlap_begin(start);
+    set_hint(hint, it);
+    return it;
+  }
+
+  void set_hint(Hint *hint, typename MapType::const_iterator it) const {
+    if (hint) {
+      hint->id_ = epoch_.id;
+      hint->epoch_ = epoch_.n;
+      hint->it_ = it;
+    }
+  }
+
+  // An empty erase turns a const_iterator into an iterator in O(1).
+  typename MapType::iterator to_mutable(typename MapType::const_iterator it) {
+    return Map_.erase(it, it);
+  }
+
+  // Try to merge the entry at 'it' with its left and right neighbors, and
+  // return the entry that holds it afterwards.
+  typename MapType::iterator coalesce(typename MapType::iterator it) {
     // Merge with right neighbor.
     auto right = std::next(it);
     if (right != Map_.end() && it->second.first == right->first &&
         it->second.second == right->second.second) {
       it->second.first = right->second.first;
       Map_.erase(right);
+      detail::count_merge();
     }
     // Merge with left neighbor.
     if (it != Map_.begin()) {
@@ -183,8 +883,11 @@ private:
           left->second.second == it->second.second) {
         left->second.first = it->second.first;
         Map_.erase(it);
+        detail::count_merge();
+        return left;
       }
     }
+    return it;
   }
 };
 
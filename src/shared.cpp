@@ -0,0 +1,405 @@
+#include "shared.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <new>
+#include <thread>
+
+namespace mmap {
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "shared words must be lock-free to work across processes");
+static_assert(sizeof(Usage) % 8 == 0, "Usage is copied as words");
+static_assert(sizeof(SharedHeader) % 8 == 0, "directory must be aligned");
+
+static const size_t kBlockBytes = kSharedBlock * sizeof(SharedEntry);
+
+// Readers give up after this many tries that overlapped an update.
+static const int kReadTries = 1 << 16;
+
+static size_t align64(size_t n) { return (n + 63) & ~(size_t)63; }
+
+static size_t blocks_offset(uint64_t nblocks) {
+  return align64(sizeof(SharedHeader) + sizeof(uint64_t) * nblocks);
+}
+
+size_t shared_arena_size(size_t regions) {
+  // Every block is at least half full unless it is the only one.
+  uint64_t nblocks = 2 * regions / kSharedBlock + 1;
+  return blocks_offset(nblocks) + nblocks * kBlockBytes;
+}
+
+static uint64_t load(const std::atomic<uint64_t> &w) {
+  return w.load(std::memory_order_relaxed);
+}
+
+static void store(std::atomic<uint64_t> &w, uint64_t v) {
+  w.store(v, std::memory_order_relaxed);
+}
+
+static Region load_entry(const SharedEntry &e) {
+  uint64_t start = load(e.words[0]);
+  uint64_t end = load(e.words[1]);
+  uint64_t prot_flags = load(e.words[3]);
+  uint64_t fd_original = load(e.words[4]);
+  MapInfo info{(int)(uint32_t)prot_flags, (int)(uint32_t)(prot_flags >> 32),
+               (int)(uint32_t)fd_original, (int64_t)load(e.words[2]),
+               (fd_original >> 32) != 0};
+  return {start, end - start, info};
+}
+
+static void store_entry(SharedEntry &e, const Region &r) {
+  store(e.words[0], r.start);
+  store(e.words[1], r.start + r.len);
+  store(e.words[2], (uint64_t)r.info.offset);
+  store(e.words[3],
+        (uint32_t)r.info.prot | (uint64_t)(uint32_t)r.info.flags << 32);
+  store(e.words[4],
+        (uint32_t)r.info.fd | (uint64_t)(r.info.original ? 1 : 0) << 32);
+}
+
+bool SharedAddrSpace::open(const void *data, size_t len) {
+  if (len < sizeof(SharedHeader) || (uintptr_t)data % alignof(uint64_t))
+    return false;
+  auto *hdr = static_cast<const SharedHeader *>(data);
+  if (memcmp(hdr->magic, kSharedMagic, sizeof(kSharedMagic)) != 0)
+    return false;
+  uint64_t nblocks = hdr->nblocks;
+  if (nblocks == 0 || nblocks > len / kBlockBytes ||
+      hdr->dir != sizeof(SharedHeader) ||
+      hdr->blocks != blocks_offset(nblocks) ||
+      hdr->blocks + nblocks * kBlockBytes > len)
+    return false;
+  auto *base = static_cast<const char *>(data);
+  hdr_ = hdr;
+  dir_ = reinterpret_cast<const std::atomic<uint64_t> *>(base + hdr->dir);
+  blocks_ = reinterpret_cast<const SharedEntry *>(base + hdr->blocks);
+  return true;
+}
+
+template <class Fn> SharedRead SharedAddrSpace::read(Fn fn) const {
+  for (int i = 0; i < kReadTries; i++) {
+    uint64_t seq = hdr_->seq.load(std::memory_order_acquire);
+    if (seq & 1) {
+      std::this_thread::yield();
+      continue;
+    }
+    bool stale = load(hdr_->count) == kSharedStale;
+    bool ok = stale || fn();
+    // Order the reads above before the second look at the sequence number.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (hdr_->seq.load(std::memory_order_relaxed) != seq)
+      continue;
+    if (stale)
+      return SharedRead::kStale;
+    if (ok)
+      return SharedRead::kOk;
+  }
+  return SharedRead::kBusy;
+}
+
+bool SharedAddrSpace::slot(uint64_t slot, uint64_t *block,
+                           uint64_t *n) const {
+  uint64_t w = load(dir_[slot]);
+  *block = (uint32_t)w;
+  *n = w >> 32;
+  return *block < hdr_->nblocks && *n >= 1 && *n <= kSharedBlock;
+}
+
+SharedRead SharedAddrSpace::query_page(uintptr_t addr, MapInfo *info,
+                                       bool *found) const {
+  return read([&] {
+    *found = false;
+    uint64_t used = load(hdr_->used);
+    if (used > hdr_->nblocks)
+      return false;
+    // Find the last block whose first region starts at or below 'addr',
+    // then the last such region in it.
+    uint64_t lo = 0, hi = used, b, n;
+    while (lo < hi) {
+      uint64_t mid = lo + (hi - lo) / 2;
+      if (!slot(mid, &b, &n))
+        return false;
+      if (load(block(b)[0].words[0]) <= addr)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo == 0)
+      return true;
+    if (!slot(lo - 1, &b, &n))
+      return false;
+    const SharedEntry *e = block(b);
+    uint64_t i = 0, j = n;
+    while (i < j) {
+      uint64_t mid = i + (j - i) / 2;
+      if (load(e[mid].words[0]) <= addr)
+        i = mid + 1;
+      else
+        j = mid;
+    }
+    if (i == 0)
+      return false;
+    Region r = load_entry(e[i - 1]);
+    if (addr - r.start < r.len) {
+      *info = r.info;
+      *found = true;
+    }
+    return true;
+  });
+}
+
+SharedRead SharedAddrSpace::usage(Usage *out) const {
+  return read([&] {
+    uint64_t words[sizeof(Usage) / 8];
+    for (size_t i = 0; i < std::size(words); i++)
+      words[i] = load(hdr_->usage[i]);
+    memcpy(out, words, sizeof(words));
+    return true;
+  });
+}
+
+SharedRead SharedAddrSpace::regions(Region *out, size_t max,
+                                    size_t *count) const {
+  return regions(max, count, [out](size_t i, Region r) { out[i] = r; });
+}
+
+SharedRead SharedAddrSpace::regions(size_t max, size_t *count,
+                                    const SharedRegionFn &fn) const {
+  return read([&] {
+    uint64_t used = load(hdr_->used);
+    if (used > hdr_->nblocks)
+      return false;
+    size_t total = 0;
+    for (uint64_t s = 0; s < used; s++) {
+      uint64_t b, n;
+      if (!slot(s, &b, &n))
+        return false;
+      for (uint64_t i = 0; i < n; i++, total++) {
+        if (total < max)
+          fn(total, load_entry(block(b)[i]));
+      }
+    }
+    *count = total;
+    return true;
+  });
+}
+
+namespace detail {
+
+SharedHeader *SharedWriter::create(void *data, size_t len) {
+  if (len < sizeof(SharedHeader) || (uintptr_t)data % alignof(uint64_t))
+    return nullptr;
+  uint64_t nblocks = std::min<uint64_t>(
+      (len - sizeof(SharedHeader)) / (sizeof(uint64_t) + kBlockBytes),
+      UINT32_MAX);
+  while (nblocks > 0 && blocks_offset(nblocks) + nblocks * kBlockBytes > len)
+    nblocks--;
+  if (nblocks == 0)
+    return nullptr;
+
+  auto *base = static_cast<char *>(data);
+  auto *hdr = new (base) SharedHeader();
+  hdr->dir = sizeof(SharedHeader);
+  hdr->blocks = blocks_offset(nblocks);
+  hdr->nblocks = nblocks;
+  for (uint64_t k = 0; k < nblocks; k++)
+    new (base + hdr->dir + k * sizeof(uint64_t)) std::atomic<uint64_t>(k);
+  for (uint64_t k = 0; k < nblocks * kSharedBlock; k++)
+    new (base + hdr->blocks + k * sizeof(SharedEntry)) SharedEntry();
+  // Readers check the magic, so write it last.
+  memcpy(hdr->magic, kSharedMagic, sizeof(kSharedMagic));
+  std::atomic_thread_fence(std::memory_order_release);
+  return hdr;
+}
+
+SharedWriter::SharedWriter(SharedHeader *hdr, std::vector<Region> *scratch)
+    : hdr_(hdr),
+      dir_(reinterpret_cast<std::atomic<uint64_t> *>(
+          reinterpret_cast<char *>(hdr) + hdr->dir)),
+      blocks_(reinterpret_cast<SharedEntry *>(reinterpret_cast<char *>(hdr) +
+                                              hdr->blocks)),
+      scratch_(scratch) {}
+
+void SharedWriter::lock() {
+  store(hdr_->seq, load(hdr_->seq) + 1);
+  // Order the odd sequence number before the updates that follow.
+  std::atomic_thread_fence(std::memory_order_release);
+}
+
+void SharedWriter::unlock() {
+  hdr_->seq.store(load(hdr_->seq) + 1, std::memory_order_release);
+}
+
+bool SharedWriter::stale() const { return load(hdr_->count) == kSharedStale; }
+
+uint64_t SharedWriter::block_of(uint64_t slot) const {
+  return (uint32_t)load(dir_[slot]);
+}
+
+uint64_t SharedWriter::size_of(uint64_t slot) const {
+  return load(dir_[slot]) >> 32;
+}
+
+Region SharedWriter::get(uint64_t block, uint64_t idx) const {
+  return load_entry(blocks_[block * kSharedBlock + idx]);
+}
+
+void SharedWriter::put(uint64_t block, uint64_t idx, const Region &r) {
+  store_entry(blocks_[block * kSharedBlock + idx], r);
+}
+
+template <class Pred> auto SharedWriter::find(Pred pred) const -> Pos {
+  // The first block whose last region matches, then the first match in it.
+  uint64_t used = load(hdr_->used);
+  uint64_t lo = 0, hi = used;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (pred(get(block_of(mid), size_of(mid) - 1)))
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  if (lo == used)
+    return {used, 0};
+  uint64_t b = block_of(lo);
+  uint64_t i = 0, j = size_of(lo);
+  while (i < j) {
+    uint64_t mid = i + (j - i) / 2;
+    if (pred(get(b, mid)))
+      j = mid;
+    else
+      i = mid + 1;
+  }
+  return {lo, i};
+}
+
+void SharedWriter::gather(uint64_t from, uint64_t to,
+                          std::vector<Region> *out) const {
+  for (uint64_t s = from; s < to; s++) {
+    uint64_t b = block_of(s);
+    for (uint64_t i = 0, n = size_of(s); i < n; i++)
+      out->push_back(get(b, i));
+  }
+}
+
+// Reverse directory words [i, j).
+static void reverse(std::atomic<uint64_t> *dir, uint64_t i, uint64_t j) {
+  for (; i + 1 < j; i++, j--) {
+    uint64_t t = load(dir[i]);
+    store(dir[i], load(dir[j - 1]));
+    store(dir[j - 1], t);
+  }
+}
+
+bool SharedWriter::rewrite(uint64_t g0, uint64_t g1,
+                           const std::vector<Region> &regions) {
+  uint64_t used = load(hdr_->used);
+  uint64_t m = g1 - g0;
+  uint64_t total = regions.size();
+  // Keep the blocks if they stay between half and completely full, and
+  // otherwise use as many as makes each at least half full.
+  uint64_t n = m;
+  if (total == 0)
+    n = 0;
+  else if (total > m * kSharedBlock || 2 * total < m * kSharedBlock)
+    n = std::max<uint64_t>(1, 2 * total / kSharedBlock);
+  if (used - m + n > hdr_->nblocks)
+    return false;
+
+  // Rotate the directory so that slots [g0, g0 + n) are the blocks to fill
+  // and the free block indexes still follow the used slots.
+  if (n > m) {
+    uint64_t d = n - m;
+    reverse(dir_, g1, used);
+    reverse(dir_, used, used + d);
+    reverse(dir_, g1, used + d);
+  } else if (n < m) {
+    reverse(dir_, g0 + n, g1);
+    reverse(dir_, g1, used);
+    reverse(dir_, g0 + n, used);
+  }
+  for (uint64_t k = 0; k < n; k++) {
+    uint64_t b = block_of(g0 + k);
+    uint64_t first = total * k / n;
+    uint64_t last = total * (k + 1) / n;
+    for (uint64_t i = first; i < last; i++)
+      put(b, i - first, regions[i]);
+    store(dir_[g0 + k], b | (last - first) << 32);
+  }
+  store(hdr_->used, used - m + n);
+  return true;
+}
+
+bool SharedWriter::assign(const std::vector<Region> &regions) {
+  for (uint64_t k = 0; k < hdr_->nblocks; k++)
+    store(dir_[k], k);
+  store(hdr_->used, 0);
+  if (!rewrite(0, 0, regions)) {
+    store(hdr_->count, kSharedStale);
+    return false;
+  }
+  store(hdr_->count, regions.size());
+  return true;
+}
+
+bool SharedWriter::replace(uintptr_t lo, uintptr_t hi,
+                           const std::vector<Region> &regions) {
+  uint64_t used = load(hdr_->used);
+  Pos a = find([&](const Region &r) { return r.start + r.len >= lo; });
+  Pos b = find([&](const Region &r) { return r.start > hi; });
+  // Rewrite the blocks holding [a, b), or the one to insert into.
+  uint64_t g0 = std::min(a.slot, used > 0 ? used - 1 : 0);
+  uint64_t g1 = std::min(std::max(b.idx > 0 ? b.slot + 1 : b.slot, g0 + 1),
+                         used);
+  auto before = [&](uint64_t s, uint64_t i, Pos p) {
+    return s < p.slot || (s == p.slot && i < p.idx);
+  };
+  std::vector<Region> &out = *scratch_;
+  out.clear();
+  uint64_t old = 0;
+  for (uint64_t s = g0; s < g1; s++) {
+    old += size_of(s);
+    for (uint64_t i = 0, n = size_of(s); i < n && before(s, i, a); i++)
+      out.push_back(get(block_of(s), i));
+  }
+  out.insert(out.end(), regions.begin(), regions.end());
+  for (uint64_t s = g0; s < g1; s++) {
+    for (uint64_t i = 0, n = size_of(s); i < n; i++) {
+      if (!before(s, i, b))
+        out.push_back(get(block_of(s), i));
+    }
+  }
+  // Merge a block that would be less than half full with a neighbor.
+  if (!out.empty() && out.size() < kSharedBlock / 2 && g1 - g0 < used) {
+    if (g1 < used) {
+      old += size_of(g1);
+      gather(g1, g1 + 1, &out);
+      g1++;
+    } else {
+      g0--;
+      old += size_of(g0);
+      size_t n = out.size();
+      gather(g0, g0 + 1, &out);
+      std::rotate(out.begin(), out.begin() + n, out.end());
+    }
+  }
+  if (!rewrite(g0, g1, out)) {
+    store(hdr_->count, kSharedStale);
+    return false;
+  }
+  store(hdr_->count, load(hdr_->count) + out.size() - old);
+  return true;
+}
+
+void SharedWriter::set_usage(const Usage &usage) {
+  uint64_t words[sizeof(Usage) / 8];
+  memcpy(words, &usage, sizeof(words));
+  for (size_t i = 0; i < std::size(words); i++)
+    store(hdr_->usage[i], words[i]);
+}
+
+} // namespace detail
+
+} // namespace mmap
@@ -0,0 +1,172 @@
+#ifndef LIBMMAP_SHARED_H
+#define LIBMMAP_SHARED_H
+
+#include "addr_space.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace mmap {
+
+// Address spaces shared with other processes.
+//
+// BasicAddrSpace::share() publishes the regions and usage totals of an
+// address space to an arena supplied by the caller, typically MAP_SHARED
+// memory, and keeps it up to date as the mapping changes. Another process
+// that maps the same arena, such as a supervisor, reads it through
+// SharedAddrSpace without any cooperation from the owner.
+//
+// The arena holds offsets from its start rather than pointers, so each
+// process may map it at a different address. It is guarded by a sequence
+// lock: the owner makes the sequence number odd, updates the arena and makes
+// it even again, and a reader retries any read that saw an odd number or a
+// change of the number. Readers never block the owner. Every word is read and
+// written as an atomic, so the unlocked reads are not data races.
+//
+// After the header come a directory of 'nblocks' words and then 'nblocks'
+// blocks of up to kSharedBlock regions. The first 'used' directory words
+// give the blocks in address order, each as the block index in the low 32
+// bits and its number of regions in the high 32 bits; the rest hold the
+// free block indexes. A change rewrites only the blocks around it, and
+// moves directory words only when it splits or merges blocks.
+
+inline constexpr char kSharedMagic[8] = {'M', 'M', 'S', 'H', 'A', 'R', 'E', 1};
+
+// Regions per block.
+inline constexpr size_t kSharedBlock = 32;
+// Value of 'count' while the regions do not fit in the arena.
+inline constexpr uint64_t kSharedStale = ~0ULL;
+
+struct SharedHeader {
+  char magic[8];
+  // Odd while the owner is updating the arena.
+  std::atomic<uint64_t> seq;
+  // Offsets of the directory and the blocks, and the number of blocks.
+  uint64_t dir;
+  uint64_t blocks;
+  uint64_t nblocks;
+  // Directory words in use, and the number of regions or kSharedStale.
+  std::atomic<uint64_t> used;
+  std::atomic<uint64_t> count;
+  // The Usage fields in order.
+  std::atomic<uint64_t> usage[sizeof(Usage) / 8];
+};
+
+// Each region is five words: start, end, offset, prot and flags (low and
+// high 32 bits), and fd and original (low and high 32 bits).
+struct SharedEntry {
+  std::atomic<uint64_t> words[5];
+};
+
+// Bytes of arena that always hold 'regions' regions.
+size_t shared_arena_size(size_t regions);
+
+// Result of a read from a shared arena.
+enum class SharedRead {
+  kOk,
+  // The owner was updating the arena throughout every retry, for example
+  // because it died mid-update.
+  kBusy,
+  // The owner's regions do not fit in the arena.
+  kStale,
+};
+
+// Called by SharedAddrSpace::regions() with the index and value of each
+// region copied out.
+using SharedRegionFn = std::function<void(size_t, Region)>;
+
+// Read-only view of an arena published by BasicAddrSpace::share(), usually
+// from another process. Each read is consistent: it sees the state between
+// two of the owner's calls.
+class SharedAddrSpace {
+public:
+  SharedAddrSpace() = default;
+
+  // View the arena at 'data', which must be 8-byte aligned and already set
+  // up by share(). Returns false if it is not a shared arena of at most
+  // 'len' bytes.
+  bool open(const void *data, size_t len);
+
+  // Set '*found', and '*info' if found, as BasicAddrSpace::query_page does.
+  // O(log n).
+  SharedRead query_page(uintptr_t addr, MapInfo *info, bool *found) const;
+  SharedRead usage(Usage *out) const;
+  // Copy the first 'max' regions in address order to 'out' and set
+  // '*count' to the number of regions, which may be more than 'max'.
+  SharedRead regions(Region *out, size_t max, size_t *count) const;
+  // Like the above, but hand the first 'max' regions to 'fn' instead, so
+  // that they can be converted without a buffer. A read that is retried
+  // starts again from index 0, so only the last value given for each index
+  // counts, and only once kOk is returned.
+  SharedRead regions(size_t max, size_t *count,
+                     const SharedRegionFn &fn) const;
+
+private:
+  // Run 'fn' under the sequence lock until it returns true with the lock
+  // unchanged; it returns false on reading an impossible state.
+  template <class Fn> SharedRead read(Fn fn) const;
+  // Block index and region count of directory word 'slot', or false if
+  // they are out of range.
+  bool slot(uint64_t slot, uint64_t *block, uint64_t *n) const;
+  const SharedEntry *block(uint64_t b) const {
+    return blocks_ + b * kSharedBlock;
+  }
+
+  const SharedHeader *hdr_ = nullptr;
+  const std::atomic<uint64_t> *dir_ = nullptr;
+  const SharedEntry *blocks_ = nullptr;
+};
+
+namespace detail {
+
+// The owner's side of a shared arena, used by BasicAddrSpace.
+class SharedWriter {
+public:
+  // Lay out an empty arena at 'data'. Returns null if it is not 8-byte
+  // aligned or has no room for a block.
+  static SharedHeader *create(void *data, size_t len);
+
+  // 'scratch' is working space, kept by the caller so that it is reused.
+  SharedWriter(SharedHeader *hdr, std::vector<Region> *scratch);
+
+  void lock();
+  void unlock();
+  bool stale() const;
+  // Replace every region with 'regions'. If they do not fit, mark the arena
+  // stale and return false.
+  bool assign(const std::vector<Region> &regions);
+  // Replace the regions that overlap or touch [lo, hi] with 'regions',
+  // which must be sorted and lie in the same span. If they do not fit,
+  // mark the arena stale and return false.
+  bool replace(uintptr_t lo, uintptr_t hi, const std::vector<Region> &regions);
+  void set_usage(const Usage &usage);
+
+private:
+  struct Pos {
+    uint64_t slot;
+    uint64_t idx;
+  };
+  template <class Pred> Pos find(Pred pred) const;
+  uint64_t block_of(uint64_t slot) const;
+  uint64_t size_of(uint64_t slot) const;
+  Region get(uint64_t block, uint64_t idx) const;
+  void put(uint64_t block, uint64_t idx, const Region &r);
+  // Append the regions of directory slots [from, to) to 'out'.
+  void gather(uint64_t from, uint64_t to, std::vector<Region> *out) const;
+  // Replace directory slots [g0, g1) with blocks holding 'regions'.
+  bool rewrite(uint64_t g0, uint64_t g1, const std::vector<Region> &regions);
+
+  SharedHeader *hdr_;
+  std::atomic<uint64_t> *dir_;
+  SharedEntry *blocks_;
+  std::vector<Region> *scratch_;
+};
+
+} // namespace detail
+
+} // namespace mmap
+
+#endif // LIBMMAP_SHARED_H
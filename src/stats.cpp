@@ -0,0 +1,127 @@
+#include "stats.h"
+
+#include <algorithm>
+
+namespace mmap {
+
+static std::atomic<uint64_t> next_collector_id{1};
+
+StatsCollector::StatsCollector()
+    : id_(next_collector_id.fetch_add(1, std::memory_order_relaxed)) {}
+
+// The shards the current thread used most recently, newest first, so that a
+// thread working on several collectors only takes a lock the first time it
+// uses each one. Collector ids are never reused, so the entries of a
+// destroyed collector just age out.
+struct ShardCache {
+  static constexpr size_t kEntries = 8;
+  struct Entry {
+    uint64_t id = 0;
+    void *shard = nullptr;
+  };
+  Entry entries[kEntries];
+
+  void *find(uint64_t id) {
+    if (entries[0].id == id)
+      return entries[0].shard;
+    for (size_t i = 1; i < kEntries; i++) {
+      if (entries[i].id == id) {
+        Entry e = entries[i];
+        std::move_backward(entries, entries + i, entries + i + 1);
+        entries[0] = e;
+        return e.shard;
+      }
+    }
+    return nullptr;
+  }
+
+  void add(uint64_t id, void *shard) {
+    std::move_backward(entries, entries + kEntries - 1, entries + kEntries);
+    entries[0] = {id, shard};
+  }
+};
+
+static thread_local ShardCache shard_cache;
+
+StatsCollector::Shard &StatsCollector::shard() {
+  if (void *s = shard_cache.find(id_))
+    return *static_cast<Shard *>(s);
+  return add_shard();
+}
+
+StatsCollector::Shard &StatsCollector::add_shard() {
+  std::lock_guard<std::mutex> lock(mu_);
+  std::thread::id self = std::this_thread::get_id();
+  Shard *found = nullptr;
+  for (auto &s : shards_) {
+    if (s->owner == self) {
+      found = s.get();
+      break;
+    }
+  }
+  if (!found) {
+    shards_.push_back(std::make_unique<Shard>());
+    found = shards_.back().get();
+    found->owner = self;
+  }
+  shard_cache.add(id_, found);
+  return *found;
+}
+
+void StatsCollector::record(StatOp op, const detail::WorkCounters &start,
+                            std::chrono::steady_clock::time_point t0) {
+  auto t1 = std::chrono::steady_clock::now();
+  uint64_t ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    t1 - t0)
+                    .count();
+  size_t bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+  if (bucket >= kLatencyBuckets)
+    bucket = kLatencyBuckets - 1;
+
+  const detail::WorkCounters &now = detail::work_counters;
+  Shard &s = shard();
+  auto &o = s.ops[(size_t)op];
+  o.count.add(1);
+  o.visits.add(now.visits - start.visits);
+  o.latency[bucket].add(1);
+  s.splits.add(now.splits - start.splits);
+  s.merges.add(now.merges - start.merges);
+  s.callbacks.add(now.callbacks - start.callbacks);
+  s.hint_misses.add(now.hint_misses - start.hint_misses);
+}
+
+Stats StatsCollector::snapshot() const {
+  Stats st{};
+  std::lock_guard<std::mutex> lock(mu_);
+  for (auto &s : shards_) {
+    for (size_t i = 0; i < kNumStatOps; i++) {
+      st.ops[i].count += s->ops[i].count.get();
+      st.ops[i].nodes_visited += s->ops[i].visits.get();
+      for (size_t b = 0; b < kLatencyBuckets; b++)
+        st.ops[i].latency_ns[b] += s->ops[i].latency[b].get();
+    }
+    st.splits += s->splits.get();
+    st.merges += s->merges.get();
+    st.callbacks += s->callbacks.get();
+    st.hint_misses += s->hint_misses.get();
+  }
+  return st;
+}
+
+void StatsCollector::reset() {
+  std::lock_guard<std::mutex> lock(mu_);
+  for (auto &s : shards_) {
+    for (auto &o : s->ops) {
+      o.count.clear();
+      o.visits.clear();
+      for (auto &c : o.latency)
+        c.clear();
+    }
+    s->splits.clear();
+    s->merges.clear();
+    s->callbacks.clear();
+    s->hint_misses.clear();
+  }
+}
+
+} // namespace mmap
@@ -0,0 +1,193 @@
+#ifndef LIBMMAP_STATS_H
+#define LIBMMAP_STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace mmap {
+
+// Statistics are only collected when the library and its users are built
+// with LIBMMAP_STATS defined. Otherwise every counting hook is an empty
+// inline function and AddrSpace::stats() reports only the region count.
+#ifdef LIBMMAP_STATS
+inline constexpr bool kStatsEnabled = true;
+#else
+inline constexpr bool kStatsEnabled = false;
+#endif
+
+enum class StatOp {
+  kMapAny,
+  kMapAt,
+  kUnmap,
+  kProtect,
+  kQueryPage,
+  kMarkOriginal,
+  kUnmapNonOriginal,
+  kSetAttr,
+};
+
+inline constexpr size_t kNumStatOps = 8;
+
+// Latency bucket i counts calls that took [2^i, 2^(i+1)) nanoseconds;
+// bucket 0 also counts calls under 1 ns.
+inline constexpr size_t kLatencyBuckets = 32;
+
+struct OpStats {
+  uint64_t count;
+  // Tree nodes and inline blocks examined, summed over all calls.
+  uint64_t nodes_visited;
+  uint64_t latency_ns[kLatencyBuckets];
+};
+
+struct Stats {
+  OpStats ops[kNumStatOps];
+  // Existing ranges cut by an insert or remove, one per piece that remains.
+  uint64_t splits;
+  // Adjacent ranges with equal values joined after an insert.
+  uint64_t merges;
+  // UpdateFn invocations.
+  uint64_t callbacks;
+  // map_any calls with a hint that could not be used.
+  uint64_t hint_misses;
+  uint64_t regions;
+
+  const OpStats &op(StatOp op) const { return ops[(size_t)op]; }
+};
+
+namespace detail {
+
+// Work done by the current thread, counted by RangeMap and AddrSpace and
+// attributed to the enclosing AddrSpace call by StatsCollector::Scope.
+struct WorkCounters {
+  uint64_t visits;
+  uint64_t splits;
+  uint64_t merges;
+  uint64_t callbacks;
+  uint64_t hint_misses;
+};
+
+inline thread_local WorkCounters work_counters;
+
+inline void count_visits(uint64_t n = 1) {
+  if constexpr (kStatsEnabled)
+    work_counters.visits += n;
+}
+inline void count_splits(uint64_t n = 1) {
+  if constexpr (kStatsEnabled)
+    work_counters.splits += n;
+}
+inline void count_merge() {
+  if constexpr (kStatsEnabled)
+    work_counters.merges++;
+}
+inline void count_callback() {
+  if constexpr (kStatsEnabled)
+    work_counters.callbacks++;
+}
+inline void count_hint_miss() {
+  if constexpr (kStatsEnabled)
+    work_counters.hint_misses++;
+}
+
+// Key comparison for the region tree that counts every node it examines.
+template <class K> struct CountingLess {
+  bool operator()(const K &a, const K &b) const {
+    count_visits();
+    return a < b;
+  }
+};
+
+} // namespace detail
+
+// StatsCollector keeps one shard of counters per thread that uses it, so
+// counting never contends; snapshot() sums the shards. Each shard is only
+// written by its own thread, with relaxed atomic stores, so reading while
+// other threads count is safe but may miss calls in flight.
+class StatsCollector {
+public:
+  StatsCollector();
+  StatsCollector(const StatsCollector &) = delete;
+  StatsCollector &operator=(const StatsCollector &) = delete;
+
+  // Counts one call from construction to destruction.
+  class Scope {
+  public:
+    Scope(StatsCollector &c, StatOp op)
+        : c_(c), op_(op), start_(detail::work_counters),
+          t0_(std::chrono::steady_clock::now()) {}
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+    ~Scope() { c_.record(op_, start_, t0_); }
+
+  private:
+    StatsCollector &c_;
+    StatOp op_;
+    detail::WorkCounters start_;
+    std::chrono::steady_clock::time_point t0_;
+  };
+
+  Scope scope(StatOp op) { return Scope(*this, op); }
+
+  // Sum of every thread's counters. 'regions' is left zero.
+  Stats snapshot() const;
+  // Zero every thread's counters. Calls in flight on other threads may
+  // still be counted.
+  void reset();
+
+private:
+  struct Counter {
+    std::atomic<uint64_t> v{0};
+    void add(uint64_t n) {
+      v.store(v.load(std::memory_order_relaxed) + n,
+              std::memory_order_relaxed);
+    }
+    uint64_t get() const { return v.load(std::memory_order_relaxed); }
+    void clear() { v.store(0, std::memory_order_relaxed); }
+  };
+
+  struct Shard {
+    std::thread::id owner;
+    struct {
+      Counter count;
+      Counter visits;
+      Counter latency[kLatencyBuckets];
+    } ops[kNumStatOps];
+    Counter splits;
+    Counter merges;
+    Counter callbacks;
+    Counter hint_misses;
+  };
+
+  void record(StatOp op, const detail::WorkCounters &start,
+              std::chrono::steady_clock::time_point t0);
+  Shard &shard();
+  Shard &add_shard();
+
+  // Distinguishes collectors in the per-thread shard cache, even when one
+  // is allocated where a destroyed one used to be.
+  uint64_t id_;
+  mutable std::mutex mu_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+// Stand-in for StatsCollector when statistics are disabled.
+struct NoStats {
+  struct Scope {};
+  Scope scope(StatOp) { return {}; }
+  Stats snapshot() const { return Stats{}; }
+  void reset() {}
+};
+
+using StatsCollectorType =
+    std::conditional_t<kStatsEnabled, StatsCollector, NoStats>;
+
+} // namespace mmap
+
+#endif // LIBMMAP_STATS_H
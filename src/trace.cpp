@@ -0,0 +1,213 @@
+#include "trace.h"
+
+#include <cstring>
+
+namespace mmap {
+
+static const char kMagic[8] = {'M', 'M', 'T', 'R', 'A', 'C', 'E', 1};
+static const uint8_t kHasUfn = 0x80;
+
+static uint64_t zigzag(int64_t v) {
+  return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v) {
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+TraceWriter::TraceWriter(FILE *out) : out_(out) {
+  if (fwrite(kMagic, 1, sizeof(kMagic), out_) != sizeof(kMagic))
+    ok_ = false;
+}
+
+void TraceWriter::flush() {
+  if (fflush(out_) != 0)
+    ok_ = false;
+}
+
+void TraceWriter::put(uint8_t byte) {
+  if (putc(byte, out_) == EOF)
+    ok_ = false;
+}
+
+void TraceWriter::put_varint(uint64_t v) {
+  while (v >= 0x80) {
+    put((uint8_t)(v | 0x80));
+    v >>= 7;
+  }
+  put((uint8_t)v);
+}
+
+void TraceWriter::put_svarint(int64_t v) { put_varint(zigzag(v)); }
+
+void TraceWriter::put_addr(uint64_t addr) {
+  put_svarint((int64_t)(addr - last_addr_));
+  last_addr_ = addr;
+}
+
+void TraceWriter::record(const TraceRecord &rec) {
+  put((uint8_t)rec.op | (rec.has_ufn ? kHasUfn : 0));
+  switch (rec.op) {
+  case TraceOp::kInit:
+    put_addr(rec.addr);
+    put_varint(rec.len);
+    put_varint(rec.pagesize);
+    put((uint8_t)rec.result);
+    break;
+  case TraceOp::kMapAny:
+  case TraceOp::kMapAt:
+  case TraceOp::kMapAtNoReplace:
+    put_addr(rec.addr);
+    put_varint(rec.len);
+    put_svarint(rec.prot);
+    put_svarint(rec.flags);
+    put_svarint(rec.fd);
+    put_svarint(rec.offset);
+    put_addr(rec.result);
+    break;
+  case TraceOp::kUnmap:
+    put_addr(rec.addr);
+    put_varint(rec.len);
+    put((uint8_t)rec.result);
+    break;
+  case TraceOp::kQueryPage:
+    put_addr(rec.addr);
+    put((uint8_t)rec.result);
+    if (rec.result) {
+      put_svarint(rec.info.prot);
+      put_svarint(rec.info.flags);
+      put_svarint(rec.info.fd);
+      put_svarint(rec.info.offset);
+      put(rec.info.original);
+    }
+    break;
+  case TraceOp::kProtect:
+    put_addr(rec.addr);
+    put_varint(rec.len);
+    put_svarint(rec.prot);
+    put((uint8_t)rec.result);
+    break;
+  case TraceOp::kSetLimit:
+    put_varint(rec.len);
+    break;
+  case TraceOp::kReset:
+  case TraceOp::kMarkOriginal:
+  case TraceOp::kUnmapNonOriginal:
+    break;
+  }
+}
+
+TraceReader::TraceReader(FILE *in) : in_(in) {
+  char magic[sizeof(kMagic)];
+  if (fread(magic, 1, sizeof(magic), in_) != sizeof(magic) ||
+      memcmp(magic, kMagic, sizeof(kMagic)) != 0)
+    error_ = true;
+}
+
+bool TraceReader::get(uint8_t *byte) {
+  int c = getc(in_);
+  if (c == EOF) {
+    error_ = true;
+    return false;
+  }
+  *byte = (uint8_t)c;
+  return true;
+}
+
+bool TraceReader::get_varint(uint64_t *v) {
+  *v = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7) {
+    uint8_t byte;
+    if (!get(&byte))
+      return false;
+    *v |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  error_ = true;
+  return false;
+}
+
+bool TraceReader::get_svarint(int64_t *v) {
+  uint64_t u;
+  if (!get_varint(&u))
+    return false;
+  *v = unzigzag(u);
+  return true;
+}
+
+bool TraceReader::get_int(int *v) {
+  int64_t s;
+  if (!get_svarint(&s))
+    return false;
+  *v = (int)s;
+  return true;
+}
+
+bool TraceReader::get_addr(uint64_t *addr) {
+  int64_t delta;
+  if (!get_svarint(&delta))
+    return false;
+  *addr = last_addr_ + (uint64_t)delta;
+  last_addr_ = *addr;
+  return true;
+}
+
+bool TraceReader::next(TraceRecord *rec) {
+  if (error_)
+    return false;
+  int c = getc(in_);
+  if (c == EOF)
+    return false;
+  *rec = TraceRecord{};
+  rec->has_ufn = (c & kHasUfn) != 0;
+  rec->op = (TraceOp)(c & ~kHasUfn);
+  uint8_t byte;
+  switch (rec->op) {
+  case TraceOp::kInit:
+    if (!get_addr(&rec->addr) || !get_varint(&rec->len) ||
+        !get_varint(&rec->pagesize) || !get(&byte))
+      return false;
+    rec->result = byte;
+    return true;
+  case TraceOp::kMapAny:
+  case TraceOp::kMapAt:
+  case TraceOp::kMapAtNoReplace:
+    return get_addr(&rec->addr) && get_varint(&rec->len) &&
+           get_int(&rec->prot) && get_int(&rec->flags) && get_int(&rec->fd) &&
+           get_svarint(&rec->offset) && get_addr(&rec->result);
+  case TraceOp::kUnmap:
+    if (!get_addr(&rec->addr) || !get_varint(&rec->len) || !get(&byte))
+      return false;
+    rec->result = byte;
+    return true;
+  case TraceOp::kQueryPage:
+    if (!get_addr(&rec->addr) || !get(&byte))
+      return false;
+    rec->result = byte;
+    if (rec->result) {
+      if (!get_int(&rec->info.prot) || !get_int(&rec->info.flags) ||
+          !get_int(&rec->info.fd) || !get_svarint(&rec->info.offset) ||
+          !get(&byte))
+        return false;
+      rec->info.original = byte != 0;
+    }
+    return true;
+  case TraceOp::kProtect:
+    if (!get_addr(&rec->addr) || !get_varint(&rec->len) ||
+        !get_int(&rec->prot) || !get(&byte))
+      return false;
+    rec->result = byte;
+    return true;
+  case TraceOp::kSetLimit:
+    return get_varint(&rec->len);
+  case TraceOp::kReset:
+  case TraceOp::kMarkOriginal:
+  case TraceOp::kUnmapNonOriginal:
+    return true;
+  }
+  error_ = true;
+  return false;
+}
+
+} // namespace mmap
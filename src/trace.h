@@ -0,0 +1,151 @@
+#ifndef LIBMMAP_TRACE_H
+#define LIBMMAP_TRACE_H
+
+#include "addr_space.h"
+
+#include <cstdint>
+#include <cstdio>
+
+namespace mmap {
+
+// Operation traces.
+//
+// A TraceWriter attached to an AddrSpace with set_trace() records every
+// public call with its arguments and result. Calls made internally (such as
+// the unmap inside map_at) are not recorded. Attach the writer before init()
+// so that replay starts from the same state.
+//
+// The file starts with an 8-byte magic and is followed by one record per
+// call: an opcode byte, whose top bit is set if the call was given an
+// UpdateFn, then the arguments as LEB128 varints. Signed values are
+// zigzag-encoded, and addresses are stored as the zigzag delta from the
+// previous address in the trace, so most records take a handful of bytes.
+
+enum class TraceOp : uint8_t {
+  kInit = 1,
+  kReset,
+  kMapAny,
+  kMapAt,
+  kUnmap,
+  kQueryPage,
+  kProtect,
+  kMarkOriginal,
+  kUnmapNonOriginal,
+  kMapAtNoReplace,
+  kSetLimit,
+};
+
+// One recorded call. Fields not used by 'op' are zero.
+struct TraceRecord {
+  TraceOp op;
+  bool has_ufn = false;
+  // init: start; map_any: hint; otherwise the address argument.
+  uint64_t addr = 0;
+  // set_limit: the limit in bytes.
+  uint64_t len = 0;
+  // init only.
+  uint64_t pagesize = 0;
+  int prot = 0;
+  int flags = 0;
+  int fd = 0;
+  int64_t offset = 0;
+  // Returned address for the map_ calls, the Error for unmap and
+  // protect, and 0 or 1 for init and query_page.
+  uint64_t result = 0;
+  // query_page only, if it returned true.
+  MapInfo info{};
+};
+
+class TraceWriter {
+public:
+  // Write the trace header to 'out', which must stay open while the writer
+  // is in use.
+  explicit TraceWriter(FILE *out);
+
+  // False once any write to the file has failed.
+  bool ok() const { return ok_; }
+  void flush();
+
+  void record(const TraceRecord &rec);
+
+private:
+  void put(uint8_t byte);
+  void put_varint(uint64_t v);
+  void put_svarint(int64_t v);
+  void put_addr(uint64_t addr);
+
+  FILE *out_;
+  bool ok_ = true;
+  uint64_t last_addr_ = 0;
+};
+
+class TraceReader {
+public:
+  // Read and check the trace header from 'in'.
+  explicit TraceReader(FILE *in);
+
+  // Read the next record. Returns false at the end of the trace or if the
+  // trace is malformed; error() tells the two apart.
+  bool next(TraceRecord *rec);
+  bool error() const { return error_; }
+
+private:
+  bool get(uint8_t *byte);
+  bool get_varint(uint64_t *v);
+  bool get_svarint(int64_t *v);
+  bool get_int(int *v);
+  bool get_addr(uint64_t *addr);
+
+  FILE *in_;
+  bool error_ = false;
+  uint64_t last_addr_ = 0;
+};
+
+// Replay 'rec' against 'mm' and return whether the result matches the
+// recorded one. Calls that were given an UpdateFn are replayed with one
+// that does nothing, so the callback walk is still timed.
+template <class Space> bool replay(Space &mm, const TraceRecord &rec) {
+  UpdateFn ufn = nullptr;
+  if (rec.has_ufn)
+    ufn = [](uintptr_t, size_t, MapInfo) {};
+  switch (rec.op) {
+  case TraceOp::kInit:
+    return mm.init(rec.addr, rec.len, rec.pagesize) == (rec.result != 0);
+  case TraceOp::kReset:
+    mm.reset();
+    return true;
+  case TraceOp::kMapAny:
+    return mm.map_any(rec.addr, rec.len, rec.prot, rec.flags, rec.fd,
+                      rec.offset) == rec.result;
+  case TraceOp::kMapAt:
+    return mm.map_at(rec.addr, rec.len, rec.prot, rec.flags, rec.fd,
+                     rec.offset, ufn) == rec.result;
+  case TraceOp::kMapAtNoReplace:
+    return mm.map_at_noreplace(rec.addr, rec.len, rec.prot, rec.flags, rec.fd,
+                               rec.offset) == rec.result;
+  case TraceOp::kUnmap:
+    return (uint64_t)mm.unmap(rec.addr, rec.len, ufn) == rec.result;
+  case TraceOp::kQueryPage: {
+    MapInfo info{};
+    bool found = mm.query_page(rec.addr, &info);
+    return found == (rec.result != 0) && (!found || info == rec.info);
+  }
+  case TraceOp::kProtect:
+    return (uint64_t)mm.protect(rec.addr, rec.len, rec.prot, ufn) ==
+           rec.result;
+  case TraceOp::kMarkOriginal:
+    mm.mark_original();
+    return true;
+  case TraceOp::kUnmapNonOriginal:
+    mm.unmap_non_original(ufn);
+    return true;
+  case TraceOp::kSetLimit:
+    mm.set_limit(rec.len);
+    return true;
+  }
+  return false;
+}
+
+} // namespace mmap
+
+#endif // LIBMMAP_TRACE_H
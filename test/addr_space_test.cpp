@@ -1,11 +1,33 @@
 #include "addr_space.h"
+#include "frozen.h"
+#include "mmap_c.h"
+#include "shared.h"
+#include "trace.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
 
 using mmap::AddrSpace;
+using mmap::AddrSpace16K;
+using mmap::AddrSpace4K;
+using mmap::CompactAddrSpace;
 using mmap::Error;
 using mmap::MapInfo;
+using mmap::SharedAddrSpace;
+using mmap::SharedRead;
+using mmap::StatOp;
+using mmap::Stats;
+using mmap::TraceReader;
+using mmap::TraceRecord;
+using mmap::TraceWriter;
 
 static int test_num = 0;
 
@@ -13,10 +35,39 @@ static int test_num = 0;
   fn();                                                                        \
   printf("ok %d - %s\n", ++test_num, #fn)
 
+// Run a test written against any Space once with each layout.
+#define RUN_LAYOUT_TEST(fn)                                                    \
+  fn<AddrSpace>();                                                             \
+  fn<CompactAddrSpace>();                                                      \
+  printf("ok %d - %s\n", ++test_num, #fn)
+
 static const size_t kPageSize = 4096;
 static const uintptr_t kBase = 0x10000;
 static const size_t kSize = 0x100000;
 
+// Heap allocations made through operator new, for the tests that check a
+// small space does not allocate.
+static size_t allocs = 0;
+
+void *operator new(size_t size) {
+  allocs++;
+  if (void *p = malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  allocs++;
+  return malloc(size ? size : 1);
+}
+void *operator new[](size_t size) { return operator new(size); }
+void *operator new[](size_t size, const std::nothrow_t &tag) noexcept {
+  return operator new(size, tag);
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
 static void test_init() {
   AddrSpace mm;
   assert(mm.init(kBase, kSize, kPageSize));
@@ -544,8 +595,1936 @@ static void test_mark_original_twice() {
   assert(info.original);
 }
 
+static void test_compact_init_limits() {
+  CompactAddrSpace mm;
+  assert(mm.init(kBase, kSize, kPageSize));
+
+  // 2^32 pages is one more than a 32-bit key can count.
+  assert(!mm.init(0, (size_t)1 << 44, kPageSize));
+  assert(mm.init(0, ((size_t)1 << 44) - kPageSize, kPageSize));
+}
+
+static void test_compact_matches_wide() {
+  // Random operations give the same results in both storage layouts, even
+  // while interned infos churn through many distinct offsets.
+  AddrSpace wide;
+  CompactAddrSpace compact;
+  assert(wide.init(kBase, kSize, kPageSize));
+  assert(compact.init(kBase, kSize, kPageSize));
+  const int pages = kSize / kPageSize;
+  srand(3);
+  for (int op = 0; op < 5000; op++) {
+    uintptr_t addr = kBase + (rand() % pages) * kPageSize;
+    size_t len = (1 + rand() % 8) * kPageSize;
+    int prot = rand() % 4;
+    switch (rand() % 5) {
+    case 0: {
+      int64_t offset = rand() % 64;
+      assert(wide.map_at(addr, len, prot, 0, 3, offset) ==
+             compact.map_at(addr, len, prot, 0, 3, offset));
+      break;
+    }
+    case 1:
+      assert(wide.unmap(addr, len) == compact.unmap(addr, len));
+      break;
+    case 2:
+      assert(wide.protect(addr, len, prot) == compact.protect(addr, len, prot));
+      break;
+    case 3:
+      assert(wide.map_any(addr, len, prot, 0, -1, 0) ==
+             compact.map_any(addr, len, prot, 0, -1, 0));
+      break;
+    case 4:
+      if (rand() % 50 == 0) {
+        wide.mark_original();
+        compact.mark_original();
+      }
+      break;
+    }
+    for (int i = 0; i < pages; i++) {
+      MapInfo a{}, b{};
+      bool found = wide.query_page(kBase + i * kPageSize, &a);
+      assert(found == compact.query_page(kBase + i * kPageSize, &b));
+      assert(!found || a == b);
+    }
+  }
+}
+
+static void test_fixed_page_size() {
+  AddrSpace4K mm4;
+  assert(mm4.init(kBase, kSize, 4096));
+  assert(!mm4.init(kBase, kSize, 16384));
+
+  AddrSpace16K mm16;
+  assert(!mm16.init(kBase, kSize, 4096));
+  assert(mm16.init(kBase, kSize, 16384));
+
+  // Lengths round up to whole 16 KiB pages.
+  uintptr_t p = mm16.map_any(0, 1, 1, 0, -1, 0);
+  assert(p != (uintptr_t)-1);
+  assert(p % 16384 == 0);
+  MapInfo info;
+  assert(mm16.query_page(p + 16383, &info));
+  assert(!mm16.query_page(p + 16384, &info));
+  assert(mm16.protect(p + 4096, 4096, 7) == Error::kInval);
+  assert(mm16.unmap(p, 1) == Error::kOk);
+  assert(!mm16.query_page(p, &info));
+}
+
+static void test_trace_replay() {
+  FILE *f = tmpfile();
+  assert(f);
+  TraceWriter writer(f);
+  AddrSpace mm;
+  mm.set_trace(&writer);
+  assert(mm.init(kBase, kSize, kPageSize));
+  mmap::UpdateFn ufn = [](uintptr_t, size_t, MapInfo) {};
+  const int pages = kSize / kPageSize;
+  size_t calls = 1;
+  srand(5);
+  for (int op = 0; op < 2000; op++, calls++) {
+    uintptr_t addr = kBase + (rand() % pages) * kPageSize;
+    size_t len = (1 + rand() % 8) * kPageSize;
+    int prot = rand() % 4;
+    MapInfo info;
+    switch (rand() % 6) {
+    case 0:
+      // The unmap done inside map_at is not recorded separately.
+      mm.map_at(addr, len, prot, 0, 3, rand() % 64, ufn);
+      break;
+    case 1:
+      mm.unmap(addr, len, rand() % 2 ? ufn : nullptr);
+      break;
+    case 2:
+      mm.protect(addr + rand() % 2, len, prot);
+      break;
+    case 3:
+      mm.map_any(rand() % 2 ? addr : 0, len, prot, 0, -1, -op);
+      break;
+    case 4:
+      mm.query_page(addr, &info);
+      break;
+    case 5:
+      if (rand() % 2)
+        mm.mark_original();
+      else
+        mm.unmap_non_original(ufn);
+      break;
+    }
+  }
+  // Calls after detaching the writer are not recorded.
+  mm.set_trace(nullptr);
+  MapInfo info;
+  mm.query_page(kBase, &info);
+  writer.flush();
+  assert(writer.ok());
+
+  rewind(f);
+  TraceReader reader(f);
+  AddrSpace replayed;
+  TraceRecord rec;
+  size_t records = 0;
+  while (reader.next(&rec)) {
+    assert(mmap::replay(replayed, rec));
+    records++;
+  }
+  assert(!reader.error());
+  assert(records == calls);
+  for (int i = 0; i < pages; i++) {
+    MapInfo a{}, b{};
+    bool found = mm.query_page(kBase + i * kPageSize, &a);
+    assert(found == replayed.query_page(kBase + i * kPageSize, &b));
+    assert(!found || a == b);
+  }
+  fclose(f);
+}
+
+static void test_trace_malformed() {
+  FILE *f = tmpfile();
+  assert(f);
+  fputs("not a trace", f);
+  rewind(f);
+  TraceRecord rec;
+  TraceReader bad_header(f);
+  assert(!bad_header.next(&rec));
+  assert(bad_header.error());
+  fclose(f);
+
+  // A record cut short is an error, not the end of the trace.
+  f = tmpfile();
+  assert(f);
+  {
+    TraceWriter writer(f);
+    AddrSpace mm;
+    mm.set_trace(&writer);
+    assert(mm.init(kBase, kSize, kPageSize));
+    mm.map_any(0, kPageSize, 1, 0, -1, 0);
+    writer.flush();
+  }
+  long size = ftell(f);
+  assert(size > 10);
+  rewind(f);
+  char buf[256];
+  assert(fread(buf, 1, size, f) == (size_t)size);
+  fclose(f);
+  f = tmpfile();
+  fwrite(buf, 1, size - 1, f);
+  rewind(f);
+  TraceReader truncated(f);
+  assert(truncated.next(&rec));
+  assert(rec.op == mmap::TraceOp::kInit);
+  assert(!truncated.next(&rec));
+  assert(truncated.error());
+  fclose(f);
+}
+
+static void test_no_alloc() {
+  // A small space allocates its region pool when it is created, and after
+  // that its first init() and mapping calls make no allocations.
+  AddrSpace mm;
+  MapInfo info;
+  // With statistics, the first call on each thread allocates its shard.
+  if (mmap::kStatsEnabled) {
+    assert(mm.init(kBase, kSize, kPageSize));
+    mm.query_page(kBase, &info);
+  }
+  size_t before = allocs;
+  assert(mm.init(kBase, kSize, kPageSize));
+  for (int i = 0; i < 8; i++)
+    mm.map_at(kBase + 3 * i * kPageSize, (1 + i % 2) * kPageSize, i % 3, 0,
+              -1, 0);
+  uintptr_t p = mm.map_any(0, 2 * kPageSize, 1, 0, -1, 0);
+  assert(p != (uintptr_t)-1);
+  assert(mm.protect(kBase, 4 * kPageSize, 3) == Error::kOk);
+  assert(mm.unmap(kBase + 6 * kPageSize, kPageSize) == Error::kOk);
+  assert(mm.query_page(kBase, &info));
+  assert(mm.usage().largest_gap > 0);
+  mm.reset();
+  assert(allocs == before);
+}
+
+static void test_stats() {
+  AddrSpace mm;
+  assert(mm.init(kBase, kSize, kPageSize));
+  uintptr_t p = mm.map_any(0, 4 * kPageSize, 1, 0, -1, 0);
+  // The hint is taken, so the page goes in the first gap and coalesces.
+  assert(mm.map_any(p, kPageSize, 1, 0, -1, 0) == p + 4 * kPageSize);
+  // Split [p, p+5) in three, then merge it back.
+  mm.protect(p + kPageSize, kPageSize, 3);
+  mm.protect(p + kPageSize, kPageSize, 1);
+  int calls = 0;
+  mm.unmap(p, 2 * kPageSize, [&](uintptr_t, size_t, MapInfo) { calls++; });
+  assert(calls == 1);
+  // Queries from another thread are counted in its own shard.
+  std::thread t([&] {
+    MapInfo info;
+    for (int i = 0; i < 10; i++)
+      assert(mm.query_page(p + 2 * kPageSize, &info));
+  });
+  t.join();
+
+  Stats st = mm.stats();
+  assert(st.regions == 1);
+  if (!mmap::kStatsEnabled) {
+    assert(st.op(StatOp::kMapAny).count == 0);
+    assert(st.splits == 0 && st.merges == 0 && st.callbacks == 0);
+    return;
+  }
+  assert(st.op(StatOp::kMapAny).count == 2);
+  assert(st.op(StatOp::kProtect).count == 2);
+  assert(st.op(StatOp::kUnmap).count == 1);
+  assert(st.op(StatOp::kQueryPage).count == 10);
+  assert(st.op(StatOp::kMapAt).count == 0);
+  assert(st.hint_misses == 1);
+  assert(st.callbacks == 1);
+  // Two pieces left by the first protect, one by the unmap.
+  assert(st.splits == 3);
+  // One from the second map_any, two from the second protect.
+  assert(st.merges == 3);
+  for (auto op : {StatOp::kMapAny, StatOp::kProtect, StatOp::kUnmap,
+                  StatOp::kQueryPage}) {
+    const auto &o = st.op(op);
+    assert(o.nodes_visited >= o.count);
+    uint64_t total = 0;
+    for (uint64_t n : o.latency_ns)
+      total += n;
+    assert(total == o.count);
+  }
+
+  mm.reset_stats();
+  st = mm.stats();
+  assert(st.op(StatOp::kMapAny).count == 0);
+  assert(st.op(StatOp::kQueryPage).count == 0);
+  assert(st.splits == 0 && st.merges == 0);
+  assert(st.regions == 1);
+}
+
+static void test_stats_interleaved() {
+  // One thread alternating between spaces counts each call in the right
+  // one, including with more spaces than it keeps shards cached for.
+  std::vector<AddrSpace> spaces(12);
+  for (auto &mm : spaces)
+    assert(mm.init(kBase, kSize, kPageSize));
+  MapInfo info;
+  for (int i = 0; i < 50; i++) {
+    spaces[0].query_page(kBase, &info);
+    spaces[1].map_at(kBase, kPageSize, i % 2, 0, -1, 0);
+  }
+  for (int round = 0; round < 3; round++)
+    for (auto &mm : spaces)
+      mm.query_page(kBase, &info);
+  if (!mmap::kStatsEnabled)
+    return;
+  assert(spaces[0].stats().op(StatOp::kQueryPage).count == 53);
+  assert(spaces[0].stats().op(StatOp::kMapAt).count == 0);
+  assert(spaces[1].stats().op(StatOp::kMapAt).count == 50);
+  assert(spaces[1].stats().op(StatOp::kQueryPage).count == 3);
+  for (size_t i = 2; i < spaces.size(); i++)
+    assert(spaces[i].stats().op(StatOp::kQueryPage).count == 3);
+}
+
+static void test_usage() {
+  AddrSpace mm;
+  assert(mm.init(kBase, kSize, kPageSize));
+  const uint64_t pages = kSize / kPageSize;
+  mmap::Usage u = mm.usage();
+  assert(u.mapped_pages == 0 && u.regions == 0 && u.largest_gap == pages);
+
+  mm.map_at(kBase, 4 * kPageSize, 3, 0, -1, 0);
+  mm.map_at(kBase + 8 * kPageSize, 2 * kPageSize, 5, 0, -1, 0);
+  u = mm.usage();
+  assert(u.mapped_pages == 6 && u.regions == 2);
+  assert(u.prot_pages[3] == 4 && u.prot_pages[5] == 2);
+  assert(u.largest_gap == pages - 10);
+
+  // Overwriting replaces pages rather than adding them.
+  mm.map_at(kBase + 2 * kPageSize, 4 * kPageSize, 1, 0, -1, 0);
+  u = mm.usage();
+  assert(u.mapped_pages == 8);
+  assert(u.prot_pages[3] == 2 && u.prot_pages[1] == 4);
+  assert(u.prot_pages[5] == 2);
+
+  mm.protect(kBase, 10 * kPageSize, 5);
+  u = mm.usage();
+  assert(u.mapped_pages == 8 && u.prot_pages[5] == 8);
+  assert(u.prot_pages[1] == 0 && u.prot_pages[3] == 0);
+
+  // Unmapping everything but the last page leaves one gap before it.
+  mm.unmap(kBase, (pages - 1) * kPageSize);
+  mm.map_at(kBase + (pages - 1) * kPageSize, kPageSize, 0, 0, -1, 0);
+  u = mm.usage();
+  assert(u.mapped_pages == 1 && u.regions == 1);
+  assert(u.largest_gap == pages - 1);
+
+  mm.reset();
+  u = mm.usage();
+  assert(u.mapped_pages == 0 && u.regions == 0 && u.largest_gap == pages);
+}
+
+static void test_usage_matches_scan() {
+  // The incrementally kept totals agree with a page-by-page scan after
+  // random operations.
+  AddrSpace mm;
+  assert(mm.init(kBase, kSize, kPageSize));
+  const int pages = kSize / kPageSize;
+  srand(5);
+  for (int op = 0; op < 3000; op++) {
+    uintptr_t addr = kBase + (rand() % pages) * kPageSize;
+    size_t len = (1 + rand() % 12) * kPageSize;
+    int prot = rand() % 8;
+    switch (rand() % 6) {
+    case 0:
+    case 1:
+      mm.map_at(addr, len, prot, 0, -1, 0);
+      break;
+    case 2:
+      mm.unmap(addr, len);
+      break;
+    case 3:
+      mm.protect(addr, len, prot);
+      break;
+    case 4:
+      mm.map_any(rand() % 2 ? addr : 0, len, prot, 0, -1, 0);
+      break;
+    case 5:
+      if (rand() % 20 == 0)
+        mm.mark_original();
+      else if (rand() % 20 == 0)
+        mm.unmap_non_original();
+      break;
+    }
+    uint64_t mapped = 0, prot_pages[mmap::kProtClasses] = {};
+    uint64_t gap = 0, largest = 0;
+    for (int i = 0; i < pages; i++) {
+      MapInfo info;
+      if (mm.query_page(kBase + i * kPageSize, &info)) {
+        mapped++;
+        prot_pages[info.prot]++;
+        gap = 0;
+      } else if (++gap > largest) {
+        largest = gap;
+      }
+    }
+    mmap::Usage u = mm.usage();
+    assert(u.mapped_pages == mapped);
+    for (size_t p = 0; p < mmap::kProtClasses; p++)
+      assert(u.prot_pages[p] == prot_pages[p]);
+    assert(u.largest_gap == largest);
+  }
+}
+
+static void test_limit() {
+  FILE *f = tmpfile();
+  assert(f);
+  TraceWriter writer(f);
+  AddrSpace mm;
+  mm.set_trace(&writer);
+  assert(mm.init(kBase, kSize, kPageSize));
+  mm.set_limit(4 * kPageSize);
+
+  uintptr_t a = mm.map_any(0, 3 * kPageSize, 3, 0, -1, 0);
+  assert(a != (uintptr_t)-1 && mm.map_error() == Error::kOk);
+  assert(mm.map_any(0, 2 * kPageSize, 3, 0, -1, 0) == (uintptr_t)-1);
+  assert(mm.map_error() == Error::kNoMem);
+  assert(mm.map_at(kBase + 64 * kPageSize, 2 * kPageSize, 3, 0, -1, 0) ==
+         (uintptr_t)-1);
+  assert(mm.map_error() == Error::kNoMem);
+
+  // Remapping pages that are already mapped does not count twice.
+  assert(mm.map_at(a + kPageSize, 3 * kPageSize, 1, 0, -1, 0) ==
+         a + kPageSize);
+  assert(mm.usage().mapped_pages == 4);
+
+  // Failed calls leave the space unchanged.
+  assert(mm.map_at(a, 5 * kPageSize, 1, 0, -1, 0) == (uintptr_t)-1);
+  MapInfo info;
+  assert(mm.query_page(a, &info) && info.prot == 3);
+
+  assert(mm.map_at(a + 1, kPageSize, 1, 0, -1, 0) == (uintptr_t)-1);
+  assert(mm.map_error() == Error::kInval);
+
+  mm.set_limit(0);
+  assert(mm.map_any(0, 8 * kPageSize, 3, 0, -1, 0) != (uintptr_t)-1);
+
+  // A request longer than every gap fails with kNoMem.
+  assert(mm.map_any(0, kSize, 3, 0, -1, 0) == (uintptr_t)-1);
+  assert(mm.map_error() == Error::kNoMem);
+
+  // The limit is traced, so the calls it failed fail again in replay.
+  mm.set_trace(nullptr);
+  writer.flush();
+  rewind(f);
+  TraceReader reader(f);
+  AddrSpace replayed;
+  TraceRecord rec;
+  int limits = 0;
+  while (reader.next(&rec)) {
+    limits += rec.op == mmap::TraceOp::kSetLimit;
+    assert(mmap::replay(replayed, rec));
+  }
+  assert(!reader.error() && limits == 2);
+  assert(replayed.usage().mapped_pages == mm.usage().mapped_pages);
+  fclose(f);
+}
+
+template <class Space> static void test_iterate() {
+  Space mm;
+  assert(mm.init(kBase, kSize, kPageSize));
+  assert(mm.begin() == mm.end());
+  // Enough regions to leave inline storage.
+  const int n = 40;
+  for (int i = 0; i < n; i++)
+    mm.map_at(kBase + 3 * i * kPageSize, 2 * kPageSize, i % 4, 0, -1, i);
+
+  int i = 0;
+  for (mmap::Region r : mm) {
+    assert(r.start == kBase + 3 * i * kPageSize);
+    assert(r.len == 2 * kPageSize);
+    assert(r.info.prot == i % 4 && r.info.offset == i);
+    i++;
+  }
+  assert(i == n);
+
+  // A start inside a region yields that region whole.
+  auto it = mm.begin_from(kBase + 3 * 5 * kPageSize + kPageSize + 12);
+  assert((*it).start == kBase + 3 * 5 * kPageSize);
+  // A start in a gap yields the next region.
+  it = mm.begin_from(kBase + 3 * 5 * kPageSize + 2 * kPageSize);
+  assert((*it).start == kBase + 3 * 6 * kPageSize);
+  ++it;
+  assert((*it).start == kBase + 3 * 7 * kPageSize);
+
+  assert(mm.begin_from(0) == mm.begin());
+  assert(mm.begin_from(kBase + kSize) == mm.end());
+  assert(mm.begin_from(kBase + 3 * n * kPageSize) == mm.end());
+}
+
+static void test_iterate_c() {
+  struct MMapAddrSpace *mm = mmap_create(kBase, kSize, kPageSize);
+  assert(mm);
+  mmap_map_at(mm, kBase, kPageSize, 1, 0, -1, 0, nullptr, nullptr);
+  mmap_map_at(mm, kBase + 4 * kPageSize, 2 * kPageSize, 3, 0, -1, 0, nullptr,
+              nullptr);
+
+  struct MMapIter it;
+  struct MMapRegion r;
+  mmap_iter_begin(mm, 0, &it);
+  assert(mmap_iter_next(&it, &r));
+  assert(r.start == kBase && r.len == kPageSize && r.info.prot == 1);
+  assert(mmap_iter_next(&it, &r));
+  assert(r.start == kBase + 4 * kPageSize && r.len == 2 * kPageSize);
+  assert(!mmap_iter_next(&it, &r));
+
+  mmap_iter_begin(mm, kBase + 5 * kPageSize, &it);
+  assert(mmap_iter_next(&it, &r) && r.start == kBase + 4 * kPageSize);
+  assert(!mmap_iter_next(&it, &r));
+  mmap_destroy(mm);
+}
+
+// A small listing with a named anonymous region, a file mapping and a
+// shared anonymous mapping.
+static void fill_maps(AddrSpace &mm) {
+  assert(mm.init(kBase, kSize, kPageSize));
+  mm.map_at(kBase, kPageSize, 3, 0, -1, 0);
+  mm.map_at(kBase + 2 * kPageSize, 2 * kPageSize, 5, 0, 3, 0x1000);
+  mm.map_at(kBase + 4 * kPageSize, kPageSize, 3, 1, -1, 0);
+}
+
+static mmap::MapsName name_region(uintptr_t start, size_t, MapInfo info) {
+  mmap::MapsName name;
+  if (info.fd == 3) {
+    name.path = "/usr/lib/libx.so";
+    name.dev_major = 0xfe;
+    name.inode = 467394;
+  } else if (start == kBase) {
+    name.path = "[heap]";
+  }
+  return name;
+}
+
+static void test_read_maps() {
+  AddrSpace mm;
+  fill_maps(mm);
+  const std::string expected =
+      "00010000-00011000 rw-p 00000000 00:00 0" + std::string(34, ' ') +
+      "[heap]\n"
+      "00012000-00014000 r-xp 00001000 fe:00 467394" +
+      std::string(29, ' ') +
+      "/usr/lib/libx.so\n"
+      "00014000-00015000 rw-s 00000000 00:00 0 \n";
+
+  char buf[4096];
+  mmap::MapsCursor cursor;
+  size_t n = mm.read_maps(&cursor, buf, sizeof(buf), name_region);
+  assert(std::string(buf, n) == expected);
+  assert(mm.read_maps(&cursor, buf, sizeof(buf), name_region) == 0);
+
+  // Reads of any size split lines and resume where they stopped.
+  for (size_t chunk : {1, 7, 64, 100}) {
+    std::string got;
+    mmap::MapsCursor c;
+    while ((n = mm.read_maps(&c, buf, chunk, name_region)) > 0) {
+      assert(n <= chunk);
+      got.append(buf, n);
+    }
+    assert(got == expected);
+  }
+
+  // Without a resolver no region has a path.
+  mmap::MapsCursor c;
+  n = mm.read_maps(&c, buf, sizeof(buf));
+  assert(std::string(buf, n).find('/') == std::string::npos);
+  assert(std::string(buf, n).find("00 0 \n") != std::string::npos);
+}
+
+static void test_read_maps_changes() {
+  // A listing read in pieces continues after the last region returned even
+  // if the mapping changes in between.
+  AddrSpace mm;
+  fill_maps(mm);
+  char buf[4096];
+  mmap::MapsCursor cursor;
+  size_t first = mm.read_maps(&cursor, buf, 90, name_region);
+  std::string got(buf, first);
+  mm.map_at(kBase + kPageSize, kPageSize, 3, 0, -1, 0);
+  mm.map_at(kBase + 8 * kPageSize, kPageSize, 1, 0, -1, 0);
+  size_t n;
+  while ((n = mm.read_maps(&cursor, buf, 90, name_region)) > 0)
+    got.append(buf, n);
+  // The heap was listed before it grew; the new region at the end is
+  // listed.
+  assert(got.find("00010000-00011000") == 0);
+  assert(got.find("00011000-") == std::string::npos);
+  assert(got.find("00018000-00019000 r--p") != std::string::npos);
+  size_t lines = 0;
+  for (char ch : got)
+    lines += ch == '\n';
+  assert(lines == 4);
+}
+
+static void test_read_maps_wide_fields() {
+  // Addresses and offsets above 32 bits widen their columns; the path is
+  // still preceded by a space.
+  AddrSpace mm;
+  const uintptr_t base = 0x7f0000000000;
+  assert(mm.init(base, 1 << 20, kPageSize));
+  mm.map_at(base, kPageSize, 7, 0, 3, 0x123456789);
+  char buf[256];
+  mmap::MapsCursor cursor;
+  size_t n = mm.read_maps(&cursor, buf, sizeof(buf),
+                          [](uintptr_t, size_t, MapInfo) {
+                            mmap::MapsName name;
+                            name.path = "/x";
+                            name.dev_minor = 0x12345;
+                            name.inode = 18446744073709551615u;
+                            return name;
+                          });
+  const std::string prefix = "7f0000000000-7f0000001000 rwxp 123456789 "
+                             "00:12345 18446744073709551615 ";
+  std::string expected =
+      prefix + std::string(72 - prefix.size(), ' ') + " /x\n";
+  assert(std::string(buf, n) == expected);
+}
+
+// A temporary file holding 'text', positioned at its start.
+static FILE *text_file(const std::string &text) {
+  FILE *f = tmpfile();
+  assert(f);
+  fwrite(text.data(), 1, text.size(), f);
+  rewind(f);
+  return f;
+}
+
+static void test_import_maps() {
+  // A listing read back from one address space rebuilds it in another.
+  AddrSpace src;
+  fill_maps(src);
+  std::string text;
+  char buf[4096];
+  mmap::MapsCursor cursor;
+  while (size_t n = src.read_maps(&cursor, buf, sizeof(buf), name_region))
+    text.append(buf, n);
+  FILE *f = text_file(text);
+  AddrSpace mm;
+  assert(mm.init(kBase, kSize, kPageSize));
+  mm.map_at(kBase + 16 * kPageSize, kPageSize, 1, 0, -1, 0);
+  assert(mm.import_maps(f, true) == Error::kOk);
+  fclose(f);
+
+  auto a = src.begin();
+  for (mmap::Region r : mm) {
+    mmap::Region want = *a++;
+    assert(r.start == want.start && r.len == want.len);
+    assert(r.info.prot == want.info.prot);
+    assert(r.info.flags == (want.info.flags & 1 ? 1 : 2));
+    assert(r.info.fd == -1);
+    assert(r.info.offset == want.info.offset);
+    assert(r.info.original);
+  }
+  assert(a == src.end());
+  assert(mm.usage().mapped_pages == 4);
+  assert(mm.usage().prot_pages[3] == 2);
+  assert(mm.usage().largest_gap == src.usage().largest_gap);
+  mm.map_at(kBase + 8 * kPageSize, kPageSize, 1, 0, -1, 0);
+  mm.unmap_non_original();
+  assert(mm.usage().regions == 3);
+
+  // Regions are clipped to the address space, a path longer than the read
+  // buffer is skipped, and the last line needs no newline.
+  std::string lines = "00001000-00011000 r--p 00000000 00:00 0\n"
+                      "00011000-00012000 rw-p 00000000 08:01 12 /" +
+                      std::string(10000, 'x') +
+                      "\n"
+                      "00012000-00013000 rw-p 00000000 00:00 0\n"
+                      "ffffffffff600000-ffffffffff601000 --xp 00000000 00:00 0";
+  f = text_file(lines);
+  assert(mm.import_maps(f) == Error::kOk);
+  fclose(f);
+  auto it = mm.begin();
+  mmap::Region r = *it++;
+  assert(r.start == kBase && r.len == kPageSize && r.info.prot == 1);
+  assert(!r.info.original);
+  // The two rw-p lines coalesce.
+  r = *it++;
+  assert(r.start == kBase + kPageSize && r.len == 2 * kPageSize);
+  assert(it == mm.end());
+}
+
+static void test_import_maps_errors() {
+  const char *bad[] = {
+      "00010000-00011000 rw-p 00000000 00:00 0\n"
+      "00010000-00012000 rw-p 00000000 00:00 0\n",
+      "00012000-00011000 rw-p 00000000 00:00 0\n",
+      "00010000-00011000 rw?p 00000000 00:00 0\n",
+      "00010000-00011000 rw-p 00000000 00:00\n",
+      "00010000 rw-p 00000000 00:00 0\n",
+      "\n",
+  };
+  for (const char *text : bad) {
+    // A failed import leaves nothing mapped.
+    AddrSpace mm;
+    fill_maps(mm);
+    FILE *f = text_file(text);
+    assert(mm.import_maps(f) == Error::kInval);
+    fclose(f);
+    assert(mm.begin() == mm.end());
+    assert(mm.usage().mapped_pages == 0);
+    assert(mm.usage().largest_gap == kSize / kPageSize);
+  }
+
+  // So does one over the limit, which is checked like load_regions does.
+  AddrSpace mm;
+  fill_maps(mm);
+  mm.set_limit(2 * kPageSize);
+  FILE *f = text_file("00010000-00012000 rw-p 00000000 00:00 0\n"
+                      "00020000-00021000 rw-p 00000000 00:00 0\n");
+  assert(mm.import_maps(f) == Error::kNoMem);
+  fclose(f);
+  assert(mm.begin() == mm.end());
+  assert(mm.usage().mapped_pages == 0);
+  assert(mm.usage().largest_gap == kSize / kPageSize);
+  f = text_file("00010000-00012000 rw-p 00000000 00:00 0\n");
+  assert(mm.import_maps(f) == Error::kOk);
+  fclose(f);
+  assert(mm.usage().mapped_pages == 2);
+
+  mmap::MapsLine line;
+  const char ok[] = "7f00-8f00 r-xs 1f 0a:3 42   /a b";
+  assert(mmap::parse_maps_line(ok, ok + sizeof(ok) - 1, &line));
+  assert(line.start == 0x7f00 && line.end == 0x8f00);
+  assert(line.prot == 5 && line.flags == 1 && line.offset == 0x1f);
+  assert(line.dev_major == 10 && line.dev_minor == 3 && line.inode == 42);
+  assert(std::string(line.path, line.path_len) == "/a b");
+
+  struct MMapAddrSpace *c = mmap_create(kBase, kSize, kPageSize);
+  f = text_file("00010000-00012000 r--p 00000000 00:00 0\n");
+  mmap_set_limit(c, kPageSize);
+  assert(mmap_import_maps(c, f, true) == MMAP_NOMEM);
+  fclose(f);
+  mmap_set_limit(c, 0);
+  f = text_file("00010000-00012000 r--p 00000000 00:00 0\n");
+  assert(mmap_import_maps(c, f, true) == MMAP_OK);
+  fclose(f);
+  struct MMapInfo info;
+  assert(mmap_query_page(c, kBase + kPageSize, &info) && info.original);
+  mmap_destroy(c);
+}
+
+template <class Space> static void test_load_regions() {
+  FILE *f = tmpfile();
+  assert(f);
+  TraceWriter writer(f);
+  Space mm;
+  mm.set_trace(&writer);
+  assert(mm.init(kBase, kSize, kPageSize));
+  mm.map_at(kBase + 32 * kPageSize, kPageSize, 1, 0, -1, 0);
+  const mmap::Region regions[] = {
+      {kBase, kPageSize, {3, 2, -1, 0, true}},
+      // Coalesces with the first region.
+      {kBase + kPageSize, 2 * kPageSize, {3, 2, -1, 0, true}},
+      {kBase + 3 * kPageSize, kPageSize, {5, 2, 4, 0x1000, false}},
+      {kBase + 8 * kPageSize, 100, {1, 1, -1, 0, true}},
+  };
+  assert(mm.load_regions(regions, 4) == Error::kOk);
+  auto it = mm.begin();
+  mmap::Region r = *it++;
+  assert(r.start == kBase && r.len == 3 * kPageSize && r.info.original);
+  r = *it++;
+  assert(r.start == kBase + 3 * kPageSize && r.info.fd == 4);
+  assert(!r.info.original);
+  r = *it++;
+  assert(r.start == kBase + 8 * kPageSize && r.len == kPageSize);
+  assert(it == mm.end());
+  mmap::Usage u = mm.usage();
+  assert(u.mapped_pages == 5 && u.regions == 3);
+  assert(u.prot_pages[3] == 3 && u.prot_pages[5] == 1);
+  assert(u.largest_gap == kSize / kPageSize - 9);
+
+  // Bad input changes nothing.
+  const mmap::Region overlap[] = {
+      {kBase, 2 * kPageSize, {1, 0, -1, 0, false}},
+      {kBase + kPageSize, kPageSize, {1, 0, -1, 0, false}},
+  };
+  assert(mm.load_regions(overlap, 2) == Error::kInval);
+  const mmap::Region unaligned[] = {{kBase + 1, 1, {1, 0, -1, 0, false}}};
+  assert(mm.load_regions(unaligned, 1) == Error::kInval);
+  const mmap::Region outside[] = {{kBase + kSize, 1, {1, 0, -1, 0, false}}};
+  assert(mm.load_regions(outside, 1) == Error::kInval);
+  mm.set_limit(4 * kPageSize);
+  assert(mm.load_regions(regions, 4) == Error::kNoMem);
+  mm.set_limit(0);
+  assert(mm.usage().mapped_pages == 5);
+
+  // The trace rebuilds the same regions, originals included.
+  mm.set_trace(nullptr);
+  writer.flush();
+  rewind(f);
+  TraceReader reader(f);
+  Space replayed;
+  TraceRecord rec;
+  while (reader.next(&rec))
+    assert(mmap::replay(replayed, rec));
+  fclose(f);
+  auto a = mm.begin();
+  for (mmap::Region b : replayed) {
+    mmap::Region want = *a++;
+    assert(b.start == want.start && b.len == want.len);
+    assert(b.info == want.info);
+  }
+  assert(a == mm.end());
+
+  assert(mm.load_regions(nullptr, 0) == Error::kOk);
+  assert(mm.begin() == mm.end());
+  assert(mm.usage().largest_gap == kSize / kPageSize);
+}
+
+static void test_load_regions_c() {
+  struct MMapAddrSpace *c = mmap_create(kBase, kSize, kPageSize);
+  struct MMapRegion regions[] = {
+      {kBase, kPageSize, {1, 2, -1, 0, false}},
+      {kBase + 4 * kPageSize, kPageSize, {3, 2, -1, 0, true}},
+  };
+  assert(mmap_load_regions(c, regions, 2) == MMAP_OK);
+  struct MMapInfo info;
+  assert(mmap_query_page(c, kBase + 4 * kPageSize, &info) && info.original);
+  assert(mmap_load_regions(c, regions + 1, 1) == MMAP_OK);
+  assert(!mmap_query_page(c, kBase, &info));
+  std::swap(regions[0], regions[1]);
+  assert(mmap_load_regions(c, regions, 2) == MMAP_INVAL);
+  mmap_destroy(c);
+}
+
+template <class Space> static bool same_regions(Space &a, Space &b) {
+  auto it = b.begin();
+  for (mmap::Region r : a) {
+    if (it == b.end())
+      return false;
+    mmap::Region o = *it++;
+    if (r.start != o.start || r.len != o.len || !(r.info == o.info))
+      return false;
+  }
+  return it == b.end();
+}
+
+template <class Space> static void test_serialize() {
+  Space mm;
+  assert(mm.init(kBase, kSize, kPageSize));
+  srand(11);
+  for (int i = 0; i < 200; i++) {
+    uintptr_t addr = kBase + (rand() % (kSize / kPageSize - 8)) * kPageSize;
+    mm.map_at(addr, (1 + rand() % 4) * kPageSize, rand() % 4, rand() % 2,
+              -1, i % 50 ? 0 : -4096);
+    if (i == 100)
+      mm.mark_original();
+  }
+
+  size_t size = mm.serialize(nullptr, 0);
+  std::vector<uint8_t> buf(size);
+  assert(mm.serialize(buf.data(), buf.size()) == size);
+  // Delta-coded pages and a dictionary of the few distinct infos keep
+  // regions to a few bytes each.
+  assert(size < 200 + 4 * mm.usage().regions);
+
+  // The copy needs no init(); the parameters come with the data.
+  Space copy;
+  assert(copy.deserialize(buf.data(), size) == Error::kOk);
+  assert(same_regions(mm, copy));
+  assert(copy.usage().mapped_pages == mm.usage().mapped_pages);
+  assert(copy.usage().largest_gap == mm.usage().largest_gap);
+
+  // A short buffer gets a prefix and the full size.
+  std::vector<uint8_t> part(size / 2);
+  assert(mm.serialize(part.data(), part.size()) == size);
+  assert(std::equal(part.begin(), part.end(), buf.begin()));
+
+  // Any truncation is rejected without touching the target.
+  for (size_t n = 0; n < size; n++)
+    assert(copy.deserialize(buf.data(), n) == Error::kInval);
+  std::vector<uint8_t> longer = buf;
+  longer.push_back(0);
+  assert(copy.deserialize(longer.data(), longer.size()) == Error::kInval);
+  std::vector<uint8_t> version = buf;
+  version[7]++;
+  assert(copy.deserialize(version.data(), version.size()) == Error::kInval);
+  copy.set_limit(kPageSize);
+  assert(copy.deserialize(buf.data(), size) == Error::kNoMem);
+  assert(same_regions(mm, copy));
+  copy.set_limit(0);
+  assert(copy.map_any(0, kSize, 1, 0, -1, 0) == (uintptr_t)-1);
+  assert(copy.map_at(kBase + kSize - kPageSize, kPageSize, 1, 0, -1, 0) ==
+         kBase + kSize - kPageSize);
+}
+
+static void test_serialize_across_layouts() {
+  // Data is portable between layouts, but not to a fixed page size that
+  // differs.
+  AddrSpace16K mm16;
+  assert(mm16.init(kBase, kSize, 16384));
+  mm16.map_at(kBase, 16384, 3, 0, -1, 0);
+  std::vector<uint8_t> buf(mm16.serialize(nullptr, 0));
+  mm16.serialize(buf.data(), buf.size());
+  AddrSpace4K mm4;
+  assert(mm4.deserialize(buf.data(), buf.size()) == Error::kInval);
+  CompactAddrSpace compact;
+  assert(compact.deserialize(buf.data(), buf.size()) == Error::kOk);
+  MapInfo info;
+  assert(compact.query_page(kBase + 16383, &info) && info.prot == 3);
+
+  // Deserializing is traced as an init and a load.
+  FILE *f = tmpfile();
+  assert(f);
+  TraceWriter writer(f);
+  AddrSpace traced;
+  traced.set_trace(&writer);
+  assert(traced.deserialize(buf.data(), buf.size()) == Error::kOk);
+  traced.set_trace(nullptr);
+  writer.flush();
+  rewind(f);
+  TraceReader reader(f);
+  AddrSpace replayed;
+  TraceRecord rec;
+  while (reader.next(&rec))
+    assert(mmap::replay(replayed, rec));
+  fclose(f);
+  assert(same_regions(traced, replayed));
+}
+
+static void test_serialize_c() {
+  struct MMapAddrSpace *a = mmap_create(kBase, kSize, kPageSize);
+  struct MMapAddrSpace *b = mmap_create(0, kPageSize, kPageSize);
+  mmap_map_at(a, kBase + kPageSize, kPageSize, 1, 0, -1, 0, NULL, NULL);
+  uint8_t data[64];
+  size_t n = mmap_serialize(a, data, sizeof(data));
+  assert(n <= sizeof(data));
+  assert(mmap_deserialize(b, data, n) == MMAP_OK);
+  struct MMapInfo cinfo;
+  assert(mmap_query_page(b, kBase + kPageSize, &cinfo) && cinfo.prot == 1);
+  assert(mmap_deserialize(b, data, n - 1) == MMAP_INVAL);
+  mmap_destroy(a);
+  mmap_destroy(b);
+}
+
+// Freeze 'mm' into 'image', which holds uint64_t for alignment.
+template <class Space>
+static void freeze_into(const Space &mm, std::vector<uint64_t> *image) {
+  size_t size = mm.freeze(nullptr, 0);
+  image->assign((size + 7) / 8, 0);
+  assert(mm.freeze(image->data(), size) == size);
+}
+
+template <class Space> static void test_freeze() {
+  for (int count : {0, 1, 2, 3, 7, 8, 80}) {
+    Space mm;
+    assert(mm.init(kBase, kSize, kPageSize));
+    for (int i = 0; i < count; i++)
+      mm.map_at(kBase + 3 * i * kPageSize, (1 + i % 2) * kPageSize, i % 3, 0,
+                i % 5 - 1, 0);
+    if (count > 2)
+      mm.mark_original();
+    std::vector<uint64_t> image;
+    freeze_into(mm, &image);
+    size_t size = mm.freeze(nullptr, 0);
+
+    mmap::FrozenAddrSpace frozen;
+    assert(frozen.open(image.data(), size));
+    assert(frozen.size() == mm.usage().regions);
+    assert(frozen.start() == kBase && frozen.len() == kSize);
+    for (uintptr_t a = kBase - kPageSize; a < kBase + kSize; a += 2048) {
+      MapInfo want{}, got{};
+      bool found = mm.query_page(a, &want);
+      assert(frozen.query_page(a, &got) == found);
+      assert(!found || got == want);
+    }
+    auto it = mm.begin();
+    for (mmap::Region r : frozen) {
+      mmap::Region want = *it++;
+      assert(r.start == want.start && r.len == want.len);
+      assert(r.info == want.info);
+    }
+    assert(it == mm.end());
+
+    Space thawed;
+    assert(thawed.thaw(frozen) == Error::kOk);
+    assert(same_regions(mm, thawed));
+    assert(thawed.usage().mapped_pages == mm.usage().mapped_pages);
+    assert(thawed.usage().largest_gap == mm.usage().largest_gap);
+  }
+}
+
+static void test_freeze_errors() {
+  AddrSpace mm;
+  fill_maps(mm);
+  std::vector<uint64_t> image;
+  freeze_into(mm, &image);
+  size_t size = mm.freeze(nullptr, 0);
+  mmap::FrozenAddrSpace frozen;
+  // Only the header is checked on open.
+  assert(!frozen.open(image.data(), size - 1));
+  assert(!frozen.open(reinterpret_cast<char *>(image.data()) + 1, size));
+  std::vector<uint64_t> bad = image;
+  bad[0] ^= 1;
+  assert(!frozen.open(bad.data(), size));
+
+  // Thawing checks the page size and the regions.
+  assert(frozen.open(image.data(), size));
+  AddrSpace16K mm16;
+  assert(mm16.thaw(frozen) == Error::kInval);
+  AddrSpace4K mm4;
+  mm4.set_limit(kPageSize);
+  assert(mm4.thaw(frozen) == Error::kNoMem);
+  mm4.set_limit(0);
+  assert(mm4.thaw(frozen) == Error::kOk);
+  mmap::FrozenHeader hdr;
+  memcpy(&hdr, image.data(), sizeof(hdr));
+  bad = image;
+  // Swap the first two regions' positions in the tree.
+  uint64_t *starts = bad.data() + sizeof(hdr) / 8;
+  std::swap(starts[1], starts[2]);
+  assert(frozen.open(bad.data(), size));
+  assert(mm4.thaw(frozen) == Error::kInval);
+  assert(mm4.usage().regions == hdr.regions);
+}
+
+static void test_freeze_c() {
+  struct MMapAddrSpace *c = mmap_create(kBase, kSize, kPageSize);
+  mmap_map_at(c, kBase, kPageSize, 5, 0, -1, 0, NULL, NULL);
+  mmap_map_at(c, kBase + 4 * kPageSize, 2 * kPageSize, 3, 0, -1, 0, NULL,
+              NULL);
+  size_t size = mmap_freeze(c, NULL, 0);
+  std::vector<uint64_t> image((size + 7) / 8);
+  assert(mmap_freeze(c, image.data(), size) == size);
+  struct MMapFrozen *cf = mmap_frozen_open(image.data(), size);
+  assert(cf);
+  struct MMapInfo info;
+  assert(mmap_frozen_query_page(cf, kBase, &info) && info.prot == 5);
+  assert(!mmap_frozen_query_page(cf, kBase + kPageSize, &info));
+  // The frozen iterator yields what the live one does.
+  struct MMapIter it, frozen_it;
+  struct MMapRegion r, fr;
+  mmap_iter_begin(c, 0, &it);
+  mmap_frozen_iter_begin(cf, &frozen_it);
+  size_t n = 0;
+  while (mmap_iter_next(&it, &r)) {
+    assert(mmap_frozen_iter_next(&frozen_it, &fr));
+    assert(fr.start == r.start && fr.len == r.len);
+    assert(fr.info.prot == r.info.prot && fr.info.fd == r.info.fd);
+    n++;
+  }
+  assert(n == 2);
+  assert(!mmap_frozen_iter_next(&frozen_it, &fr));
+  mmap_reset(c);
+  assert(mmap_thaw(c, cf) == MMAP_OK);
+  assert(mmap_query_page(c, kBase, &info) && info.prot == 5);
+  mmap_frozen_close(cf);
+  assert(!mmap_frozen_open(image.data(), size - 8));
+  mmap_destroy(c);
+}
+
+template <class Space> static void test_freeze_regions() {
+  Space mm;
+  assert(mm.init(kBase, kSize, kPageSize));
+  for (int i = 0; i < 60; i++)
+    mm.map_at(kBase + 4 * i * kPageSize, (1 + i % 3) * kPageSize, i % 4, 0, -1,
+              0);
+  std::vector<MapInfo> want;
+  for (uintptr_t a = kBase; a < kBase + kSize; a += kPageSize) {
+    MapInfo info{};
+    if (!mm.query_page(a, &info))
+      info.prot = -1;
+    want.push_back(info);
+  }
+  mm.freeze_regions();
+  for (size_t i = 0; i < want.size(); i++) {
+    MapInfo info{};
+    assert(mm.query_page(kBase + i * kPageSize, &info) == (want[i].prot >= 0));
+    assert(want[i].prot < 0 || info == want[i]);
+  }
+  // Changes go to the tree as usual.
+  uintptr_t addr = mm.map_any(0, kPageSize, 7, 0, -1, 0);
+  assert(addr != (uintptr_t)-1);
+  MapInfo info;
+  assert(mm.query_page(addr, &info) && info.prot == 7);
+  mm.freeze_regions();
+  assert(mm.unmap(kBase, 8 * kPageSize) == Error::kOk);
+  assert(!mm.query_page(kBase, &info));
+  assert(mm.query_page(kBase + 8 * kPageSize, &info));
+}
+
+static void test_freeze_regions_c() {
+  struct MMapAddrSpace *c = mmap_create(kBase, kSize, kPageSize);
+  assert(mmap_map_at(c, kBase, kPageSize, 3, 0, -1, 0, NULL, NULL) == kBase);
+  mmap_freeze_regions(c);
+  struct MMapInfo info;
+  assert(mmap_query_page(c, kBase, &info) && info.prot == 3);
+  mmap_destroy(c);
+}
+
+// Check that 'shared' holds the regions and usage of 'mm'.
+template <class Space>
+static void check_shared(const Space &mm, const SharedAddrSpace &shared) {
+  std::vector<mmap::Region> rs(300);
+  size_t count = 0;
+  assert(shared.regions(rs.data(), rs.size(), &count) == SharedRead::kOk);
+  assert(count <= rs.size());
+  rs.resize(count);
+  auto it = mm.begin();
+  for (const mmap::Region &r : rs) {
+    assert(it != mm.end());
+    mmap::Region want = *it++;
+    assert(r.start == want.start && r.len == want.len);
+    assert(r.info == want.info);
+  }
+  assert(it == mm.end());
+  mmap::Usage u, want = mm.usage();
+  assert(shared.usage(&u) == SharedRead::kOk);
+  assert(memcmp(&u, &want, sizeof(u)) == 0);
+}
+
+template <class Space> static void test_share() {
+  Space mm;
+  assert(mm.init(kBase, kSize, kPageSize));
+  std::vector<uint64_t> arena(mmap::shared_arena_size(256) / 8);
+  assert(mm.share(arena.data(), arena.size() * 8));
+  SharedAddrSpace shared;
+  assert(shared.open(arena.data(), arena.size() * 8));
+  check_shared(mm, shared);
+
+  // Enough regions to split and merge many blocks.
+  const int pages = kSize / kPageSize;
+  srand(7);
+  for (int op = 0; op < 3000; op++) {
+    uintptr_t addr = kBase + (rand() % pages) * kPageSize;
+    size_t len = (1 + rand() % 4) * kPageSize;
+    int prot = rand() % 4;
+    switch (rand() % 6) {
+    case 0:
+    case 1:
+      mm.map_at(addr, len, prot, 0, -1, rand() % 8);
+      break;
+    case 2:
+      mm.unmap(addr, (1 + rand() % 16) * kPageSize);
+      break;
+    case 3:
+      mm.protect(addr, len, prot);
+      break;
+    case 4:
+      mm.map_any(addr, len, prot, 0, -1, 0);
+      break;
+    case 5:
+      if (rand() % 100 == 0)
+        mm.mark_original();
+      else if (rand() % 100 == 0)
+        mm.unmap_non_original();
+      break;
+    }
+    check_shared(mm, shared);
+    uintptr_t a = kBase + (rand() % pages) * kPageSize;
+    MapInfo want{}, got{};
+    bool found = false;
+    assert(shared.query_page(a, &got, &found) == SharedRead::kOk);
+    assert(found == mm.query_page(a, &want));
+    assert(!found || got == want);
+  }
+  mm.reset();
+  check_shared(mm, shared);
+}
+
+static void test_share_stale() {
+  // Too many regions mark the arena stale until they fit again.
+  AddrSpace mm;
+  assert(mm.init(kBase, kSize, kPageSize));
+  std::vector<uint64_t> arena(mmap::shared_arena_size(40) / 8);
+  assert(!mm.share(arena.data(), 8));
+  assert(mm.share(arena.data(), arena.size() * 8));
+  SharedAddrSpace shared;
+  assert(shared.open(arena.data(), arena.size() * 8));
+  assert(!shared.open(arena.data(), 16));
+  for (int i = 0; i < 120; i++)
+    mm.map_at(kBase + 2 * i * kPageSize, kPageSize, 1, 0, -1, 0);
+  mmap::Usage u;
+  assert(shared.usage(&u) == SharedRead::kStale);
+  assert(mm.unmap(kBase, 200 * kPageSize) == Error::kOk);
+  check_shared(mm, shared);
+
+  // A null arena stops publishing.
+  assert(mm.share(nullptr, 0));
+  mm.map_at(kBase, kPageSize, 1, 0, -1, 0);
+  assert(shared.usage(&u) == SharedRead::kOk && u.regions == 20);
+
+  std::vector<uint64_t> garbage(arena.size(), 0);
+  assert(!shared.open(garbage.data(), garbage.size() * 8));
+}
+
+static void test_share_concurrent() {
+  // Each region's offset is its start, so a torn read would show up as a
+  // region whose fields disagree.
+  AddrSpace mm;
+  assert(mm.init(kBase, kSize, kPageSize));
+  std::vector<uint64_t> arena(mmap::shared_arena_size(256) / 8);
+  assert(mm.share(arena.data(), arena.size() * 8));
+  SharedAddrSpace shared;
+  assert(shared.open(arena.data(), arena.size() * 8));
+
+  std::atomic<bool> done{false};
+  std::thread reader([&] {
+    std::vector<mmap::Region> rs(256);
+    while (!done.load()) {
+      size_t count = 0;
+      assert(shared.regions(rs.data(), rs.size(), &count) == SharedRead::kOk);
+      assert(count <= rs.size());
+      for (size_t i = 0; i < count; i++) {
+        assert(rs[i].len == kPageSize);
+        assert((uintptr_t)rs[i].info.offset == rs[i].start);
+        assert(i == 0 || rs[i - 1].start < rs[i].start);
+      }
+    }
+  });
+  const int pages = kSize / kPageSize;
+  srand(11);
+  for (int op = 0; op < 20000; op++) {
+    uintptr_t addr = kBase + (rand() % pages) * kPageSize;
+    if (rand() % 2)
+      mm.map_at(addr, kPageSize, rand() % 2 + 1, 0, -1, addr);
+    else
+      mm.unmap(addr, kPageSize);
+  }
+  done.store(true);
+  reader.join();
+  check_shared(mm, shared);
+
+  struct MMapAddrSpace *c = mmap_create(kBase, kSize, kPageSize);
+  size_t size = mmap_shared_size(16);
+  std::vector<uint64_t> carena((size + 7) / 8);
+  assert(mmap_share(c, carena.data(), size));
+  mmap_map_at(c, kBase, kPageSize, 5, 0, -1, 0, NULL, NULL);
+  struct MMapShared *cs = mmap_shared_open(carena.data(), size);
+  assert(cs);
+  struct MMapInfo info;
+  bool found = false;
+  assert(mmap_shared_query_page(cs, kBase, &info, &found) == MMAP_SHARED_OK);
+  assert(found && info.prot == 5);
+  assert(mmap_shared_query_page(cs, kBase + kPageSize, &info, &found) ==
+             MMAP_SHARED_OK &&
+         !found);
+  struct MMapUsage cu;
+  assert(mmap_shared_usage(cs, &cu) == MMAP_SHARED_OK && cu.regions == 1);
+  struct MMapRegion cr[2];
+  size_t count = 0;
+  size_t before = allocs;
+  assert(mmap_shared_regions(cs, cr, 2, &count) == MMAP_SHARED_OK);
+  assert(allocs == before);
+  assert(count == 1 && cr[0].start == kBase && cr[0].info.prot == 5);
+  mmap_shared_close(cs);
+  assert(!mmap_shared_open(carena.data(), 8));
+  mmap_destroy(c);
+}
+
+struct DiffChange {
+  mmap::DiffOp op;
+  uintptr_t start;
+  size_t len;
+  MapInfo info;
+};
+
+template <class Space>
+static std::vector<DiffChange> diff_of(Space &mm, const Space &target,
+                                       bool apply = false) {
+  std::vector<DiffChange> changes;
+  assert(mm.diff(
+             target,
+             [&](mmap::DiffOp op, uintptr_t start, size_t len, MapInfo info) {
+               changes.push_back({op, start, len, info});
+             },
+             apply) == Error::kOk);
+  return changes;
+}
+
+template <class Space> static void test_diff() {
+  const int pages = kSize / kPageSize;
+  srand(13);
+  for (int round = 0; round < 40; round++) {
+    Space mm, target;
+    assert(mm.init(kBase, kSize, kPageSize));
+    assert(target.init(kBase, kSize, kPageSize));
+    for (int op = 0; op < 60; op++) {
+      uintptr_t addr = kBase + (rand() % pages) * kPageSize;
+      size_t len = (1 + rand() % 8) * kPageSize;
+      int prot = rand() % 4;
+      int64_t offset = rand() % 3;
+      mm.map_at(addr, len, prot, 0, -1, offset);
+      // The target shares most of the layout.
+      if (rand() % 4 == 0)
+        prot = rand() % 4;
+      if (rand() % 8 != 0)
+        target.map_at(addr, len, prot, 0, -1, offset);
+      if (rand() % 8 == 0)
+        target.unmap(addr, len);
+    }
+    if (round % 5 == 0)
+      target.mark_original();
+
+    auto changes = diff_of(mm, target);
+    // Only differing pages are touched, and only a change of prot where
+    // that is all that differs.
+    std::vector<int> seen(pages, -1);
+    for (size_t i = 0; i < changes.size(); i++) {
+      const DiffChange &c = changes[i];
+      assert(c.len > 0 && c.start % kPageSize == 0 && c.len % kPageSize == 0);
+      assert(i == 0 ||
+             changes[i - 1].start + changes[i - 1].len <= c.start);
+      for (size_t a = c.start; a < c.start + c.len; a += kPageSize)
+        seen[(a - kBase) / kPageSize] = (int)c.op;
+      // Neighbors that one call could make are merged.
+      if (i > 0 && changes[i - 1].start + changes[i - 1].len == c.start &&
+          changes[i - 1].op == c.op) {
+        assert(c.op != mmap::DiffOp::kUnmap);
+        if (c.op == mmap::DiffOp::kMap)
+          assert(!(changes[i - 1].info == c.info));
+        else
+          assert(changes[i - 1].info.prot != c.info.prot);
+      }
+    }
+    for (int i = 0; i < pages; i++) {
+      MapInfo cur{}, want{};
+      bool has_cur = mm.query_page(kBase + i * kPageSize, &cur);
+      bool has_want = target.query_page(kBase + i * kPageSize, &want);
+      // The host never sees 'original', so it is no reason to change.
+      cur.original = want.original;
+      int expect = -1;
+      if (has_cur && !has_want)
+        expect = (int)mmap::DiffOp::kUnmap;
+      else if (has_want && (!has_cur || !(cur == want)))
+        expect = (int)mmap::DiffOp::kMap;
+      if (expect == (int)mmap::DiffOp::kMap && has_cur) {
+        cur.prot = want.prot;
+        if (cur == want)
+          expect = (int)mmap::DiffOp::kProtect;
+      }
+      assert(seen[i] == expect);
+    }
+
+    auto applied = diff_of(mm, target, true);
+    assert(applied.size() == changes.size());
+    assert(same_regions(mm, target));
+    mmap::Usage a = mm.usage(), b = target.usage();
+    assert(memcmp(&a, &b, sizeof(a)) == 0);
+    assert(diff_of(mm, target).empty());
+  }
+}
+
+static void test_diff_example() {
+  AddrSpace mm, target;
+  assert(mm.init(kBase, kSize, kPageSize));
+  assert(target.init(kBase, kSize, kPageSize));
+  auto page = [](int i) { return kBase + i * kPageSize; };
+  mm.map_at(page(0), 4 * kPageSize, 1, 0, -1, 0);
+  mm.map_at(page(4), 4 * kPageSize, 1, 0, 3, 0);
+  mm.map_at(page(10), 2 * kPageSize, 2, 0, -1, 0);
+  mm.map_at(page(12), 2 * kPageSize, 1, 0, 4, 0);
+  mm.map_at(page(14), 2 * kPageSize, 1, 0, 5, 0);
+  target.map_at(page(0), 4 * kPageSize, 3, 0, -1, 0);
+  target.map_at(page(4), 6 * kPageSize, 1, 0, 3, 0);
+  target.map_at(page(12), 2 * kPageSize, 5, 0, 4, 0);
+  target.map_at(page(14), 2 * kPageSize, 5, 0, 5, 0);
+  auto changes = diff_of(mm, target);
+  assert(changes.size() == 4);
+  assert(changes[0].op == mmap::DiffOp::kProtect);
+  assert(changes[0].start == page(0));
+  assert(changes[0].len == 4 * kPageSize && changes[0].info.prot == 3);
+  // [4, 8) already matches.
+  assert(changes[1].op == mmap::DiffOp::kMap && changes[1].start == page(8));
+  assert(changes[1].len == 2 * kPageSize && changes[1].info.fd == 3);
+  assert(changes[2].op == mmap::DiffOp::kUnmap);
+  assert(changes[2].start == page(10));
+  assert(changes[2].len == 2 * kPageSize);
+  // Two regions that change only in prot take one call.
+  assert(changes[3].op == mmap::DiffOp::kProtect);
+  assert(changes[3].start == page(12));
+  assert(changes[3].len == 4 * kPageSize && changes[3].info.prot == 5);
+
+  AddrSpace other;
+  assert(other.init(kBase, kSize / 2, kPageSize));
+  assert(mm.diff(other, nullptr) == Error::kInval);
+  assert(mm.diff(target, nullptr) == Error::kOk);
+  assert(diff_of(mm, target).size() == 4);
+
+  // An applied diff is traced as a reset and load.
+  FILE *f = tmpfile();
+  assert(f);
+  TraceWriter writer(f);
+  mm.set_trace(&writer);
+  assert(mm.diff(target, nullptr, true) == Error::kOk);
+  mm.set_trace(nullptr);
+  writer.flush();
+  rewind(f);
+  TraceReader reader(f);
+  AddrSpace replayed;
+  assert(replayed.init(kBase, kSize, kPageSize));
+  TraceRecord rec;
+  while (reader.next(&rec))
+    assert(mmap::replay(replayed, rec));
+  assert(same_regions(replayed, target));
+  fclose(f);
+}
+
+static void test_diff_c() {
+  struct MMapAddrSpace *c = mmap_create(kBase, kSize, kPageSize);
+  struct MMapAddrSpace *ct = mmap_create(kBase, kSize, kPageSize);
+  mmap_map_at(c, kBase, 2 * kPageSize, 1, 0, -1, 0, NULL, NULL);
+  mmap_map_at(ct, kBase, 2 * kPageSize, 3, 0, -1, 0, NULL, NULL);
+  mmap_map_at(ct, kBase + 4 * kPageSize, kPageSize, 1, 0, -1, 0, NULL, NULL);
+  int ops[3] = {0, 0, 0};
+  auto count = [](enum MMapDiffOp op, uintptr_t, size_t, struct MMapInfo,
+                  void *udata) { static_cast<int *>(udata)[op]++; };
+  assert(mmap_diff(c, ct, count, ops, true) == MMAP_OK);
+  assert(ops[MMAP_DIFF_PROTECT] == 1 && ops[MMAP_DIFF_MAP] == 1);
+  assert(ops[MMAP_DIFF_UNMAP] == 0);
+  struct MMapInfo info;
+  assert(mmap_query_page(c, kBase, &info) && info.prot == 3);
+  assert(mmap_query_page(c, kBase + 4 * kPageSize, &info));
+  assert(mmap_diff(c, ct, NULL, NULL, false) == MMAP_OK);
+  mmap_destroy(ct);
+  mmap_destroy(c);
+}
+
+static void test_diff_original() {
+  // 'original' is never a reason to remap: a region that differs only in it
+  // needs no change, and applying the diff sets it in place.
+  auto page = [](int i) { return kBase + i * kPageSize; };
+  AddrSpace orig, plain;
+  assert(orig.init(kBase, kSize, kPageSize));
+  assert(plain.init(kBase, kSize, kPageSize));
+  orig.map_at(page(0), 4 * kPageSize, 1, 0, 3, 0);
+  orig.map_at(page(6), 2 * kPageSize, 1, 0, -1, 0);
+  orig.mark_original();
+  plain.map_at(page(0), 4 * kPageSize, 1, 0, 3, 0);
+  plain.map_at(page(6), kPageSize, 3, 0, -1, 0);
+  plain.map_at(page(7), kPageSize, 1, 0, -1, 0);
+  auto check = [&](AddrSpace &from, AddrSpace &to) {
+    auto d = diff_of(from, to);
+    assert(d.size() == 1);
+    assert(d[0].op == mmap::DiffOp::kProtect && d[0].start == page(6));
+    assert(d[0].len == kPageSize);
+  };
+  check(orig, plain);
+  check(plain, orig);
+  assert(orig.begin_txn());
+  assert(orig.diff(plain, nullptr, true) == Error::kOk);
+  assert(same_regions(orig, plain));
+  orig.rollback();
+  MapInfo mi;
+  assert(orig.query_page(page(7), &mi) && mi.original && mi.prot == 1);
+  assert(plain.diff(orig, nullptr, true) == Error::kOk);
+  assert(same_regions(plain, orig));
+  assert(plain.query_page(page(0), &mi) && mi.original);
+}
+
+template <class Space>
+static void random_change(Space &mm, const Space &other, int pages) {
+  uintptr_t addr = kBase + (rand() % pages) * kPageSize;
+  size_t len = (1 + rand() % 8) * kPageSize;
+  int prot = rand() % 4;
+  switch (rand() % 10) {
+  case 0:
+  case 1:
+    mm.map_at(addr, len, prot, 0, -1, rand() % 4);
+    break;
+  case 2:
+    mm.unmap(addr, len);
+    break;
+  case 3:
+    mm.protect(addr, len, prot);
+    break;
+  case 4:
+    mm.map_any(addr, len, prot, 0, -1, 0);
+    break;
+  case 5:
+    mm.mark_original();
+    break;
+  case 6:
+    mm.unmap_non_original();
+    break;
+  case 7:
+    if (rand() % 4 == 0)
+      mm.reset();
+    break;
+  case 8: {
+    if (rand() % 2) {
+      assert(mm.diff(other, nullptr, true) == Error::kOk);
+    } else {
+      std::vector<mmap::Region> rs(other.begin(), other.end());
+      assert(mm.load_regions(rs.data(), rs.size()) == Error::kOk);
+    }
+    break;
+  }
+  case 9:
+    mm.map_at_noreplace(addr, len, prot, 0, -1, 0);
+    break;
+  }
+}
+
+template <class Space> static void test_txn() {
+  const int pages = kSize / kPageSize;
+  srand(17);
+  Space mm, other;
+  assert(mm.init(kBase, kSize, kPageSize));
+  assert(other.init(kBase, kSize, kPageSize));
+  for (int i = 0; i < 20; i++)
+    other.map_at(kBase + 7 * i * kPageSize, 3 * kPageSize, i % 4, 0, -1, 0);
+  // Rollbacks reach a shared arena like any other change.
+  std::vector<uint64_t> arena(mmap::shared_arena_size(256) / 8);
+  assert(mm.share(arena.data(), arena.size() * 8));
+  SharedAddrSpace shared;
+  assert(shared.open(arena.data(), arena.size() * 8));
+  for (int round = 0; round < 200; round++) {
+    std::vector<mmap::Region> before(mm.begin(), mm.end());
+    mmap::Usage usage = mm.usage();
+    assert(mm.begin_txn() && mm.in_txn());
+    assert(!mm.begin_txn());
+    int changes = 1 + rand() % 6;
+    for (int i = 0; i < changes; i++)
+      random_change(mm, other, pages);
+    if (rand() % 3 == 0) {
+      mm.commit();
+      assert(!mm.in_txn());
+      continue;
+    }
+    mm.rollback();
+    assert(!mm.in_txn());
+    size_t i = 0;
+    for (mmap::Region r : mm) {
+      assert(i < before.size());
+      assert(r.start == before[i].start && r.len == before[i].len);
+      assert(r.info == before[i].info);
+      i++;
+    }
+    assert(i == before.size());
+    mmap::Usage now = mm.usage();
+    assert(memcmp(&now, &usage, sizeof(now)) == 0);
+    check_shared(mm, shared);
+  }
+}
+
+static void test_txn_host_failure() {
+  // A failed host call after map_at replaced a region.
+  AddrSpace mm;
+  assert(mm.init(kBase, kSize, kPageSize));
+  mm.map_at(kBase, 4 * kPageSize, 1, 0, 3, 0);
+  assert(mm.begin_txn());
+  mm.map_at(kBase + kPageSize, 2 * kPageSize, 3, 0, -1, 0);
+  mm.rollback();
+  MapInfo info;
+  assert(mm.query_page(kBase + kPageSize, &info) && info.fd == 3);
+  assert(mm.usage().regions == 1);
+  // Nothing to undo, and init() commits.
+  mm.rollback();
+  assert(mm.begin_txn());
+  mm.commit();
+  assert(mm.begin_txn());
+  mm.map_at(kBase + 8 * kPageSize, kPageSize, 1, 0, -1, 0);
+  assert(mm.init(kBase, kSize, kPageSize));
+  assert(!mm.in_txn());
+}
+
+static void test_txn_traced() {
+  // A rollback is traced as a reset and load.
+  AddrSpace mm;
+  assert(mm.init(kBase, kSize, kPageSize));
+  FILE *f = tmpfile();
+  assert(f);
+  TraceWriter writer(f);
+  mm.set_trace(&writer);
+  mm.map_at(kBase, kPageSize, 1, 0, -1, 0);
+  assert(mm.begin_txn());
+  mm.unmap(kBase, kPageSize);
+  mm.map_at(kBase + kPageSize, kPageSize, 2, 0, -1, 0);
+  mm.rollback();
+  mm.set_trace(nullptr);
+  writer.flush();
+  rewind(f);
+  TraceReader reader(f);
+  AddrSpace replayed;
+  assert(replayed.init(kBase, kSize, kPageSize));
+  TraceRecord rec;
+  while (reader.next(&rec))
+    assert(mmap::replay(replayed, rec));
+  assert(same_regions(replayed, mm));
+  fclose(f);
+}
+
+static void test_txn_c() {
+  struct MMapAddrSpace *c = mmap_create(kBase, kSize, kPageSize);
+  mmap_map_at(c, kBase, kPageSize, 1, 0, -1, 0, NULL, NULL);
+  assert(mmap_begin_txn(c));
+  assert(!mmap_begin_txn(c));
+  mmap_unmap(c, kBase, kPageSize, NULL, NULL);
+  mmap_rollback(c);
+  struct MMapInfo cinfo;
+  assert(mmap_query_page(c, kBase, &cinfo) && cinfo.prot == 1);
+  assert(mmap_begin_txn(c));
+  mmap_unmap(c, kBase, kPageSize, NULL, NULL);
+  mmap_commit(c);
+  assert(!mmap_query_page(c, kBase, &cinfo));
+  mmap_destroy(c);
+}
+
+template <class Space> static void test_map_at_noreplace() {
+  Space mm;
+  assert(mm.init(kBase, kSize, kPageSize));
+  std::vector<uint64_t> arena(mmap::shared_arena_size(16) / 8);
+  assert(mm.share(arena.data(), arena.size() * 8));
+  SharedAddrSpace shared;
+  assert(shared.open(arena.data(), arena.size() * 8));
+  assert(mm.map_at_noreplace(kBase + 4 * kPageSize, 2 * kPageSize, 1, 0, -1,
+                             0) == kBase + 4 * kPageSize);
+  mm.map_at(kBase + 8 * kPageSize, kPageSize, 3, 0, -1, 0);
+  std::vector<mmap::Region> before(mm.begin(), mm.end());
+  mmap::Usage usage = mm.usage();
+
+  // Any overlap fails, however small, and changes nothing.
+  const uintptr_t kOverlaps[][2] = {{3, 2}, {5, 1}, {5, 3}, {0, 20}, {8, 1}};
+  for (const auto &o : kOverlaps) {
+    assert(mm.map_at_noreplace(kBase + o[0] * kPageSize, o[1] * kPageSize, 2,
+                               0, -1, 0) == (uintptr_t)-1);
+    assert(mm.map_error() == Error::kExists);
+  }
+  size_t i = 0;
+  for (mmap::Region r : mm) {
+    assert(r.start == before[i].start && r.len == before[i].len);
+    assert(r.info == before[i].info);
+    i++;
+  }
+  assert(i == before.size());
+  mmap::Usage now = mm.usage();
+  assert(memcmp(&now, &usage, sizeof(now)) == 0);
+  check_shared(mm, shared);
+
+  // A range that only touches mapped pages fits, and merges like map_at.
+  assert(mm.map_at_noreplace(kBase + 6 * kPageSize, 2 * kPageSize, 1, 0, -1,
+                             0) == kBase + 6 * kPageSize);
+  assert(mm.usage().regions == 2);
+  check_shared(mm, shared);
+  // Invalid ranges are still kInval.
+  assert(mm.map_at_noreplace(kBase + 1, kPageSize, 1, 0, -1, 0) ==
+         (uintptr_t)-1);
+  assert(mm.map_error() == Error::kInval);
+
+  // A failure leaves nothing for a rollback to undo.
+  assert(mm.begin_txn());
+  assert(mm.map_at_noreplace(kBase, 5 * kPageSize, 2, 0, -1, 0) ==
+         (uintptr_t)-1);
+  assert(mm.map_at_noreplace(kBase + 20 * kPageSize, kPageSize, 2, 0, -1,
+                             0) != (uintptr_t)-1);
+  mm.rollback();
+  assert(mm.usage().regions == 2);
+  MapInfo info;
+  assert(!mm.query_page(kBase + 20 * kPageSize, &info));
+  check_shared(mm, shared);
+}
+
+static void test_map_at_end_of_space() {
+  // map_at, with or without replacing, stops at the end of the space.
+  AddrSpace mm;
+  assert(mm.init(kBase, kSize, kPageSize));
+  assert(mm.map_at(kBase + kSize, kPageSize, 1, 0, -1, 0) == (uintptr_t)-1);
+  assert(mm.map_at(kBase + kSize - kPageSize, 2 * kPageSize, 1, 0, -1, 0) ==
+         (uintptr_t)-1);
+  assert(mm.map_at_noreplace(kBase + 2 * kSize, kPageSize, 1, 0, -1, 0) ==
+         (uintptr_t)-1);
+  assert(mm.map_error() == Error::kInval);
+  assert(mm.map_at(kBase + kSize - kPageSize, kPageSize, 1, 0, -1, 0) ==
+         kBase + kSize - kPageSize);
+}
+
+static void test_map_at_noreplace_traced() {
+  // Traced calls replay with the same results.
+  AddrSpace mm;
+  assert(mm.init(kBase, kSize, kPageSize));
+  FILE *f = tmpfile();
+  assert(f);
+  TraceWriter writer(f);
+  mm.set_trace(&writer);
+  mm.map_at_noreplace(kBase, 2 * kPageSize, 1, 0, -1, 0);
+  mm.map_at_noreplace(kBase + kPageSize, kPageSize, 3, 0, -1, 0);
+  mm.set_trace(nullptr);
+  writer.flush();
+  rewind(f);
+  TraceReader reader(f);
+  AddrSpace replayed;
+  assert(replayed.init(kBase, kSize, kPageSize));
+  TraceRecord rec;
+  int n = 0;
+  while (reader.next(&rec)) {
+    assert(rec.op == mmap::TraceOp::kMapAtNoReplace);
+    assert(mmap::replay(replayed, rec));
+    n++;
+  }
+  assert(n == 2);
+  assert(same_regions(replayed, mm));
+  fclose(f);
+}
+
+static void test_map_at_noreplace_c() {
+  struct MMapAddrSpace *c = mmap_create(kBase, kSize, kPageSize);
+  assert(mmap_map_at_noreplace(c, kBase, kPageSize, 1, 0, -1, 0) == kBase);
+  assert(mmap_map_at_noreplace(c, kBase, kPageSize, 1, 0, -1, 0) ==
+         (uintptr_t)-1);
+  assert(mmap_map_error(c) == MMAP_EXISTS);
+  mmap_destroy(c);
+}
+
+template <class Space> static void test_attrs() {
+  // Two layers against a per-page model, alongside a space without layers
+  // that must end up with the same regions.
+  const int pages = kSize / kPageSize;
+  srand(23);
+  Space mm, plain;
+  assert(mm.init(kBase, kSize, kPageSize));
+  assert(plain.init(kBase, kSize, kPageSize));
+  assert(mm.add_layer() == 0 && mm.add_layer() == 1 && mm.layers() == 2);
+  std::vector<bool> mapped(pages);
+  std::vector<uint64_t> attrs[2] = {std::vector<uint64_t>(pages),
+                                    std::vector<uint64_t>(pages)};
+  std::vector<bool> saved_mapped;
+  std::vector<uint64_t> saved[2];
+  for (int op = 0; op < 3000; op++) {
+    int first = rand() % (pages - 8);
+    int n = 1 + rand() % 8;
+    uintptr_t addr = kBase + first * kPageSize;
+    size_t len = n * kPageSize;
+    int prot = rand() % 4;
+    switch (rand() % 8) {
+    case 0:
+      mm.map_at(addr, len, prot, 0, -1, 0);
+      plain.map_at(addr, len, prot, 0, -1, 0);
+      for (int p = first; p < first + n; p++) {
+        mapped[p] = true;
+        attrs[0][p] = attrs[1][p] = 0;
+      }
+      break;
+    case 1:
+      mm.unmap(addr, len);
+      plain.unmap(addr, len);
+      for (int p = first; p < first + n; p++) {
+        mapped[p] = false;
+        attrs[0][p] = attrs[1][p] = 0;
+      }
+      break;
+    case 2:
+      mm.protect(addr, len, prot);
+      plain.protect(addr, len, prot);
+      break;
+    case 3:
+    case 4:
+    case 5: {
+      int layer = rand() % 2;
+      uint64_t value = rand() % 3;
+      bool all = true;
+      for (int p = first; p < first + n; p++)
+        all = all && mapped[p];
+      Error err = mm.set_attr(layer, addr, len, value);
+      assert(err == (all ? Error::kOk : Error::kNoMem));
+      for (int p = first; all && p < first + n; p++)
+        attrs[layer][p] = value;
+      break;
+    }
+    case 6:
+      if (!mm.in_txn()) {
+        assert(mm.begin_txn() && plain.begin_txn());
+        saved_mapped = mapped;
+        saved[0] = attrs[0];
+        saved[1] = attrs[1];
+      } else if (rand() % 2) {
+        mm.commit();
+        plain.commit();
+      } else {
+        mm.rollback();
+        plain.rollback();
+        mapped = saved_mapped;
+        attrs[0] = saved[0];
+        attrs[1] = saved[1];
+      }
+      break;
+    case 7:
+      if (rand() % 20 == 0) {
+        mm.reset();
+        plain.reset();
+        mapped.assign(pages, false);
+        attrs[0].assign(pages, 0);
+        attrs[1].assign(pages, 0);
+      }
+      break;
+    }
+    for (int layer = 0; layer < 2; layer++) {
+      for (int p = 0; p < pages; p++)
+        assert(mm.attr(layer, kBase + p * kPageSize) == attrs[layer][p]);
+    }
+    assert(same_regions(mm, plain));
+  }
+
+  // Applying a diff gives each layer the target's values, on remapped pages
+  // too, and clears the layer the target lacks; a rollback undoes it.
+  if (mm.in_txn())
+    mm.commit();
+  Space target;
+  assert(target.init(kBase, kSize, kPageSize));
+  assert(target.add_layer() == 0);
+  for (int i = 0; i < 16; i++) {
+    uintptr_t addr = kBase + rand() % (pages - 8) * kPageSize;
+    target.map_at(addr, 4 * kPageSize, rand() % 4, 0, -1, 0);
+    assert(target.set_attr(0, addr + kPageSize, 2 * kPageSize,
+                           1 + rand() % 3) == Error::kOk);
+  }
+  assert(mm.begin_txn());
+  assert(mm.diff(target, nullptr, true) == Error::kOk);
+  assert(same_regions(mm, target));
+  for (int p = 0; p < pages; p++) {
+    uintptr_t a = kBase + p * kPageSize;
+    assert(mm.attr(0, a) == target.attr(0, a) && mm.attr(1, a) == 0);
+  }
+  mm.rollback();
+  assert(same_regions(mm, plain));
+  for (int layer = 0; layer < 2; layer++) {
+    for (int p = 0; p < pages; p++)
+      assert(mm.attr(layer, kBase + p * kPageSize) == attrs[layer][p]);
+  }
+}
+
+static void test_attr_runs() {
+  AddrSpace mm;
+  assert(mm.init(kBase, kSize, kPageSize));
+  size_t advice = mm.add_layer();
+  mm.map_at(kBase, 8 * kPageSize, 3, 0, -1, 0);
+  assert(mm.set_attr(advice, kBase + 2 * kPageSize, 2 * kPageSize, 4) ==
+         Error::kOk);
+  assert(mm.set_attr(advice, kBase + 4 * kPageSize, kPageSize, 4) ==
+         Error::kOk);
+  assert(mm.set_attr(advice, kBase + 6 * kPageSize, kPageSize, 5) ==
+         Error::kOk);
+  assert(mm.usage().regions == 1);
+  // Equal neighbors coalesce, and runs are clipped to the range asked for.
+  std::vector<std::pair<uintptr_t, uint64_t>> runs;
+  assert(mm.for_each_attr(advice, kBase + 3 * kPageSize, 5 * kPageSize,
+                          [&](uintptr_t a, size_t len, uint64_t v) {
+                            runs.push_back({a, v});
+                            assert(len == (v == 4 ? 2 : 1) * kPageSize);
+                          }) == Error::kOk);
+  assert(runs.size() == 2 && runs[0].first == kBase + 3 * kPageSize &&
+         runs[1].first == kBase + 6 * kPageSize);
+  // Bad arguments.
+  assert(mm.set_attr(1, kBase, kPageSize, 1) == Error::kInval);
+  assert(mm.set_attr(advice, kBase + 1, kPageSize, 1) == Error::kInval);
+  assert(mm.set_attr(advice, kBase + 7 * kPageSize, 2 * kPageSize, 1) ==
+         Error::kNoMem);
+  assert(mm.attr(advice, kBase + 7 * kPageSize) == 0);
+  assert(mm.attr(1, kBase) == 0 && mm.attr(advice, kBase + kSize) == 0);
+  assert(mm.for_each_attr(1, kBase, kPageSize, nullptr) == Error::kInval);
+  // Like protect, every call is counted, failed or not.
+  if (mmap::kStatsEnabled)
+    assert(mm.stats().op(StatOp::kSetAttr).count == 6);
+  // protect keeps the values, map_at over them clears them.
+  mm.protect(kBase, 8 * kPageSize, 1);
+  assert(mm.attr(advice, kBase + 2 * kPageSize) == 4);
+  mm.map_at(kBase + 2 * kPageSize, kPageSize, 1, 0, -1, 0);
+  assert(mm.attr(advice, kBase + 2 * kPageSize) == 0);
+  assert(mm.attr(advice, kBase + 3 * kPageSize) == 4);
+  // Loading a whole mapping clears every layer, but keeps the layers.
+  mmap::Region r{kBase, kPageSize, MapInfo{1, 0, -1, 0, false}};
+  assert(mm.load_regions(&r, 1) == Error::kOk);
+  assert(mm.attr(advice, kBase + 3 * kPageSize) == 0 && mm.layers() == 1);
+}
+
+static void test_attrs_c() {
+  struct MMapAddrSpace *c = mmap_create(kBase, kSize, kPageSize);
+  size_t layer = mmap_add_layer(c);
+  assert(mmap_set_attr(c, layer, kBase, kPageSize, 1) == MMAP_NOMEM);
+  mmap_map_at(c, kBase, 4 * kPageSize, 1, 0, -1, 0, NULL, NULL);
+  assert(mmap_set_attr(c, layer, kBase, 2 * kPageSize, 7) == MMAP_OK);
+  assert(mmap_attr(c, layer, kBase + kPageSize) == 7);
+  size_t total = 0;
+  assert(mmap_for_each_attr(
+             c, layer, kBase, 4 * kPageSize,
+             [](uintptr_t, size_t len, uint64_t, void *udata) {
+               *(size_t *)udata += len;
+             },
+             &total) == MMAP_OK);
+  assert(total == 2 * kPageSize);
+  mmap_unmap(c, kBase, kPageSize, NULL, NULL);
+  assert(mmap_attr(c, layer, kBase) == 0);
+  struct MMapStats st;
+  mmap_stats(c, &st);
+  assert(st.ops[MMAP_STAT_SET_ATTR].count == (mmap::kStatsEnabled ? 2 : 0));
+  mmap_destroy(c);
+}
+
+template <class Space> static void test_copy_move() {
+  // Enough regions to spill out of the inline storage.
+  Space mm;
+  assert(mm.init(kBase, kSize, kPageSize));
+  for (int i = 0; i < 40; i++)
+    mm.map_at(kBase + 2 * i * kPageSize, kPageSize, i % 3, 0, -1, 0);
+  size_t layer = mm.add_layer();
+  assert(mm.set_attr(layer, kBase, kPageSize, 7) == Error::kOk);
+
+  // A copy has the same regions, usage and attributes, and changes to
+  // either leave the other alone.
+  Space copy(mm);
+  assert(same_regions(copy, mm));
+  assert(copy.usage().largest_gap == mm.usage().largest_gap);
+  assert(copy.attr(layer, kBase) == 7);
+  copy.unmap(kBase, 10 * kPageSize);
+  copy.reset();
+  assert(copy.usage().regions == 0);
+  assert(mm.usage().regions == 40);
+  copy.map_at(kBase + kPageSize, kPageSize, 1, 0, -1, 0);
+  copy = mm;
+  assert(same_regions(copy, mm));
+
+  // A move hands everything over; the space moved from can be initialized
+  // again without touching the other.
+  Space moved(std::move(copy));
+  assert(same_regions(moved, mm));
+  assert(moved.attr(layer, kBase) == 7);
+  assert(copy.init(kBase, kSize, kPageSize));
+  copy.map_at(kBase + kPageSize, 4 * kPageSize, 1, 0, -1, 0);
+  for (int i = 0; i < 40; i++)
+    copy.map_at(kBase + 3 * i * kPageSize, kPageSize, 2, 0, -1, 0);
+  copy.reset();
+  assert(same_regions(moved, mm));
+  moved.unmap(kBase, 20 * kPageSize);
+  assert(moved.usage().regions == 30);
+
+  Space other;
+  assert(other.init(kBase, kSize, kPageSize));
+  other.map_at(kBase, kPageSize, 1, 0, -1, 0);
+  other = std::move(moved);
+  assert(other.usage().regions == 30);
+  other.reset();
+  assert(other.usage().regions == 0);
+}
+
+static void test_copy_move_shared() {
+  // The shared arena goes with a move but not with a copy.
+  AddrSpace mm;
+  assert(mm.init(kBase, kSize, kPageSize));
+  std::vector<uint64_t> arena(mmap::shared_arena_size(16) / 8);
+  assert(mm.share(arena.data(), arena.size() * 8));
+  SharedAddrSpace shared;
+  assert(shared.open(arena.data(), arena.size() * 8));
+  AddrSpace copy(mm);
+  copy.map_at(kBase, kPageSize, 1, 0, -1, 0);
+  mmap::Usage u;
+  assert(shared.usage(&u) == SharedRead::kOk && u.regions == 0);
+  AddrSpace moved(std::move(mm));
+  moved.map_at(kBase, kPageSize, 1, 0, -1, 0);
+  assert(shared.usage(&u) == SharedRead::kOk && u.regions == 1);
+  assert(mm.init(kBase, kSize, kPageSize));
+  mm.map_at(kBase + kPageSize, kPageSize, 1, 0, -1, 0);
+  assert(shared.usage(&u) == SharedRead::kOk && u.regions == 1);
+}
+
 int main() {
-  printf("1..35\n");
+  printf("1..83\n");
   RUN_TEST(test_init);
   RUN_TEST(test_map_any_and_query);
   RUN_TEST(test_query_unmapped);
@@ -581,5 +2560,53 @@ int main() {
   RUN_TEST(test_unmap_non_original);
   RUN_TEST(test_unmap_non_original_empty);
   RUN_TEST(test_mark_original_twice);
+  RUN_TEST(test_compact_init_limits);
+  RUN_TEST(test_compact_matches_wide);
+  RUN_TEST(test_fixed_page_size);
+  RUN_TEST(test_trace_replay);
+  RUN_TEST(test_trace_malformed);
+  RUN_TEST(test_no_alloc);
+  RUN_TEST(test_stats);
+  RUN_TEST(test_stats_interleaved);
+  RUN_TEST(test_usage);
+  RUN_TEST(test_usage_matches_scan);
+  RUN_TEST(test_limit);
+  RUN_LAYOUT_TEST(test_iterate);
+  RUN_TEST(test_iterate_c);
+  RUN_TEST(test_read_maps);
+  RUN_TEST(test_read_maps_changes);
+  RUN_TEST(test_read_maps_wide_fields);
+  RUN_TEST(test_import_maps);
+  RUN_TEST(test_import_maps_errors);
+  RUN_LAYOUT_TEST(test_load_regions);
+  RUN_TEST(test_load_regions_c);
+  RUN_LAYOUT_TEST(test_serialize);
+  RUN_TEST(test_serialize_across_layouts);
+  RUN_TEST(test_serialize_c);
+  RUN_LAYOUT_TEST(test_freeze);
+  RUN_TEST(test_freeze_errors);
+  RUN_TEST(test_freeze_c);
+  RUN_LAYOUT_TEST(test_freeze_regions);
+  RUN_TEST(test_freeze_regions_c);
+  RUN_LAYOUT_TEST(test_share);
+  RUN_TEST(test_share_stale);
+  RUN_TEST(test_share_concurrent);
+  RUN_LAYOUT_TEST(test_diff);
+  RUN_TEST(test_diff_example);
+  RUN_TEST(test_diff_c);
+  RUN_TEST(test_diff_original);
+  RUN_LAYOUT_TEST(test_txn);
+  RUN_TEST(test_txn_host_failure);
+  RUN_TEST(test_txn_traced);
+  RUN_TEST(test_txn_c);
+  RUN_LAYOUT_TEST(test_map_at_noreplace);
+  RUN_TEST(test_map_at_end_of_space);
+  RUN_TEST(test_map_at_noreplace_traced);
+  RUN_TEST(test_map_at_noreplace_c);
+  RUN_LAYOUT_TEST(test_attrs);
+  RUN_TEST(test_attr_runs);
+  RUN_TEST(test_attrs_c);
+  RUN_LAYOUT_TEST(test_copy_move);
+  RUN_TEST(test_copy_move_shared);
   return 0;
 }
@@ -26,8 +26,10 @@ static bool consume(const uint8_t *&data, size_t &size, T *out) {
   return true;
 }
 
-// Verify that both implementations agree on the state of every page.
+// Verify that both implementations agree on the state of every page, and
+// that our usage totals match.
 static void verify_equal(mmap::AddrSpace &ours, MMAddrSpace &theirs) {
+  uint64_t mapped = 0, gap = 0, largest = 0;
   for (int i = 0; i < kNumPages; i++) {
     uintptr_t addr = kBase + i * kPageSize;
     mmap::MapInfo our_info{};
@@ -40,8 +42,15 @@ static void verify_equal(mmap::AddrSpace &ours, MMAddrSpace &theirs) {
       assert(our_info.flags == their_info.flags);
       assert(our_info.fd == their_info.fd);
       assert(our_info.offset == their_info.offset);
+      mapped++;
+      gap = 0;
+    } else if (++gap > largest) {
+      largest = gap;
     }
   }
+  mmap::Usage usage = ours.usage();
+  assert(usage.mapped_pages == mapped);
+  assert(usage.largest_gap == largest);
 }
 
 enum Op : uint8_t {
@@ -1,8 +1,16 @@
+#include "key_search.h"
+#include "node_pool.h"
 #include "range_map.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
 
+using mmap::NodePool;
+using mmap::PoolAllocator;
 using mmap::RangeMap;
 
 static int test_num = 0;
@@ -410,8 +418,541 @@ static void test_single_point_range() {
   assert(!m.find(6));
 }
 
+static void test_node_pool_reuse() {
+  NodePool pool;
+  void *a = pool.allocate(32);
+  void *b = pool.allocate(32);
+  assert(a != b);
+
+  // Freed nodes are handed out again first.
+  pool.deallocate(a, 32);
+  assert(pool.allocate(32) == a);
+
+  // After a release the pool starts over from its first slab.
+  pool.release();
+  assert(pool.allocate(32) == a);
+  assert(pool.allocate(32) == b);
+}
+
+static void test_pool_allocator() {
+  NodePool pool;
+  RangeMap<int, int, PoolAllocator<int>> m{PoolAllocator<int>(&pool)};
+  for (int i = 0; i < 100; i++)
+    m.insert(i * 10, i * 10 + 5, i);
+  assert(m.size() == 100);
+
+  m.remove(0, 500);
+  assert(m.size() == 50);
+  assert(!m.find(100));
+  assert(m.find(502)->val == 50);
+
+  m.clear();
+  assert(m.empty());
+  assert(!m.find(502));
+
+  // The map is fully usable after its nodes were released in bulk.
+  for (int i = 0; i < 100; i++)
+    m.insert(i * 10, i * 10 + 5, i + 1);
+  assert(m.size() == 100);
+  assert(m.find(992)->val == 100);
+}
+
+static void test_inline_spill() {
+  // Crossing the inline capacity moves entries into the tree intact.
+  RangeMap<int, int, std::allocator<int>, 4> m;
+  for (int i = 0; i < 4; i++)
+    m.insert(i * 10, i * 10 + 5, i);
+  assert(m.size() == 4);
+
+  // Splitting an entry in two needs one more slot than is available.
+  m.remove(1, 2);
+  assert(m.size() == 5);
+  assert(m.find(0)->end == 1);
+  assert(m.find(3)->start == 2);
+  for (int i = 1; i < 4; i++)
+    assert(m.find(i * 10)->val == i);
+
+  m.clear();
+  assert(m.empty());
+  m.insert(0, 5, 1);
+  assert(m.find(2)->val == 1);
+}
+
+static void test_inline_matches_tree() {
+  // Random operations give identical results with and without inline
+  // storage.
+  RangeMap<int, int, std::allocator<int>, 8> small;
+  RangeMap<int, int, std::allocator<int>, 0> tree;
+  srand(1);
+  for (int round = 0; round < 20; round++) {
+    small.clear();
+    tree.clear();
+    for (int op = 0; op < 200; op++) {
+      int start = rand() % 100;
+      int end = start + rand() % 20;
+      if (rand() % 3 == 0) {
+        small.remove(start, end);
+        tree.remove(start, end);
+      } else {
+        int val = rand() % 3;
+        small.insert(start, end, val);
+        tree.insert(start, end, val);
+      }
+      assert(small.size() == tree.size());
+      auto a = small.get_overlapping(0, 200);
+      auto b = tree.get_overlapping(0, 200);
+      assert(a.size() == b.size());
+      for (size_t i = 0; i < a.size(); i++)
+        assert(a[i].start == b[i].start && a[i].end == b[i].end &&
+               a[i].val == b[i].val);
+    }
+  }
+}
+
+template <size_t InlineCap> static void check_for_each_from() {
+  RangeMap<int, int, std::allocator<int>, InlineCap> m;
+  std::vector<int> starts;
+  auto collect = [&](int key) {
+    starts.clear();
+    m.for_each_from(key, [&](const auto &e) { starts.push_back(e.start); });
+  };
+  collect(0);
+  assert(starts.empty());
+
+  m.insert(10, 20, 1);
+  m.insert(30, 40, 2);
+  m.insert(50, 60, 3);
+  collect(0);
+  assert((starts == std::vector<int>{10, 30, 50}));
+  collect(10);
+  assert((starts == std::vector<int>{10, 30, 50}));
+  collect(11);
+  assert((starts == std::vector<int>{10, 30, 50}));
+  collect(25);
+  assert((starts == std::vector<int>{10, 30, 50}));
+  collect(31);
+  assert((starts == std::vector<int>{30, 50}));
+  collect(100);
+  assert((starts == std::vector<int>{50}));
+
+  // Returning false stops the walk.
+  int n = 0;
+  m.for_each_from(0, [&](const auto &) { return ++n < 2; });
+  assert(n == 2);
+}
+
+static void test_for_each_from() {
+  check_for_each_from<8>();
+  check_for_each_from<0>();
+}
+
+template <size_t InlineCap> static void check_iterator() {
+  RangeMap<int, int, std::allocator<int>, InlineCap> m;
+  assert(m.begin() == m.end());
+  assert(m.begin_from(5) == m.end());
+  for (int i = 0; i < 6; i++)
+    m.insert(10 * i, 10 * i + 5, i);
+
+  int n = 0;
+  for (auto e : m) {
+    assert(e.start == 10 * n && e.end == 10 * n + 5 && e.val == n);
+    n++;
+  }
+  assert(n == 6);
+
+  // Starting inside an entry yields it whole; starting in a gap yields the
+  // next one.
+  auto it = m.begin_from(22);
+  assert((*it).start == 20);
+  it = m.begin_from(25);
+  assert((*it).start == 30);
+  it++;
+  assert((*it).start == 40);
+  assert(m.begin_from(0) == m.begin());
+  assert(m.begin_from(55) == m.end());
+}
+
+static void test_iterator() {
+  check_iterator<16>();
+  check_iterator<0>();
+}
+
+template <size_t InlineCap> static void check_append() {
+  // Appending past the inline capacity spills, and equal neighbors
+  // coalesce just as with insert().
+  RangeMap<int, int, std::allocator<int>, InlineCap> m;
+  for (int i = 0; i < 20; i++)
+    m.append(10 * i, 10 * i + 5, i);
+  m.append(200, 210, 7);
+  m.append(210, 220, 7);
+  m.append(220, 220, 8);
+  assert(m.size() == 21);
+  int n = 0;
+  for (auto e : m) {
+    if (n < 20)
+      assert(e.start == 10 * n && e.end == 10 * n + 5 && e.val == n);
+    else
+      assert(e.start == 200 && e.end == 220 && e.val == 7);
+    n++;
+  }
+  assert(n == 21);
+  m.insert(195, 200, 7);
+  assert(m.find(196)->start == 195 && m.find(196)->end == 220);
+}
+
+static void test_append() {
+  check_append<16>();
+  check_append<0>();
+}
+
+template <size_t InlineCap> static void check_assign_sorted() {
+  using E = mmap::Entry<int, int>;
+  RangeMap<int, int, std::allocator<int>, InlineCap> m;
+  m.insert(1000, 1001, 9);
+  std::vector<E> in;
+  for (int i = 0; i < 30; i++)
+    in.push_back({10 * i, 10 * i + 5, i});
+  // Touching entries with equal values coalesce.
+  in.push_back({300, 310, 7});
+  in.push_back({310, 320, 7});
+  assert(m.assign_sorted(in.begin(), in.end()));
+  assert(m.size() == 31);
+  assert(!m.find(1000));
+  assert(m.find(315)->start == 300 && m.find(315)->end == 320);
+  assert(m.find(42)->val == 4);
+
+  // Overlapping, unsorted or empty entries are rejected without changing
+  // the map.
+  std::vector<E> bad[] = {
+      {{0, 10, 1}, {5, 15, 2}},
+      {{20, 30, 1}, {0, 10, 2}},
+      {{0, 10, 1}, {10, 10, 2}},
+  };
+  for (auto &b : bad) {
+    assert(!m.assign_sorted(b.begin(), b.end()));
+    assert(m.size() == 31);
+  }
+
+  // Entries can come from another map's iterator.
+  RangeMap<int, int, std::allocator<int>, InlineCap> copy;
+  assert(copy.assign_sorted(m.begin(), m.end()));
+  assert(copy.size() == m.size());
+  assert(std::equal(m.begin(), m.end(), copy.begin(),
+                    [](const E &a, const E &b) {
+                      return a.start == b.start && a.end == b.end &&
+                             a.val == b.val;
+                    }));
+  assert(m.assign_sorted(in.end(), in.end()));
+  assert(m.empty());
+}
+
+static void test_assign_sorted() {
+  check_assign_sorted<16>();
+  check_assign_sorted<0>();
+}
+
+template <class M> static bool same_entries(const M &a, const M &b) {
+  auto x = a.get_overlapping(0, 1000);
+  auto y = b.get_overlapping(0, 1000);
+  if (x.size() != y.size())
+    return false;
+  for (size_t i = 0; i < x.size(); i++)
+    if (x[i].start != y[i].start || x[i].end != y[i].end ||
+        x[i].val != y[i].val)
+      return false;
+  return true;
+}
+
+static void test_freeze() {
+  // A frozen map answers every lookup as the tree does, for tree sizes that
+  // fill the last level to varying depths.
+  using Map = RangeMap<int, int, std::allocator<int>, 0>;
+  srand(3);
+  for (int n : {0, 1, 2, 3, 4, 7, 8, 9, 31, 100}) {
+    Map tree;
+    for (int i = 0; i < n; i++)
+      tree.insert(i * 8 + rand() % 3, i * 8 + 4 + rand() % 4, rand() % 2 + i);
+    Map m = tree;
+    m.freeze();
+    assert(m.frozen() == (n > 0));
+    assert(same_entries(m, tree));
+    for (int key = -2; key < n * 8 + 4; key++) {
+      auto a = m.find(key);
+      auto b = tree.find(key);
+      assert(a.has_value() == b.has_value());
+      assert(!a || (a->start == b->start && a->val == b->val));
+      for (int len : {1, 3, 9}) {
+        assert(m.overlaps(key, key + len) == tree.overlaps(key, key + len));
+        auto x = m.get_overlapping(key, key + len);
+        auto y = tree.get_overlapping(key, key + len);
+        assert(x.size() == y.size());
+        for (size_t i = 0; i < x.size(); i++)
+          assert(x[i].start == y[i].start && x[i].end == y[i].end);
+        assert(m.find_gap(key, key + 20, len) ==
+               tree.find_gap(key, key + 20, len));
+      }
+      std::vector<int> x, y;
+      m.for_each_from(key, [&](const auto &e) { x.push_back(e.start); });
+      tree.for_each_from(key, [&](const auto &e) { y.push_back(e.start); });
+      assert(x == y);
+    }
+  }
+
+  // Any write thaws the map; the tree was kept, so nothing is lost.
+  Map m;
+  for (int i = 0; i < 20; i++)
+    m.insert(i * 10, i * 10 + 5, i);
+  Map tree = m;
+  m.freeze();
+  m.insert(3, 12, 7);
+  tree.insert(3, 12, 7);
+  assert(!m.frozen() && same_entries(m, tree));
+  m.freeze();
+  m.remove(40, 60);
+  tree.remove(40, 60);
+  assert(!m.frozen() && same_entries(m, tree));
+  m.freeze();
+  m.update_all([](int &v) { v++; });
+  tree.update_all([](int &v) { v++; });
+  assert(!m.frozen() && same_entries(m, tree));
+  m.freeze();
+  m.append(300, 310, 1);
+  tree.append(300, 310, 1);
+  assert(!m.frozen() && same_entries(m, tree));
+  m.freeze();
+  m.clear();
+  assert(!m.frozen() && m.empty() && !m.find(0));
+
+  // Inline entries are searched in place already.
+  RangeMap<int, int> small;
+  small.insert(1, 2, 1);
+  small.freeze();
+  assert(!small.frozen() && small.find(1)->val == 1);
+
+  // Frozen lookups on 64-bit keys treat them as unsigned.
+  RangeMap<uint64_t, int, std::allocator<int>, 0> wide;
+  uint64_t hi = uint64_t(1) << 63;
+  wide.insert(10, 20, 1);
+  wide.insert(hi, hi + 10, 2);
+  wide.insert(~uint64_t(0) - 10, ~uint64_t(0), 3);
+  wide.freeze();
+  assert(wide.find(15)->val == 1);
+  assert(wide.find(hi + 5)->val == 2);
+  assert(wide.find(~uint64_t(0) - 1)->val == 3);
+  assert(!wide.find(hi - 1));
+  assert(!wide.overlaps(20, hi));
+}
+
+template <size_t InlineCap> static void check_replace() {
+  // replace() reports what insert() overwrites and the neighbors around it,
+  // and a veto changes nothing.
+  using Map = RangeMap<int, int, std::allocator<int>, InlineCap>;
+  srand(9);
+  Map m;
+  for (int op = 0; op < 3000; op++) {
+    int start = rand() % 200;
+    int end = start + 1 + rand() % 12;
+    int val = rand() % 3;
+    if (op % 7 == 6)
+      m.freeze();
+    Map before = m;
+    auto want = m.get_overlapping(start, end);
+    int lo = -1, hi = -1;
+    std::vector<mmap::Entry<int, int>> got;
+    bool veto = rand() % 5 == 0;
+    bool ok = m.replace(
+        start, end, val,
+        [&](const mmap::Entry<int, int> &e) {
+          got.push_back(e);
+          return !veto;
+        },
+        &lo, &hi);
+    if (veto && !want.empty()) {
+      assert(!ok && got.size() == 1);
+      assert(same_entries(m, before));
+      continue;
+    }
+    assert(ok && got.size() == want.size());
+    for (size_t i = 0; i < got.size(); i++)
+      assert(got[i].start == want[i].start && got[i].end == want[i].end);
+    // The neighbors are the nearest entries outside the overlapped ones.
+    int want_lo = -1, want_hi = -1;
+    for (auto e : before) {
+      if (e.end <= start)
+        want_lo = e.end;
+      if (e.start >= end && want_hi == -1)
+        want_hi = e.start;
+    }
+    assert(lo == want_lo && hi == want_hi);
+    before.insert(start, end, val);
+    assert(same_entries(m, before));
+  }
+}
+
+static void test_replace() {
+  check_replace<16>();
+  check_replace<0>();
+}
+
+template <size_t InlineCap> static void check_hint() {
+  // Hinted calls agree with unhinted ones whether the hint is near, far,
+  // stale, or was last set by another map.
+  using Map = RangeMap<int, int, std::allocator<int>, InlineCap>;
+  using E = mmap::Entry<int, int>;
+  auto same = [](const std::vector<E> &x, const std::vector<E> &y) {
+    if (x.size() != y.size())
+      return false;
+    for (size_t i = 0; i < x.size(); i++) {
+      if (x[i].start != y[i].start || x[i].end != y[i].end ||
+          x[i].val != y[i].val)
+        return false;
+    }
+    return true;
+  };
+  srand(11);
+  Map a, b;
+  typename Map::Hint hint;
+  int cursor = 0;
+  for (int op = 0; op < 6000; op++) {
+    // Mostly move forward through the keys, as a loader does.
+    int start = rand() % 4 ? cursor : rand() % 400;
+    int end = start + 1 + rand() % 6;
+    cursor = end % 400;
+    int val = rand() % 3;
+    switch (rand() % 6) {
+    case 0:
+    case 1:
+      a.insert(start, end, val, &hint);
+      b.insert(start, end, val);
+      break;
+    case 2:
+      a.remove(start, end, &hint);
+      b.remove(start, end);
+      break;
+    case 3: {
+      auto x = a.find(start, &hint);
+      auto y = b.find(start);
+      assert(x.has_value() == y.has_value());
+      if (x)
+        assert(same({*x}, {*y}));
+      break;
+    }
+    case 4: {
+      std::vector<E> x, y;
+      a.for_each_overlapping(
+          start, end, [&](const E &e) { x.push_back(e); }, &hint);
+      b.for_each_overlapping(start, end, [&](const E &e) { y.push_back(e); });
+      assert(same(x, y));
+      x.clear();
+      y.clear();
+      a.for_each_from(
+          start,
+          [&](const E &e) {
+            x.push_back(e);
+            return x.size() < 3;
+          },
+          &hint);
+      b.for_each_from(start, [&](const E &e) {
+        y.push_back(e);
+        return y.size() < 3;
+      });
+      assert(same(x, y));
+      break;
+    }
+    case 5:
+      switch (rand() % 5) {
+      case 0:
+        a.insert(start, end, val);
+        b.insert(start, end, val);
+        break;
+      case 1: {
+        Map c = a;
+        c.find(start, &hint);
+        break;
+      }
+      case 2:
+        a = b;
+        break;
+      case 3:
+        a.freeze();
+        b.freeze();
+        break;
+      case 4:
+        if (rand() % 8 == 0) {
+          a.clear();
+          b.clear();
+        }
+        break;
+      }
+      break;
+    }
+    assert(same_entries(a, b));
+  }
+}
+
+static void test_hint() {
+  check_hint<16>();
+  check_hint<0>();
+}
+
+template <class K> static void check_key_search_kernels() {
+  using mmap::SearchIsa;
+  auto scalar = mmap::key_search_for<K>(SearchIsa::kScalar);
+  const K top = K(1) << (sizeof(K) * 8 - 1);
+  srand(2);
+  for (SearchIsa isa :
+       {SearchIsa::kSse42, SearchIsa::kAvx2, SearchIsa::kAvx512}) {
+    if (!mmap::search_isa_supported(isa))
+      continue;
+    auto ks = mmap::key_search_for<K>(isa);
+    assert(ks.isa == isa);
+    for (size_t n = 0; n <= 40; n++) {
+      std::vector<K> keys(n);
+      K k = rand() % 4 == 0 ? top - 8 : 0;
+      for (auto &key : keys) {
+        k += rand() % 4;
+        key = k;
+      }
+      std::vector<K> probes = {K(0), K(1), top, K(~K(0)), k, K(k + 1)};
+      for (K key : keys) {
+        probes.push_back(K(key - 1));
+        probes.push_back(key);
+        probes.push_back(K(key + 1));
+      }
+      for (K probe : probes) {
+        assert(ks.count_less(keys.data(), n, probe) ==
+               scalar.count_less(keys.data(), n, probe));
+        assert(ks.count_less_equal(keys.data(), n, probe) ==
+               scalar.count_less_equal(keys.data(), n, probe));
+      }
+    }
+  }
+}
+
+static void test_key_search_kernels() {
+  // Every kernel supported by this CPU agrees with the scalar one, including
+  // on keys with the top bit set.
+  check_key_search_kernels<uint64_t>();
+  check_key_search_kernels<uint32_t>();
+}
+
+static void test_inline_high_keys() {
+  // Inline lookups on 64-bit keys treat them as unsigned.
+  RangeMap<uint64_t, int> m;
+  uint64_t hi = uint64_t(1) << 63;
+  m.insert(10, 20, 1);
+  m.insert(hi, hi + 10, 2);
+  m.insert(~uint64_t(0) - 10, ~uint64_t(0), 3);
+  assert(m.find(15)->val == 1);
+  assert(m.find(hi + 5)->val == 2);
+  assert(m.find(~uint64_t(0) - 1)->val == 3);
+  assert(!m.find(hi - 1));
+  assert(m.overlaps(hi - 5, hi + 1));
+  assert(!m.overlaps(20, hi));
+}
+
 int main() {
-  printf("1..35\n");
+  printf("1..48\n");
   RUN_TEST(test_empty);
   RUN_TEST(test_insert_find);
   RUN_TEST(test_insert_overlap_replace);
@@ -447,5 +988,18 @@ int main() {
   RUN_TEST(test_get_gaps_partial_coverage);
   RUN_TEST(test_get_gaps_empty_map);
   RUN_TEST(test_clear);
+  RUN_TEST(test_node_pool_reuse);
+  RUN_TEST(test_pool_allocator);
+  RUN_TEST(test_inline_spill);
+  RUN_TEST(test_inline_matches_tree);
+  RUN_TEST(test_for_each_from);
+  RUN_TEST(test_iterator);
+  RUN_TEST(test_append);
+  RUN_TEST(test_assign_sorted);
+  RUN_TEST(test_freeze);
+  RUN_TEST(test_replace);
+  RUN_TEST(test_hint);
+  RUN_TEST(test_key_search_kernels);
+  RUN_TEST(test_inline_high_keys);
   return 0;
 }
@@ -0,0 +1,247 @@
+// Checks that RangeMap and AddrSpace operations scale no worse than their
+// declared complexity.
+//
+// Each operation is run against structures of 1k to 1M regions, and its cost
+// is the number of tree nodes it visits, as counted by the statistics hooks
+// (so this test must be built with LIBMMAP_STATS). Costs are divided by the
+// declared growth function, and the test fails if the least-squares slope of
+// log(cost / f(n)) against log(n) is above kMaxSlope, i.e. if the cost grows
+// polynomially faster than declared. Counting work instead of timing makes
+// the result deterministic.
+//
+// Usage: test_scaling [--max-regions N]
+
+#include "addr_space.h"
+#include "range_map.h"
+#include "stats.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifndef LIBMMAP_STATS
+#error "scaling_test needs LIBMMAP_STATS"
+#endif
+
+using mmap::AddrSpace;
+using mmap::MapInfo;
+
+namespace {
+
+enum class Growth { kLog, kLinear };
+
+const char *growth_name(Growth g) {
+  return g == Growth::kLog ? "O(log n)" : "O(n)";
+}
+
+double growth(Growth g, size_t n) {
+  return g == Growth::kLog ? std::log2((double)n) : (double)n;
+}
+
+// Log-log slope above which cost is considered to outgrow its declared
+// class. Going from O(log n) to O(n) over 1k..1M gives a slope of about
+// 0.9, and one extra log factor about 0.1.
+const double kMaxSlope = 0.05;
+
+uint64_t visits() { return mmap::detail::work_counters.visits; }
+
+// Mean nodes visited by op(i), for i in 'idx'. undo(i) restores the
+// structure and is not counted.
+template <class Op, class Undo>
+double cost(const std::vector<size_t> &idx, Op op, Undo undo) {
+  uint64_t total = 0;
+  for (size_t i : idx) {
+    uint64_t before = visits();
+    op(i);
+    total += visits() - before;
+    undo(i);
+  }
+  return (double)total / idx.size();
+}
+
+template <class Op> double cost(const std::vector<size_t> &idx, Op op) {
+  return cost(idx, op, [](size_t) {});
+}
+
+struct Series {
+  std::string name;
+  Growth declared;
+  std::vector<double> costs;
+};
+
+std::vector<Series> g_series;
+
+void add(const std::string &name, Growth declared, double c) {
+  for (auto &s : g_series) {
+    if (s.name == name) {
+      s.costs.push_back(c);
+      return;
+    }
+  }
+  g_series.push_back({name, declared, {c}});
+}
+
+// Indices for 'reps' calls, spread over [0, n).
+std::vector<size_t> indices(size_t n, size_t reps) {
+  std::mt19937_64 rng(n);
+  std::vector<size_t> idx(reps);
+  for (auto &i : idx)
+    i = rng() % n;
+  return idx;
+}
+
+const size_t kReps = 1000;
+const size_t kLinearReps = 3;
+
+// RangeMap holding [2i, 2i+1) for i < n, so every odd key is a gap.
+void measure_rangemap(size_t n) {
+  mmap::RangeMap<uint64_t, int> m;
+  for (size_t i = 0; i < n; i++)
+    m.insert(2 * i, 2 * i + 1, (int)(i % 2));
+  auto idx = indices(n, kReps);
+
+  add("rangemap/find", Growth::kLog,
+      cost(idx, [&](size_t i) { m.find(2 * i); }));
+  add("rangemap/insert", Growth::kLog,
+      cost(
+          idx, [&](size_t i) { m.insert(2 * i + 1, 2 * i + 2, 7); },
+          [&](size_t i) { m.remove(2 * i + 1, 2 * i + 2); }));
+  add("rangemap/remove", Growth::kLog,
+      cost(
+          idx, [&](size_t i) { m.remove(2 * i, 2 * i + 1); },
+          [&](size_t i) { m.insert(2 * i, 2 * i + 1, (int)(i % 2)); }));
+  add("rangemap/overlaps", Growth::kLog,
+      cost(idx, [&](size_t i) { m.overlaps(2 * i + 1, 2 * i + 2); }));
+  add("rangemap/for_each_overlapping", Growth::kLog, cost(idx, [&](size_t i) {
+        m.for_each_overlapping(2 * i, 2 * i + 8, [](const auto &) {});
+      }));
+  add("rangemap/get_gaps", Growth::kLog,
+      cost(idx, [&](size_t i) { m.get_gaps(2 * i, 2 * i + 8); }));
+  // No gap of two keys exists before the end.
+  add("rangemap/find_gap", Growth::kLinear,
+      cost(indices(n, kLinearReps),
+           [&](size_t) { m.find_gap(0, 2 * n + 16, 2); }));
+  mmap::RangeMap<uint64_t, int> copy;
+  add("rangemap/assign_sorted", Growth::kLinear,
+      cost(indices(n, kLinearReps),
+           [&](size_t) { copy.assign_sorted(m.begin(), m.end()); }));
+}
+
+const uintptr_t kBase = 0x10000000;
+const size_t kPage = 4096;
+
+uintptr_t page(size_t i) { return kBase + i * kPage; }
+
+// AddrSpace with one-page regions at every even page, alternating
+// protections, so no two coalesce and every gap is one page.
+void measure_addrspace(size_t n) {
+  AddrSpace mm;
+  if (!mm.init(kBase, (2 * n + 16) * kPage, kPage))
+    abort();
+  for (size_t i = 0; i < n; i++)
+    mm.map_at(page(2 * i), kPage, (int)(i % 2), 0, -1, 0);
+  auto idx = indices(n, kReps);
+  auto lin = indices(n, kLinearReps);
+  MapInfo info;
+
+  add("addrspace/query_page", Growth::kLog,
+      cost(idx, [&](size_t i) { mm.query_page(page(2 * i), &info); }));
+  add("addrspace/map_at", Growth::kLog,
+      cost(
+          idx,
+          [&](size_t i) { mm.map_at(page(2 * i + 1), kPage, 2, 0, -1, 0); },
+          [&](size_t i) { mm.unmap(page(2 * i + 1), kPage); }));
+  add("addrspace/unmap", Growth::kLog,
+      cost(
+          idx, [&](size_t i) { mm.unmap(page(2 * i), kPage); },
+          [&](size_t i) {
+            mm.map_at(page(2 * i), kPage, (int)(i % 2), 0, -1, 0);
+          }));
+  add("addrspace/protect", Growth::kLog,
+      cost(
+          idx, [&](size_t i) { mm.protect(page(2 * i), kPage, 2); },
+          [&](size_t i) { mm.protect(page(2 * i), kPage, (int)(i % 2)); }));
+  add("addrspace/iterate", Growth::kLinear, cost(lin, [&](size_t) {
+        for (mmap::Region r : mm)
+          info = r.info;
+      }));
+  // Two pages only fit after the last region, so first fit scans them all.
+  uintptr_t got = 0;
+  add("addrspace/map_any", Growth::kLinear,
+      cost(
+          lin, [&](size_t) { got = mm.map_any(0, 2 * kPage, 2, 0, -1, 0); },
+          [&](size_t) { mm.unmap(got, 2 * kPage); }));
+  std::vector<mmap::Region> regions(mm.begin(), mm.end());
+  AddrSpace copy;
+  if (!copy.init(kBase, (2 * n + 16) * kPage, kPage))
+    abort();
+  add("addrspace/load_regions", Growth::kLinear, cost(lin, [&](size_t) {
+        copy.load_regions(regions.data(), regions.size());
+      }));
+  add("addrspace/mark_original", Growth::kLinear,
+      cost(lin, [&](size_t) { mm.mark_original(); }));
+  add("addrspace/unmap_non_original", Growth::kLinear,
+      cost(
+          lin, [&](size_t) { mm.unmap_non_original(); },
+          [&](size_t) { mm.map_at(page(2 * n), kPage, 2, 0, -1, 0); }));
+}
+
+// Least-squares slope of log(cost / f(n)) against log(n).
+double slope(const std::vector<size_t> &ns, const Series &s) {
+  size_t k = s.costs.size();
+  double sx = 0, sy = 0, sxx = 0, sxy = 0;
+  for (size_t i = 0; i < k; i++) {
+    double x = std::log((double)ns[i]);
+    double y = std::log(std::max(s.costs[i], 1.0) / growth(s.declared, ns[i]));
+    sx += x;
+    sy += y;
+    sxx += x * x;
+    sxy += x * y;
+  }
+  return (k * sxy - sx * sy) / (k * sxx - sx * sx);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  size_t max_regions = 1000000;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--max-regions") && i + 1 < argc) {
+      max_regions = strtoull(argv[++i], nullptr, 0);
+    } else {
+      fprintf(stderr, "usage: %s [--max-regions N]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  std::vector<size_t> ns;
+  for (size_t n = 1000; n <= max_regions; n *= 10) {
+    ns.push_back(n);
+    measure_rangemap(n);
+    measure_addrspace(n);
+  }
+  if (ns.size() < 2) {
+    fprintf(stderr, "need at least two region counts\n");
+    return 1;
+  }
+
+  printf("1..%zu\n", g_series.size());
+  int failed = 0;
+  for (size_t t = 0; t < g_series.size(); t++) {
+    const Series &s = g_series[t];
+    double sl = slope(ns, s);
+    bool ok = sl <= kMaxSlope;
+    printf("%s %zu - %s %s (slope %.3f)\n", ok ? "ok" : "not ok", t + 1,
+           s.name.c_str(), growth_name(s.declared), sl);
+    for (size_t i = 0; i < ns.size(); i++)
+      printf("#   n=%zu visits/op=%.1f\n", ns[i], s.costs[i]);
+    failed += !ok;
+  }
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,552 @@
+// Convert an strace log of memory system calls into an AddrSpace trace that
+// replay_mmap can replay.
+//
+// The log is the output of
+//
+//   strace -f -e trace=memory,execve -o LOG PROGRAM...
+//
+// Timestamps (-t, -tt, -ttt, -r), pid prefixes and unfinished/resumed call
+// pairs are understood. mmap, munmap, mprotect, mremap and brk calls that
+// succeeded are turned into AddrSpace calls, and a successful execve resets
+// the space. Every pid is assumed to share one address space, as threads
+// do; use --pid to pick out the processes of a multi-process log.
+//
+// Real addresses span most of the 47-bit user space, so they are rebased
+// into a window starting at kWindowBase: the touched ranges keep their
+// layout and the gaps between them, but gaps longer than kMaxGap are
+// shortened to kMaxGap.
+//
+// mmap without MAP_FIXED becomes map_any with the rebased kernel result as
+// the hint, so the space follows the kernel's placement whenever that range
+// is free. The number of calls where it was not is reported.
+//
+// Usage: import_strace [--pid N]... [--pagesize N] LOG TRACE
+
+#include "addr_space.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace {
+
+const uint64_t kWindowBase = 0x10000000;
+const uint64_t kMaxGap = 1ULL << 30;
+
+const int kMapShared = 0x01;
+const int kMapPrivate = 0x02;
+const int kMapFixed = 0x10;
+const int kMapFixedNoreplace = 0x100000;
+const int kMapAnonymous = 0x20;
+const int kMremapMaymove = 1;
+const int kMremapFixed = 2;
+const int kMremapDontunmap = 4;
+const int kProtRW = 3;
+
+struct Name {
+  const char *name;
+  int value;
+};
+
+const Name kNames[] = {
+    {"PROT_NONE", 0},
+    {"PROT_READ", 1},
+    {"PROT_WRITE", 2},
+    {"PROT_EXEC", 4},
+    {"PROT_SEM", 8},
+    {"PROT_GROWSDOWN", 0x01000000},
+    {"PROT_GROWSUP", 0x02000000},
+    {"MAP_SHARED", kMapShared},
+    {"MAP_PRIVATE", kMapPrivate},
+    {"MAP_SHARED_VALIDATE", 0x03},
+    {"MAP_FIXED", kMapFixed},
+    {"MAP_ANONYMOUS", kMapAnonymous},
+    {"MAP_ANON", kMapAnonymous},
+    {"MAP_32BIT", 0x40},
+    {"MAP_GROWSDOWN", 0x100},
+    {"MAP_DENYWRITE", 0x800},
+    {"MAP_EXECUTABLE", 0x1000},
+    {"MAP_LOCKED", 0x2000},
+    {"MAP_NORESERVE", 0x4000},
+    {"MAP_POPULATE", 0x8000},
+    {"MAP_NONBLOCK", 0x10000},
+    {"MAP_STACK", 0x20000},
+    {"MAP_HUGETLB", 0x40000},
+    {"MAP_SYNC", 0x80000},
+    {"MAP_FIXED_NOREPLACE", kMapFixedNoreplace},
+    {"MREMAP_MAYMOVE", kMremapMaymove},
+    {"MREMAP_FIXED", kMremapFixed},
+    {"MREMAP_DONTUNMAP", kMremapDontunmap},
+};
+
+enum class Sys { kMmap, kMunmap, kMprotect, kMremap, kBrk, kExecve };
+
+// One successful call from the log. Arguments are numbered as in the
+// system call.
+struct Call {
+  Sys sys;
+  uint64_t arg[6];
+  uint64_t ret;
+};
+
+uint64_t parse_num(const std::string &s) {
+  if (s == "NULL")
+    return 0;
+  return strtoull(s.c_str(), nullptr, 0);
+}
+
+// Parse "A|B|0x40" style flag sets.
+uint64_t parse_flags(const std::string &s) {
+  uint64_t v = 0;
+  size_t pos = 0;
+  while (pos <= s.size()) {
+    size_t bar = s.find('|', pos);
+    if (bar == std::string::npos)
+      bar = s.size();
+    std::string tok = s.substr(pos, bar - pos);
+    bool named = false;
+    for (const Name &n : kNames) {
+      if (tok == n.name) {
+        v |= (uint64_t)n.value;
+        named = true;
+        break;
+      }
+    }
+    if (!named)
+      v |= strtoull(tok.c_str(), nullptr, 0);
+    pos = bar + 1;
+  }
+  return v;
+}
+
+// Split a top-level argument list, ignoring commas inside brackets,
+// braces and quotes.
+std::vector<std::string> split_args(const std::string &s) {
+  std::vector<std::string> args;
+  std::string cur;
+  int depth = 0;
+  bool quoted = false;
+  for (size_t i = 0; i < s.size(); i++) {
+    char c = s[i];
+    if (quoted) {
+      if (c == '\\' && i + 1 < s.size())
+        cur += s[i++];
+      else if (c == '"')
+        quoted = false;
+    } else if (c == '"') {
+      quoted = true;
+    } else if (c == '(' || c == '[' || c == '{' || c == '<') {
+      depth++;
+    } else if (c == ')' || c == ']' || c == '}' || c == '>') {
+      depth--;
+    } else if (c == ',' && depth == 0) {
+      args.push_back(cur);
+      cur.clear();
+      continue;
+    } else if (c == ' ' && cur.empty()) {
+      continue;
+    }
+    cur += c;
+  }
+  if (!cur.empty())
+    args.push_back(cur);
+  return args;
+}
+
+class LogParser {
+public:
+  explicit LogParser(std::vector<long> pids) : pids_(std::move(pids)) {}
+
+  // Parse one log line, appending to 'calls' if it completes a successful
+  // memory call.
+  void parse(std::string line, std::vector<Call> &calls);
+
+  size_t skipped() const { return skipped_; }
+
+private:
+  bool wanted(long pid) const {
+    return pids_.empty() ||
+           std::find(pids_.begin(), pids_.end(), pid) != pids_.end();
+  }
+  void parse_call(const std::string &text, std::vector<Call> &calls);
+
+  std::vector<long> pids_;
+  // Text of unfinished calls by pid.
+  std::map<long, std::string> pending_;
+  size_t skipped_ = 0;
+};
+
+void LogParser::parse(std::string line, std::vector<Call> &calls) {
+  while (!line.empty() && (line.back() == '\n' || line.back() == '\r'))
+    line.pop_back();
+
+  // "[pid N] " from strace -f, or a bare "N " from strace -f -o.
+  long pid = 0;
+  size_t pos = 0;
+  if (line.compare(0, 5, "[pid ") == 0) {
+    pid = strtol(line.c_str() + 5, nullptr, 10);
+    pos = line.find(']') + 1;
+  } else if (isdigit((unsigned char)line[0])) {
+    char *end;
+    long n = strtol(line.c_str(), &end, 10);
+    if (*end == ' ') {
+      pid = n;
+      pos = end - line.c_str();
+    }
+  }
+  while (pos < line.size() && line[pos] == ' ')
+    pos++;
+  // Timestamps are digits, ':' and '.'.
+  size_t ts = pos;
+  while (ts < line.size() &&
+         (isdigit((unsigned char)line[ts]) || line[ts] == ':' ||
+          line[ts] == '.'))
+    ts++;
+  if (ts > pos && ts < line.size() && line[ts] == ' ') {
+    pos = ts;
+    while (pos < line.size() && line[pos] == ' ')
+      pos++;
+  }
+  std::string text = line.substr(pos);
+  if (!wanted(pid))
+    return;
+
+  const char *unfinished = " <unfinished ...>";
+  size_t u = text.find(unfinished);
+  if (u != std::string::npos) {
+    pending_[pid] = text.substr(0, u);
+    return;
+  }
+  if (text.compare(0, 5, "<... ") == 0) {
+    size_t r = text.find(" resumed>");
+    auto it = pending_.find(pid);
+    if (r == std::string::npos || it == pending_.end()) {
+      skipped_++;
+      return;
+    }
+    text = it->second + text.substr(r + 9);
+    pending_.erase(it);
+  }
+  parse_call(text, calls);
+}
+
+void LogParser::parse_call(const std::string &text, std::vector<Call> &calls) {
+  // strace pads the " = " before the result with spaces.
+  size_t open = text.find('(');
+  size_t eq = text.rfind(" = ");
+  if (open == std::string::npos || eq == std::string::npos)
+    return;
+  size_t close = text.find_last_not_of(' ', eq);
+  if (close == std::string::npos || close <= open || text[close] != ')')
+    return;
+  std::string name = text.substr(0, open);
+  std::string ret = text.substr(eq + 3);
+  Call call{};
+  if (name == "mmap" || name == "mmap2")
+    call.sys = Sys::kMmap;
+  else if (name == "munmap")
+    call.sys = Sys::kMunmap;
+  else if (name == "mprotect" || name == "pkey_mprotect")
+    call.sys = Sys::kMprotect;
+  else if (name == "mremap")
+    call.sys = Sys::kMremap;
+  else if (name == "brk")
+    call.sys = Sys::kBrk;
+  else if (name == "execve" || name == "execveat")
+    call.sys = Sys::kExecve;
+  else
+    return;
+  // Failed or interrupted calls change nothing.
+  if (ret.empty() || ret[0] == '-' || ret[0] == '?') {
+    skipped_++;
+    return;
+  }
+  call.ret = parse_num(ret.substr(0, ret.find(' ')));
+  if (call.sys == Sys::kExecve) {
+    calls.push_back(call);
+    return;
+  }
+  auto args = split_args(text.substr(open + 1, close - open - 1));
+  for (size_t i = 0; i < args.size() && i < 6; i++) {
+    bool flags = (call.sys == Sys::kMmap && (i == 2 || i == 3)) ||
+                 (call.sys == Sys::kMprotect && i == 2) ||
+                 (call.sys == Sys::kMremap && i == 3);
+    // With strace -y, fds look like "3</path/to/file>".
+    call.arg[i] = flags ? parse_flags(args[i]) : parse_num(args[i]);
+  }
+  // mmap2 offsets are in 4096-byte units.
+  if (name == "mmap2")
+    call.arg[5] *= 4096;
+  calls.push_back(call);
+}
+
+// Maps real addresses into the window.
+class Rebaser {
+public:
+  Rebaser(const std::vector<Call> &calls, uint64_t pagesize);
+
+  uint64_t operator()(uint64_t addr) const {
+    auto it = std::upper_bound(
+        clusters_.begin(), clusters_.end(), addr,
+        [](uint64_t a, const Cluster &c) { return a < c.start; });
+    if (it == clusters_.begin())
+      return kWindowBase;
+    --it;
+    return it->window + (addr - it->start);
+  }
+  uint64_t window_len() const { return len_; }
+
+private:
+  struct Cluster {
+    uint64_t start;
+    uint64_t end;
+    uint64_t window;
+  };
+  std::vector<Cluster> clusters_;
+  uint64_t len_ = 0;
+};
+
+Rebaser::Rebaser(const std::vector<Call> &calls, uint64_t pagesize) {
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
+  auto add = [&](uint64_t start, uint64_t len) {
+    start &= ~(pagesize - 1);
+    uint64_t end = (start + len + pagesize - 1) & ~(pagesize - 1);
+    ranges.push_back({start, std::max(end, start + pagesize)});
+  };
+  uint64_t brk_start = 0;
+  for (const Call &c : calls) {
+    switch (c.sys) {
+    case Sys::kMmap:
+      add(c.ret, c.arg[1]);
+      break;
+    case Sys::kMunmap:
+    case Sys::kMprotect:
+      add(c.arg[0], c.arg[1]);
+      break;
+    case Sys::kMremap:
+      add(c.arg[0], c.arg[1]);
+      add(c.ret, c.arg[2]);
+      break;
+    case Sys::kBrk:
+      if (c.arg[0] == 0 || brk_start == 0)
+        brk_start = c.ret;
+      add(std::min(brk_start, c.ret),
+          std::max(brk_start, c.ret) - std::min(brk_start, c.ret));
+      break;
+    case Sys::kExecve:
+      brk_start = 0;
+      break;
+    }
+  }
+  std::sort(ranges.begin(), ranges.end());
+  uint64_t window = kWindowBase;
+  for (auto &r : ranges) {
+    if (!clusters_.empty() && r.first <= clusters_.back().end) {
+      clusters_.back().end = std::max(clusters_.back().end, r.second);
+      continue;
+    }
+    // Ranges are sorted by start, so the last cluster is complete.
+    if (!clusters_.empty()) {
+      auto &last = clusters_.back();
+      uint64_t gap = std::min(r.first - last.end, kMaxGap);
+      window = last.window + (last.end - last.start) + gap;
+    }
+    clusters_.push_back({r.first, r.second, window});
+  }
+  if (!clusters_.empty()) {
+    auto &last = clusters_.back();
+    len_ = last.window + (last.end - last.start) - kWindowBase;
+  }
+  len_ += kMaxGap;
+}
+
+uint64_t page_up(uint64_t v, uint64_t pagesize) {
+  return (v + pagesize - 1) & ~(pagesize - 1);
+}
+
+// Replays 'calls' against an AddrSpace that records them to 'writer'.
+class Importer {
+public:
+  Importer(const Rebaser &rebase, uint64_t pagesize, mmap::TraceWriter *w)
+      : rebase_(rebase), pagesize_(pagesize) {
+    mm_.set_trace(w);
+  }
+
+  bool init() {
+    return mm_.init(kWindowBase, rebase_.window_len(), pagesize_);
+  }
+  void apply(const Call &c);
+
+  size_t moved() const { return moved_; }
+
+private:
+  void map(const Call &c);
+  void remap(const Call &c);
+  void set_brk(const Call &c);
+
+  const Rebaser &rebase_;
+  uint64_t pagesize_;
+  mmap::AddrSpace mm_;
+  uint64_t brk_start_ = 0;
+  uint64_t brk_cur_ = 0;
+  size_t moved_ = 0;
+};
+
+void Importer::apply(const Call &c) {
+  switch (c.sys) {
+  case Sys::kMmap:
+    map(c);
+    break;
+  case Sys::kMunmap:
+    mm_.unmap(rebase_(c.arg[0]), c.arg[1]);
+    break;
+  case Sys::kMprotect:
+    mm_.protect(rebase_(c.arg[0]), c.arg[1], (int)c.arg[2]);
+    break;
+  case Sys::kMremap:
+    remap(c);
+    break;
+  case Sys::kBrk:
+    set_brk(c);
+    break;
+  case Sys::kExecve:
+    mm_.reset();
+    brk_start_ = brk_cur_ = 0;
+    break;
+  }
+}
+
+void Importer::map(const Call &c) {
+  uint64_t addr = rebase_(c.ret);
+  int prot = (int)c.arg[2];
+  int flags = (int)c.arg[3];
+  int fd = (flags & kMapAnonymous) ? -1 : (int)c.arg[4];
+  int64_t offset = (int64_t)c.arg[5];
+  if (flags & kMapFixedNoreplace) {
+    mm_.map_at_noreplace(addr, c.arg[1], prot, flags, fd, offset);
+    return;
+  }
+  if (flags & kMapFixed) {
+    mm_.map_at(addr, c.arg[1], prot, flags, fd, offset);
+    return;
+  }
+  if (mm_.map_any(addr, c.arg[1], prot, flags, fd, offset) != addr)
+    moved_++;
+}
+
+void Importer::remap(const Call &c) {
+  uint64_t old_addr = rebase_(c.arg[0]);
+  uint64_t old_len = page_up(c.arg[1], pagesize_);
+  uint64_t new_len = page_up(c.arg[2], pagesize_);
+  uint64_t new_addr = rebase_(c.ret);
+  mmap::MapInfo info;
+  if (!mm_.query_page(old_addr, &info))
+    info = {kProtRW, kMapPrivate | kMapAnonymous, -1, 0, false};
+  if (c.ret == c.arg[0]) {
+    if (new_len > old_len)
+      mm_.map_at(old_addr + old_len, new_len - old_len, info.prot, info.flags,
+                 info.fd,
+                 info.fd >= 0 ? info.offset + (int64_t)old_len : 0);
+    else if (new_len < old_len)
+      mm_.unmap(old_addr + new_len, old_len - new_len);
+    return;
+  }
+  mm_.map_at(new_addr, new_len, info.prot, info.flags, info.fd, info.offset);
+  if (!(c.arg[3] & kMremapDontunmap))
+    mm_.unmap(old_addr, old_len);
+}
+
+void Importer::set_brk(const Call &c) {
+  if (brk_start_ == 0) {
+    brk_start_ = brk_cur_ = c.ret;
+    return;
+  }
+  uint64_t cur = page_up(brk_cur_, pagesize_);
+  uint64_t next = page_up(c.ret, pagesize_);
+  if (next > cur)
+    mm_.map_at(rebase_(cur), next - cur, kProtRW,
+               kMapPrivate | kMapAnonymous, -1, 0);
+  else if (next < cur)
+    mm_.unmap(rebase_(next), cur - next);
+  brk_cur_ = c.ret;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  std::vector<long> pids;
+  uint64_t pagesize = 4096;
+  const char *paths[2] = {};
+  int npaths = 0;
+  bool usage = false;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--pid") && i + 1 < argc)
+      pids.push_back(strtol(argv[++i], nullptr, 10));
+    else if (!strcmp(argv[i], "--pagesize") && i + 1 < argc)
+      pagesize = strtoull(argv[++i], nullptr, 0);
+    else if (npaths < 2)
+      paths[npaths++] = argv[i];
+    else
+      usage = true;
+  }
+  if (usage || npaths != 2 || pagesize == 0 ||
+      (pagesize & (pagesize - 1)) != 0) {
+    fprintf(stderr,
+            "usage: %s [--pid N]... [--pagesize N] LOG TRACE\n", argv[0]);
+    return 1;
+  }
+
+  FILE *log = fopen(paths[0], "r");
+  if (!log) {
+    perror(paths[0]);
+    return 1;
+  }
+  LogParser parser(pids);
+  std::vector<Call> calls;
+  char buf[4096];
+  std::string line;
+  while (fgets(buf, sizeof(buf), log)) {
+    line += buf;
+    if (line.back() != '\n' && !feof(log))
+      continue;
+    parser.parse(line, calls);
+    line.clear();
+  }
+  fclose(log);
+
+  FILE *out = fopen(paths[1], "wb");
+  if (!out) {
+    perror(paths[1]);
+    return 1;
+  }
+  Rebaser rebase(calls, pagesize);
+  mmap::TraceWriter writer(out);
+  Importer importer(rebase, pagesize, &writer);
+  if (!importer.init()) {
+    fprintf(stderr, "window of %" PRIu64 " bytes is too large\n",
+            rebase.window_len());
+    return 1;
+  }
+  for (const Call &c : calls)
+    importer.apply(c);
+  writer.flush();
+  bool ok = writer.ok();
+  fclose(out);
+  if (!ok) {
+    fprintf(stderr, "%s: write failed\n", paths[1]);
+    return 1;
+  }
+  fprintf(stderr,
+          "%zu calls imported, %zu failed or unmatched calls skipped, "
+          "%zu mappings placed away from the kernel's choice\n",
+          calls.size(), parser.skipped(), importer.moved());
+  return 0;
+}
@@ -0,0 +1,138 @@
+// Replay a trace recorded with mmap::TraceWriter against a fresh AddrSpace.
+//
+// Every call is replayed at full speed and its result checked against the
+// recorded one. Afterwards one JSON object is printed per operation kind,
+// with a log2 latency histogram whose buckets are [lo_ns, count] pairs
+// covering [lo_ns, 2 * lo_ns):
+//
+//   {"op":"map_any","count":5120,"mismatches":0,"mean_ns":212.4,
+//    "p50_ns":180,"p99_ns":901,"max_ns":10240,
+//    "histogram":[[128,3012],[256,2001],[512,95],[8192,12]]}
+//
+// Exits with status 1 if the trace is malformed or any result differs.
+//
+// Usage: replay_mmap [--compact] TRACE
+
+#include "addr_space.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+const char *const kOpNames[] = {
+    "",              "init",               "reset",            "map_any",
+    "map_at",        "unmap",              "query_page",       "protect",
+    "mark_original", "unmap_non_original", "map_at_noreplace", "set_limit",
+};
+const size_t kNumOps = sizeof(kOpNames) / sizeof(kOpNames[0]);
+static_assert(kNumOps == (size_t)mmap::TraceOp::kSetLimit + 1,
+              "op names out of sync");
+
+// Only report the first few mismatches in detail.
+const size_t kMaxReported = 10;
+
+struct OpStats {
+  size_t mismatches = 0;
+  std::vector<uint64_t> latencies;
+};
+
+void print_stats(const char *name, OpStats &st) {
+  auto &lat = st.latencies;
+  if (lat.empty())
+    return;
+  std::sort(lat.begin(), lat.end());
+  double total = 0;
+  size_t buckets[64] = {};
+  for (uint64_t ns : lat) {
+    total += ns;
+    buckets[ns ? 63 - __builtin_clzll(ns) : 0]++;
+  }
+  printf("{\"op\":\"%s\",\"count\":%zu,\"mismatches\":%zu,\"mean_ns\":%.1f,"
+         "\"p50_ns\":%llu,\"p99_ns\":%llu,\"max_ns\":%llu,\"histogram\":[",
+         name, lat.size(), st.mismatches, total / lat.size(),
+         (unsigned long long)lat[(lat.size() - 1) / 2],
+         (unsigned long long)lat[(lat.size() - 1) * 99 / 100],
+         (unsigned long long)lat.back());
+  bool first = true;
+  for (int i = 0; i < 64; i++) {
+    if (!buckets[i])
+      continue;
+    printf("%s[%llu,%zu]", first ? "" : ",", i ? 1ULL << i : 0ULL,
+           buckets[i]);
+    first = false;
+  }
+  printf("]}\n");
+}
+
+template <class Space> int run(FILE *in) {
+  mmap::TraceReader reader(in);
+  Space mm;
+  OpStats stats[kNumOps];
+  size_t index = 0;
+  size_t mismatches = 0;
+  mmap::TraceRecord rec;
+  while (reader.next(&rec)) {
+    auto t0 = Clock::now();
+    bool ok = mmap::replay(mm, rec);
+    auto t1 = Clock::now();
+    OpStats &st = stats[(size_t)rec.op];
+    st.latencies.push_back(
+        (uint64_t)std::chrono::duration<double, std::nano>(t1 - t0).count());
+    if (!ok) {
+      st.mismatches++;
+      if (mismatches++ < kMaxReported)
+        fprintf(stderr, "record %zu: %s(0x%llx, 0x%llx) result differs\n",
+                index, kOpNames[(size_t)rec.op], (unsigned long long)rec.addr,
+                (unsigned long long)rec.len);
+    }
+    index++;
+  }
+  if (reader.error()) {
+    fprintf(stderr, "malformed trace at record %zu\n", index);
+    return 1;
+  }
+  for (size_t i = 1; i < kNumOps; i++)
+    print_stats(kOpNames[i], stats[i]);
+  if (mismatches) {
+    fprintf(stderr, "%zu of %zu results differ\n", mismatches, index);
+    return 1;
+  }
+  return 0;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  bool compact = false;
+  const char *path = nullptr;
+  bool usage = false;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--compact"))
+      compact = true;
+    else if (!path)
+      path = argv[i];
+    else
+      usage = true;
+  }
+  if (!path || usage) {
+    fprintf(stderr, "usage: %s [--compact] TRACE\n", argv[0]);
+    return 1;
+  }
+  FILE *in = fopen(path, "rb");
+  if (!in) {
+    perror(path);
+    return 1;
+  }
+  int ret =
+      compact ? run<mmap::CompactAddrSpace>(in) : run<mmap::AddrSpace>(in);
+  fclose(in);
+  return ret;
+}